@@ -0,0 +1,140 @@
+/**@file
+   Functions and structures for region-based memory allocation.
+
+   An arena hands out memory from large blocks by advancing an offset, so
+   allocation is nearly free and nothing is released individually.  All
+   memory obtained from an arena is released at once with arena_reset(),
+   which keeps the arena's blocks for reuse, or arena_release().  Memory
+   used for scratch can also be given back in stack order with
+   arena_save() and arena_restore().
+
+   An arena is not thread safe; threads that allocate concurrently should
+   each use their own.
+
+   Copyright (C) 2006-2012  Rob Hess <rob@iqengines.com>
+
+   @version 1.1.2-20100521
+*/
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+
+/******************************* Defs and macros *****************************/
+
+/* alignment in bytes of every allocation from an arena */
+#define ARENA_ALIGN 16
+
+/* default size in bytes of arena blocks */
+#define ARENA_BLOCK_SIZE 65536
+
+
+/********************************** Structures *******************************/
+
+/** a block of memory from which an arena allocates */
+struct arena_block
+{
+  struct arena_block* next;    /* next block in the arena */
+  size_t size;                 /* bytes available in this block */
+  char* data;                  /* start of this block's memory */
+};
+
+
+/** a region-based memory allocator */
+struct arena
+{
+  struct arena_block* first;   /* first block of the arena */
+  struct arena_block* cur;     /* block currently being allocated from */
+  size_t used;                 /* bytes allocated from cur */
+  size_t block_size;           /* minimum size of new blocks */
+};
+
+
+/** a position in an arena, returned by arena_save() */
+struct arena_pos
+{
+  struct arena_block* block;
+  size_t used;
+};
+
+
+/*************************** Function Prototypes *****************************/
+
+/**
+   Creates an empty arena.
+
+   @param block_size minimum size in bytes of the blocks the arena
+     allocates from the heap; 0 selects ARENA_BLOCK_SIZE
+
+   @return Returns a new arena, which must be released with arena_release()
+*/
+extern struct arena* arena_init( size_t block_size );
+
+
+/**
+   Allocates memory from an arena.
+
+   @param arena an arena
+   @param size number of bytes to allocate
+
+   @return Returns a pointer to \a size bytes aligned to ARENA_ALIGN bytes,
+     valid until the arena is reset, restored to an earlier position, or
+     released, or NULL if no memory is available
+*/
+extern void* arena_alloc( struct arena* arena, size_t size );
+
+
+/**
+   Allocates zeroed memory for an array from an arena.
+
+   @param arena an arena
+   @param n number of array elements
+   @param size size in bytes of each element
+
+   @return Returns a pointer to the zeroed array or NULL if no memory is
+     available
+   @see arena_alloc()
+*/
+extern void* arena_calloc( struct arena* arena, size_t n, size_t size );
+
+
+/**
+   Records the current position of an arena.
+
+   @param arena an arena
+
+   @return Returns the current position of \a arena
+*/
+extern struct arena_pos arena_save( struct arena* arena );
+
+
+/**
+   Returns an arena to a position recorded by arena_save(), releasing all
+   memory allocated since then.
+
+   @param arena an arena
+   @param pos a position of \a arena
+*/
+extern void arena_restore( struct arena* arena, struct arena_pos pos );
+
+
+/**
+   Releases all memory allocated from an arena while keeping its blocks for
+   further allocations.
+
+   @param arena an arena
+*/
+extern void arena_reset( struct arena* arena );
+
+
+/**
+   De-allocates an arena and all memory allocated from it
+
+   @param arena pointer to an arena
+*/
+extern void arena_release( struct arena** arena );
+
+
+#endif
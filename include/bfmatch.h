@@ -0,0 +1,69 @@
+/**@file
+   Functions for exact brute-force nearest neighbor matching between sets
+   of feature descriptors.
+
+   Every query descriptor is compared with every train descriptor, so the
+   matches found are exact, unlike those of kdtree_bbf_knn(), which makes
+   this suitable for ground truth and for small galleries.  Squared
+   distances are found as \f$\|a\|^2 + \|b\|^2 - 2 a \cdot b\f$, with dot
+   products computed in cache-sized tiles of query and train descriptors
+   in the manner of a matrix multiply.  Byte descriptors make all of this
+   integer arithmetic, so distances are exact too.
+
+   Copyright (C) 2006-2012  Rob Hess <rob@iqengines.com>
+
+   @version 1.1.2-20100521
+*/
+
+#ifndef BFMATCH_H
+#define BFMATCH_H
+
+struct feature_set;
+struct thread_pool;
+
+
+/******************************* Defs and macros *****************************/
+
+/** number of query descriptors in each block handed to a thread */
+#define BFMATCH_QUERY_BLOCK 32
+
+/** bytes of widened train descriptors in each tile; sized for L2 */
+#define BFMATCH_TRAIN_TILE_BYTES 131072
+
+
+/********************************** Structures *******************************/
+
+/** the two nearest train features to a query feature */
+struct bf_match
+{
+  int nn[2];                   /**< indices of the nearest and second-nearest
+				  train features, or -1 if there are none */
+  int dsq[2];                  /**< their squared distances, or INT_MAX */
+};
+
+
+/*************************** Function Prototypes *****************************/
+
+/**
+   Finds the nearest and second-nearest train feature to each query
+   feature by comparing all pairs, as needed for Lowe's ratio test.  When
+   two train features are equally distant from a query, the one with the
+   lower index is taken to be nearer, so results do not depend on the
+   number of threads.
+
+   @param query query features
+   @param train train features; must have the same descriptor length as
+     \a query
+   @param matches array of \a query->n structures in which to store the
+     neighbors of each query feature
+   @param pool threads across which blocks of query features are divided,
+     or NULL to match on the calling thread
+
+   @return Returns 0 on success or -1 if the feature sets' descriptor
+     lengths differ or no memory is available
+*/
+extern int bfmatch_knn2( struct feature_set* query, struct feature_set* train,
+			 struct bf_match* matches, struct thread_pool* pool );
+
+
+#endif
@@ -0,0 +1,128 @@
+/**@file
+   Functions and structures implementing a bounded queue through which any
+   number of threads may pass pointers to any number of others.
+
+   Items are stored in a ring of cells, each with a sequence number that
+   tells producers and consumers whose turn it is to use it, so pushing and
+   popping are lock-free: a thread claims a cell with one compare-and-swap
+   and never waits on another thread to finish with the queue.  For more
+   information, refer to:
+
+   Vyukov, D.  Bounded MPMC queue.
+   http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+
+   Threads block only when the queue is full or empty, on a pair of
+   semaphores counting free cells and queued items, so a full queue holds
+   back its producers without spinning; this bounds the memory held by
+   items in flight between the stages of a pipeline.
+
+   Copyright (C) 2006-2012  Rob Hess <rob@iqengines.com>
+
+   @version 1.1.2-20100521
+*/
+
+#ifndef BQUEUE_H
+#define BQUEUE_H
+
+#include <semaphore.h>
+
+
+/******************************* Defs and macros *****************************/
+
+/** bytes separating the fields written by producers from those written by
+    consumers, so that they do not share a cache line */
+#define BQUEUE_PAD 64
+
+
+/********************************** Structures *******************************/
+
+/* a cell of a bounded queue */
+struct bqueue_cell
+{
+  unsigned long seq;           /* position whose turn it is to use the cell */
+  void* data;                  /* the item */
+};
+
+
+/** a bounded multi-producer, multi-consumer queue of pointers */
+struct bqueue
+{
+  int cap;                     /**< capacity, a power of 2 */
+  struct bqueue_cell* cells;   /* ring of cap cells */
+  sem_t slots;                 /* counts free cells */
+  sem_t items;                 /* counts queued items */
+  int closed;                  /* set by bqueue_close() */
+  unsigned long npush;         /**< number of items pushed */
+  unsigned long nfull;         /**< number of pushes that found the queue
+				  full and had to wait */
+  unsigned long nempty;        /**< number of pops that found the queue
+				  empty and had to wait */
+  char pad0[BQUEUE_PAD];
+  unsigned long head;          /* next position to push */
+  char pad1[BQUEUE_PAD];
+  unsigned long tail;          /* next position to pop */
+  char pad2[BQUEUE_PAD];
+};
+
+
+/*************************** Function Prototypes *****************************/
+
+/**
+   Creates a bounded queue.
+
+   @param cap minimum capacity; rounded up to a power of 2
+
+   @return Returns a new queue, which must be released with
+     bqueue_release(), or NULL on error
+*/
+extern struct bqueue* bqueue_init( int cap );
+
+
+
+/**
+   Adds an item to a queue, waiting for room if it is full.
+
+   @param q a queue
+   @param data the item
+
+   @return Returns 0 on success or -1 if the queue has been closed
+*/
+extern int bqueue_push( struct bqueue* q, void* data );
+
+
+
+/**
+   Removes the oldest item from a queue, waiting for one if it is empty and
+   has not been closed.
+
+   @param q a queue
+   @param data output as the item
+
+   @return Returns 1 if an item was removed or 0 if the queue is empty and
+     has been closed
+*/
+extern int bqueue_pop( struct bqueue* q, void** data );
+
+
+
+/**
+   Closes a queue once nothing more will be pushed to it.  Consumers waiting
+   on the queue, and those that find it empty from then on, are woken and
+   returned 0 by bqueue_pop().  Items already queued may still be popped.
+   A queue should be closed only after every push to it has returned.
+
+   @param q a queue
+*/
+extern void bqueue_close( struct bqueue* q );
+
+
+
+/**
+   De-allocates a queue.  Items still queued are not freed.
+
+   @param q pointer to a queue; set to NULL
+*/
+extern void bqueue_release( struct bqueue** q );
+
+
+#endif
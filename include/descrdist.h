@@ -0,0 +1,107 @@
+/**@file
+   Functions for computing squared Euclidean distances between feature
+   descriptors.
+
+   Descriptors may be stored as doubles, as in struct feature, as floats,
+   or as bytes, as in struct feature_set.  Each distance is computed with
+   AVX2 and FMA or with SSE2 when the CPU supports them and in plain C
+   otherwise; see simd_level().  Byte descriptors are compared with integer
+   arithmetic, which is exact.  SIFT descriptor elements are integers in
+   [0, 255], so every code path for every descriptor type computes exactly
+   the same distance for them.
+
+   The bounded variants stop as soon as a partial distance exceeds a given
+   bound, which saves time when only distances below a known bound, e.g.
+   that of the second-nearest neighbor found so far, matter.
+
+   Copyright (C) 2006-2012  Rob Hess <rob@iqengines.com>
+
+   @version 1.1.2-20100521
+*/
+
+#ifndef DESCRDIST_H
+#define DESCRDIST_H
+
+
+/******************************* Defs and macros *****************************/
+
+/** number of elements compared between bound checks in bounded distances */
+#define DESCRDIST_BOUND_STEP 32
+
+
+/*************************** Function Prototypes *****************************/
+
+/**
+   Computes the squared Euclidean distance between two byte descriptors.
+
+   @param a a descriptor
+   @param b another descriptor
+   @param d descriptor length; descriptors in a feature set may be compared
+     over their whole padded stride, which is often faster
+
+   @return Returns the squared distance between \a a and \a b
+*/
+extern int descr_dist_sq_u8( const unsigned char* a, const unsigned char* b,
+			     int d );
+
+
+/**
+   Computes the squared Euclidean distance between two byte descriptors,
+   giving up once it exceeds a bound.
+
+   @param a a descriptor
+   @param b another descriptor
+   @param d descriptor length
+   @param bound a bound on the distances of interest
+
+   @return Returns the squared distance between \a a and \a b if it is no
+     greater than \a bound; otherwise returns some value greater than
+     \a bound
+*/
+extern int descr_dist_sq_u8_bound( const unsigned char* a,
+				   const unsigned char* b, int d, int bound );
+
+
+/**
+   Computes the squared Euclidean distance between two float descriptors.
+
+   @param a a descriptor
+   @param b another descriptor
+   @param d descriptor length
+
+   @return Returns the squared distance between \a a and \a b
+*/
+extern float descr_dist_sq_f32( const float* a, const float* b, int d );
+
+
+/**
+   Computes the squared Euclidean distance between two float descriptors,
+   giving up once it exceeds a bound.
+
+   @param a a descriptor
+   @param b another descriptor
+   @param d descriptor length
+   @param bound a bound on the distances of interest
+
+   @return Returns the squared distance between \a a and \a b if it is no
+     greater than \a bound; otherwise returns some value greater than
+     \a bound
+*/
+extern float descr_dist_sq_f32_bound( const float* a, const float* b, int d,
+				      float bound );
+
+
+/**
+   Computes the squared Euclidean distance between two double descriptors.
+
+   @param a a descriptor
+   @param b another descriptor
+   @param d descriptor length
+
+   @return Returns the squared distance between \a a and \a b
+   @see descr_dist_sq()
+*/
+extern double descr_dist_sq_f64( const double* a, const double* b, int d );
+
+
+#endif
@@ -0,0 +1,227 @@
+/**@file
+   Functions and structures for storing sets of SIFT features compactly.
+
+   A struct feature takes well over a kilobyte, most of it a descriptor of
+   doubles whose elements are integers in [0, 255] for SIFT features.  A
+   feature set instead keeps each feature's location, scale, and
+   orientation in separate float arrays and all descriptors in one matrix
+   of bytes, so matching streams an eighth of the descriptor memory and
+   geometry can be scanned without touching descriptors at all.
+
+   Every descriptor row starts on a FEATSET_ALIGN-byte boundary and is
+   padded with zeros to a multiple of FEATSET_ALIGN bytes, so vectorized
+   distance computations may process whole rows without tail handling.
+
+   A feature set can be saved to a binary file laid out as it is in
+   memory: a FEATSET_ALIGN-byte header, the x, y, scale, and orientation
+   arrays as floats, and, from the next FEATSET_ALIGN-byte boundary, the
+   padded descriptor matrix.  Loading such a file with feature_set_map()
+   maps it into memory and points a feature set into the mapping, so no
+   parsing or copying is done and only pages actually touched are read.
+   The header holds a magic string, a byte order mark, FEATSET_VERSION,
+   and the set's dimensions; files are written in the byte order of the
+   machine writing them.
+
+   Copyright (C) 2006-2012  Rob Hess <rob@iqengines.com>
+
+   @version 1.1.2-20100521
+*/
+
+#ifndef FEATSET_H
+#define FEATSET_H
+
+#include <stddef.h>
+
+struct feature;
+
+
+/******************************* Defs and macros *****************************/
+
+/** alignment in bytes of each descriptor in a feature set */
+#define FEATSET_ALIGN 64
+
+/** version of the binary feature set files written by feature_set_save() */
+#define FEATSET_VERSION 1
+
+/** returns a pointer to descriptor \a i of feature set \a set */
+#define feature_set_descr( set, i ) \
+  ( (set)->descr + (size_t)(i) * (set)->stride )
+
+
+/********************************** Structures *******************************/
+
+/** a set of Lowe-style features in structure-of-arrays form */
+struct feature_set
+{
+  int n;                       /**< number of features */
+  int d;                       /**< descriptor length */
+  int stride;                  /**< bytes from one descriptor to the next */
+  float* x;                    /**< x coords */
+  float* y;                    /**< y coords */
+  float* scl;                  /**< scales */
+  float* ori;                  /**< orientations */
+  unsigned char* descr;        /**< n x stride matrix of descriptors */
+  void* map;                   /* file mapping holding the arrays, for a
+				  set from feature_set_map() or
+				  feature_set_create(), or NULL */
+  size_t map_size;             /* size of map in bytes */
+};
+
+
+/*************************** Function Prototypes *****************************/
+
+/**
+   Creates a feature set with room for a given number of features.  All
+   geometry and descriptors are zeroed.
+
+   @param n number of features
+   @param d descriptor length
+
+   @return Returns a new feature set, which must be released with
+     feature_set_release(), or NULL if no memory is available
+*/
+extern struct feature_set* feature_set_init( int n, int d );
+
+
+/**
+   Converts an array of features to a feature set.  Descriptor elements are
+   rounded and clamped to [0, 255], which loses nothing for SIFT features.
+   Oxford-type affine regions are not represented in a feature set.
+
+   @param feat array of features
+   @param n number of features in \a feat
+
+   @return Returns a new feature set or NULL if no memory is available
+*/
+extern struct feature_set* feature_set_from_features( struct feature* feat,
+						      int n );
+
+
+/**
+   Stores a feature in a feature set, converting its descriptor as
+   feature_set_from_features() does.  Descriptor elements beyond the set's
+   descriptor length are dropped.
+
+   @param set a feature set
+   @param i index at which to store \a feat; must be less than \a set->n
+   @param feat a feature
+*/
+extern void feature_set_store( struct feature_set* set, int i,
+			       struct feature* feat );
+
+
+/**
+   Converts one feature of a feature set to a Lowe-style feature, as
+   feature_set_to_features() does for all of them.
+
+   @param set a feature set
+   @param i index of the feature to convert; must be less than \a set->n
+   @param feat the feature in which to store it
+*/
+extern void feature_set_fetch( struct feature_set* set, int i,
+			       struct feature* feat );
+
+
+/**
+   Converts a feature set to an array of Lowe-style features.
+
+   @param set a feature set
+   @param feat pointer to an array in which to store the features; memory
+     for this array is allocated by this function and must be released by
+     the caller using free(*feat)
+
+   @return Returns the number of features stored in \a feat
+*/
+extern int feature_set_to_features( struct feature_set* set,
+				    struct feature** feat );
+
+
+/**
+   Writes a feature set to a binary file that feature_set_map() can load.
+
+   @param set a feature set
+   @param filename name of the file to write
+
+   @return Returns 0 on success or -1 on error
+*/
+extern int feature_set_save( struct feature_set* set, char* filename );
+
+
+/**
+   Loads a feature set from a binary file written by feature_set_save() by
+   mapping the file into memory.  The set's arrays point into the mapping,
+   which is private, so changes to the set are never written to the file.
+
+   @param filename name of the file to load
+
+   @return Returns a feature set, which must be released with
+     feature_set_release(), or NULL if the file could not be mapped or was
+     not written by feature_set_save() on a machine of the same byte order
+*/
+extern struct feature_set* feature_set_map( char* filename );
+
+
+/**
+   Creates a binary feature set file with room for a given number of
+   features and maps it into memory, so that a set too large to hold in
+   memory can be written a few features at a time with
+   feature_set_store().  The mapping is shared: what is stored in the set
+   is written back to the file by the system as memory is needed, and in
+   full when the set is released, after which feature_set_map() can load
+   the file.  Features not stored are left zeroed.
+
+   @param filename name of the file to create
+   @param n number of features
+   @param d descriptor length
+
+   @return Returns a feature set, which must be released with
+     feature_set_release(), or NULL on error
+*/
+extern struct feature_set* feature_set_create( char* filename, int n, int d );
+
+
+/**
+   Copies descriptors from a number of feature sets into one matrix, as for
+   training.  If \a max is positive and the sets hold more descriptors than
+   that, they are taken at evenly spaced indices across all the sets;
+   otherwise every descriptor is taken.  All sets must have the same
+   descriptor length.
+
+   @param sets feature sets
+   @param nsets number of sets
+   @param max maximum number of descriptors, or 0 for no limit
+   @param stride bytes between rows of the matrix; at least the descriptor
+     length
+   @param n output as the number of rows
+
+   @return Returns the matrix, with rows padded with zeros, which the
+     caller must free, or NULL if there are no descriptors, more than an
+     int can count and no maximum, or no memory
+*/
+extern unsigned char* feature_sets_sample( struct feature_set** sets,
+					   int nsets, int max, int stride,
+					   int* n );
+
+
+/**
+   Determines whether a file begins like a binary feature set file, so
+   that callers can tell such files from text feature files.
+
+   @param filename name of a file
+
+   @return Returns 1 if the file is a binary feature set file or 0 if it is
+     not or cannot be read
+*/
+extern int feature_set_is_file( char* filename );
+
+
+/**
+   De-allocates a feature set, unmapping its file if it was loaded with
+   feature_set_map() or feature_set_create()
+
+   @param set pointer to a feature set
+*/
+extern void feature_set_release( struct feature_set** set );
+
+
+#endif
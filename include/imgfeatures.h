@@ -11,6 +11,9 @@
 
 #include "cxcore.h"
 
+struct feature_reader;
+struct feature_writer;
+
 /** FEATURE_OXFD <BR> FEATURE_LOWE */
 enum feature_type
   {
@@ -18,6 +21,10 @@ enum feature_type
     FEATURE_LOWE,
   };
 
+/** type of feature_writer_open() files written as binary feature sets;
+    see featset.h */
+#define FEATURE_BINARY 2
+
 /** FEATURE_FWD_MATCH <BR> FEATURE_BCK_MATCH <BR> FEATURE_MDL_MATCH */
 enum feature_match_type
   {
@@ -76,6 +83,9 @@ struct feature
      <BR><BR>
      If \a type is FEATURE_LOWE, the input file is treated as if it is from
      David Lowe's SIFT code: http://www.cs.ubc.ca/~lowe/keypoints  
+     <BR><BR>
+     Binary feature set files written by feature_set_save() are recognized
+     whatever \a type is and imported as Lowe-type features.
    @param feat pointer to an array in which to store imported features; memory
      for this array is allocated by this function and must be released by
      the caller using free(*feat)
@@ -98,6 +108,96 @@ extern int import_features( char* filename, int type, struct feature** feat );
 extern int export_features( char* filename, struct feature* feat, int n );
 
 
+/**
+   Opens a feature file to be read a few features at a time with
+   feature_reader_read(), so that files too large to import whole can be
+   processed in chunks.  Text files are read through a fixed-size window
+   and binary feature set files are mapped into memory, so memory use does
+   not grow with the size of the file.
+
+   @param filename location of a file containing image features
+   @param type FEATURE_OXFD or FEATURE_LOWE, as for import_features();
+     binary feature set files are recognized whatever \a type is and read
+     as Lowe-type features
+   @param n if not NULL, output as the number of features in the file
+   @param d if not NULL, output as the descriptor length of the features
+
+   @return Returns a reader, which must be closed with
+     feature_reader_close(), or NULL on error
+*/
+extern struct feature_reader* feature_reader_open( char* filename, int type,
+						   int* n, int* d );
+
+
+/**
+   Reads the next features from a feature file.
+
+   @param reader a reader returned by feature_reader_open()
+   @param feat array in which to store the features
+   @param n maximum number of features to read
+
+   @return Returns the number of features read, which is less than \a n
+     only once the end of the file is reached, or -1 on error
+*/
+extern int feature_reader_read( struct feature_reader* reader,
+				struct feature* feat, int n );
+
+
+/**
+   Closes a feature file opened with feature_reader_open()
+
+   @param reader pointer to a reader; set to NULL
+*/
+extern void feature_reader_close( struct feature_reader** reader );
+
+
+/**
+   Creates a feature file to be written a few features at a time with
+   feature_writer_write(), so that features need never all be in memory at
+   once.
+
+   @param filename name of the file to create
+   @param type FEATURE_OXFD or FEATURE_LOWE to write a text file formatted
+     as export_features() would, or FEATURE_BINARY to write a binary
+     feature set file, as feature_set_save() would
+   @param n number of features that will be written; for text files it may
+     be -1 if it is not known, in which case the count is filled in by
+     feature_writer_close() and the file must be seekable
+   @param d descriptor length of the features
+
+   @return Returns a writer, which must be closed with
+     feature_writer_close(), or NULL on error
+*/
+extern struct feature_writer* feature_writer_open( char* filename, int type,
+						   int n, int d );
+
+
+/**
+   Writes features to a feature file.  The first \a d descriptor elements
+   of each feature are written, where \a d is the length given to
+   feature_writer_open().
+
+   @param writer a writer returned by feature_writer_open()
+   @param feat array of features
+   @param n number of features in \a feat
+
+   @return Returns 0 on success or -1 on error
+*/
+extern int feature_writer_write( struct feature_writer* writer,
+				 struct feature* feat, int n );
+
+
+/**
+   Finishes and closes a feature file opened with feature_writer_open()
+
+   @param writer pointer to a writer; set to NULL
+
+   @return Returns 0 on success or -1 if any write failed or the number of
+     features written was not the number given to feature_writer_open()
+*/
+extern int feature_writer_close( struct feature_writer** writer );
+
+
 /**
    Displays a set of features on an image
 
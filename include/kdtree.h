@@ -8,6 +8,29 @@
    nearest-neighbor search in high-dimensional spaces.  In <EM>Conference
    on Computer Vision and Pattern Recognition (CVPR)</EM> (2003),
    pp. 1000--1006.
+
+   A tree is stored in one allocation: an array of nodes that refer to
+   their children by index, followed by a matrix of the descriptors of all
+   its features in leaf order, so a leaf's descriptors are scanned
+   sequentially and a tree can be copied or written out as a block.
+   Leaves hold up to a configurable number of features.
+
+   Searching never modifies a tree, so one tree may be searched by any
+   number of threads at once, each with its own search context.
+
+   A randomized k-d forest indexes the same features in several trees, each
+   of which splits on a dimension chosen at random from among those of
+   highest variance, optionally after a random rotation of the descriptor
+   space.  The trees are searched together with one priority queue, as in
+
+   Muja, M. and Lowe, D. G.  Fast approximate nearest neighbors with
+   automatic algorithm configuration.  In <EM>International Conference on
+   Computer Vision Theory and Applications (VISAPP)</EM> (2009),
+   pp. 331--340,
+
+   so that a bin missed by one tree's partitions is likely reached early in
+   another's, which finds more true neighbors for the same number of
+   checks.
    
    Copyright (C) 2006-2012  Rob Hess <rob@iqengines.com>
 
@@ -24,6 +47,8 @@
 /********************************* Structures ********************************/
 
 struct feature;
+struct min_pq;
+struct thread_pool;
 
 /** a node in a k-d tree */
 struct kd_node
@@ -31,17 +56,105 @@ struct kd_node
   int ki;                      /**< partition key index */
   double kv;                   /**< partition key value */
   int leaf;                    /**< 1 if node is a leaf, 0 otherwise */
-  struct feature* features;    /**< features at this node */
+  int first;                   /**< index in leaf order of first feature */
+  int n;                       /**< number of features */
+  int kd_left;                 /**< index of left child, or -1 */
+  int kd_right;                /**< index of right child, or -1 */
+};
+
+
+/** a k-d tree of features; see kdtree_build() */
+struct kd_tree
+{
   int n;                       /**< number of features */
-  struct kd_node* kd_left;     /**< left child */
-  struct kd_node* kd_right;    /**< right child */
+  int d;                       /**< descriptor length */
+  int leaf_size;               /**< maximum number of features per leaf */
+  int nnodes;                  /**< number of nodes; node 0 is the root */
+  struct kd_node* nodes;       /**< nodes, each subtree's root first */
+  struct feature* features;    /**< features, in leaf order unless
+				  \a order is set */
+  double* descr;               /**< n x d matrix of descriptors, in leaf
+				  order, or NULL if \a order is set */
+  int* order;                  /**< index in \a features of the feature at
+				  each leaf position, or NULL if
+				  \a features is in leaf order */
+  double* rot;                 /**< d x d rotation applied to descriptors
+				  before they are compared with partition
+				  keys, or NULL */
+};
+
+
+/** parameters of a randomized k-d forest; see kdtree_forest_params_init() */
+struct kd_forest_params
+{
+  int ntrees;                  /**< number of trees */
+  int leaf_size;               /**< maximum number of features per leaf */
+  int rand_dims;               /**< each node splits on a dimension chosen at
+				  random from this many of highest variance */
+  int rotate;                  /**< if nonzero, each tree partitions a
+				  randomly rotated descriptor space */
+  unsigned int seed;           /**< seed of the random choices, so a forest
+				  can be rebuilt exactly */
 };
 
 
+/** a randomized k-d forest of features; see kdtree_forest_build() */
+struct kd_forest
+{
+  int n;                       /**< number of features */
+  int d;                       /**< descriptor length */
+  int ntrees;                  /**< number of trees */
+  struct kd_tree** trees;      /**< the trees */
+  struct feature* features;    /**< features, in their original order */
+};
+
+
+/**
+   buffers reused across k-d tree searches; see kdtree_search_init().  Each
+   search overwrites the neighbors found by the previous one.
+*/
+struct kd_search
+{
+  struct min_pq* min_pq;       /* queue of unexplored nodes */
+  struct feature** nbrs;       /**< neighbors found by the last search */
+  double* dists;               /**< their squared descriptor distances */
+  int nallocd;                 /* number of neighbors there is room for */
+  double* q;                   /* query rotated into each tree's space */
+  int nq_allocd;               /* number of doubles there is room for in q */
+  unsigned int* seen;          /* stamp of the last search to check each
+				  feature of a forest */
+  int nseen_allocd;            /* number of features there is room for */
+  unsigned int stamp;          /* stamp of the current search */
+};
+
+
+/******************************* Defs and macros *****************************/
+
+/** default maximum number of features per k-d tree leaf */
+#define KDTREE_LEAF_SIZE 8
+
+/** minimum number of queries handled by one task of a batch search */
+#define KDTREE_BATCH_GRAIN 32
+
+/** default number of trees in a randomized k-d forest */
+#define KDTREE_FOREST_TREES 4
+
+/** default number of highest-variance dimensions among which a forest's
+    nodes choose their partition keys */
+#define KDTREE_FOREST_RAND_DIMS 5
+
+/** default for whether a forest's trees rotate the descriptor space */
+#define KDTREE_FOREST_ROTATE 0
+
+/** default seed of a forest's random choices */
+#define KDTREE_FOREST_SEED 1
+
+
 /*************************** Function Prototypes *****************************/
 
 /**
    A function to build a k-d tree database from keypoints in an array.
+   Leaves hold up to KDTREE_LEAF_SIZE features.
    
    @param features an array of features; <EM>this function rearranges the order
      of the features in this array, so you should take appropriate measures if
@@ -49,9 +162,29 @@ struct kd_node
      before order is important)</EM>
    @param n the number of features in \a features
    
-   @return Returns the root of a kd tree built from \a features.
+   @return Returns a kd tree built from \a features, or NULL on error.
+   @see _kdtree_build()
+*/
+extern struct kd_tree* kdtree_build( struct feature* features, int n );
+
+
+
+/**
+   A function to build a k-d tree database from keypoints in an array with
+   a specified leaf size.  Larger leaves make a shallower tree whose leaves
+   are scanned with fewer priority queue operations per feature.
+
+   @param features an array of features, which this function rearranges
+     into leaf order; see kdtree_build()
+   @param n the number of features in \a features
+   @param leaf_size maximum number of features per leaf; a node is split
+     only if it holds more features than this
+
+   @return Returns a kd tree built from \a features, or NULL on error.
+   @see kdtree_build()
 */
-extern struct kd_node* kdtree_build( struct feature* features, int n );
+extern struct kd_tree* _kdtree_build( struct feature* features, int n,
+				      int leaf_size );
 
 
 
@@ -59,27 +192,112 @@ extern struct kd_node* kdtree_build( struct feature* features, int n );
    Finds an image feature's approximate k nearest neighbors in a kd tree using
    Best Bin First search.
    
-   @param kd_root root of an image feature kd tree
+   @param kd_tree an image feature kd tree
    @param feat image feature for whose neighbors to search
    @param k number of neighbors to find
    @param nbrs pointer to an array in which to store pointers to neighbors
      in order of increasing descriptor distance; memory for this array is
      allocated by this function and must be freed by the caller using
      free(*nbrs)
-   @param max_nn_chks search is cut off after examining this many tree entries
+   @param max_nn_chks search is cut off after examining this many tree
+     entries; the leaf being examined when the limit is reached is finished
    
    @return Returns the number of neighbors found and stored in \a nbrs, or
      -1 on error.
+   @see kdtree_search_knn()
 */
-extern int kdtree_bbf_knn( struct kd_node* kd_root, struct feature* feat,
+extern int kdtree_bbf_knn( struct kd_tree* kd_tree, struct feature* feat,
 			   int k, struct feature*** nbrs, int max_nn_chks );
 
 
+/**
+   Creates a context for searching k-d trees.  A context holds the priority
+   queue and neighbor arrays used by a search and keeps them for the next,
+   so searching with a context allocates nothing once its buffers have
+   grown to fit.  A context may be used by only one thread at a time.
+
+   @return Returns a new search context, which must be released with
+     kdtree_search_release(), or NULL if no memory is available
+*/
+extern struct kd_search* kdtree_search_init( void );
+
+
+
+/**
+   Finds an image feature's approximate k nearest neighbors in a kd tree using
+   Best Bin First search and a reusable search context.  The neighbors are
+   stored in \a search->nbrs, in order of increasing descriptor distance,
+   and their squared distances in \a search->dists, where they remain until
+   the context is next used.
+
+   @param search a search context created with kdtree_search_init()
+   @param kd_tree an image feature kd tree
+   @param feat image feature for whose neighbors to search
+   @param k number of neighbors to find
+   @param max_nn_chks search is cut off after examining this many tree
+     entries; the leaf being examined when the limit is reached is finished
+
+   @return Returns the number of neighbors found, or -1 on error.
+   @see kdtree_bbf_knn()
+*/
+extern int kdtree_search_knn( struct kd_search* search,
+			      struct kd_tree* kd_tree, struct feature* feat,
+			      int k, int max_nn_chks );
+
+
+
+/**
+   De-allocates a k-d tree search context
+
+   @param search pointer to a search context
+*/
+extern void kdtree_search_release( struct kd_search** search );
+
+
+
+/**
+   Finds the approximate k nearest neighbors of each of an array of image
+   features in a kd tree using Best Bin First search, dividing the queries
+   among the threads of a pool.  Each thread searches the shared tree with
+   its own search context, and each query's neighbors are stored in its own
+   row of a dense matrix, so results do not depend on the number of threads.
+
+   @param kd_tree an image feature kd tree
+   @param feat array of image features for whose neighbors to search
+   @param n number of features in \a feat
+   @param k number of neighbors to find for each feature
+   @param max_nn_chks each search is cut off after examining this many tree
+     entries
+   @param ratio_thr if positive, a threshold on the squared ratio of the
+     distances to the nearest and second-nearest neighbors; the row of any
+     feature whose nearest neighbor is not closer than this fraction of the
+     second-nearest's distance, or that has fewer than two neighbors, is
+     cleared.  Requires \a k >= 2.
+   @param nbrs an \a n x \a k matrix in which to store pointers to each
+     feature's neighbors in order of increasing descriptor distance; entries
+     for which no neighbor was found are set to NULL
+   @param dists an \a n x \a k matrix in which to store the neighbors'
+     squared descriptor distances, or DBL_MAX where there is no neighbor;
+     may be NULL
+   @param pool threads among which to divide the queries, or NULL to search
+     on the calling thread
+
+   @return Returns the number of features for which at least one neighbor
+     was stored, i.e. the number that passed the ratio test if \a ratio_thr
+     is positive, or -1 on error.
+*/
+extern int kdtree_bbf_knn_batch( struct kd_tree* kd_tree, struct feature* feat,
+				 int n, int k, int max_nn_chks,
+				 double ratio_thr, struct feature** nbrs,
+				 double* dists, struct thread_pool* pool );
+
+
+
 /**
    Finds an image feature's approximate k nearest neighbors within a specified
    spatial region in a kd tree using Best Bin First search.
    
-   @param kd_root root of an image feature kd tree
+   @param kd_tree an image feature kd tree
    @param feat image feature for whose neighbors to search
    @param k number of neighbors to find
    @param nbrs pointer to an array in which to store pointers to neighbors
@@ -95,18 +313,106 @@ extern int kdtree_bbf_knn( struct kd_node* kd_root, struct feature* feat,
      (in case \a k neighbors could not be found before examining
      \a max_nn_checks keypoint entries).
 */
-extern int kdtree_bbf_spatial_knn( struct kd_node* kd_root,
+extern int kdtree_bbf_spatial_knn( struct kd_tree* kd_tree,
 				   struct feature* feat, int k,
 				   struct feature*** nbrs, int max_nn_chks,
 				   CvRect rect, int model );
 
 
 /**
-   De-allocates memory held by a kd tree
+   De-allocates memory held by a kd tree.  The features from which the tree
+   was built are not released.
+
+   @param kd_tree a kd tree
+*/
+extern void kdtree_release( struct kd_tree* kd_tree );
+
+
+
+/**
+   Sets randomized k-d forest parameters to their defaults:
+   KDTREE_FOREST_TREES trees with leaves of up to KDTREE_LEAF_SIZE
+   features, splitting among KDTREE_FOREST_RAND_DIMS dimensions, with
+   rotation as given by KDTREE_FOREST_ROTATE and seed KDTREE_FOREST_SEED.
+
+   @param params parameters to initialize
+*/
+extern void kdtree_forest_params_init( struct kd_forest_params* params );
+
+
+
+/**
+   Builds a randomized k-d forest from features in an array.  Unlike
+   kdtree_build(), this leaves the features in their order.  Each tree
+   keeps its own nodes and leaf order but reads descriptors from the
+   features, so trees are cheap in memory; their cost is the time spent
+   descending several of them in each search.  A rotation costs a further
+   d x d matrix per tree and a d x d matrix-vector product per tree and
+   query.  The same features and parameters always give the same forest.
+
+   @param features an array of features, which must remain valid while the
+     forest is used and must not be moved
+   @param n the number of features in \a features
+   @param params forest parameters, or NULL for the defaults; with one tree,
+     one random dimension and no rotation, the tree is the one
+     _kdtree_build() would build
+
+   @return Returns a forest built from \a features, which must be released
+     with kdtree_forest_release(), or NULL on error.
+*/
+extern struct kd_forest* kdtree_forest_build( struct feature* features, int n,
+					      struct kd_forest_params* params );
+
+
+
+/**
+   Finds an image feature's approximate k nearest neighbors in a randomized
+   k-d forest using Best Bin First search with one priority queue shared by
+   all the trees.  A feature reached in more than one tree is checked only
+   once.  Results are stored in the search context as by
+   kdtree_search_knn().
+
+   @param search a search context created with kdtree_search_init()
+   @param forest a randomized k-d forest
+   @param feat image feature for whose neighbors to search
+   @param k number of neighbors to find
+   @param max_nn_chks search is cut off after examining this many distinct
+     features; the leaf being examined when the limit is reached is finished
+
+   @return Returns the number of neighbors found, or -1 on error.
+*/
+extern int kdtree_forest_search_knn( struct kd_search* search,
+				     struct kd_forest* forest,
+				     struct feature* feat, int k,
+				     int max_nn_chks );
+
+
+
+/**
+   Finds the approximate k nearest neighbors of each of an array of image
+   features in a randomized k-d forest, dividing the queries among the
+   threads of a pool.  Parameters and results are as for
+   kdtree_bbf_knn_batch().
+
+   @return Returns the number of features for which at least one neighbor
+     was stored, or -1 on error.
+   @see kdtree_bbf_knn_batch()
+*/
+extern int kdtree_forest_knn_batch( struct kd_forest* forest,
+				    struct feature* feat, int n, int k,
+				    int max_nn_chks, double ratio_thr,
+				    struct feature** nbrs, double* dists,
+				    struct thread_pool* pool );
+
+
+
+/**
+   De-allocates a randomized k-d forest.  The features from which it was
+   built are not released.
 
-   @param kd_root pointer to the root of a kd tree
+   @param forest pointer to a forest; set to NULL
 */
-extern void kdtree_release( struct kd_node* kd_root );
+extern void kdtree_forest_release( struct kd_forest** forest );
 
 
 #endif
@@ -81,6 +81,15 @@ extern void* minpq_get_min( struct min_pq* min_pq );
 extern void* minpq_extract_min( struct min_pq* min_pq );
 
 
+/**
+   Removes all elements from a minimizing priority queue, keeping its memory
+   for reuse.
+
+   @param min_pq a minimizing priority queue
+*/
+extern void minpq_reset( struct min_pq* min_pq );
+
+
 /**
    De-allocates the memory held by a minimizing priorioty queue
 
@@ -0,0 +1,110 @@
+/**@file
+   Functions and structures for running loops in parallel on a pool of
+   threads.
+
+   A thread pool is created once and reused for many parallel loops, so the
+   cost of starting threads is paid only once per pool.  The thread calling
+   parallel_for() always takes part in the loop, so a pool of \a n threads
+   starts \a n - 1 worker threads.
+
+   Copyright (C) 2006-2012  Rob Hess <rob@iqengines.com>
+
+   @version 1.1.2-20100521
+*/
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <pthread.h>
+
+
+/********************************* Structures ********************************/
+
+/**
+   A loop body run by parallel_for().  It processes the indices in
+   [\a begin, \a end) on behalf of thread \a tid, where 0 <= \a tid <
+   thread_pool_size().  No two calls running at the same time share a
+   \a tid, so \a tid may be used to index per-thread scratch memory.
+*/
+typedef void (*parallel_fn)( void* ctx, int begin, int end, int tid );
+
+
+/** a pool of threads that run parallel loops */
+struct thread_pool
+{
+  int nthreads;                /**< number of threads, including the caller */
+  pthread_t* threads;          /* worker threads */
+  pthread_mutex_t lock;        /* protects the fields below */
+  pthread_cond_t start;        /* signaled when a loop is started */
+  pthread_cond_t done;         /* signaled when the last worker finishes */
+  unsigned long gen;           /* number of loops started */
+  int busy;                    /* workers still running the current loop */
+  int quit;                    /* set to stop the workers */
+  parallel_fn fn;              /* current loop body */
+  void* ctx;                   /* argument to fn */
+  int n;                       /* number of indices in the current loop */
+  int chunk;                   /* number of indices claimed at once */
+  int next;                    /* next unclaimed index */
+  int next_tid;                /* next unclaimed thread index */
+};
+
+
+/*************************** Function Prototypes *****************************/
+
+/**
+   Creates a thread pool.
+
+   @param nthreads the total number of threads that should run each loop;
+     values less than 1 select one thread per online CPU
+
+   @return Returns a new thread pool, which must be released with
+     thread_pool_release(), or NULL if worker threads could not be started
+*/
+extern struct thread_pool* thread_pool_init( int nthreads );
+
+
+/**
+   Returns the number of threads that run each loop of a thread pool.
+
+   @param pool a thread pool; may be NULL, which denotes a single thread
+
+   @return Returns the number of threads in \a pool
+*/
+extern int thread_pool_size( struct thread_pool* pool );
+
+
+/**
+   Runs a loop body over the indices [0, \a n) on the threads of a pool and
+   waits for it to finish.  Indices are handed out in contiguous chunks of
+   at least \a grain indices, in increasing order, to whichever thread is
+   free.  Loop bodies must therefore write results to locations determined
+   by index, not by thread, for results to be independent of scheduling.
+
+   @param pool a thread pool; if NULL, \a fn is called once on the calling
+     thread for the whole range
+   @param n number of indices
+   @param grain minimum number of indices per call to \a fn
+   @param fn loop body
+   @param ctx argument passed to \a fn
+*/
+extern void parallel_for( struct thread_pool* pool, int n, int grain,
+			  parallel_fn fn, void* ctx );
+
+
+/**
+   Stops the threads of a thread pool and de-allocates its memory
+
+   @param pool pointer to a thread pool
+*/
+extern void thread_pool_release( struct thread_pool** pool );
+
+
+/**
+   Returns the number of online CPUs
+
+   @return Returns the number of online CPUs, or 1 if it cannot be determined
+*/
+extern int num_cpus( void );
+
+
+#endif
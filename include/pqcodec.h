@@ -0,0 +1,243 @@
+/**@file
+   Functions and structures for storing large numbers of SIFT descriptors
+   as compact product quantization codes and searching them.
+
+   A product quantizer splits a descriptor into \a m subvectors and
+   quantizes each to one of PQ_CENTROIDS centroids learned by k-means for
+   its subspace, so a descriptor is stored as \a m bytes instead of 128.
+   To make the codes more precise and search non-exhaustive, descriptors
+   are first assigned to the nearest of \a nlist coarse centroids, and it
+   is their residuals from those centroids that are product quantized and
+   kept in one inverted list per coarse centroid.  A query visits only the
+   inverted lists of its \a nprobe nearest coarse centroids.  For each list
+   it fills a table of squared distances between its residual's
+   subvectors and every subspace centroid, after which the asymmetric
+   distance to each code is the sum of \a m table lookups.  The terms of
+   those tables that do not depend on the query are computed once in
+   training, so filling a table takes only additions.  For more
+   information, refer to:
+
+   Jegou, H., Douze, M., and Schmid, C.  Product quantization for nearest
+   neighbor search.  <EM>IEEE Transactions on Pattern Analysis and Machine
+   Intelligence</EM>, 33, 1 (2011), pp. 117--128.
+
+   Each stored descriptor costs \a m bytes of code and a 4-byte id, against
+   128 bytes in a feature set and over 1,024 in a struct feature.  The
+   index itself takes \a nlist x \a m x PQ_CENTROIDS floats of
+   precomputed terms.
+
+   Copyright (C) 2006-2012  Rob Hess <rob@iqengines.com>
+
+   @version 1.1.2-20100521
+*/
+
+#ifndef PQCODEC_H
+#define PQCODEC_H
+
+struct feature_set;
+struct thread_pool;
+
+
+/******************************* Defs and macros *****************************/
+
+/** number of centroids of each subspace; each code element is one byte */
+#define PQ_CENTROIDS 256
+
+/** default number of subquantizers, i.e. bytes per code */
+#define PQ_SUBQUANTIZERS 8
+
+/** default number of coarse centroids and inverted lists */
+#define PQ_NLIST 256
+
+/** default number of inverted lists visited by a query */
+#define PQ_NPROBE 8
+
+/** default maximum number of k-means iterations */
+#define PQ_ITERS 20
+
+/** default maximum number of training descriptors; 0 means use all */
+#define PQ_MAX_TRAIN 65536
+
+/** default seed of k-means initialization */
+#define PQ_SEED 1
+
+
+/********************************** Structures *******************************/
+
+/** parameters of a product quantizer; see pq_params_init() */
+struct pq_params
+{
+  int m;                       /**< number of subquantizers; must divide the
+				  descriptor length */
+  int nlist;                   /**< number of coarse centroids; 1 makes
+				  search exhaustive */
+  int iters;                   /**< maximum k-means iterations */
+  int max_train;               /**< if positive, at most this many training
+				  descriptors are used, taken evenly from
+				  the training sets */
+  unsigned int seed;           /**< seed of k-means initialization */
+};
+
+
+/** a trained product quantizer and the codes it has stored */
+struct pq_index
+{
+  int d;                       /**< descriptor length */
+  int m;                       /**< number of subquantizers */
+  int dsub;                    /**< length of each subvector, d / m */
+  int nlist;                   /**< number of coarse centroids */
+  float* coarse;               /**< nlist x d matrix of coarse centroids */
+  float* codebooks;            /**< m x PQ_CENTROIDS x dsub array of
+				  subspace centroids */
+  float* terms;                /**< nlist x m x PQ_CENTROIDS array of the
+				  query-independent terms of distance
+				  tables */
+  int n;                       /**< number of codes stored */
+  unsigned char** codes;       /**< codes of each inverted list, m bytes
+				  apiece */
+  int** ids;                   /**< id of each code of each inverted list */
+  int* nlisted;                /**< number of codes in each inverted list */
+  int* nallocd;                /* room in each inverted list */
+};
+
+
+/** a stored descriptor returned by a search */
+struct pq_hit
+{
+  int id;                      /**< id of the descriptor, or -1 if fewer
+				  were found than requested */
+  float dsq;                   /**< approximate squared distance to the
+				  query */
+};
+
+
+/*************************** Function Prototypes *****************************/
+
+/**
+   Sets product quantizer parameters to their defaults: PQ_SUBQUANTIZERS,
+   PQ_NLIST, PQ_ITERS, PQ_MAX_TRAIN, and PQ_SEED.
+
+   @param params parameters to initialize
+*/
+extern void pq_params_init( struct pq_params* params );
+
+
+
+/**
+   Trains a product quantizer on the descriptors of a number of feature
+   sets: first the coarse centroids by k-means over the descriptors, then
+   each subspace's centroids by k-means over that subspace of the
+   descriptors' residuals.  The index stores no codes until pq_add() is
+   called.
+
+   @param sets feature sets whose descriptors are used for training; all
+     must have the same descriptor length
+   @param nsets number of sets in \a sets
+   @param params quantizer parameters, or NULL for the defaults
+   @param pool threads among which to divide k-means assignment, or NULL
+
+   @return Returns a new index, which must be released with
+     pq_release(), or NULL on error.
+*/
+extern struct pq_index* pq_train( struct feature_set** sets, int nsets,
+				  struct pq_params* params,
+				  struct thread_pool* pool );
+
+
+
+/**
+   Encodes a descriptor.
+
+   @param index a trained product quantizer
+   @param descr a descriptor of \a index->d bytes
+   @param code array of \a index->m bytes in which to store the code
+
+   @return Returns the index of the descriptor's inverted list, or -1 if
+     no memory is available.
+*/
+extern int pq_encode( struct pq_index* index, const unsigned char* descr,
+		      unsigned char* code );
+
+
+
+/**
+   Reconstructs the approximation of a descriptor represented by a code.
+
+   @param index a trained product quantizer
+   @param list the descriptor's inverted list
+   @param code the descriptor's code
+   @param descr array of \a index->d floats in which to store the
+     reconstruction
+*/
+extern void pq_decode( struct pq_index* index, int list,
+		       const unsigned char* code, float* descr );
+
+
+
+/**
+   Encodes the descriptors of a feature set and appends them to an
+   index's inverted lists.  Descriptors are encoded in parallel and stored
+   in order, so lists do not depend on the number of threads.
+
+   @param index a trained product quantizer
+   @param set features whose descriptors are added
+   @param ids id of each feature, returned in search hits, or NULL to
+     number the features consecutively from \a index->n
+   @param pool threads among which to divide encoding, or NULL
+
+   @return Returns 0 on success or -1 on error.
+*/
+extern int pq_add( struct pq_index* index, struct feature_set* set,
+		   int* ids, struct thread_pool* pool );
+
+
+
+/**
+   Finds the approximate k nearest neighbors of a descriptor among those
+   stored in an index by asymmetric distance computation.
+
+   @param index a product quantizer
+   @param descr the query descriptor, of \a index->d bytes
+   @param k number of neighbors to find
+   @param nprobe number of inverted lists to visit
+   @param hits array in which to store \a k neighbors, in order of
+     increasing distance; ties are broken in favor of lower ids, and
+     missing neighbors have id -1
+
+   @return Returns the number of neighbors found or -1 on error.
+*/
+extern int pq_search_knn( struct pq_index* index,
+			  const unsigned char* descr, int k, int nprobe,
+			  struct pq_hit* hits );
+
+
+
+/**
+   Runs pq_search_knn() for every feature of a set, dividing the features
+   among the threads of a pool, each with its own distance tables.
+
+   @param index a product quantizer
+   @param set query features
+   @param k number of neighbors to find for each feature
+   @param nprobe number of inverted lists to visit for each feature
+   @param hits array of \a set->n x \a k structures in which to store the
+     neighbors of feature i at hits[i*k] to hits[i*k+k-1]
+   @param pool threads, or NULL to search on the calling thread
+
+   @return Returns 0 on success or -1 on error.
+*/
+extern int pq_knn_batch( struct pq_index* index, struct feature_set* set,
+			 int k, int nprobe, struct pq_hit* hits,
+			 struct thread_pool* pool );
+
+
+
+/**
+   De-allocates a product quantizer and its codes
+
+   @param index pointer to an index; set to NULL
+*/
+extern void pq_release( struct pq_index** index );
+
+
+#endif
@@ -0,0 +1,142 @@
+/**@file
+   Functions and structures for building Gaussian scale space pyramids with
+   precomputed, separable convolution kernels.
+
+   Each level of a SIFT Gaussian pyramid is produced by blurring the level
+   below it with one of a small, fixed set of incremental sigmas.  The
+   kernels for those sigmas are computed once per pyramid, and every blur
+   is performed as a horizontal pass followed by a vertical pass.  Both
+   passes are vectorized with AVX2 or SSE2 when the CPU supports them and
+   fall back to plain C otherwise.
+
+   The gradient magnitude and orientation of every pixel of a pyramid level
+   can also be computed at once, with the same vectorization, into a pair
+   of planes from which features' orientations and descriptors are read.
+
+   Copyright (C) 2006-2012  Rob Hess <rob@iqengines.com>
+
+   @version 1.1.2-20100521
+*/
+
+#ifndef PYRAMID_H
+#define PYRAMID_H
+
+#include "cxcore.h"
+
+
+/******************************* Defs and macros *****************************/
+
+/** largest error in radians of the orientations from calc_grad_rows() */
+#define PYR_ATAN2_MAX_ERR 2e-5
+
+
+/********************************* Structures ********************************/
+
+/** a normalized, symmetric 1D Gaussian kernel */
+struct gauss_kernel
+{
+  double sigma;                /**< standard deviation of the kernel */
+  int n;                       /**< number of taps; always odd */
+  int h;                       /**< half width, i.e. (n - 1) / 2 */
+  float* k;                    /**< the n kernel coefficients */
+};
+
+
+/*************************** Function Prototypes *****************************/
+
+/**
+   Computes a Gaussian kernel.  The kernel size and coefficients are chosen
+   exactly as cvSmooth() chooses them for a 32-bit floating point image, so
+   gauss_smooth() reproduces cvSmooth( src, dst, CV_GAUSSIAN, 0, 0, sigma,
+   sigma ) up to floating point rounding.
+
+   @param sigma standard deviation of the Gaussian
+
+   @return Returns a new kernel, which must be released with
+     release_gauss_kernel().
+*/
+extern struct gauss_kernel* create_gauss_kernel( double sigma );
+
+
+/**
+   Computes the kernels needed to build one octave of a Gaussian scale space
+   pyramid.  Kernel \a i blurs level \a i-1 of an octave to produce level
+   \a i.
+
+   @param intvls the number of intervals sampled per octave of scale space
+   @param sigma the amount of Gaussian smoothing at the base of each octave
+
+   @return Returns an array of \a intvls + 3 kernels.  Element 0 is NULL,
+     since the base of each octave is not produced by blurring.  The array
+     must be released with release_pyr_kernels().
+*/
+extern struct gauss_kernel** create_pyr_kernels( int intvls, double sigma );
+
+
+/**
+   Blurs a single-channel, 32-bit floating point image with a Gaussian
+   kernel.  Image borders are handled by replicating edge pixels.
+
+   @param src source image
+   @param dst destination image; must be the same size as \a src and may
+     be \a src itself
+   @param kernel the Gaussian kernel with which to blur
+*/
+extern void gauss_smooth( IplImage* src, IplImage* dst,
+			  struct gauss_kernel* kernel );
+
+
+/**
+   Blurs a band of rows of a single-channel, 32-bit floating point image
+   with a Gaussian kernel.  Only rows \a r0 through \a r1 - 1 of \a dst are
+   written, and they are identical to the corresponding rows written by
+   gauss_smooth(), so disjoint bands of one image may be blurred
+   concurrently.
+
+   @param src source image
+   @param dst destination image; must be the same size as \a src and may be
+     \a src itself only if the band covers the whole image
+   @param kernel the Gaussian kernel with which to blur
+   @param r0 first row of the band
+   @param r1 one past the last row of the band
+*/
+extern void gauss_smooth_rows( IplImage* src, IplImage* dst,
+			       struct gauss_kernel* kernel, int r0, int r1 );
+
+
+/**
+   Computes the gradient magnitude and orientation of a band of rows of a
+   single-channel, 32-bit floating point image.  Gradients are central
+   differences, as in Lowe's paper.  Orientations are computed with a
+   polynomial approximation of atan2() whose error is at most
+   PYR_ATAN2_MAX_ERR radians and lie in [-pi, pi].  Pixels on the image
+   border have no gradient; their magnitude and orientation are set to 0.
+
+   @param img source image
+   @param mag output magnitude image; must be the same size as \a img
+   @param ori output orientation image; must be the same size as \a img
+   @param r0 first row of the band
+   @param r1 one past the last row of the band
+*/
+extern void calc_grad_rows( IplImage* img, IplImage* mag, IplImage* ori,
+			    int r0, int r1 );
+
+
+/**
+   De-allocates memory held by a Gaussian kernel
+
+   @param kernel pointer to a Gaussian kernel
+*/
+extern void release_gauss_kernel( struct gauss_kernel** kernel );
+
+
+/**
+   De-allocates memory held by an array of pyramid kernels
+
+   @param kernels pointer to an array returned by create_pyr_kernels()
+   @param intvls the number of intervals used to create \a kernels
+*/
+extern void release_pyr_kernels( struct gauss_kernel*** kernels, int intvls );
+
+
+#endif
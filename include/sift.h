@@ -33,9 +33,42 @@ struct detection_data
   int intvl;
   double subintvl;
   double scl_octv;
+  double contr;
 };
 
 struct feature;
+struct feature_set;
+
+
+/**
+   threads and memory used to detect features in a series of images; see
+   sift_ctx_init()
+*/
+struct sift_ctx;
+
+
+/** parameters controlling SIFT feature detection; see _sift_features() */
+struct sift_params
+{
+  int intvls;                  /**< intervals sampled per octave */
+  double sigma;                /**< smoothing at the base of each octave */
+  double contr_thr;            /**< low threshold on feature contrast */
+  int curv_thr;                /**< high threshold on principal curvatures */
+  int img_dbl;                 /**< double the image before detection? */
+  int descr_width;             /**< width of descriptor histogram array */
+  int descr_hist_bins;         /**< bins per descriptor histogram */
+  int threads;                 /**< threads per image; < 1 for one per CPU */
+  int grad_planes;             /**< precompute gradient planes? */
+  int roi_margin;              /**< pixels of image kept around a region of
+				  interest; see sift_features_roi() */
+  int budget;                  /**< most features returned; < 1 for no
+				  limit; see SIFT_BUDGET */
+  int budget_grid;             /**< width of grid of cells over which the
+				  budget is spread; < 2 for none */
+  int first_octv;              /**< octave at which the pyramid starts;
+				  must not be negative; see SIFT_FIRST_OCTV */
+  int max_octvs;               /**< most octaves built; < 1 for no limit */
+};
 
 
 /******************************* Defs and macros *****************************/
@@ -61,12 +94,72 @@ struct feature;
 /** default number of bins per histogram in descriptor array */
 #define SIFT_DESCR_HIST_BINS 8
 
+/** default number of threads used to detect features in one image */
+#define SIFT_THREADS 1
+
+/**
+   read gradients from precomputed planes by default?  Planes hold the
+   gradient magnitude and approximate orientation of every pixel of each
+   pyramid level on which a feature lies, costing 8 bytes per pixel, and
+   spare orientation assignment and descriptor computation from finding
+   the gradients of overlapping regions over and over.
+*/
+#define SIFT_GRAD_PLANES 0
+
+/**
+   default margin in pixels around a region of interest over which the
+   pyramid is also built.  Features whose Gaussian blur and descriptor
+   windows fit within the margin, which with default parameters are those
+   of the first octave, are found in a region just as in the whole image.
+*/
+#define SIFT_ROI_MARGIN 32
+
+/**
+   default limit on the number of features returned per image, or 0 for
+   none.  With a limit, extrema are ranked by contrast |D(x)| before
+   orientations are assigned, and only the strongest are oriented and
+   described; those beyond the limit, including extra orientations of a
+   feature, are dropped.
+*/
+#define SIFT_BUDGET 0
+
+/**
+   default width of the grid of cells over which a feature budget is
+   spread, or 0 to take the strongest features wherever they lie.  With a
+   grid, the strongest feature of every cell is taken first, then the
+   second strongest, and so on, so that features cover the image evenly.
+*/
+#define SIFT_BUDGET_GRID 0
+
+/**
+   default octave at which the pyramid starts, counting the octaves of the
+   pyramid that would otherwise be built, whose first octave is the doubled
+   image when image doubling is on.  Octave k > 0 starts from the image
+   halved k times, or k - 1 times with doubling on, and the image is then
+   never doubled.  Together with a cap on the number of octaves, see
+   SIFT_MAX_OCTVS, this gives a fast preview of an image's coarse features.
+   A preview starting at octave k can be refined later by detecting again
+   with a first octave of 0 and at most k octaves, which searches only the
+   finer octaves the preview skipped; together, the two calls find the
+   features of every octave.
+*/
+#define SIFT_FIRST_OCTV 0
+
+/** default cap on the number of octaves in the pyramid, or 0 for none */
+#define SIFT_MAX_OCTVS 0
+
 /* assumed gaussian blur for input image */
 #define SIFT_INIT_SIGMA 0.5
 
 /* width of border in which to ignore keypoints */
 #define SIFT_IMG_BORDER 5
 
+/* bytes of DoG rows kept in cache while searching for extrema; sized for L2 */
+#define SIFT_DOG_WINDOW_BYTES 262144
+
+/* minimum number of image rows handled by one task when detecting in parallel */
+#define SIFT_PAR_MIN_ROWS 32
+
 /* maximum steps of keypoint interpolation before failure */
 #define SIFT_MAX_INTERP_STEPS 5
 
@@ -147,4 +240,205 @@ extern int _sift_features( IplImage* img, struct feature** feat, int intvls,
 			   double sigma, double contr_thr, int curv_thr,
 			   int img_dbl, int descr_width, int descr_hist_bins );
 
+
+
+/**
+   Sets SIFT parameters to their default values
+
+   @param params SIFT parameters
+*/
+extern void sift_params_init( struct sift_params* params );
+
+
+
+/**
+   Finds SIFT features in an image using the parameters in a sift_params
+   structure.  All detected features are stored in the array pointed to by
+   \a feat.
+
+   When \a params->threads is greater than 1, pyramid construction, extremum
+   detection, orientation assignment, and descriptor computation are each
+   split across that many threads.  The work is divided so that the
+   features found, and the order in which they are returned, do not depend
+   on the number of threads.
+
+   When \a params->grad_planes is nonzero, orientations and descriptors are
+   computed from gradient planes built once per pyramid level; see
+   SIFT_GRAD_PLANES.  Gradient orientations are then approximated to within
+   PYR_ATAN2_MAX_ERR radians, so features may differ slightly from those
+   found without planes.
+
+   When \a params->budget is positive, at most that many features are
+   returned, and orientations and descriptors are computed only for those
+   kept; see SIFT_BUDGET and SIFT_BUDGET_GRID.
+
+   @param img the image in which to detect features
+   @param feat a pointer to an array in which to store detected features;
+     memory for this array is allocated by this function and must be freed by
+     the caller using free(*feat)
+   @param params detection parameters, initialized with sift_params_init()
+
+   @return Returns the number of keypoints stored in \a feat or -1 on failure
+   @see _sift_features()
+*/
+extern int sift_features_params( IplImage* img, struct feature** feat,
+				 const struct sift_params* params );
+
+
+
+/**
+   Finds SIFT features in an image using the parameters in a sift_params
+   structure and stores them in a compact feature set; see featset.h.  The
+   features are the same, in the same order, as those found by
+   sift_features_params(), but no array of struct feature is ever made.
+
+   @param img the image in which to detect features
+   @param set a pointer to a feature set in which to store detected
+     features; the set is created by this function and must be released by
+     the caller using feature_set_release()
+   @param params detection parameters, initialized with sift_params_init()
+
+   @return Returns the number of keypoints stored in \a set or -1 on failure
+*/
+extern int sift_features_set( IplImage* img, struct feature_set** set,
+			      const struct sift_params* params );
+
+
+
+/**
+   Finds SIFT features in a region of interest of an image, optionally
+   restricted further by a mask.  The pyramid is built only over the
+   region, expanded by \a params->roi_margin pixels on each side and
+   aligned so that it is sampled at every octave on the same grid as the
+   whole image, and only the pixels of the region, and of the mask, are
+   searched for extrema.  Detection time thus falls roughly in proportion
+   to the area of the region.  Features are returned in the coordinates of
+   the whole image, and are those whose extremum lies in the region and in
+   the mask.  Near the region's edges, features too large for the margin
+   may differ from those found in the whole image, and the region's size
+   limits the number of octaves, and so the largest scale, searched.
+
+   @param img the image in which to detect features; any ROI set on it is
+     ignored
+   @param roi region of \a img in which to detect features
+   @param mask an 8-bit, single-channel image the size of \a img whose
+     nonzero pixels may hold features, or NULL to search all of \a roi
+   @param feat a pointer to an array in which to store detected features;
+     memory for this array is allocated by this function and must be freed by
+     the caller using free(*feat)
+   @param params detection parameters, initialized with sift_params_init()
+
+   @return Returns the number of keypoints stored in \a feat or -1 on failure
+*/
+extern int sift_features_roi( IplImage* img, CvRect roi, IplImage* mask,
+			      struct feature** feat,
+			      const struct sift_params* params );
+
+
+
+/**
+   Creates a context for detecting SIFT features in a series of images.  The
+   context owns the threads used for detection and the memory in which
+   keypoints, detection data, and histograms are built.  That memory is
+   allocated from per-thread arenas that are emptied all at once after each
+   image and reused for the next, so a context should be kept for as long
+   as there are images to process.
+
+   The context also keeps the buffers in which the scale space of an image
+   is built: the gray and doubled images, every level of the Gaussian
+   pyramid, and the gradient planes of levels on which features have been
+   found.  They are allocated for the first image, or by
+   sift_ctx_reserve(), and are reused for every later image of the same
+   size, so detecting features in the frames of a video allocates no image
+   memory after the first frame.  An image of another size replaces them.
+
+   @param params detection parameters, initialized with sift_params_init();
+     these are copied into the context
+
+   @return Returns a new context, which must be released with
+     sift_ctx_release(), or NULL if the parameters are invalid
+*/
+extern struct sift_ctx* sift_ctx_init( const struct sift_params* params );
+
+
+
+/**
+   Allocates a detection context's scale space buffers for images of a
+   given size, so that none are allocated when features are detected in
+   the first of them.  Buffers for another size are released.
+
+   @param ctx a detection context created with sift_ctx_init()
+   @param size size of the images in which features will be detected
+*/
+extern void sift_ctx_reserve( struct sift_ctx* ctx, CvSize size );
+
+
+
+/**
+   Finds SIFT features in an image using a detection context.  All detected
+   features are stored in the array pointed to by \a feat.  A context may
+   be used by only one thread at a time.
+
+   @param ctx a detection context created with sift_ctx_init()
+   @param img the image in which to detect features
+   @param feat a pointer to an array in which to store detected features;
+     memory for this array is allocated by this function and must be freed by
+     the caller using free(*feat)
+
+   @return Returns the number of keypoints stored in \a feat or -1 on failure
+   @see sift_features_params()
+*/
+extern int sift_ctx_features( struct sift_ctx* ctx, IplImage* img,
+			      struct feature** feat );
+
+
+
+/**
+   Finds SIFT features in an image using a detection context and stores
+   them in a compact feature set.
+
+   @param ctx a detection context created with sift_ctx_init()
+   @param img the image in which to detect features
+   @param set a pointer to a feature set in which to store detected
+     features; the set is created by this function and must be released by
+     the caller using feature_set_release()
+
+   @return Returns the number of keypoints stored in \a set or -1 on failure
+   @see sift_features_set()
+*/
+extern int sift_ctx_features_set( struct sift_ctx* ctx, IplImage* img,
+				  struct feature_set** set );
+
+
+
+/**
+   Finds SIFT features in a region of interest of an image, optionally
+   restricted further by a mask, using a detection context.
+
+   @param ctx a detection context created with sift_ctx_init()
+   @param img the image in which to detect features; any ROI set on it is
+     ignored
+   @param roi region of \a img in which to detect features
+   @param mask an 8-bit, single-channel image the size of \a img whose
+     nonzero pixels may hold features, or NULL
+   @param feat a pointer to an array in which to store detected features;
+     memory for this array is allocated by this function and must be freed by
+     the caller using free(*feat)
+
+   @return Returns the number of keypoints stored in \a feat or -1 on failure
+   @see sift_features_roi()
+*/
+extern int sift_ctx_features_roi( struct sift_ctx* ctx, IplImage* img,
+				  CvRect roi, IplImage* mask,
+				  struct feature** feat );
+
+
+
+/**
+   De-allocates a detection context
+
+   @param ctx pointer to a detection context
+*/
+extern void sift_ctx_release( struct sift_ctx** ctx );
+
 #endif
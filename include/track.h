@@ -0,0 +1,200 @@
+/**@file
+   Functions and structures for tracking SIFT features through the frames
+   of a video.
+
+   A tracker keeps a model of the scene: features in the coordinates of the
+   first frame, each matched in a recent frame.  Each frame's features are
+   matched to the model and a homography from the frame to the model is
+   fit to the matches by RANSAC.
+
+   Rather than detecting features in each whole frame, a tracker divides
+   frames into square cells and compares each cell with its contents when
+   features were last detected there.  Features whose support lies
+   entirely in unchanged cells are carried over from the previous frame,
+   along with their descriptors and model matches.  Features are detected
+   again only in the cells that changed, or in which a carried feature's
+   support changed, and only those new features are described and matched
+   to the model, against model features near the locations predicted for
+   them by the previous frame's homography.  The work done for a frame thus
+   grows with how much of the scene changed rather than with frame size.
+   When no homography can be fit, the next frame is detected and matched
+   in full.
+
+   New features that match nothing are added to the model, and model
+   features not matched for a number of frames are dropped, so the model
+   follows a changing scene.
+
+   Copyright (C) 2006-2012  Rob Hess <rob@iqengines.com>
+
+   @version 1.1.2-20100521
+*/
+
+#ifndef TRACK_H
+#define TRACK_H
+
+#include "sift.h"
+#include "imgfeatures.h"
+
+#include <cxcore.h>
+
+struct kd_tree;
+
+
+/******************************* Defs and macros *****************************/
+
+/** default width in pixels of the square cells compared between frames */
+#define TRACK_CELL 32
+
+/** default threshold on the mean absolute difference between a cell's gray
+    levels and those it held when last detected above which the cell is
+    detected again */
+#define TRACK_DIFF_THR 4.0
+
+/** default half-width in pixels of the region of the model around a new
+    feature's predicted location in which its match is sought */
+#define TRACK_SEARCH_RADIUS 24
+
+/** default number of frames after which an unmatched model feature is
+    dropped */
+#define TRACK_MAX_AGE 30
+
+/** default fraction of cells that, once changed, are detected as one whole
+    frame instead of region by region */
+#define TRACK_FULL_FRAC 0.5
+
+/** default fraction of the model that may be added or dropped before the
+    model's k-d tree is rebuilt; until then, features added are searched
+    linearly */
+#define TRACK_REBUILD_FRAC 0.2
+
+/** ratio of a feature's descriptor radius to its scale; with default
+    descriptor parameters, radius is 3 x scale x sqrt(2) x (4 + 1) / 2 */
+#define TRACK_SUPPORT_FCTR 10.61
+
+/** threshold on squared ratio of distances to the nearest and
+    second-nearest model features for a match */
+#define TRACK_NN_SQ_DIST_RATIO_THR 0.49
+
+/** maximum number of k-d tree entries examined to match a feature */
+#define TRACK_BBF_MAX_NN_CHKS 200
+
+
+/********************************** Structures *******************************/
+
+/** parameters of a tracker; see track_params_init() */
+struct track_params
+{
+  int cell;                    /**< width of cells in pixels */
+  double diff_thr;             /**< threshold on a cell's mean absolute
+				  difference in gray levels */
+  int search_radius;           /**< half-width of model regions searched */
+  int max_age;                 /**< frames an unmatched model feature is
+				  kept */
+  double full_frac;            /**< fraction of changed cells above which
+				  whole frames are detected */
+  double rebuild_frac;         /**< fraction of the model changed before its
+				  k-d tree is rebuilt */
+};
+
+
+/** a tracker of features through the frames of a video */
+struct tracker
+{
+  struct track_params params;  /**< tracking parameters */
+  struct sift_ctx* ctx;        /* detects features */
+  int frame;                   /**< number of frames tracked */
+  CvSize size;                 /* frame size */
+  int ncols;                   /* columns of cells */
+  int nrows;                   /* rows of cells */
+  IplImage* gray;              /* gray level copy of the current frame */
+  IplImage* ref;               /* each cell's contents when last detected */
+  int* label;                  /* region in which each cell is detected,
+				  or 0 if its features are carried over */
+  int* stack;                  /* cells waiting to be labeled */
+  CvRect* rects;               /* bounding box of each region */
+  struct feature* feat;        /**< features of the current frame */
+  int n;                       /**< number of features in \a feat */
+  int nallocd;                 /* room in feat */
+  int* match;                  /* model index of each feature's match, or
+				  -1 */
+  struct feature* model;       /**< model features; their \a mdl_pt fields
+				  hold model coordinates */
+  int nmodel;                  /**< number of model features */
+  int nmodel_allocd;           /* room in model */
+  int* seen;                   /* frame in which each model feature was
+				  last matched */
+  struct feature* kd_feat;     /* copy of the model indexed by kd; each
+				  copy's category is its model index */
+  struct kd_tree* kd;          /* k-d tree of the model, or NULL */
+  int nindexed;                /* model features [0, nindexed) are in kd */
+  int nstale;                  /* model features dropped or added since
+				  kd was built */
+  CvMat* H;                    /**< homography from the current frame to
+				  the model, or NULL if none was found */
+  int ncarried;                /**< features carried from the last frame */
+  int ndetected;               /**< features detected in the current frame */
+  int nmatched;                /**< features matched to the model */
+  int ninliers;                /**< matches consistent with \a H */
+  int ncells;                  /**< cells detected in the current frame */
+};
+
+
+/*************************** Function Prototypes *****************************/
+
+/**
+   Sets tracking parameters to their defaults: TRACK_CELL, TRACK_DIFF_THR,
+   TRACK_SEARCH_RADIUS, TRACK_MAX_AGE, TRACK_FULL_FRAC, and
+   TRACK_REBUILD_FRAC.
+
+   @param params parameters to initialize
+*/
+extern void track_params_init( struct track_params* params );
+
+
+
+/**
+   Creates a tracker.
+
+   @param sift_params parameters with which features are detected,
+     initialized with sift_params_init()
+   @param params tracking parameters, or NULL for the defaults
+
+   @return Returns a new tracker, which must be released with
+     tracker_release(), or NULL if \a sift_params are invalid
+*/
+extern struct tracker* tracker_init( const struct sift_params* sift_params,
+				     const struct track_params* params );
+
+
+
+/**
+   Finds the features of the next frame of a video and the homography from
+   the frame to the model.  The first frame is detected in full and becomes
+   the model, so model coordinates are those of the first frame.  Frames
+   must all be the same size.
+
+   @param tracker a tracker created with tracker_init()
+   @param img the next frame
+   @param feat pointer in which to return the frame's features, which
+     belong to the tracker and are valid until its next frame; each
+     feature's \a mdl_match points to its model match, or is NULL
+   @param H pointer in which to return the homography from the frame to the
+     model, which belongs to the tracker, or NULL if none could be found;
+     may be NULL
+
+   @return Returns the number of features in \a feat, or -1 on error
+*/
+extern int tracker_update( struct tracker* tracker, IplImage* img,
+			   struct feature** feat, CvMat** H );
+
+
+
+/**
+   De-allocates a tracker
+
+   @param tracker pointer to a tracker; set to NULL
+*/
+extern void tracker_release( struct tracker** tracker );
+
+
+#endif
@@ -20,6 +20,14 @@
 #define ABS(x) ( ( (x) < 0 )? -(x) : (x) )
 #endif
 
+/** SIMD_NONE <BR> SIMD_SSE2 <BR> SIMD_AVX2 */
+enum simd_level
+  {
+    SIMD_NONE,
+    SIMD_SSE2,
+    SIMD_AVX2,
+  };
+
 /***************************** Inline Functions ******************************/
 
 
@@ -159,6 +167,35 @@ extern char* prepend_path( const char* path, const char* file );
 extern char* basename( const char* pathname );
 
 
+/**
+   Reads a line of a text file into a buffer, without its line ending.  A
+   line too long for the buffer is skipped through its end, so that its
+   remainder is not read as the next line.
+
+   @param file a text file
+   @param line buffer in which to store the line
+   @param size size of line in bytes
+
+   @return Returns the length of the line, -1 at the end of the file, or
+     -2 if the line was too long; line then holds as much of it as fits
+*/
+extern int read_line( FILE* file, char* line, int size );
+
+
+/**
+   Reads the non-empty lines of a list file, such as a list of image or
+   feature files.  Exits with an error if the file cannot be read, names
+   no files, or has a line too long to be a file name.
+
+   @param filename name of the list file
+   @param n output as the number of lines read
+
+   @return Returns an array of the lines, without line endings; the caller
+     must free each line and the array
+*/
+extern char** read_list( char* filename, int* n );
+
+
 /**
    Displays progress in the console with a spinning pinwheel.  Every time this
    function is called, the state of the pinwheel is incremented.  The pinwheel
@@ -201,6 +238,48 @@ extern int array_double( void** array, int n, int size );
 extern double dist_sq_2D( CvPoint2D64f p1, CvPoint2D64f p2 );
 
 
+/**
+   Reads a monotonic clock, e.g. for timing code.
+
+   @return Returns the current time in milliseconds, measured from an
+     arbitrary starting point
+*/
+extern double get_time_ms( void );
+
+
+/**
+   Advances a xorshift random state.  Callers keep their own state rather
+   than using random() so that their results are repeatable and do not
+   disturb, or race with, other users of the C library's generator.
+
+   @param state random state, which must not be zero
+
+   @return Returns the next 32-bit random number.
+*/
+extern unsigned int rand_next( unsigned int* state );
+
+
+/**
+   Determines the most capable SIMD instruction set available for vectorized
+   code paths.  The CPU is queried once, at the first call.  SIMD_AVX2 is
+   reported only for CPUs that also support FMA, so AVX2 code paths may
+   use fused multiply-adds.
+
+   @return Returns one of SIMD_NONE, SIMD_SSE2, or SIMD_AVX2, capped by any
+     limit set with limit_simd_level()
+*/
+extern int simd_level( void );
+
+
+/**
+   Caps the SIMD instruction set used by vectorized code paths, e.g. to
+   compare them against their plain C fallbacks.
+
+   @param level one of SIMD_NONE, SIMD_SSE2, or SIMD_AVX2
+*/
+extern void limit_simd_level( int level );
+
+
 /**
    Draws an x on an image.
 
@@ -0,0 +1,244 @@
+/**@file
+   Functions and structures for indexing large collections of images by
+   quantizing their features with a vocabulary tree.
+
+   A vocabulary tree is built by hierarchical k-means: the training
+   descriptors are clustered into \a branch groups, each group is
+   clustered again, and so on to a fixed depth, so that a descriptor is
+   quantized to one of \a branch ^ \a depth visual words by descending the
+   tree, comparing it with only \a branch centers at each level.  Each word
+   keeps an inverted file of the images in which it occurs and how often.
+   An image is scored against a query by the cosine similarity of their
+   TF-IDF weighted word histograms, which only touches the inverted files
+   of the query's words.  For more information, refer to:
+
+   Nister, D. and Stewenius, H.  Scalable recognition with a vocabulary
+   tree.  In <EM>Conference on Computer Vision and Pattern Recognition
+   (CVPR)</EM> (2006), pp. 2161--2168.
+
+   Descriptors and cluster centers are bytes, as in a feature set, so
+   quantization uses descr_dist_sq_u8().  Building and indexing divide
+   their work among the threads of a pool; queries never modify a tree, so
+   any number of threads may query one tree at once.
+
+   Copyright (C) 2006-2012  Rob Hess <rob@iqengines.com>
+
+   @version 1.1.2-20100521
+*/
+
+#ifndef VOCAB_H
+#define VOCAB_H
+
+struct feature_set;
+struct thread_pool;
+
+
+/******************************* Defs and macros *****************************/
+
+/** default number of children of each vocabulary tree node */
+#define VOCAB_BRANCH 10
+
+/** default number of levels of a vocabulary tree below its root */
+#define VOCAB_DEPTH 6
+
+/** default maximum number of k-means iterations at each node */
+#define VOCAB_ITERS 10
+
+/** default maximum number of training descriptors; 0 means use all */
+#define VOCAB_MAX_TRAIN 0
+
+/** default seed of k-means initialization */
+#define VOCAB_SEED 1
+
+/** default number of images returned by a query */
+#define VOCAB_TOP_K 10
+
+
+/********************************** Structures *******************************/
+
+/** parameters of a vocabulary tree; see vocab_params_init() */
+struct vocab_params
+{
+  int branch;                  /**< number of children of each node */
+  int depth;                   /**< number of levels below the root */
+  int iters;                   /**< maximum k-means iterations per node */
+  int max_train;               /**< if positive, at most this many training
+				  descriptors are used, taken evenly from
+				  the training sets */
+  unsigned int seed;           /**< seed of k-means initialization, so a
+				  tree can be rebuilt exactly */
+};
+
+
+/** one image's entry in a visual word's inverted file */
+struct vocab_posting
+{
+  int image;                   /**< index of the image in the tree */
+  int count;                   /**< number of the image's features
+				  quantized to the word */
+};
+
+
+/** a vocabulary tree and its inverted files; see vocab_build() */
+struct vocab_tree
+{
+  int d;                       /**< descriptor length */
+  int stride;                  /**< bytes from one center to the next */
+  int branch;                  /**< number of children of each node */
+  int depth;                   /**< number of levels below the root */
+  int nnodes;                  /**< number of nodes, counting the root */
+  int nwords;                  /**< number of leaves, i.e. visual words */
+  unsigned char* centers;      /**< nnodes x stride matrix of cluster
+				  centers; the children of node i are nodes
+				  i * branch + 1 to i * branch + branch, and
+				  the last nwords nodes are the leaves */
+  int* ntrain;                 /**< number of training descriptors in each
+				  node's cluster; empty nodes are never
+				  descended into */
+  int nimages;                 /**< number of images indexed */
+  int* image_ids;              /**< caller's id of each image */
+  double* norms;               /**< norm of each image's weighted word
+				  histogram */
+  double* idf;                 /**< inverse document frequency of each
+				  word */
+  struct vocab_posting** postings; /**< inverted file of each word, in
+				      order of image */
+  int* npostings;              /**< number of entries in each inverted file */
+  int* nallocd;                /* room in each inverted file */
+  int nimages_allocd;          /* room in image_ids and norms */
+};
+
+
+/** an image returned by a query */
+struct vocab_hit
+{
+  int image;                   /**< index of the image in the tree */
+  int id;                      /**< caller's id of the image */
+  double score;                /**< cosine similarity to the query, in
+				  [0, 1] */
+};
+
+
+/*************************** Function Prototypes *****************************/
+
+/**
+   Sets vocabulary tree parameters to their defaults: VOCAB_BRANCH,
+   VOCAB_DEPTH, VOCAB_ITERS, VOCAB_MAX_TRAIN, and VOCAB_SEED.
+
+   @param params parameters to initialize
+*/
+extern void vocab_params_init( struct vocab_params* params );
+
+
+
+/**
+   Builds a vocabulary tree by hierarchical k-means over the descriptors of
+   a number of feature sets.  Each node's children are initialized with
+   k-means++ seeding from a random state derived from \a params->seed and
+   the node, so a tree does not depend on the number of threads.  A node
+   with no more descriptors than \a params->branch gets one child per
+   descriptor.  The tree has no images until vocab_add_images() is called.
+
+   @param sets feature sets whose descriptors are clustered; all must have
+     the same descriptor length
+   @param nsets number of sets in \a sets
+   @param params tree parameters, or NULL for the defaults
+   @param pool threads among which to divide the clustering, or NULL to
+     build on the calling thread
+
+   @return Returns a new vocabulary tree, which must be released with
+     vocab_release(), or NULL on error.
+*/
+extern struct vocab_tree* vocab_build( struct feature_set** sets, int nsets,
+				       struct vocab_params* params,
+				       struct thread_pool* pool );
+
+
+
+/**
+   Quantizes a descriptor to a visual word by descending a vocabulary tree.
+
+   @param tree a vocabulary tree
+   @param descr a descriptor of \a tree->d bytes, readable for
+     \a tree->stride bytes, as in a feature set
+
+   @return Returns the index of the descriptor's word.
+*/
+extern int vocab_quantize( struct vocab_tree* tree,
+			   const unsigned char* descr );
+
+
+
+/**
+   Adds images to a vocabulary tree's inverted files.  Images' features are
+   quantized in parallel and appended in order, after which every word's
+   inverse document frequency and every image's norm are recomputed, so
+   images are best added in large batches.
+
+   @param tree a vocabulary tree
+   @param sets the images' feature sets
+   @param ids caller's id of each image, returned in query hits, or NULL
+     to use the images' indices in the tree
+   @param n number of images
+   @param pool threads among which to divide quantization, or NULL
+
+   @return Returns 0 on success or -1 on error.
+*/
+extern int vocab_add_images( struct vocab_tree* tree,
+			     struct feature_set** sets, int* ids, int n,
+			     struct thread_pool* pool );
+
+
+
+/**
+   Finds the images in a vocabulary tree most similar to a query image.
+
+   @param tree a vocabulary tree
+   @param set the query's features
+   @param hits array in which to store up to \a top_k images, in order of
+     decreasing score; ties are broken in favor of earlier images
+   @param top_k maximum number of images to return
+
+   @return Returns the number of images stored in \a hits, which omits
+     images sharing no words with the query, or -1 on error.
+*/
+extern int vocab_query( struct vocab_tree* tree, struct feature_set* set,
+			struct vocab_hit* hits, int top_k );
+
+
+
+/**
+   Writes a vocabulary tree and its inverted files to a binary file in the
+   byte order of the machine writing it.
+
+   @param tree a vocabulary tree
+   @param filename name of the file to write
+
+   @return Returns 0 on success or -1 on error.
+*/
+extern int vocab_save( struct vocab_tree* tree, char* filename );
+
+
+
+/**
+   Reads a vocabulary tree written by vocab_save().
+
+   @param filename name of the file to read
+
+   @return Returns the tree, which must be released with vocab_release(),
+     or NULL if the file could not be read or was not written by
+     vocab_save() on a machine of the same byte order.
+*/
+extern struct vocab_tree* vocab_load( char* filename );
+
+
+
+/**
+   De-allocates a vocabulary tree
+
+   @param tree pointer to a vocabulary tree; set to NULL
+*/
+extern void vocab_release( struct vocab_tree** tree );
+
+
+#endif
@@ -0,0 +1,211 @@
+/*
+  Functions for region-based memory allocation.
+
+  Copyright (C) 2006-2012  Rob Hess <rob@iqengines.com>
+
+  @version 1.1.2-20100521
+*/
+
+#include "arena.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* rounds a size up to a multiple of ARENA_ALIGN */
+#define arena_round( n ) \
+  ( ( (n) + ARENA_ALIGN - 1 ) & ~(size_t)( ARENA_ALIGN - 1 ) )
+
+/************************* Local Function Prototypes *************************/
+
+static struct arena_block* new_block( size_t );
+
+
+/********************** Functions prototyped in arena.h **********************/
+
+/*
+  Creates an empty arena.
+
+  @param block_size minimum size in bytes of new blocks; 0 for the default
+
+  @return Returns a new arena
+*/
+struct arena* arena_init( size_t block_size )
+{
+  struct arena* arena;
+
+  arena = calloc( 1, sizeof( struct arena ) );
+  arena->block_size = ( block_size )? block_size : ARENA_BLOCK_SIZE;
+  return arena;
+}
+
+
+
+/*
+  Allocates memory from an arena.  Blocks left over from before the last
+  reset or restore are reused when large enough; otherwise a new block is
+  inserted after the current one.
+
+  @param arena an arena
+  @param size number of bytes to allocate
+
+  @return Returns a pointer to size bytes or NULL if no memory is available
+*/
+void* arena_alloc( struct arena* arena, size_t size )
+{
+  struct arena_block* block;
+  void* p;
+
+  size = arena_round( ( size )? size : 1 );
+  if( arena->cur  &&  arena->used + size <= arena->cur->size )
+    {
+      p = arena->cur->data + arena->used;
+      arena->used += size;
+      return p;
+    }
+
+  /* move on to the next block, or add one big enough */
+  block = ( arena->cur )? arena->cur->next : arena->first;
+  if( ! block  ||  block->size < size )
+    {
+      block = new_block( ( size > arena->block_size )? size :
+			 arena->block_size );
+      if( ! block )
+	{
+	  fprintf( stderr, "Warning: unable to allocate memory in " \
+		   "arena_alloc(), %s line %d\n", __FILE__, __LINE__ );
+	  return NULL;
+	}
+      if( arena->cur )
+	{
+	  block->next = arena->cur->next;
+	  arena->cur->next = block;
+	}
+      else
+	{
+	  block->next = arena->first;
+	  arena->first = block;
+	}
+    }
+
+  arena->cur = block;
+  arena->used = size;
+  return block->data;
+}
+
+
+
+/*
+  Allocates zeroed memory for an array from an arena.
+
+  @param arena an arena
+  @param n number of array elements
+  @param size size in bytes of each element
+
+  @return Returns a pointer to the zeroed array or NULL on failure
+*/
+void* arena_calloc( struct arena* arena, size_t n, size_t size )
+{
+  void* p;
+
+  p = arena_alloc( arena, n * size );
+  if( p )
+    memset( p, 0, n * size );
+  return p;
+}
+
+
+
+/*
+  Records the current position of an arena.
+
+  @param arena an arena
+
+  @return Returns the current position of arena
+*/
+struct arena_pos arena_save( struct arena* arena )
+{
+  struct arena_pos pos;
+
+  pos.block = arena->cur;
+  pos.used = arena->used;
+  return pos;
+}
+
+
+
+/*
+  Returns an arena to a position recorded by arena_save().
+
+  @param arena an arena
+  @param pos a position of arena
+*/
+void arena_restore( struct arena* arena, struct arena_pos pos )
+{
+  arena->cur = pos.block;
+  arena->used = pos.used;
+}
+
+
+
+/*
+  Releases all memory allocated from an arena, keeping its blocks.
+
+  @param arena an arena
+*/
+void arena_reset( struct arena* arena )
+{
+  arena->cur = NULL;
+  arena->used = 0;
+}
+
+
+
+/*
+  De-allocates an arena and all memory allocated from it
+
+  @param arena pointer to an arena
+*/
+void arena_release( struct arena** arena )
+{
+  struct arena_block* block, * next;
+
+  if( ! arena  ||  ! *arena )
+    return;
+  for( block = (*arena)->first; block; block = next )
+    {
+      next = block->next;
+      free( block );
+    }
+  free( *arena );
+  *arena = NULL;
+}
+
+
+/************************ Functions prototyped here **************************/
+
+/*
+  Allocates a block with room for size bytes of data.  The block's header
+  and data share one heap allocation.
+
+  @param size number of bytes of data
+
+  @return Returns a new block or NULL if no memory is available
+*/
+static struct arena_block* new_block( size_t size )
+{
+  struct arena_block* block;
+  size_t hdr = arena_round( sizeof( struct arena_block ) );
+
+  block = malloc( hdr + size + ARENA_ALIGN );
+  if( ! block )
+    return NULL;
+  block->next = NULL;
+  block->size = size;
+  block->data = (char*)block + hdr;
+
+  /* malloc() may align more loosely than ARENA_ALIGN */
+  block->data += ( ARENA_ALIGN - (size_t)block->data % ARENA_ALIGN ) %
+    ARENA_ALIGN;
+  return block;
+}
@@ -0,0 +1,402 @@
+/*
+  Functions for exact brute-force nearest neighbor matching between sets
+  of feature descriptors.
+
+  Copyright (C) 2006-2012  Rob Hess <rob@iqengines.com>
+
+  @version 1.1.2-20100521
+*/
+
+#include "bfmatch.h"
+#include "featset.h"
+#include "parallel.h"
+#include "utils.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(__GNUC__)  &&  ( defined(__x86_64__)  ||  defined(__i386__) )
+#define BF_X86
+#include <immintrin.h>
+#endif
+
+/* query and train descriptors whose dot products one kernel call finds */
+#define BF_QROWS 2
+#define BF_TROWS 4
+
+
+/********************************** Structures *******************************/
+
+/* descriptors widened to 16 bits, with their squared norms */
+struct wide_descr
+{
+  short* descr;                /* rows x ld matrix; rows past n are zero */
+  int* norm;                   /* squared norm of each row */
+  int n;                       /* number of descriptors */
+  int rows;                    /* number of rows, a multiple of the kernel's */
+};
+
+/* shared state of a parallel match; see match_blocks() */
+struct match_job
+{
+  struct wide_descr* query;
+  struct wide_descr* train;
+  int ld;                      /* elements from one row to the next */
+  int tile;                    /* train rows per tile, a multiple of BF_TROWS */
+  int simd;                    /* SIMD level of the dot product kernel */
+  struct bf_match* matches;
+};
+
+
+/************************* Local Function Prototypes *************************/
+
+static int widen_descr( struct feature_set*, int, int, struct wide_descr* );
+static void match_blocks( void*, int, int, int );
+static void dot_block( const short*, const short*, int, int*, int );
+static void dot_block_c( const short*, const short*, int, int* );
+static void update_top2( struct bf_match*, int, int );
+#ifdef BF_X86
+static void dot_block_sse2( const short*, const short*, int, int* );
+static void dot_block_avx2( const short*, const short*, int, int* );
+#endif
+
+
+/********************* Functions prototyped in bfmatch.h *********************/
+
+/*
+  Finds the two nearest train features to each query feature by comparing
+  all pairs.  Both sets' descriptors are widened to 16 bits so that dot
+  products can be accumulated with pmaddwd, then blocks of
+  BFMATCH_QUERY_BLOCK queries are handed out to the threads of pool.  Each
+  block is compared with one L2-sized tile of train descriptors at a time,
+  BF_QROWS queries against BF_TROWS train descriptors per kernel call.
+
+  @param query query features
+  @param train train features
+  @param matches array in which to store each query's neighbors
+  @param pool threads, or NULL
+
+  @return Returns 0 on success or -1 on failure
+*/
+int bfmatch_knn2( struct feature_set* query, struct feature_set* train,
+		  struct bf_match* matches, struct thread_pool* pool )
+{
+  struct wide_descr wq, wt;
+  struct match_job job;
+  int i, ret = -1;
+
+  if( ! query  ||  ! train  ||  ( ! matches  &&  query->n > 0 ) )
+    fatal_error( "NULL pointer error, %s, line %d",  __FILE__, __LINE__ );
+  if( query->d != train->d )
+    {
+      fprintf( stderr, "Warning: descriptor lengths differ, %s line %d\n",
+	       __FILE__, __LINE__ );
+      return -1;
+    }
+
+  for( i = 0; i < query->n; i++ )
+    {
+      matches[i].nn[0] = matches[i].nn[1] = -1;
+      matches[i].dsq[0] = matches[i].dsq[1] = INT_MAX;
+    }
+  if( query->n == 0  ||  train->n == 0 )
+    return 0;
+
+  /* mapped sets may have different strides, each a multiple of every
+     kernel's width; both are widened to the larger */
+  job.ld = MAX( query->stride, train->stride );
+  wt.descr = NULL;
+  if( widen_descr( query, job.ld, BF_QROWS, &wq ) )
+    return -1;
+  if( widen_descr( train, job.ld, BF_TROWS, &wt ) )
+    goto out;
+
+  job.query = &wq;
+  job.train = &wt;
+  job.tile = BFMATCH_TRAIN_TILE_BYTES / ( job.ld * sizeof( short ) );
+  job.tile = MAX( job.tile / BF_TROWS * BF_TROWS, BF_TROWS );
+  job.simd = simd_level();
+  job.matches = matches;
+  parallel_for( pool, ( query->n + BFMATCH_QUERY_BLOCK - 1 ) /
+		BFMATCH_QUERY_BLOCK, 1, match_blocks, &job );
+  ret = 0;
+
+ out:
+  free( wq.descr );
+  free( wt.descr );
+  return ret;
+}
+
+
+/************************ Functions prototyped here **************************/
+
+/*
+  Copies a feature set's descriptors into a matrix of 16-bit elements and
+  computes their squared norms.  The number of rows is rounded up to a
+  multiple of a kernel's row count with zero descriptors, which kernels may
+  process but whose results are ignored.
+
+  @param set a feature set
+  @param ld elements from one row of the matrix to the next, at least the
+    set's stride
+  @param mult the number of rows must be a multiple of this
+  @param wide structure in which to store the widened descriptors; its
+    descr and norm share one allocation, to be freed with free(wide->descr)
+
+  @return Returns 0 on success or -1 if no memory is available
+*/
+static int widen_descr( struct feature_set* set, int ld, int mult,
+			struct wide_descr* wide )
+{
+  unsigned char* src;
+  short* dst;
+  int i, k;
+
+  wide->n = set->n;
+  wide->rows = ( set->n + mult - 1 ) / mult * mult;
+  wide->descr = calloc( 1, (size_t)wide->rows * ( ld * sizeof( short ) +
+						 sizeof( int ) ) );
+  if( ! wide->descr )
+    {
+      fprintf( stderr, "Warning: unable to allocate memory in " \
+	       "bfmatch_knn2(), %s line %d\n", __FILE__, __LINE__ );
+      return -1;
+    }
+  wide->norm = (int*)( wide->descr + (size_t)wide->rows * ld );
+
+  for( i = 0; i < set->n; i++ )
+    {
+      src = feature_set_descr( set, i );
+      dst = wide->descr + (size_t)i * ld;
+      wide->norm[i] = 0;
+      for( k = 0; k < set->d; k++ )
+	{
+	  dst[k] = src[k];
+	  wide->norm[i] += src[k] * src[k];
+	}
+    }
+  return 0;
+}
+
+
+
+/*
+  Finds the two nearest train features to each query feature in a range of
+  query blocks; run by parallel_for().  Each query's neighbors are updated
+  in increasing order of train index, so ties go to the lower index.
+
+  @param data a struct match_job
+  @param begin first query block
+  @param end one past the last query block
+  @param tid thread index; unused
+*/
+static void match_blocks( void* data, int begin, int end, int tid )
+{
+  struct match_job* job = data;
+  struct wide_descr* query = job->query, * train = job->train;
+  const short* q, * t;
+  int dot[BF_QROWS * BF_TROWS];
+  int ld = job->ld, q0, q1, t0, t1, i, j, r, c;
+
+  for( ; begin < end; begin++ )
+    {
+      q0 = begin * BFMATCH_QUERY_BLOCK;
+      q1 = MIN( q0 + BFMATCH_QUERY_BLOCK, query->rows );
+      for( t0 = 0; t0 < train->rows; t0 = t1 )
+	{
+	  t1 = MIN( t0 + job->tile, train->rows );
+	  for( i = q0; i < q1; i += BF_QROWS )
+	    {
+	      q = query->descr + (size_t)i * ld;
+	      for( j = t0; j < t1; j += BF_TROWS )
+		{
+		  t = train->descr + (size_t)j * ld;
+		  dot_block( q, t, ld, dot, job->simd );
+		  for( r = 0; r < BF_QROWS  &&  i + r < query->n; r++ )
+		    for( c = 0; c < BF_TROWS  &&  j + c < train->n; c++ )
+		      update_top2( job->matches + i + r, j + c,
+				   query->norm[i+r] + train->norm[j+c] -
+				   2 * dot[r*BF_TROWS+c] );
+		}
+	    }
+	}
+    }
+}
+
+
+
+/*
+  Computes the dot products of BF_QROWS consecutive query descriptors with
+  BF_TROWS consecutive train descriptors using the best available code
+  path.
+
+  @param q first query descriptor
+  @param t first train descriptor
+  @param ld elements from one descriptor to the next; a multiple of 16
+  @param dot array in which to store the dot product of query r and train
+    descriptor c at index r * BF_TROWS + c
+  @param simd one of SIMD_NONE, SIMD_SSE2, or SIMD_AVX2
+*/
+static void dot_block( const short* q, const short* t, int ld, int* dot,
+		       int simd )
+{
+#ifdef BF_X86
+  if( simd >= SIMD_AVX2 )
+    {
+      dot_block_avx2( q, t, ld, dot );
+      return;
+    }
+  if( simd >= SIMD_SSE2 )
+    {
+      dot_block_sse2( q, t, ld, dot );
+      return;
+    }
+#endif
+  dot_block_c( q, t, ld, dot );
+}
+
+
+
+/* Plain C version of dot_block() */
+static void dot_block_c( const short* q, const short* t, int ld, int* dot )
+{
+  int r, c, k, s;
+
+  for( r = 0; r < BF_QROWS; r++ )
+    for( c = 0; c < BF_TROWS; c++ )
+      {
+	s = 0;
+	for( k = 0; k < ld; k++ )
+	  s += q[r*ld+k] * t[c*ld+k];
+	dot[r*BF_TROWS+c] = s;
+      }
+}
+
+
+
+/*
+  Offers a train feature as one of a query's two nearest neighbors
+
+  @param m the query's neighbors so far
+  @param j index of the train feature
+  @param dsq squared distance from the query to train feature j
+*/
+static void update_top2( struct bf_match* m, int j, int dsq )
+{
+  if( dsq >= m->dsq[1] )
+    return;
+  if( dsq < m->dsq[0] )
+    {
+      m->nn[1] = m->nn[0];
+      m->dsq[1] = m->dsq[0];
+      m->nn[0] = j;
+      m->dsq[0] = dsq;
+    }
+  else
+    {
+      m->nn[1] = j;
+      m->dsq[1] = dsq;
+    }
+}
+
+
+#ifdef BF_X86
+
+/*
+  SSE2 version of dot_block().  Each of the eight query-train pairs has its
+  own accumulator, so every train load is used twice and every query load
+  four times.
+*/
+static void dot_block_sse2( const short* q, const short* t, int ld, int* dot )
+{
+  __m128i q0, q1, v, a00, a01, a02, a03, a10, a11, a12, a13, lo, hi;
+  int k;
+
+  a00 = a01 = a02 = a03 = a10 = a11 = a12 = a13 = _mm_setzero_si128();
+  for( k = 0; k < ld; k += 8 )
+    {
+      q0 = _mm_loadu_si128( (const __m128i*)( q + k ) );
+      q1 = _mm_loadu_si128( (const __m128i*)( q + ld + k ) );
+      v = _mm_loadu_si128( (const __m128i*)( t + k ) );
+      a00 = _mm_add_epi32( a00, _mm_madd_epi16( q0, v ) );
+      a10 = _mm_add_epi32( a10, _mm_madd_epi16( q1, v ) );
+      v = _mm_loadu_si128( (const __m128i*)( t + ld + k ) );
+      a01 = _mm_add_epi32( a01, _mm_madd_epi16( q0, v ) );
+      a11 = _mm_add_epi32( a11, _mm_madd_epi16( q1, v ) );
+      v = _mm_loadu_si128( (const __m128i*)( t + 2 * ld + k ) );
+      a02 = _mm_add_epi32( a02, _mm_madd_epi16( q0, v ) );
+      a12 = _mm_add_epi32( a12, _mm_madd_epi16( q1, v ) );
+      v = _mm_loadu_si128( (const __m128i*)( t + 3 * ld + k ) );
+      a03 = _mm_add_epi32( a03, _mm_madd_epi16( q0, v ) );
+      a13 = _mm_add_epi32( a13, _mm_madd_epi16( q1, v ) );
+    }
+
+  /* transpose-and-add each row's four accumulators into one vector */
+  lo = _mm_add_epi32( _mm_unpacklo_epi32( a00, a01 ),
+		      _mm_unpackhi_epi32( a00, a01 ) );
+  hi = _mm_add_epi32( _mm_unpacklo_epi32( a02, a03 ),
+		      _mm_unpackhi_epi32( a02, a03 ) );
+  _mm_storeu_si128( (__m128i*)dot,
+		    _mm_add_epi32( _mm_unpacklo_epi64( lo, hi ),
+				   _mm_unpackhi_epi64( lo, hi ) ) );
+  lo = _mm_add_epi32( _mm_unpacklo_epi32( a10, a11 ),
+		      _mm_unpackhi_epi32( a10, a11 ) );
+  hi = _mm_add_epi32( _mm_unpacklo_epi32( a12, a13 ),
+		      _mm_unpackhi_epi32( a12, a13 ) );
+  _mm_storeu_si128( (__m128i*)( dot + BF_TROWS ),
+		    _mm_add_epi32( _mm_unpacklo_epi64( lo, hi ),
+				   _mm_unpackhi_epi64( lo, hi ) ) );
+}
+
+
+
+/* AVX2 version of dot_block(); see dot_block_sse2() */
+__attribute__(( target( "avx2" ) ))
+static void dot_block_avx2( const short* q, const short* t, int ld, int* dot )
+{
+  __m256i q0, q1, v, a00, a01, a02, a03, a10, a11, a12, a13, lo, hi;
+  __m128i s;
+  int k;
+
+  a00 = a01 = a02 = a03 = a10 = a11 = a12 = a13 = _mm256_setzero_si256();
+  for( k = 0; k < ld; k += 16 )
+    {
+      q0 = _mm256_loadu_si256( (const __m256i*)( q + k ) );
+      q1 = _mm256_loadu_si256( (const __m256i*)( q + ld + k ) );
+      v = _mm256_loadu_si256( (const __m256i*)( t + k ) );
+      a00 = _mm256_add_epi32( a00, _mm256_madd_epi16( q0, v ) );
+      a10 = _mm256_add_epi32( a10, _mm256_madd_epi16( q1, v ) );
+      v = _mm256_loadu_si256( (const __m256i*)( t + ld + k ) );
+      a01 = _mm256_add_epi32( a01, _mm256_madd_epi16( q0, v ) );
+      a11 = _mm256_add_epi32( a11, _mm256_madd_epi16( q1, v ) );
+      v = _mm256_loadu_si256( (const __m256i*)( t + 2 * ld + k ) );
+      a02 = _mm256_add_epi32( a02, _mm256_madd_epi16( q0, v ) );
+      a12 = _mm256_add_epi32( a12, _mm256_madd_epi16( q1, v ) );
+      v = _mm256_loadu_si256( (const __m256i*)( t + 3 * ld + k ) );
+      a03 = _mm256_add_epi32( a03, _mm256_madd_epi16( q0, v ) );
+      a13 = _mm256_add_epi32( a13, _mm256_madd_epi16( q1, v ) );
+    }
+
+  /* as in dot_block_sse2(), but each 128-bit lane holds partial sums */
+  lo = _mm256_add_epi32( _mm256_unpacklo_epi32( a00, a01 ),
+			 _mm256_unpackhi_epi32( a00, a01 ) );
+  hi = _mm256_add_epi32( _mm256_unpacklo_epi32( a02, a03 ),
+			 _mm256_unpackhi_epi32( a02, a03 ) );
+  lo = _mm256_add_epi32( _mm256_unpacklo_epi64( lo, hi ),
+			 _mm256_unpackhi_epi64( lo, hi ) );
+  s = _mm_add_epi32( _mm256_castsi256_si128( lo ),
+		     _mm256_extracti128_si256( lo, 1 ) );
+  _mm_storeu_si128( (__m128i*)dot, s );
+  lo = _mm256_add_epi32( _mm256_unpacklo_epi32( a10, a11 ),
+			 _mm256_unpackhi_epi32( a10, a11 ) );
+  hi = _mm256_add_epi32( _mm256_unpacklo_epi32( a12, a13 ),
+			 _mm256_unpackhi_epi32( a12, a13 ) );
+  lo = _mm256_add_epi32( _mm256_unpacklo_epi64( lo, hi ),
+			 _mm256_unpackhi_epi64( lo, hi ) );
+  s = _mm_add_epi32( _mm256_castsi256_si128( lo ),
+		     _mm256_extracti128_si256( lo, 1 ) );
+  _mm_storeu_si128( (__m128i*)( dot + BF_TROWS ), s );
+}
+
+#endif
@@ -0,0 +1,267 @@
+/*
+  Functions implementing a bounded multi-producer, multi-consumer queue.
+
+  Copyright (C) 2006-2012  Rob Hess <rob@iqengines.com>
+
+  @version 1.1.2-20100521
+*/
+
+#include "bqueue.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/************************* Local Function Prototypes *************************/
+
+static int try_push( struct bqueue*, void* );
+static int try_pop( struct bqueue*, void** );
+static void wait_sem( sem_t*, unsigned long* );
+
+
+/********************** Functions prototyped in bqueue.h *********************/
+
+/*
+  Creates a bounded queue.  Cell i starts out waiting for a push at
+  position i.
+
+  @param cap minimum capacity
+
+  @return Returns a new queue or NULL on error
+*/
+struct bqueue* bqueue_init( int cap )
+{
+  struct bqueue* q;
+  int i;
+
+  q = calloc( 1, sizeof( struct bqueue ) );
+  if( ! q )
+    {
+      fprintf( stderr, "Warning: unable to allocate memory, %s line %d\n",
+	       __FILE__, __LINE__ );
+      return NULL;
+    }
+  for( q->cap = 1; q->cap < cap; q->cap *= 2 );
+  q->cells = calloc( q->cap, sizeof( struct bqueue_cell ) );
+  if( ! q->cells  ||  sem_init( &q->slots, 0, q->cap ) )
+    {
+      fprintf( stderr, "Warning: unable to create queue, %s line %d\n",
+	       __FILE__, __LINE__ );
+      free( q->cells );
+      free( q );
+      return NULL;
+    }
+  if( sem_init( &q->items, 0, 0 ) )
+    {
+      fprintf( stderr, "Warning: unable to create queue, %s line %d\n",
+	       __FILE__, __LINE__ );
+      sem_destroy( &q->slots );
+      free( q->cells );
+      free( q );
+      return NULL;
+    }
+  for( i = 0; i < q->cap; i++ )
+    q->cells[i].seq = i;
+
+  return q;
+}
+
+
+
+/*
+  Adds an item to a queue.  Holding a free-cell token guarantees a cell,
+  but a consumer may not yet have handed back the one at the head, so the
+  push is retried until it is.
+
+  @param q a queue
+  @param data the item
+
+  @return Returns 0 on success or -1 if the queue has been closed
+*/
+int bqueue_push( struct bqueue* q, void* data )
+{
+  if( __atomic_load_n( &q->closed, __ATOMIC_ACQUIRE ) )
+    {
+      fprintf( stderr, "Warning: push to a closed queue, %s line %d\n",
+	       __FILE__, __LINE__ );
+      return -1;
+    }
+
+  wait_sem( &q->slots, &q->nfull );
+  while( ! try_push( q, data ) )
+    sched_yield();
+  __sync_fetch_and_add( &q->npush, 1 );
+  sem_post( &q->items );
+  return 0;
+}
+
+
+
+/*
+  Removes the oldest item from a queue.  Holding an item token guarantees
+  an item, but an earlier cell may have been claimed by a producer that
+  has not yet filled it, so the pop is retried until it succeeds.  Once the
+  queue is closed, every push has completed, so a failed pop means the
+  queue is empty; the extra token posted by bqueue_close() is then passed
+  on to wake the next consumer.
+
+  @param q a queue
+  @param data output as the item
+
+  @return Returns 1 if an item was removed or 0 if the queue is empty and
+    closed
+*/
+int bqueue_pop( struct bqueue* q, void** data )
+{
+  wait_sem( &q->items, &q->nempty );
+  while( ! try_pop( q, data ) )
+    {
+      if( __atomic_load_n( &q->closed, __ATOMIC_ACQUIRE ) )
+	{
+	  if( try_pop( q, data ) )
+	    break;
+	  sem_post( &q->items );
+	  return 0;
+	}
+      sched_yield();
+    }
+  sem_post( &q->slots );
+  return 1;
+}
+
+
+
+/*
+  Closes a queue and wakes one consumer, which passes the wake-up on
+
+  @param q a queue
+*/
+void bqueue_close( struct bqueue* q )
+{
+  __atomic_store_n( &q->closed, 1, __ATOMIC_RELEASE );
+  sem_post( &q->items );
+}
+
+
+
+/*
+  De-allocates a queue
+
+  @param q pointer to a queue
+*/
+void bqueue_release( struct bqueue** q )
+{
+  if( ! q  ||  ! *q )
+    return;
+  sem_destroy( &(*q)->slots );
+  sem_destroy( &(*q)->items );
+  free( (*q)->cells );
+  free( *q );
+  *q = NULL;
+}
+
+
+/************************ Functions prototyped here **************************/
+
+/*
+  Tries to add an item at the head of a queue.  The head cell is free when
+  its sequence number equals the head position; the producer that
+  advances the head past it owns it, fills it, and marks it full by
+  advancing its sequence number by one.
+
+  @param q a queue
+  @param data the item
+
+  @return Returns 1 if the item was added or 0 if the head cell is not free
+*/
+static int try_push( struct bqueue* q, void* data )
+{
+  struct bqueue_cell* cell;
+  unsigned long pos, seq;
+  long diff;
+
+  pos = __atomic_load_n( &q->head, __ATOMIC_RELAXED );
+  while( 1 )
+    {
+      cell = q->cells + ( pos & ( q->cap - 1 ) );
+      seq = __atomic_load_n( &cell->seq, __ATOMIC_ACQUIRE );
+      diff = (long)( seq - pos );
+      if( diff == 0 )
+	{
+	  if( __atomic_compare_exchange_n( &q->head, &pos, pos + 1, 1,
+					   __ATOMIC_RELAXED,
+					   __ATOMIC_RELAXED ) )
+	    break;
+	}
+      else if( diff < 0 )
+	return 0;
+      else
+	pos = __atomic_load_n( &q->head, __ATOMIC_RELAXED );
+    }
+
+  cell->data = data;
+  __atomic_store_n( &cell->seq, pos + 1, __ATOMIC_RELEASE );
+  return 1;
+}
+
+
+
+/*
+  Tries to remove the item at the tail of a queue.  The tail cell is full
+  when its sequence number is one past the tail position; the consumer
+  that advances the tail past it takes its item and frees it for the push
+  one lap later.
+
+  @param q a queue
+  @param data output as the item
+
+  @return Returns 1 if an item was removed or 0 if the tail cell is not
+    full
+*/
+static int try_pop( struct bqueue* q, void** data )
+{
+  struct bqueue_cell* cell;
+  unsigned long pos, seq;
+  long diff;
+
+  pos = __atomic_load_n( &q->tail, __ATOMIC_RELAXED );
+  while( 1 )
+    {
+      cell = q->cells + ( pos & ( q->cap - 1 ) );
+      seq = __atomic_load_n( &cell->seq, __ATOMIC_ACQUIRE );
+      diff = (long)( seq - ( pos + 1 ) );
+      if( diff == 0 )
+	{
+	  if( __atomic_compare_exchange_n( &q->tail, &pos, pos + 1, 1,
+					   __ATOMIC_RELAXED,
+					   __ATOMIC_RELAXED ) )
+	    break;
+	}
+      else if( diff < 0 )
+	return 0;
+      else
+	pos = __atomic_load_n( &q->tail, __ATOMIC_RELAXED );
+    }
+
+  *data = cell->data;
+  __atomic_store_n( &cell->seq, pos + q->cap, __ATOMIC_RELEASE );
+  return 1;
+}
+
+
+
+/*
+  Takes a token from a semaphore, counting the times one was not available
+  at once
+
+  @param sem a semaphore
+  @param nwaits counter of waits
+*/
+static void wait_sem( sem_t* sem, unsigned long* nwaits )
+{
+  if( sem_trywait( sem ) == 0 )
+    return;
+  __sync_fetch_and_add( nwaits, 1 );
+  while( sem_wait( sem )  &&  errno == EINTR );
+}
@@ -0,0 +1,414 @@
+/*
+  Functions for computing squared Euclidean distances between feature
+  descriptors.
+
+  Copyright (C) 2006-2012  Rob Hess <rob@iqengines.com>
+
+  @version 1.1.2-20100521
+*/
+
+#include "descrdist.h"
+#include "utils.h"
+
+#if defined(__GNUC__)  &&  ( defined(__x86_64__)  ||  defined(__i386__) )
+#define DIST_X86
+#include <immintrin.h>
+#endif
+
+/************************* Local Function Prototypes *************************/
+
+static int dist_u8( const unsigned char*, const unsigned char*, int, int );
+static float dist_f32( const float*, const float*, int, int );
+static int dist_u8_c( const unsigned char*, const unsigned char*, int );
+static float dist_f32_c( const float*, const float*, int );
+static double dist_f64_c( const double*, const double*, int );
+#ifdef DIST_X86
+static int dist_u8_sse2( const unsigned char*, const unsigned char*, int );
+static int dist_u8_avx2( const unsigned char*, const unsigned char*, int );
+static float dist_f32_sse2( const float*, const float*, int );
+static float dist_f32_avx2( const float*, const float*, int );
+static double dist_f64_sse2( const double*, const double*, int );
+static double dist_f64_avx2( const double*, const double*, int );
+#endif
+
+
+/******************** Functions prototyped in descrdist.h ********************/
+
+/*
+  Computes the squared Euclidean distance between two byte descriptors.
+
+  @param a a descriptor
+  @param b another descriptor
+  @param d descriptor length
+
+  @return Returns the squared distance between a and b
+*/
+int descr_dist_sq_u8( const unsigned char* a, const unsigned char* b, int d )
+{
+  return dist_u8( a, b, d, simd_level() );
+}
+
+
+
+/*
+  Computes the squared Euclidean distance between two byte descriptors,
+  checking it against a bound every DESCRDIST_BOUND_STEP elements.
+
+  @param a a descriptor
+  @param b another descriptor
+  @param d descriptor length
+  @param bound a bound on the distances of interest
+
+  @return Returns the squared distance between a and b or, once it exceeds
+    bound, the partial distance computed so far
+*/
+int descr_dist_sq_u8_bound( const unsigned char* a, const unsigned char* b,
+			    int d, int bound )
+{
+  int simd = simd_level(), dsq = 0, i;
+
+  for( i = 0; i < d; i += DESCRDIST_BOUND_STEP )
+    {
+      dsq += dist_u8( a + i, b + i, MIN( DESCRDIST_BOUND_STEP, d - i ), simd );
+      if( dsq > bound )
+	break;
+    }
+  return dsq;
+}
+
+
+
+/*
+  Computes the squared Euclidean distance between two float descriptors.
+
+  @param a a descriptor
+  @param b another descriptor
+  @param d descriptor length
+
+  @return Returns the squared distance between a and b
+*/
+float descr_dist_sq_f32( const float* a, const float* b, int d )
+{
+  return dist_f32( a, b, d, simd_level() );
+}
+
+
+
+/*
+  Computes the squared Euclidean distance between two float descriptors,
+  checking it against a bound every DESCRDIST_BOUND_STEP elements.
+
+  @param a a descriptor
+  @param b another descriptor
+  @param d descriptor length
+  @param bound a bound on the distances of interest
+
+  @return Returns the squared distance between a and b or, once it exceeds
+    bound, the partial distance computed so far
+*/
+float descr_dist_sq_f32_bound( const float* a, const float* b, int d,
+			       float bound )
+{
+  float dsq = 0;
+  int simd = simd_level(), i;
+
+  for( i = 0; i < d; i += DESCRDIST_BOUND_STEP )
+    {
+      dsq += dist_f32( a + i, b + i, MIN( DESCRDIST_BOUND_STEP, d - i ),
+		       simd );
+      if( dsq > bound )
+	break;
+    }
+  return dsq;
+}
+
+
+
+/*
+  Computes the squared Euclidean distance between two double descriptors.
+
+  @param a a descriptor
+  @param b another descriptor
+  @param d descriptor length
+
+  @return Returns the squared distance between a and b
+*/
+double descr_dist_sq_f64( const double* a, const double* b, int d )
+{
+#ifdef DIST_X86
+  int simd = simd_level();
+
+  if( simd >= SIMD_AVX2 )
+    return dist_f64_avx2( a, b, d );
+  if( simd >= SIMD_SSE2 )
+    return dist_f64_sse2( a, b, d );
+#endif
+  return dist_f64_c( a, b, d );
+}
+
+
+/************************ Functions prototyped here **************************/
+
+/*
+  Computes the squared distance between byte descriptors using the best
+  available code path.
+
+  @param a a descriptor
+  @param b another descriptor
+  @param d descriptor length
+  @param simd one of SIMD_NONE, SIMD_SSE2, or SIMD_AVX2
+*/
+static int dist_u8( const unsigned char* a, const unsigned char* b, int d,
+		    int simd )
+{
+#ifdef DIST_X86
+  if( simd >= SIMD_AVX2 )
+    return dist_u8_avx2( a, b, d );
+  if( simd >= SIMD_SSE2 )
+    return dist_u8_sse2( a, b, d );
+#endif
+  return dist_u8_c( a, b, d );
+}
+
+
+
+/*
+  Computes the squared distance between float descriptors using the best
+  available code path.
+
+  @param a a descriptor
+  @param b another descriptor
+  @param d descriptor length
+  @param simd one of SIMD_NONE, SIMD_SSE2, or SIMD_AVX2
+*/
+static float dist_f32( const float* a, const float* b, int d, int simd )
+{
+#ifdef DIST_X86
+  if( simd >= SIMD_AVX2 )
+    return dist_f32_avx2( a, b, d );
+  if( simd >= SIMD_SSE2 )
+    return dist_f32_sse2( a, b, d );
+#endif
+  return dist_f32_c( a, b, d );
+}
+
+
+
+/* Plain C squared distance between byte descriptors */
+static int dist_u8_c( const unsigned char* a, const unsigned char* b, int d )
+{
+  int diff, dsq = 0, i;
+
+  for( i = 0; i < d; i++ )
+    {
+      diff = a[i] - b[i];
+      dsq += diff * diff;
+    }
+  return dsq;
+}
+
+
+
+/* Plain C squared distance between float descriptors */
+static float dist_f32_c( const float* a, const float* b, int d )
+{
+  float diff, dsq = 0;
+  int i;
+
+  for( i = 0; i < d; i++ )
+    {
+      diff = a[i] - b[i];
+      dsq += diff * diff;
+    }
+  return dsq;
+}
+
+
+
+/* Plain C squared distance between double descriptors */
+static double dist_f64_c( const double* a, const double* b, int d )
+{
+  double diff, dsq = 0;
+  int i;
+
+  for( i = 0; i < d; i++ )
+    {
+      diff = a[i] - b[i];
+      dsq += diff * diff;
+    }
+  return dsq;
+}
+
+
+#ifdef DIST_X86
+
+/*
+  SSE2 squared distance between byte descriptors.  Absolute differences are
+  found with saturating subtraction in both directions, widened to 16 bits,
+  and squared and summed in pairs with pmaddwd.
+*/
+static int dist_u8_sse2( const unsigned char* a, const unsigned char* b,
+			 int d )
+{
+  __m128i va, vb, ad, lo, hi, acc = _mm_setzero_si128(),
+    zero = _mm_setzero_si128();
+  int i;
+
+  for( i = 0; i + 16 <= d; i += 16 )
+    {
+      va = _mm_loadu_si128( (const __m128i*)( a + i ) );
+      vb = _mm_loadu_si128( (const __m128i*)( b + i ) );
+      ad = _mm_or_si128( _mm_subs_epu8( va, vb ), _mm_subs_epu8( vb, va ) );
+      lo = _mm_unpacklo_epi8( ad, zero );
+      hi = _mm_unpackhi_epi8( ad, zero );
+      acc = _mm_add_epi32( acc, _mm_madd_epi16( lo, lo ) );
+      acc = _mm_add_epi32( acc, _mm_madd_epi16( hi, hi ) );
+    }
+  acc = _mm_add_epi32( acc, _mm_shuffle_epi32( acc,
+						_MM_SHUFFLE( 1, 0, 3, 2 ) ) );
+  acc = _mm_add_epi32( acc, _mm_shuffle_epi32( acc,
+						_MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+  return _mm_cvtsi128_si32( acc ) + dist_u8_c( a + i, b + i, d - i );
+}
+
+
+
+/* AVX2 squared distance between byte descriptors; see dist_u8_sse2() */
+__attribute__(( target( "avx2" ) ))
+static int dist_u8_avx2( const unsigned char* a, const unsigned char* b,
+			 int d )
+{
+  __m256i va, vb, ad, lo, hi, acc = _mm256_setzero_si256(),
+    zero = _mm256_setzero_si256();
+  __m128i s;
+  int i;
+
+  for( i = 0; i + 32 <= d; i += 32 )
+    {
+      va = _mm256_loadu_si256( (const __m256i*)( a + i ) );
+      vb = _mm256_loadu_si256( (const __m256i*)( b + i ) );
+      ad = _mm256_or_si256( _mm256_subs_epu8( va, vb ),
+			    _mm256_subs_epu8( vb, va ) );
+      lo = _mm256_unpacklo_epi8( ad, zero );
+      hi = _mm256_unpackhi_epi8( ad, zero );
+      acc = _mm256_add_epi32( acc, _mm256_madd_epi16( lo, lo ) );
+      acc = _mm256_add_epi32( acc, _mm256_madd_epi16( hi, hi ) );
+    }
+  s = _mm_add_epi32( _mm256_castsi256_si128( acc ),
+		     _mm256_extracti128_si256( acc, 1 ) );
+  s = _mm_add_epi32( s, _mm_shuffle_epi32( s, _MM_SHUFFLE( 1, 0, 3, 2 ) ) );
+  s = _mm_add_epi32( s, _mm_shuffle_epi32( s, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+  /* avoid the AVX-SSE transition penalty in the non-VEX SSE2 tail code */
+  if( i < d )
+    {
+      _mm256_zeroupper();
+      return _mm_cvtsi128_si32( s ) + dist_u8_sse2( a + i, b + i, d - i );
+    }
+  return _mm_cvtsi128_si32( s );
+}
+
+
+
+/* SSE2 squared distance between float descriptors */
+static float dist_f32_sse2( const float* a, const float* b, int d )
+{
+  __m128 t, acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+  int i;
+
+  for( i = 0; i + 8 <= d; i += 8 )
+    {
+      t = _mm_sub_ps( _mm_loadu_ps( a + i ), _mm_loadu_ps( b + i ) );
+      acc0 = _mm_add_ps( acc0, _mm_mul_ps( t, t ) );
+      t = _mm_sub_ps( _mm_loadu_ps( a + i + 4 ), _mm_loadu_ps( b + i + 4 ) );
+      acc1 = _mm_add_ps( acc1, _mm_mul_ps( t, t ) );
+    }
+  acc0 = _mm_add_ps( acc0, acc1 );
+  acc0 = _mm_add_ps( acc0, _mm_movehl_ps( acc0, acc0 ) );
+  acc0 = _mm_add_ss( acc0, _mm_shuffle_ps( acc0, acc0, 1 ) );
+  return _mm_cvtss_f32( acc0 ) + dist_f32_c( a + i, b + i, d - i );
+}
+
+
+
+/* AVX2 and FMA squared distance between float descriptors */
+__attribute__(( target( "avx2,fma" ) ))
+static float dist_f32_avx2( const float* a, const float* b, int d )
+{
+  __m256 t, acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+  __m128 s;
+  int i;
+
+  for( i = 0; i + 16 <= d; i += 16 )
+    {
+      t = _mm256_sub_ps( _mm256_loadu_ps( a + i ), _mm256_loadu_ps( b + i ) );
+      acc0 = _mm256_fmadd_ps( t, t, acc0 );
+      t = _mm256_sub_ps( _mm256_loadu_ps( a + i + 8 ),
+			 _mm256_loadu_ps( b + i + 8 ) );
+      acc1 = _mm256_fmadd_ps( t, t, acc1 );
+    }
+  acc0 = _mm256_add_ps( acc0, acc1 );
+  s = _mm_add_ps( _mm256_castps256_ps128( acc0 ),
+		  _mm256_extractf128_ps( acc0, 1 ) );
+  s = _mm_add_ps( s, _mm_movehl_ps( s, s ) );
+  s = _mm_add_ss( s, _mm_shuffle_ps( s, s, 1 ) );
+  /* see dist_u8_avx2() */
+  if( i < d )
+    {
+      _mm256_zeroupper();
+      return _mm_cvtss_f32( s ) + dist_f32_sse2( a + i, b + i, d - i );
+    }
+  return _mm_cvtss_f32( s );
+}
+
+
+
+/* SSE2 squared distance between double descriptors */
+static double dist_f64_sse2( const double* a, const double* b, int d )
+{
+  __m128d t, acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+  int i;
+
+  for( i = 0; i + 4 <= d; i += 4 )
+    {
+      t = _mm_sub_pd( _mm_loadu_pd( a + i ), _mm_loadu_pd( b + i ) );
+      acc0 = _mm_add_pd( acc0, _mm_mul_pd( t, t ) );
+      t = _mm_sub_pd( _mm_loadu_pd( a + i + 2 ), _mm_loadu_pd( b + i + 2 ) );
+      acc1 = _mm_add_pd( acc1, _mm_mul_pd( t, t ) );
+    }
+  acc0 = _mm_add_pd( acc0, acc1 );
+  acc0 = _mm_add_sd( acc0, _mm_unpackhi_pd( acc0, acc0 ) );
+  return _mm_cvtsd_f64( acc0 ) + dist_f64_c( a + i, b + i, d - i );
+}
+
+
+
+/* AVX2 and FMA squared distance between double descriptors */
+__attribute__(( target( "avx2,fma" ) ))
+static double dist_f64_avx2( const double* a, const double* b, int d )
+{
+  __m256d t, acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+  __m128d s;
+  int i;
+
+  for( i = 0; i + 8 <= d; i += 8 )
+    {
+      t = _mm256_sub_pd( _mm256_loadu_pd( a + i ), _mm256_loadu_pd( b + i ) );
+      acc0 = _mm256_fmadd_pd( t, t, acc0 );
+      t = _mm256_sub_pd( _mm256_loadu_pd( a + i + 4 ),
+			 _mm256_loadu_pd( b + i + 4 ) );
+      acc1 = _mm256_fmadd_pd( t, t, acc1 );
+    }
+  acc0 = _mm256_add_pd( acc0, acc1 );
+  s = _mm_add_pd( _mm256_castpd256_pd128( acc0 ),
+		  _mm256_extractf128_pd( acc0, 1 ) );
+  s = _mm_add_sd( s, _mm_unpackhi_pd( s, s ) );
+  /* see dist_u8_avx2() */
+  if( i < d )
+    {
+      _mm256_zeroupper();
+      return _mm_cvtsd_f64( s ) + dist_f64_sse2( a + i, b + i, d - i );
+    }
+  return _mm_cvtsd_f64( s );
+}
+
+#endif
@@ -0,0 +1,223 @@
+/*
+  Times descriptor distance computation, comparing the kernels from
+  descrdist.h at each SIMD level against the scalar double loop
+  descr_dist_sq() used before them.  Every feature in a file is compared
+  with every other.  Reports nanoseconds per distance for each kernel and
+  the largest difference between its distances and the scalar loop's.
+
+  Copyright (C) 2006-2012  Rob Hess <rob@iqengines.com>
+
+  @version 1.1.2-20100521
+*/
+
+#include "imgfeatures.h"
+#include "featset.h"
+#include "descrdist.h"
+#include "utils.h"
+
+#include <cxcore.h>
+
+#include <float.h>
+#include <limits.h>
+#include <stdio.h>
+
+/* number of times all pairs of features are compared when timing */
+#define DISTBENCH_REPS 20
+
+/* kernels that can be timed */
+enum
+  {
+    KERNEL_F64,
+    KERNEL_F32,
+    KERNEL_U8,
+    KERNEL_U8_BOUND,
+  };
+
+/******************************** Globals ************************************/
+
+static char* kernel_names[] = { "f64", "f32", "u8", "u8 bound" };
+static char* level_names[] = { "C", "SSE2", "AVX2" };
+
+/*************************** Function Prototypes *****************************/
+
+static double ref_dist_sq( double*, double*, int );
+static double time_ref( struct feature*, int, int, double* );
+static double time_kernel( int, int, struct feature*, struct feature_set*,
+			   float*, int*, int, double* );
+static int* second_nn_bounds( double*, int );
+
+
+/********************************** Main *************************************/
+
+int main( int argc, char** argv )
+{
+  struct feature* feat;
+  struct feature_set* set;
+  double* ref, * dists, t, diff;
+  float* descr32;
+  int* bounds;
+  int n, d, i, k, kernel, level, top, reps = DISTBENCH_REPS;
+
+  if( argc < 2  ||  argc > 3 )
+    fatal_error( "usage: %s <lowe_feature_file> [reps]", argv[0] );
+  if( argc == 3 )
+    reps = MAX( atoi( argv[2] ), 1 );
+
+  n = import_features( argv[1], FEATURE_LOWE, &feat );
+  if( n < 2 )
+    fatal_error( "unable to load features from %s", argv[1] );
+  d = feat[0].d;
+  for( i = 1; i < n; i++ )
+    if( feat[i].d != d )
+      fatal_error( "features in %s have differing lengths", argv[1] );
+
+  set = feature_set_from_features( feat, n );
+  descr32 = malloc( n * d * sizeof( float ) );
+  for( i = 0; i < n; i++ )
+    for( k = 0; k < d; k++ )
+      descr32[i*d+k] = feat[i].descr[k];
+  ref = malloc( n * n * sizeof( double ) );
+  dists = malloc( n * n * sizeof( double ) );
+
+  top = simd_level();
+  t = time_ref( feat, n, reps, ref );
+  bounds = second_nn_bounds( ref, n );
+  fprintf( stdout, "%d features of length %d, SIMD level %d\n", n, d, top );
+  fprintf( stdout, "kernel    path    ns/dist   max diff\n" );
+  fprintf( stdout, "%-8s  %-4s  %9.3f  %9.3g\n", "scalar", "C",
+	   t * 1e6 / ( (double)n * n ), 0.0 );
+  for( kernel = KERNEL_F64; kernel <= KERNEL_U8_BOUND; kernel++ )
+    for( level = SIMD_NONE; level <= top; level++ )
+      {
+	t = time_kernel( kernel, level, feat, set, descr32, bounds, reps,
+			 dists );
+
+	/* bounded distances are only exact up to the bound */
+	diff = 0;
+	for( i = 0; i < n * n; i++ )
+	  if( kernel != KERNEL_U8_BOUND  ||  ref[i] <= bounds[i/n] )
+	    diff = MAX( diff, ABS( dists[i] - ref[i] ) );
+	fprintf( stdout, "%-8s  %-4s  %9.3f  %9.3g\n", kernel_names[kernel],
+		 level_names[level], t * 1e6 / ( (double)n * n ), diff );
+      }
+  feature_set_release( &set );
+  free( feat );
+  free( descr32 );
+  free( ref );
+  free( dists );
+  free( bounds );
+  return 0;
+}
+
+
+/************************** Function Definitions *****************************/
+
+/*
+  The scalar double loop descr_dist_sq() used before descrdist.h
+*/
+static double ref_dist_sq( double* descr1, double* descr2, int d )
+{
+  double diff, dsq = 0;
+  int i;
+
+  for( i = 0; i < d; i++ )
+    {
+      diff = descr1[i] - descr2[i];
+      dsq += diff*diff;
+    }
+  return dsq;
+}
+
+
+
+/*
+  Returns the average time in ms to compare all pairs of features with
+  ref_dist_sq(), storing the distances in dists
+*/
+static double time_ref( struct feature* feat, int n, int reps, double* dists )
+{
+  double start;
+  int r, i, j;
+
+  start = get_time_ms();
+  for( r = 0; r < reps; r++ )
+    for( i = 0; i < n; i++ )
+      for( j = 0; j < n; j++ )
+	dists[i*n+j] = ref_dist_sq( feat[i].descr, feat[j].descr, feat[i].d );
+  return ( get_time_ms() - start ) / reps;
+}
+
+
+
+/*
+  Returns the average time in ms to compare all pairs of features with one
+  kernel at one SIMD level, storing the distances in dists
+*/
+static double time_kernel( int kernel, int level, struct feature* feat,
+			   struct feature_set* set, float* descr32,
+			   int* bounds, int reps, double* dists )
+{
+  double start;
+  int n = set->n, d = set->d, r, i, j;
+
+  limit_simd_level( level );
+  start = get_time_ms();
+  for( r = 0; r < reps; r++ )
+    for( i = 0; i < n; i++ )
+      for( j = 0; j < n; j++ )
+	switch( kernel )
+	  {
+	  case KERNEL_F64:
+	    dists[i*n+j] = descr_dist_sq_f64( feat[i].descr, feat[j].descr, d );
+	    break;
+	  case KERNEL_F32:
+	    dists[i*n+j] = descr_dist_sq_f32( descr32 + i * d,
+					      descr32 + j * d, d );
+	    break;
+	  case KERNEL_U8:
+	    dists[i*n+j] = descr_dist_sq_u8( feature_set_descr( set, i ),
+					     feature_set_descr( set, j ),
+					     set->stride );
+	    break;
+	  default:
+	    dists[i*n+j] = descr_dist_sq_u8_bound( feature_set_descr( set, i ),
+						   feature_set_descr( set, j ),
+						   set->stride, bounds[i] );
+	    break;
+	  }
+  return ( get_time_ms() - start ) / reps;
+}
+
+
+
+/*
+  Finds, for each feature, the distance to its second-nearest other
+  feature, as a nearest neighbor ratio test would use for a bound
+*/
+static int* second_nn_bounds( double* dists, int n )
+{
+  double d0, d1, dsq;
+  int* bounds;
+  int i, j;
+
+  bounds = malloc( n * sizeof( int ) );
+  for( i = 0; i < n; i++ )
+    {
+      d0 = d1 = DBL_MAX;
+      for( j = 0; j < n; j++ )
+	{
+	  if( j == i )
+	    continue;
+	  dsq = dists[i*n+j];
+	  if( dsq < d0 )
+	    {
+	      d1 = d0;
+	      d0 = dsq;
+	    }
+	  else if( dsq < d1 )
+	    d1 = dsq;
+	}
+      bounds[i] = ( d1 < INT_MAX )? (int)d1 : INT_MAX;
+    }
+  return bounds;
+}
@@ -0,0 +1,157 @@
+/*
+  This program converts feature files between the text formats read by
+  import_features() and the binary feature set format written by
+  feature_set_save(), which feature_set_map() loads without parsing.  The
+  input file's format is detected; binary files are written unless -l is
+  given.  Features are converted FEATCONV_CHUNK at a time, so files larger
+  than memory can be converted.
+
+  Copyright (C) 2006-2012  Rob Hess <rob@iqengines.com>
+
+  @version 1.1.2-20100521
+*/
+
+#include "imgfeatures.h"
+#include "featset.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define OPTIONS ":olh"
+
+/* number of features read and written at a time */
+#define FEATCONV_CHUNK 1024
+
+/*************************** Function Prototypes *****************************/
+
+static void usage( char* );
+static void arg_parse( int, char** );
+
+/******************************** Globals ************************************/
+
+char* pname;
+char* in_file_name;
+char* out_file_name;
+int in_type = FEATURE_LOWE;
+int to_text = 0;
+
+
+/********************************** Main *************************************/
+
+int main( int argc, char** argv )
+{
+  struct feature_reader* reader;
+  struct feature_writer* writer;
+  struct feature* feat;
+  double start;
+  int n, d, out_type, r;
+
+  arg_parse( argc, argv );
+
+  start = get_time_ms();
+  reader = feature_reader_open( in_file_name, in_type, &n, &d );
+  if( ! reader )
+    fatal_error( "unable to load features from %s", in_file_name );
+  if( ! to_text )
+    out_type = FEATURE_BINARY;
+  else if( feature_set_is_file( in_file_name ) )
+    out_type = FEATURE_LOWE;
+  else
+    out_type = in_type;
+  writer = feature_writer_open( out_file_name, out_type, n, d );
+  if( ! writer )
+    fatal_error( "unable to write features to %s", out_file_name );
+  feat = calloc( FEATCONV_CHUNK, sizeof( struct feature ) );
+  if( ! feat )
+    fatal_error( "unable to allocate memory for %d features", FEATCONV_CHUNK );
+
+  while( ( r = feature_reader_read( reader, feat, FEATCONV_CHUNK ) ) > 0 )
+    if( feature_writer_write( writer, feat, r ) )
+      fatal_error( "unable to write features to %s", out_file_name );
+  if( r < 0 )
+    fatal_error( "unable to load features from %s", in_file_name );
+  if( feature_writer_close( &writer ) )
+    fatal_error( "unable to write features to %s", out_file_name );
+  feature_reader_close( &reader );
+  fprintf( stderr, "Converted %d features to %s in %.2f ms\n", n,
+	   out_file_name, get_time_ms() - start );
+
+  free( feat );
+  return 0;
+}
+
+
+/************************** Function Definitions *****************************/
+
+// print usage for this program
+static void usage( char* name )
+{
+  fprintf(stderr, "%s: convert between text and binary feature files\n\n",
+	  name);
+  fprintf(stderr, "Usage: %s [options] <in_file> <out_file>\n", name);
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "  -h               Display this message and exit\n");
+  fprintf(stderr, "  -o               Read a text <in_file> as Oxford-type" \
+	  " features; their affine\n");
+  fprintf(stderr, "                   regions are not kept in binary files\n");
+  fprintf(stderr, "  -l               Write <out_file> as text in the" \
+	  " features' own format instead\n");
+  fprintf(stderr, "                   of as a binary feature set\n");
+}
+
+
+
+/*
+  arg_parse() parses the command line arguments, setting appropriate globals.
+
+  argc and argv should be passed directly from the command line
+*/
+static void arg_parse( int argc, char** argv )
+{
+  //extract program name from command line (remove path, if present)
+  pname = basename( argv[0] );
+
+  //parse commandline options
+  while( 1 )
+    {
+      int arg = getopt( argc, argv, OPTIONS );
+      if( arg == -1 )
+	break;
+
+      switch( arg )
+	{
+	case 'o':
+	  in_type = FEATURE_OXFD;
+	  break;
+
+	case 'l':
+	  to_text = 1;
+	  break;
+
+	  // user asked for help
+	case 'h':
+	  usage( pname );
+	  exit(0);
+	  break;
+
+	  // catch invalid arguments
+	default:
+	  fatal_error( "-%c: invalid option.\nTry '%s -h' for help.",
+		       optopt, pname );
+	}
+    }
+
+  // make sure input and output files are specified
+  if( argc - optind < 2 )
+    fatal_error( "input and output files must be specified.\n" \
+		 "Try '%s -h' for help.", pname );
+
+  // make sure there aren't too many arguments
+  if( argc - optind > 2 )
+    fatal_error( "too many arguments.\nTry '%s -h' for help.", pname );
+
+  in_file_name = argv[optind];
+  out_file_name = argv[optind+1];
+}
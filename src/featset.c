@@ -0,0 +1,540 @@
+/*
+  Functions for storing sets of SIFT features compactly.
+
+  Copyright (C) 2006-2012  Rob Hess <rob@iqengines.com>
+
+  @version 1.1.2-20100521
+*/
+
+#include "featset.h"
+#include "imgfeatures.h"
+#include "utils.h"
+
+#include <cxcore.h>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* identifies a file written by feature_set_save() */
+#define FEATSET_MAGIC "OSFSETB"
+
+/* written after the magic to detect files of another byte order */
+#define FEATSET_BYTE_ORDER 0x01020304
+
+/* number of ints in a file header after the magic: byte order, version,
+   number of features, descriptor length, and stride */
+#define FEATSET_HEADER_INTS 5
+
+/************************* Local Function Prototypes *************************/
+
+static struct feature_set* map_set( char*, size_t, int, int, int );
+static size_t descr_offset( int );
+
+
+/********************* Functions prototyped in featset.h *********************/
+
+/*
+  Creates a zeroed feature set with room for n features.  The set's header,
+  geometry arrays, and descriptor matrix share one heap allocation.
+
+  @param n number of features
+  @param d descriptor length
+
+  @return Returns a new feature set or NULL if no memory is available
+*/
+struct feature_set* feature_set_init( int n, int d )
+{
+  struct feature_set* set;
+  size_t stride, size;
+  char* p;
+
+  stride = ( d + FEATSET_ALIGN - 1 ) / FEATSET_ALIGN * FEATSET_ALIGN;
+  size = sizeof( struct feature_set ) + 4 * (size_t)n * sizeof( float ) +
+    (size_t)n * stride + FEATSET_ALIGN;
+  set = calloc( 1, size );
+  if( ! set )
+    {
+      fprintf( stderr, "Warning: unable to allocate memory in " \
+	       "feature_set_init(), %s line %d\n", __FILE__, __LINE__ );
+      return NULL;
+    }
+
+  set->n = n;
+  set->d = d;
+  set->stride = stride;
+  set->x = (float*)( set + 1 );
+  set->y = set->x + n;
+  set->scl = set->y + n;
+  set->ori = set->scl + n;
+  p = (char*)( set->ori + n );
+  p += ( FEATSET_ALIGN - (size_t)p % FEATSET_ALIGN ) % FEATSET_ALIGN;
+  set->descr = (unsigned char*)p;
+
+  return set;
+}
+
+
+
+/*
+  Converts an array of features to a feature set.
+
+  @param feat array of features
+  @param n number of features in feat
+
+  @return Returns a new feature set or NULL if no memory is available
+*/
+struct feature_set* feature_set_from_features( struct feature* feat, int n )
+{
+  struct feature_set* set;
+  int i, d = 0;
+
+  if( ! feat  &&  n > 0 )
+    fatal_error( "NULL pointer error, %s, line %d",  __FILE__, __LINE__ );
+
+  for( i = 0; i < n; i++ )
+    d = MAX( d, feat[i].d );
+  set = feature_set_init( n, d );
+  if( ! set )
+    return NULL;
+  for( i = 0; i < n; i++ )
+    feature_set_store( set, i, feat + i );
+
+  return set;
+}
+
+
+
+/*
+  Stores a feature in a feature set.
+
+  @param set a feature set
+  @param i index at which to store feat
+  @param feat a feature
+*/
+void feature_set_store( struct feature_set* set, int i, struct feature* feat )
+{
+  unsigned char* descr;
+  int v, k, d;
+
+  set->x[i] = feat->x;
+  set->y[i] = feat->y;
+  set->scl[i] = feat->scl;
+  set->ori[i] = feat->ori;
+
+  descr = feature_set_descr( set, i );
+  d = MIN( feat->d, set->d );
+  for( k = 0; k < d; k++ )
+    {
+      v = cvRound( feat->descr[k] );
+      descr[k] = MIN( MAX( v, 0 ), 255 );
+    }
+}
+
+
+
+/*
+  Converts a feature of a feature set to a Lowe-style feature.
+
+  @param set a feature set
+  @param i index of the feature to convert
+  @param feat the feature in which to store it
+*/
+void feature_set_fetch( struct feature_set* set, int i, struct feature* feat )
+{
+  unsigned char* descr;
+  int k;
+
+  memset( feat, 0, sizeof( struct feature ) );
+  feat->type = FEATURE_LOWE;
+  feat->x = set->x[i];
+  feat->y = set->y[i];
+  feat->scl = set->scl[i];
+  feat->ori = set->ori[i];
+  feat->d = set->d;
+  descr = feature_set_descr( set, i );
+  for( k = 0; k < set->d; k++ )
+    feat->descr[k] = descr[k];
+  feat->img_pt.x = feat->x;
+  feat->img_pt.y = feat->y;
+}
+
+
+
+/*
+  Converts a feature set to an array of Lowe-style features.
+
+  @param set a feature set
+  @param feat pointer to an array in which to store the features
+
+  @return Returns the number of features stored in feat
+*/
+int feature_set_to_features( struct feature_set* set, struct feature** feat )
+{
+  int i;
+
+  if( ! set  ||  ! feat )
+    fatal_error( "NULL pointer error, %s, line %d",  __FILE__, __LINE__ );
+
+  *feat = calloc( set->n, sizeof( struct feature ) );
+  for( i = 0; i < set->n; i++ )
+    feature_set_fetch( set, i, *feat + i );
+
+  return set->n;
+}
+
+
+
+/*
+  Writes a feature set to a binary file.  The header is padded to
+  FEATSET_ALIGN bytes and the geometry arrays, which follow it, are padded
+  to a multiple of FEATSET_ALIGN bytes before the descriptors.
+
+  @param set a feature set
+  @param filename name of the file to write
+
+  @return Returns 0 on success or -1 on error
+*/
+int feature_set_save( struct feature_set* set, char* filename )
+{
+  FILE* file;
+  char pad[FEATSET_ALIGN];
+  int header[FEATSET_HEADER_INTS];
+  size_t npad;
+  int ok;
+
+  if( ! set  ||  ! filename )
+    {
+      fprintf( stderr, "Warning: NULL pointer error, %s, line %d\n",
+	       __FILE__, __LINE__ );
+      return -1;
+    }
+  if( ! ( file = fopen( filename, "wb" ) ) )
+    {
+      fprintf( stderr, "Warning: error opening %s, %s, line %d\n",
+	       filename, __FILE__, __LINE__ );
+      return -1;
+    }
+
+  memset( pad, 0, FEATSET_ALIGN );
+  header[0] = FEATSET_BYTE_ORDER;
+  header[1] = FEATSET_VERSION;
+  header[2] = set->n;
+  header[3] = set->d;
+  header[4] = set->stride;
+  npad = descr_offset( set->n ) - FEATSET_ALIGN -
+    4 * (size_t)set->n * sizeof( float );
+  ok = fwrite( FEATSET_MAGIC, 1, 8, file ) == 8  &&
+    fwrite( header, sizeof( int ), FEATSET_HEADER_INTS, file ) ==
+    FEATSET_HEADER_INTS  &&
+    fwrite( pad, 1, FEATSET_ALIGN - 8 - sizeof( header ), file ) ==
+    FEATSET_ALIGN - 8 - sizeof( header )  &&
+    fwrite( set->x, sizeof( float ), set->n, file ) == set->n  &&
+    fwrite( set->y, sizeof( float ), set->n, file ) == set->n  &&
+    fwrite( set->scl, sizeof( float ), set->n, file ) == set->n  &&
+    fwrite( set->ori, sizeof( float ), set->n, file ) == set->n  &&
+    fwrite( pad, 1, npad, file ) == npad  &&
+    fwrite( set->descr, set->stride, set->n, file ) == set->n;
+
+  if( fclose( file )  ||  ! ok )
+    {
+      fprintf( stderr, "Warning: error writing %s, %s, line %d\n",
+	       filename, __FILE__, __LINE__ );
+      return -1;
+    }
+  return 0;
+}
+
+
+
+/*
+  Loads a feature set from a binary file by mapping it into memory.  The
+  mapping is copy-on-write, so the set may be modified like any other.
+  Because mappings start on a page boundary, descriptor rows keep their
+  FEATSET_ALIGN-byte alignment.
+
+  @param filename name of the file to load
+
+  @return Returns a feature set or NULL on error
+*/
+struct feature_set* feature_set_map( char* filename )
+{
+  struct stat st;
+  char* map;
+  int* header;
+  size_t size;
+  int fd, n, d, stride;
+
+  if( ! filename )
+    {
+      fprintf( stderr, "Warning: NULL pointer error, %s, line %d\n",
+	       __FILE__, __LINE__ );
+      return NULL;
+    }
+  fd = open( filename, O_RDONLY );
+  if( fd < 0 )
+    {
+      fprintf( stderr, "Warning: error opening %s, %s, line %d\n",
+	       filename, __FILE__, __LINE__ );
+      return NULL;
+    }
+  if( fstat( fd, &st )  ||  st.st_size < FEATSET_ALIGN  ||
+      (size_t)st.st_size != st.st_size )
+    {
+      close( fd );
+      fprintf( stderr, "Warning: %s is not a feature set file, %s, line" \
+	       " %d\n", filename, __FILE__, __LINE__ );
+      return NULL;
+    }
+  size = st.st_size;
+  map = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0 );
+  close( fd );
+  if( map == MAP_FAILED )
+    {
+      fprintf( stderr, "Warning: unable to map %s, %s, line %d\n",
+	       filename, __FILE__, __LINE__ );
+      return NULL;
+    }
+
+  /* the header must describe a set that fits in the file */
+  header = (int*)( map + 8 );
+  n = header[2];
+  d = header[3];
+  stride = header[4];
+  if( memcmp( map, FEATSET_MAGIC, 8 )  ||
+      header[0] != FEATSET_BYTE_ORDER  ||  header[1] != FEATSET_VERSION  ||
+      n < 0  ||  d < 0  ||  d > FEATURE_MAX_D  ||  d > stride  ||
+      stride % FEATSET_ALIGN  ||
+      size < descr_offset( n )  ||
+      ( n > 0  &&  ( size - descr_offset( n ) ) / n < (size_t)stride ) )
+    {
+      munmap( map, size );
+      fprintf( stderr, "Warning: %s is not a readable feature set file, %s," \
+	       " line %d\n", filename, __FILE__, __LINE__ );
+      return NULL;
+    }
+
+  return map_set( map, size, n, d, stride );
+}
+
+
+
+/*
+  Creates a binary feature set file of n features and maps it into memory
+  for writing.  The file is sized in full up front and its header written,
+  so the features may be stored in any order.
+
+  @param filename name of the file to create
+  @param n number of features
+  @param d descriptor length
+
+  @return Returns a feature set or NULL on error
+*/
+struct feature_set* feature_set_create( char* filename, int n, int d )
+{
+  char* map;
+  int header[FEATSET_HEADER_INTS];
+  size_t size;
+  int fd, stride;
+
+  if( ! filename  ||  n < 0  ||  d < 0 )
+    {
+      fprintf( stderr, "Warning: invalid feature set file parameters, %s," \
+	       " line %d\n", __FILE__, __LINE__ );
+      return NULL;
+    }
+  stride = ( d + FEATSET_ALIGN - 1 ) / FEATSET_ALIGN * FEATSET_ALIGN;
+  size = descr_offset( n ) + (size_t)n * stride;
+  fd = open( filename, O_RDWR | O_CREAT | O_TRUNC, 0666 );
+  if( fd < 0 )
+    {
+      fprintf( stderr, "Warning: error opening %s, %s, line %d\n",
+	       filename, __FILE__, __LINE__ );
+      return NULL;
+    }
+  if( ftruncate( fd, size ) )
+    {
+      close( fd );
+      fprintf( stderr, "Warning: error writing %s, %s, line %d\n",
+	       filename, __FILE__, __LINE__ );
+      return NULL;
+    }
+  map = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+  close( fd );
+  if( map == MAP_FAILED )
+    {
+      fprintf( stderr, "Warning: unable to map %s, %s, line %d\n",
+	       filename, __FILE__, __LINE__ );
+      return NULL;
+    }
+
+  header[0] = FEATSET_BYTE_ORDER;
+  header[1] = FEATSET_VERSION;
+  header[2] = n;
+  header[3] = d;
+  header[4] = stride;
+  memcpy( map, FEATSET_MAGIC, 8 );
+  memcpy( map + 8, header, sizeof( header ) );
+  return map_set( map, size, n, d, stride );
+}
+
+
+
+/*
+  Copies descriptors from a number of feature sets into one matrix.  If max
+  is positive and there are more descriptors than that, they are taken at
+  evenly spaced indices across all the sets.
+
+  @param sets feature sets
+  @param nsets number of sets
+  @param max maximum number of descriptors, or 0 for no limit
+  @param stride bytes between rows of the matrix
+  @param n output as the number of rows
+
+  @return Returns the matrix, with rows padded with zeros, or NULL on error.
+*/
+unsigned char* feature_sets_sample( struct feature_set** sets, int nsets,
+				    int max, int stride, int* n )
+{
+  unsigned char* descr;
+  double total = 0, g, base;
+  int i, s, m;
+
+  for( s = 0; s < nsets; s++ )
+    total += sets[s]->n;
+  if( max <= 0  &&  total > INT_MAX )
+    {
+      fprintf( stderr, "Warning: too many descriptors; set a maximum, %s," \
+	       " line %d\n", __FILE__, __LINE__ );
+      return NULL;
+    }
+  m = ( max > 0  &&  total > max )? max : (int)total;
+  if( m < 1 )
+    {
+      fprintf( stderr, "Warning: no features to sample, %s, line %d\n",
+	       __FILE__, __LINE__ );
+      return NULL;
+    }
+  descr = calloc( m, stride );
+  if( ! descr )
+    {
+      fprintf( stderr, "Warning: unable to allocate memory, %s line %d\n",
+	       __FILE__, __LINE__ );
+      return NULL;
+    }
+
+  /* row i is descriptor floor( i * total / m ) counting across the sets */
+  for( i = 0, s = 0, base = 0; i < m; i++ )
+    {
+      g = floor( (double)i * total / m );
+      while( g >= base + sets[s]->n )
+	base += sets[s++]->n;
+      memcpy( descr + (size_t)i * stride,
+	      feature_set_descr( sets[s], (int)( g - base ) ), sets[s]->d );
+    }
+  *n = m;
+  return descr;
+}
+
+
+
+/*
+  Determines whether a file begins with the magic string of a binary
+  feature set file.
+
+  @param filename name of a file
+
+  @return Returns 1 if it does or 0 otherwise
+*/
+int feature_set_is_file( char* filename )
+{
+  FILE* file;
+  char magic[8];
+  int is;
+
+  if( ! filename  ||  ! ( file = fopen( filename, "rb" ) ) )
+    return 0;
+  is = fread( magic, 1, 8, file ) == 8  &&
+    memcmp( magic, FEATSET_MAGIC, 8 ) == 0;
+  fclose( file );
+  return is;
+}
+
+
+
+/*
+  De-allocates a feature set
+
+  @param set pointer to a feature set
+*/
+void feature_set_release( struct feature_set** set )
+{
+  if( ! set  ||  ! *set )
+    return;
+  if( (*set)->map )
+    munmap( (*set)->map, (*set)->map_size );
+  free( *set );
+  *set = NULL;
+}
+
+
+/************************ Functions prototyped here **************************/
+
+/*
+  Creates a feature set whose arrays point into a mapped feature set file
+
+  @param map the mapping
+  @param size size of the mapping in bytes
+  @param n number of features
+  @param d descriptor length
+  @param stride bytes from one descriptor to the next
+
+  @return Returns the feature set, which owns the mapping, or NULL if no
+    memory is available, in which case the mapping is released
+*/
+static struct feature_set* map_set( char* map, size_t size, int n, int d,
+				    int stride )
+{
+  struct feature_set* set;
+
+  set = calloc( 1, sizeof( struct feature_set ) );
+  if( ! set )
+    {
+      munmap( map, size );
+      fprintf( stderr, "Warning: unable to allocate memory for a mapped " \
+	       "feature set, %s line %d\n", __FILE__, __LINE__ );
+      return NULL;
+    }
+  set->n = n;
+  set->d = d;
+  set->stride = stride;
+  set->x = (float*)( map + FEATSET_ALIGN );
+  set->y = set->x + n;
+  set->scl = set->y + n;
+  set->ori = set->scl + n;
+  set->descr = (unsigned char*)( map + descr_offset( n ) );
+  set->map = map;
+  set->map_size = size;
+  return set;
+}
+
+
+
+
+/*
+  Returns the offset in a binary feature set file of the descriptors of a
+  set of n features, which follow the header and geometry arrays on a
+  FEATSET_ALIGN-byte boundary
+*/
+static size_t descr_offset( int n )
+{
+  size_t off = FEATSET_ALIGN + 4 * (size_t)n * sizeof( float );
+
+  return ( off + FEATSET_ALIGN - 1 ) / FEATSET_ALIGN * FEATSET_ALIGN;
+}
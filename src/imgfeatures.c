@@ -8,19 +8,92 @@
 
 #include "utils.h"
 #include "imgfeatures.h"
+#include "featset.h"
+#include "descrdist.h"
 
 #include <cxcore.h>
 
-static int import_oxfd_features( char*, struct feature** );
-static int export_oxfd_features( char*, struct feature*, int );
+#include <ctype.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* size of the buffers through which text feature files are read and
+   written */
+#define FEATURE_TEXT_BUF 65536
+
+/* longest text of one formatted value; %f of DBL_MAX is 316 characters */
+#define FEATURE_TEXT_MAX 400
+
+/* width of the space left for the feature count of a text file whose
+   count is not known until it is closed; enough for INT_MAX */
+#define FEATURE_COUNT_WIDTH 10
+
+/* a text feature file being written through a buffer; see text_reserve() */
+struct text_out
+{
+  FILE* file;
+  char* buf;
+  size_t len;                  /* number of characters in buf */
+  int err;                     /* set when a write fails */
+};
+
+/* a feature file being read a few features at a time */
+struct feature_reader
+{
+  int type;                    /* FEATURE_OXFD or FEATURE_LOWE */
+  int n;                       /* number of features in the file */
+  int d;                       /* descriptor length */
+  int next;                    /* index of the next feature to read */
+  int err;                     /* set once a read fails */
+  struct feature_set* set;     /* mapped binary file, or NULL */
+  FILE* file;                  /* text file, or NULL */
+  char* buf;                   /* window onto a text file; see fill_text() */
+  size_t size;                 /* capacity of buf, less its terminator */
+  size_t len;                  /* number of characters in buf */
+  size_t pos;                  /* offset in buf of the next feature */
+  int eof;                     /* set once all of a text file is in buf */
+};
+
+/* a feature file being written a few features at a time */
+struct feature_writer
+{
+  int type;                    /* FEATURE_OXFD, FEATURE_LOWE, or
+				  FEATURE_BINARY */
+  int n;                       /* number of features to write, or -1 */
+  int d;                       /* descriptor length */
+  int next;                    /* number of features written */
+  struct feature_set* set;     /* mapped binary file, or NULL */
+  struct text_out out;         /* text file, if set is NULL */
+  long count_pos;              /* offset in a text file of the space left
+				  for its feature count, or -1 */
+};
+
+static int parse_oxfd_feature( char**, int, struct feature* );
+static void format_oxfd_feature( struct text_out*, struct feature*, int );
 static void draw_oxfd_features( IplImage*, struct feature*, int );
 static void draw_oxfd_feature( IplImage*, struct feature*, CvScalar );
 
-static int import_lowe_features( char*, struct feature** );
-static int export_lowe_features( char*, struct feature*, int );
+static int parse_lowe_feature( char**, int, struct feature* );
+static void format_lowe_feature( struct text_out*, struct feature*, int );
 static void draw_lowe_features( IplImage*, struct feature*, int );
 static void draw_lowe_feature( IplImage*, struct feature*, CvScalar );
 
+static int read_text_features( struct feature_reader*, struct feature*,
+			       int );
+static int fill_text( struct feature_reader* );
+static int text_complete( struct feature_reader*, char*, int );
+static int parse_int( char**, int* );
+static int parse_double( char**, double* );
+static int text_open( struct text_out*, char* );
+static void text_reserve( struct text_out*, size_t );
+static void text_int( struct text_out*, int );
+static void text_double( struct text_out*, double );
+static void text_char( struct text_out*, char );
+static int text_close( struct text_out* );
+
 
 /*
   Reads image features from file.  The file should be formatted as from
@@ -38,31 +111,48 @@ static void draw_lowe_feature( IplImage*, struct feature*, CvScalar );
     David Lowe's SIFT code:
     
     http://www.cs.ubc.ca/~lowe/keypoints  
+
+    Binary feature set files written by feature_set_save() are recognized
+    whatever \a type is and imported as Lowe-type features.
   @param features pointer to an array in which to store features
   
   @return Returns the number of features imported from filename or -1 on error
 */
 int import_features( char* filename, int type, struct feature** feat )
 {
-  int n;
+  struct feature_reader* reader;
+  struct feature* f;
+  int n, r;
 
-  switch( type )
+  if( ! feat )
+    fatal_error( "NULL pointer error, %s, line %d",  __FILE__, __LINE__ );
+  reader = feature_reader_open( filename, type, &n, NULL );
+  if( ! reader )
     {
-    case FEATURE_OXFD:
-      n = import_oxfd_features( filename, feat );
-      break;
-    case FEATURE_LOWE:
-      n = import_lowe_features( filename, feat );
-      break;
-    default:
-      fprintf( stderr, "Warning: import_features(): unrecognized feature" \
-	       "type, %s, line %d\n", __FILE__, __LINE__ );
+      fprintf( stderr, "Warning: unable to import features from %s,"	\
+	       " %s, line %d\n", filename, __FILE__, __LINE__ );
       return -1;
     }
 
-  if( n == -1 )
-    fprintf( stderr, "Warning: unable to import features from %s,"	\
-	     " %s, line %d\n", filename, __FILE__, __LINE__ );
+  f = calloc( n, sizeof(struct feature) );
+  if( ! f  &&  n > 0 )
+    {
+      fprintf( stderr, "Warning: unable to allocate memory, %s line %d\n",
+	       __FILE__, __LINE__ );
+      feature_reader_close( &reader );
+      return -1;
+    }
+  r = feature_reader_read( reader, f, n );
+  feature_reader_close( &reader );
+  if( r != n )
+    {
+      fprintf( stderr, "Warning: unable to import features from %s,"	\
+	       " %s, line %d\n", filename, __FILE__, __LINE__ );
+      free( f );
+      return -1;
+    }
+
+  *feat = f;
   return n;
 }
 
@@ -80,7 +170,8 @@ int import_features( char* filename, int type, struct feature** feat )
 */
 int export_features( char* filename, struct feature* feat, int n )
 {
-  int r, type;
+  struct feature_writer* writer;
+  int r;
 
   if( n <= 0  ||  ! feat )
     {
@@ -88,21 +179,17 @@ int export_features( char* filename, struct feature* feat, int n )
 	       __FILE__, __LINE__ );
       return 1;
     }
-  type = feat[0].type;
-  switch( type )
+  if( feat[0].type != FEATURE_OXFD  &&  feat[0].type != FEATURE_LOWE )
     {
-    case FEATURE_OXFD:
-      r = export_oxfd_features( filename, feat, n );
-      break;
-    case FEATURE_LOWE:
-      r = export_lowe_features( filename, feat, n );
-      break;
-    default:
       fprintf( stderr, "Warning: export_features(): unrecognized feature" \
 	       "type, %s, line %d\n", __FILE__, __LINE__ );
       return -1;
     }
 
+  writer = feature_writer_open( filename, feat[0].type, n, feat[0].d );
+  r = ! writer  ||  feature_writer_write( writer, feat, n );
+  if( feature_writer_close( &writer ) )
+    r = 1;
   if( r )
     fprintf( stderr, "Warning: unable to export features to %s,"	\
 	     " %s, line %d\n", filename, __FILE__, __LINE__ );
@@ -110,6 +197,365 @@ int export_features( char* filename, struct feature* feat, int n )
 }
 
 
+
+/*
+  Opens a feature file for reading a few features at a time.  A text
+  file is read through a window of FEATURE_TEXT_BUF characters, which
+  grows only if one feature does not fit in it, and a binary file is
+  mapped, so only the pages holding features being read need be in memory.
+
+  @param filename location of a file containing image features
+  @param type FEATURE_OXFD or FEATURE_LOWE; binary feature set files are
+    recognized whatever type is and read as Lowe-type features
+  @param n if not NULL, output as the number of features in the file
+  @param d if not NULL, output as the descriptor length of the features
+
+  @return Returns a reader or NULL on error
+*/
+struct feature_reader* feature_reader_open( char* filename, int type, int* n,
+					    int* d )
+{
+  struct feature_reader* reader;
+  char* p;
+  int ok;
+
+  reader = calloc( 1, sizeof( struct feature_reader ) );
+  if( ! reader )
+    {
+      fprintf( stderr, "Warning: unable to allocate memory, %s line %d\n",
+	       __FILE__, __LINE__ );
+      return NULL;
+    }
+
+  if( feature_set_is_file( filename ) )
+    {
+      reader->type = FEATURE_LOWE;
+      reader->set = feature_set_map( filename );
+      if( ! reader->set )
+	{
+	  feature_reader_close( &reader );
+	  return NULL;
+	}
+      if( reader->set->d > FEATURE_MAX_D )
+	{
+	  fprintf( stderr, "Warning: descriptor length of %s exceeds" \
+		   " FEATURE_MAX_D, %s, line %d\n", filename, __FILE__,
+		   __LINE__ );
+	  feature_reader_close( &reader );
+	  return NULL;
+	}
+      reader->n = reader->set->n;
+      reader->d = reader->set->d;
+    }
+  else
+    {
+      if( type != FEATURE_OXFD  &&  type != FEATURE_LOWE )
+	{
+	  fprintf( stderr, "Warning: import_features(): unrecognized" \
+		   " feature type, %s, line %d\n", __FILE__, __LINE__ );
+	  feature_reader_close( &reader );
+	  return NULL;
+	}
+      reader->type = type;
+      reader->size = FEATURE_TEXT_BUF;
+      reader->buf = malloc( reader->size + 1 );
+      reader->file = fopen( filename, "rb" );
+      if( ! reader->buf  ||  ! reader->file )
+	{
+	  fprintf( stderr, "Warning: error opening %s, %s, line %d\n",
+		   filename, __FILE__, __LINE__ );
+	  feature_reader_close( &reader );
+	  return NULL;
+	}
+      reader->buf[0] = '\0';
+
+      /* read number of features and dimension */
+      while( 1 )
+	{
+	  p = reader->buf;
+	  if( type == FEATURE_OXFD )
+	    ok = parse_int( &p, &reader->d )  &&  parse_int( &p, &reader->n );
+	  else
+	    ok = parse_int( &p, &reader->n )  &&  parse_int( &p, &reader->d );
+	  if( text_complete( reader, p, ok ) )
+	    break;
+	  if( fill_text( reader ) )
+	    {
+	      ok = 0;
+	      break;
+	    }
+	}
+      if( ! ok  ||  reader->n < 0  ||  reader->d < 0 )
+	{
+	  fprintf( stderr, "Warning: file read error, %s, line %d\n",
+		   __FILE__, __LINE__ );
+	  feature_reader_close( &reader );
+	  return NULL;
+	}
+      if( reader->d > FEATURE_MAX_D )
+	{
+	  fprintf( stderr, "Warning: descriptor too long, %s, line %d\n",
+		   __FILE__, __LINE__ );
+	  feature_reader_close( &reader );
+	  return NULL;
+	}
+      reader->pos = p - reader->buf;
+    }
+
+  if( n )
+    *n = reader->n;
+  if( d )
+    *d = reader->d;
+  return reader;
+}
+
+
+
+/*
+  Reads the next features from a feature file.
+
+  @param reader a feature file opened with feature_reader_open()
+  @param feat array in which to store the features
+  @param n maximum number of features to read
+
+  @return Returns the number of features read, 0 once all have been read,
+    or -1 on error
+*/
+int feature_reader_read( struct feature_reader* reader, struct feature* feat,
+			 int n )
+{
+  int i;
+
+  if( ! reader  ||  ( ! feat  &&  n > 0 ) )
+    fatal_error( "NULL pointer error, %s, line %d",  __FILE__, __LINE__ );
+  if( reader->err )
+    return -1;
+
+  if( reader->set )
+    {
+      for( i = 0; i < n  &&  reader->next < reader->n; i++ )
+	feature_set_fetch( reader->set, reader->next++, feat + i );
+      return i;
+    }
+  i = read_text_features( reader, feat, n );
+  if( i < 0 )
+    reader->err = 1;
+  return i;
+}
+
+
+
+/*
+  Closes a feature file opened with feature_reader_open()
+
+  @param reader pointer to a reader; set to NULL
+*/
+void feature_reader_close( struct feature_reader** reader )
+{
+  if( ! reader  ||  ! *reader )
+    return;
+  if( (*reader)->file )
+    fclose( (*reader)->file );
+  feature_set_release( &(*reader)->set );
+  free( (*reader)->buf );
+  free( *reader );
+  *reader = NULL;
+}
+
+
+
+/*
+  Creates a feature file for writing a few features at a time.  Text is
+  formatted into a buffer of FEATURE_TEXT_BUF characters, and a binary file
+  is created at full size and mapped, so memory use does not grow with the
+  number of features written.
+
+  @param filename name of the file to create
+  @param type FEATURE_OXFD or FEATURE_LOWE to write a text file of that
+    type, or FEATURE_BINARY to write a binary feature set file
+  @param n number of features that will be written, or -1 if it is not
+    known, in which case space is left for the count in a text file's
+    header and filled in on closing; n must be known for a binary file
+  @param d descriptor length
+
+  @return Returns a writer or NULL on error
+*/
+struct feature_writer* feature_writer_open( char* filename, int type, int n,
+					    int d )
+{
+  struct feature_writer* writer;
+  int k;
+
+  if( d < 0  ||  d > FEATURE_MAX_D )
+    {
+      fprintf( stderr, "Warning: descriptor length %d, %s, line %d\n",
+	       d, __FILE__, __LINE__ );
+      return NULL;
+    }
+  if( type != FEATURE_OXFD  &&  type != FEATURE_LOWE  &&
+      type != FEATURE_BINARY )
+    {
+      fprintf( stderr, "Warning: feature_writer_open(): unrecognized" \
+	       " feature type, %s, line %d\n", __FILE__, __LINE__ );
+      return NULL;
+    }
+  if( type == FEATURE_BINARY  &&  n < 0 )
+    {
+      fprintf( stderr, "Warning: binary feature files need a feature" \
+	       " count, %s, line %d\n", __FILE__, __LINE__ );
+      return NULL;
+    }
+  writer = calloc( 1, sizeof( struct feature_writer ) );
+  if( ! writer )
+    {
+      fprintf( stderr, "Warning: unable to allocate memory, %s line %d\n",
+	       __FILE__, __LINE__ );
+      return NULL;
+    }
+  writer->type = type;
+  writer->n = MAX( n, -1 );
+  writer->d = d;
+  writer->count_pos = -1;
+
+  if( type == FEATURE_BINARY )
+    {
+      writer->set = feature_set_create( filename, n, d );
+      if( ! writer->set )
+	{
+	  free( writer );
+	  return NULL;
+	}
+      return writer;
+    }
+
+  if( text_open( &writer->out, filename ) )
+    {
+      fprintf( stderr, "Warning: error opening %s, %s, line %d\n",
+	       filename, __FILE__, __LINE__ );
+      free( writer );
+      return NULL;
+    }
+  if( type == FEATURE_OXFD )
+    {
+      text_int( &writer->out, d );
+      text_char( &writer->out, '\n' );
+    }
+  if( n >= 0 )
+    text_int( &writer->out, n );
+  else
+    {
+      writer->count_pos = writer->out.len;
+      for( k = 0; k < FEATURE_COUNT_WIDTH; k++ )
+	text_char( &writer->out, ' ' );
+    }
+  if( type == FEATURE_LOWE )
+    {
+      text_char( &writer->out, ' ' );
+      text_int( &writer->out, d );
+    }
+  text_char( &writer->out, '\n' );
+  return writer;
+}
+
+
+
+/*
+  Writes features to a feature file.  The first d descriptor elements of
+  each feature are written, where d is the length given when the file was
+  opened.
+
+  @param writer a feature file opened with feature_writer_open()
+  @param feat array of features
+  @param n number of features in feat
+
+  @return Returns 0 on success or -1 on error
+*/
+int feature_writer_write( struct feature_writer* writer,
+			  struct feature* feat, int n )
+{
+  int i;
+
+  if( ! writer  ||  ( ! feat  &&  n > 0 ) )
+    fatal_error( "NULL pointer error, %s, line %d",  __FILE__, __LINE__ );
+
+  for( i = 0; i < n; i++ )
+    {
+      if( writer->next == ( ( writer->n < 0 )? INT_MAX : writer->n ) )
+	{
+	  fprintf( stderr, "Warning: more features written than the %d" \
+		   " declared, %s, line %d\n", writer->next, __FILE__,
+		   __LINE__ );
+	  writer->out.err = 1;
+	  return -1;
+	}
+      if( writer->set )
+	feature_set_store( writer->set, writer->next, feat + i );
+      else if( writer->type == FEATURE_OXFD )
+	format_oxfd_feature( &writer->out, feat + i, writer->d );
+      else
+	format_lowe_feature( &writer->out, feat + i, writer->d );
+      writer->next++;
+    }
+
+  return ( writer->out.err )? -1 : 0;
+}
+
+
+
+/*
+  Finishes and closes a feature file opened with feature_writer_open(),
+  filling in its feature count if that was not known when it was opened.
+
+  @param writer pointer to a writer; set to NULL
+
+  @return Returns 0 on success or -1 if any write failed or the number of
+    features written was not the number declared
+*/
+int feature_writer_close( struct feature_writer** writer )
+{
+  struct feature_writer* w;
+  struct text_out* out;
+  int err;
+
+  if( ! writer  ||  ! *writer )
+    return -1;
+  w = *writer;
+  out = &w->out;
+  err = out->err;
+  if( w->n >= 0  &&  w->next != w->n )
+    {
+      fprintf( stderr, "Warning: wrote %d of %d features, %s, line %d\n",
+	       w->next, w->n, __FILE__, __LINE__ );
+      err = 1;
+    }
+
+  if( w->set )
+    feature_set_release( &w->set );
+  else
+    {
+      if( w->count_pos >= 0 )
+	{
+	  if( fwrite( out->buf, 1, out->len, out->file ) != out->len  ||
+	      fseek( out->file, w->count_pos, SEEK_SET )  ||
+	      fprintf( out->file, "%d", w->next ) < 0 )
+	    out->err = 1;
+	  out->len = 0;
+	}
+      if( text_close( out ) )
+	{
+	  fprintf( stderr, "Warning: file close error, %s, line %d\n",
+		   __FILE__, __LINE__ );
+	  err = 1;
+	}
+    }
+
+  free( w );
+  *writer = NULL;
+  return ( err )? -1 : 0;
+}
+
+
+
 /*
   Draws a set of features on an image
   
@@ -156,22 +602,9 @@ void draw_features( IplImage* img, struct feature* feat, int n )
 */
 double descr_dist_sq( struct feature* f1, struct feature* f2 )
 {
-  double diff, dsq = 0;
-  double* descr1, * descr2;
-  int i, d;
-
-  d = f1->d;
-  if( f2->d != d )
+  if( f2->d != f1->d )
     return DBL_MAX;
-  descr1 = f1->descr;
-  descr2 = f2->descr;
-
-  for( i = 0; i < d; i++ )
-    {
-      diff = descr1[i] - descr2[i];
-      dsq += diff*diff;
-    }
-  return dsq;
+  return descr_dist_sq_f64( f1->descr, f2->descr, f1->d );
 }
 
 
@@ -180,149 +613,83 @@ double descr_dist_sq( struct feature* f1, struct feature* f2 )
 
 
 /*
-  Reads image features from file.  The file should be formatted as from
-  the code provided by the Visual Geometry Group at Oxford:
+  Parses a feature from text formatted as by the code provided by the
+  Visual Geometry Group at Oxford:
   
   http://www.robots.ox.ac.uk:5000/~vgg/research/affine/index.html
   
-  @param filename location of a file containing image features
-  @param features pointer to an array in which to store features
+  @param p pointer into text; advanced past the feature, or to where
+    parsing failed
+  @param d descriptor length
+  @param f feature in which to store the parsed feature
   
-  @return Returns the number of features imported from filename or -1 on error
+  @return Returns 0 on success, 1 if the affine region could not be parsed,
+    or 2 if the descriptor could not be parsed
 */
-static int import_oxfd_features( char* filename, struct feature** features )
+static int parse_oxfd_feature( char** p, int d, struct feature* f )
 {
-  struct feature* f;
-  int i, j, n, d;
-  double x, y, a, b, c, dv;
-  FILE* file;
-
-  if( ! features )
-    fatal_error( "NULL pointer error, %s, line %d",  __FILE__, __LINE__ );
-  if( ! ( file = fopen( filename, "r" ) ) )
-    {
-      fprintf( stderr, "Warning: error opening %s, %s, line %d\n",
-	       filename, __FILE__, __LINE__ );
-      return -1;
-    }
-
-  /* read dimension and number of features */
-  if( fscanf( file, " %d %d ", &d, &n ) != 2 )
-    {
-      fprintf( stderr, "Warning: file read error, %s, line %d\n",
-	       __FILE__, __LINE__ );
-      return -1;
-    }
-  if( d > FEATURE_MAX_D )
-    {
-      fprintf( stderr, "Warning: descriptor too long, %s, line %d\n",
-	       __FILE__, __LINE__ );
-      return -1;
-    }
-  
-
-  f = calloc( n, sizeof(struct feature) );
-  for( i = 0; i < n; i++ )
-    {
-      /* read affine region parameters */
-      if( fscanf( file, " %lf %lf %lf %lf %lf ", &x, &y, &a, &b, &c ) != 5 )
-	{
-	  fprintf( stderr, "Warning: error reading feature #%d, %s, line %d\n",
-		   i+1, __FILE__, __LINE__ );
-	  free( f );
-	  return -1;
-	}
-      f[i].img_pt.x = f[i].x = x;
-      f[i].img_pt.y = f[i].y = y;
-      f[i].a = a;
-      f[i].b = b;
-      f[i].c = c;
-      f[i].d = d;
-      f[i].type = FEATURE_OXFD;
+  double x, y, a, b, c;
+  int j;
+
+  /* read affine region parameters */
+  if( ! parse_double( p, &x )  ||  ! parse_double( p, &y )  ||
+      ! parse_double( p, &a )  ||  ! parse_double( p, &b )  ||
+      ! parse_double( p, &c ) )
+    return 1;
+  f->img_pt.x = f->x = x;
+  f->img_pt.y = f->y = y;
+  f->a = a;
+  f->b = b;
+  f->c = c;
+  f->d = d;
+  f->type = FEATURE_OXFD;
       
-      /* read descriptor */
-      for( j = 0; j < d; j++ )
-	{
-	  if( ! fscanf( file, " %lf ", &dv ) )
-	    {
-	      fprintf( stderr, "Warning: error reading feature descriptor" \
-		       " #%d, %s, line %d\n", i+1, __FILE__, __LINE__ );
-	      free( f );
-	      return -1;
-	    }
-	  f[i].descr[j] = dv;
-	}
-
-      f[i].scl = f[i].ori = 0;
-      f[i].category = 0;
-      f[i].fwd_match = f[i].bck_match = f[i].mdl_match = NULL;
-      f[i].mdl_pt.x = f[i].mdl_pt.y = -1;
-      f[i].feature_data = NULL;
-    }
-
-  if( fclose(file) )
-    {
-      fprintf( stderr, "Warning: file close error, %s, line %d\n",
-	       __FILE__, __LINE__ );
-      free( f );
-      return -1;
-    }
-
-  *features = f;
-  return n;
+  /* read descriptor */
+  for( j = 0; j < d; j++ )
+    if( ! parse_double( p, f->descr + j ) )
+      return 2;
+
+  f->scl = f->ori = 0;
+  f->category = 0;
+  f->fwd_match = f->bck_match = f->mdl_match = NULL;
+  f->mdl_pt.x = f->mdl_pt.y = -1;
+  f->feature_data = NULL;
+  return 0;
 }
 
 
 
 
 /*
-  Exports a feature set to a file formatted as one from the code provided
-  by the Visual Geometry Group at Oxford:
+  Formats a feature as one from the code provided by the Visual Geometry
+  Group at Oxford:
   
   http://www.robots.ox.ac.uk:5000/~vgg/research/affine/index.html
   
-  @param filename name of file to which to export features
-  @param feat feature array
-  @param n number of features
-  
-  @return Returns 0 on success or 1 on error
+  @param out a buffered file
+  @param feat a feature
+  @param d number of descriptor elements to write
 */
-static int export_oxfd_features( char* filename, struct feature* feat, int n )
+static void format_oxfd_feature( struct text_out* out, struct feature* feat,
+				 int d )
 {
-  FILE* file;
-  int i, j, d;
-
-  if( n <= 0 )
-    {
-      fprintf( stderr, "Warning: feature count %d, %s, line %d\n",
-	       n, __FILE__, __LINE__ );
-      return 1;
-    }
-  if( ! ( file = fopen( filename, "w" ) ) )
-    {
-      fprintf( stderr, "Warning: error opening %s, %s, line %d\n",
-	       filename, __FILE__, __LINE__ );
-      return 1;
-    }
-
-  d = feat[0].d;
-  fprintf( file, "%d\n%d\n", d, n );
-  for( i = 0; i < n; i++ )
+  int j;
+
+  text_double( out, feat->x );
+  text_char( out, ' ' );
+  text_double( out, feat->y );
+  text_char( out, ' ' );
+  text_double( out, feat->a );
+  text_char( out, ' ' );
+  text_double( out, feat->b );
+  text_char( out, ' ' );
+  text_double( out, feat->c );
+  for( j = 0; j < d; j++ )
     {
-      fprintf( file, "%f %f %f %f %f", feat[i].x, feat[i].y, feat[i].a,
-	       feat[i].b, feat[i].c );
-      for( j = 0; j < d; j++ )
-	fprintf( file, " %f", feat[i].descr[j] );
-      fprintf( file, "\n" );
-    }
-
-  if( fclose(file) )
-    {
-      fprintf( stderr, "Warning: file close error, %s, line %d\n",
-	       __FILE__, __LINE__ );
-      return 1;
+      text_char( out, ' ' );
+      text_double( out, feat->descr[j] );
     }
-  return 0;
+  text_char( out, '\n' );
 }
 
 
@@ -386,151 +753,81 @@ static void draw_oxfd_feature( IplImage* img, struct feature* feat,
 
 
 /*
-  Reads image features from file.  The file should be formatted as from
-  the code provided by David Lowe:
+  Parses a feature from text formatted as by the code provided by David
+  Lowe:
   
   http://www.cs.ubc.ca/~lowe/keypoints/
   
-  @param filename location of a file containing image features
-  @param features pointer to an array in which to store features
+  @param p pointer into text; advanced past the feature, or to where
+    parsing failed
+  @param d descriptor length
+  @param f feature in which to store the parsed feature
   
-  @return Returns the number of features imported from filename or -1 on error
+  @return Returns 0 on success, 1 if the feature's location, scale, or
+    orientation could not be parsed, or 2 if the descriptor could not be
+    parsed
 */
-static int import_lowe_features( char* filename, struct feature** features )
+static int parse_lowe_feature( char** p, int d, struct feature* f )
 {
-  struct feature* f;
-  int i, j, n, d;
-  double x, y, s, o, dv;
-  FILE* file;
-
-  if( ! features )
-    fatal_error( "NULL pointer error, %s, line %d",  __FILE__, __LINE__ );
-  if( ! ( file = fopen( filename, "r" ) ) )
-    {
-      fprintf( stderr, "Warning: error opening %s, %s, line %d\n",
-	       filename, __FILE__, __LINE__ );
-      return -1;
-    }
-
-  /* read number of features and dimension */
-  if( fscanf( file, " %d %d ", &n, &d ) != 2 )
-    {
-      fprintf( stderr, "Warning: file read error, %s, line %d\n",
-	       __FILE__, __LINE__ );
-      return -1;
-    }
-  if( d > FEATURE_MAX_D )
-    {
-      fprintf( stderr, "Warning: descriptor too long, %s, line %d\n",
-	       __FILE__, __LINE__ );
-      return -1;
-    }
-
-  f = calloc( n, sizeof(struct feature) );
-  for( i = 0; i < n; i++ )
-    {
-      /* read affine region parameters */
-      if( fscanf( file, " %lf %lf %lf %lf ", &y, &x, &s, &o ) != 4 )
-	{
-	  fprintf( stderr, "Warning: error reading feature #%d, %s, line %d\n",
-		   i+1, __FILE__, __LINE__ );
-	  free( f );
-	  return -1;
-	}
-      f[i].img_pt.x = f[i].x = x;
-      f[i].img_pt.y = f[i].y = y;
-      f[i].scl = s;
-      f[i].ori = o;
-      f[i].d = d;
-      f[i].type = FEATURE_LOWE;
-
-      /* read descriptor */
-      for( j = 0; j < d; j++ )
-	{
-	  if( ! fscanf( file, " %lf ", &dv ) )
-	    {
-	      fprintf( stderr, "Warning: error reading feature descriptor" \
-		       " #%d, %s, line %d\n", i+1, __FILE__, __LINE__ );
-	      free( f );
-	      return -1;
-	    }
-	  f[i].descr[j] = dv;
-	}
-
-      f[i].a = f[i].b = f[i].c = 0;
-      f[i].category = 0;
-      f[i].fwd_match = f[i].bck_match = f[i].mdl_match = NULL;
-      f[i].mdl_pt.x = f[i].mdl_pt.y = -1;
-      f[i].feature_data = NULL;
-    }
-
-  if( fclose(file) )
-    {
-      fprintf( stderr, "Warning: file close error, %s, line %d\n",
-	       __FILE__, __LINE__ );
-      free( f );
-      return -1;
-    }
-
-  *features = f;
-  return n;
+  double x, y, s, o;
+  int j;
+
+  /* read affine region parameters */
+  if( ! parse_double( p, &y )  ||  ! parse_double( p, &x )  ||
+      ! parse_double( p, &s )  ||  ! parse_double( p, &o ) )
+    return 1;
+  f->img_pt.x = f->x = x;
+  f->img_pt.y = f->y = y;
+  f->scl = s;
+  f->ori = o;
+  f->d = d;
+  f->type = FEATURE_LOWE;
+
+  /* read descriptor */
+  for( j = 0; j < d; j++ )
+    if( ! parse_double( p, f->descr + j ) )
+      return 2;
+
+  f->a = f->b = f->c = 0;
+  f->category = 0;
+  f->fwd_match = f->bck_match = f->mdl_match = NULL;
+  f->mdl_pt.x = f->mdl_pt.y = -1;
+  f->feature_data = NULL;
+  return 0;
 }
 
 
 
 /*
-  Exports a feature set to a file formatted as one from the code provided
-  by David Lowe:
+  Formats a feature as one from the code provided by David Lowe:
   
   http://www.cs.ubc.ca/~lowe/keypoints/
   
-  @param filename name of file to which to export features
-  @param feat feature array
-  @param n number of features
-  
-  @return Returns 0 on success or 1 on error
+  @param out a buffered file
+  @param feat a feature
+  @param d number of descriptor elements to write
 */
-static int export_lowe_features( char* filename, struct feature* feat, int n )
+static void format_lowe_feature( struct text_out* out, struct feature* feat,
+				 int d )
 {
-  FILE* file;
-  int i, j, d;
-
-  if( n <= 0 )
-    {
-      fprintf( stderr, "Warning: feature count %d, %s, line %d\n",
-	       n, __FILE__, __LINE__ );
-      return 1;
-    }
-  if( ! ( file = fopen( filename, "w" ) ) )
+  int j;
+
+  text_double( out, feat->y );
+  text_char( out, ' ' );
+  text_double( out, feat->x );
+  text_char( out, ' ' );
+  text_double( out, feat->scl );
+  text_char( out, ' ' );
+  text_double( out, feat->ori );
+  for( j = 0; j < d; j++ )
     {
-      fprintf( stderr, "Warning: error opening %s, %s, line %d\n",
-	       filename, __FILE__, __LINE__ );
-      return 1;
+      /* write 20 descriptor values per line */
+      if( j % 20 == 0 )
+	text_char( out, '\n' );
+      text_char( out, ' ' );
+      text_int( out, (int)(feat->descr[j]) );
     }
-
-  d = feat[0].d;
-  fprintf( file, "%d %d\n", n, d );
-  for( i = 0; i < n; i++ )
-    {
-      fprintf( file, "%f %f %f %f", feat[i].y, feat[i].x,
-	       feat[i].scl, feat[i].ori );
-      for( j = 0; j < d; j++ )
-	{
-	  /* write 20 descriptor values per line */
-	  if( j % 20 == 0 )
-	    fprintf( file, "\n" );
-	  fprintf( file, " %d", (int)(feat[i].descr[j]) );
-	}
-      fprintf( file, "\n" );
-    }
-
-  if( fclose(file) )
-    {
-      fprintf( stderr, "Warning: file close error, %s, line %d\n",
-	       __FILE__, __LINE__ );
-      return 1;
-    }
-  return 0;
+  text_char( out, '\n' );
 }
 
 
@@ -595,3 +892,352 @@ static void draw_lowe_feature( IplImage* img, struct feature* feat,
 }
 
 
+
+/*
+  Reads the next features of a text feature file.  Each feature is parsed
+  from the reader's window onto the file, which is refilled and parsing
+  retried whenever a feature might run past the end of the window.
+
+  @param reader a text feature file
+  @param feat array in which to store the features
+  @param n maximum number of features to read
+
+  @return Returns the number of features read or -1 on error
+*/
+static int read_text_features( struct feature_reader* reader,
+			       struct feature* feat, int n )
+{
+  char* p;
+  int i, err;
+
+  for( i = 0; i < n  &&  reader->next < reader->n; i++ )
+    {
+      while( 1 )
+	{
+	  p = reader->buf + reader->pos;
+	  if( reader->type == FEATURE_OXFD )
+	    err = parse_oxfd_feature( &p, reader->d, feat + i );
+	  else
+	    err = parse_lowe_feature( &p, reader->d, feat + i );
+	  if( text_complete( reader, p, ! err ) )
+	    break;
+	  if( fill_text( reader ) )
+	    {
+	      fprintf( stderr, "Warning: file read error, %s, line %d\n",
+		       __FILE__, __LINE__ );
+	      return -1;
+	    }
+	}
+
+      if( err == 1 )
+	{
+	  fprintf( stderr, "Warning: error reading feature #%d, %s, line %d\n",
+		   reader->next+1, __FILE__, __LINE__ );
+	  return -1;
+	}
+      if( err )
+	{
+	  fprintf( stderr, "Warning: error reading feature descriptor" \
+		   " #%d, %s, line %d\n", reader->next+1, __FILE__, __LINE__ );
+	  return -1;
+	}
+      reader->pos = p - reader->buf;
+      reader->next++;
+    }
+
+  return i;
+}
+
+
+
+/*
+  Moves the unread part of a text feature file's window to its start and
+  fills the rest from the file.  The window is doubled if it is already
+  full, i.e. if one feature fills it.  The window is always terminated by
+  a null character.
+
+  @param reader a text feature file
+
+  @return Returns 0 on success or -1 on error.
+*/
+static int fill_text( struct feature_reader* reader )
+{
+  char* buf;
+  size_t want, r;
+
+  memmove( reader->buf, reader->buf + reader->pos, reader->len - reader->pos );
+  reader->len -= reader->pos;
+  reader->pos = 0;
+  if( reader->len == reader->size )
+    {
+      if( ! ( buf = realloc( reader->buf, 2 * reader->size + 1 ) ) )
+	return -1;
+      reader->buf = buf;
+      reader->size *= 2;
+    }
+
+  want = reader->size - reader->len;
+  r = fread( reader->buf + reader->len, 1, want, reader->file );
+  reader->len += r;
+  reader->buf[reader->len] = '\0';
+  if( r < want )
+    {
+      if( ferror( reader->file ) )
+	return -1;
+      reader->eof = 1;
+    }
+  return 0;
+}
+
+
+
+/*
+  Determines whether parsing from a text feature file's window gave the
+  result parsing the whole file would.  It may not have if it stopped in
+  the last token in the window, which could continue past the window's end,
+  or, on failure, in the whitespace before that token.
+
+  @param reader a text feature file
+  @param p where parsing stopped
+  @param ok nonzero if parsing succeeded
+
+  @return Returns 1 if the result stands or 0 if the window must be
+    refilled and parsing retried.
+*/
+static int text_complete( struct feature_reader* reader, char* p, int ok )
+{
+  char* end = reader->buf + reader->len;
+
+  if( reader->eof )
+    return 1;
+  if( ! ok )
+    while( p < end  &&  isspace( (unsigned char)*p ) )
+      p++;
+  while( p < end  &&  ! isspace( (unsigned char)*p ) )
+    p++;
+  return p < end;
+}
+
+
+
+/*
+  Reads an integer from text, as fscanf()'s " %d" would.
+
+  @param p pointer into text; advanced past the integer
+  @param v output as the integer
+
+  @return Returns 1 if an integer was read or 0 otherwise.
+*/
+static int parse_int( char** p, int* v )
+{
+  char* end;
+  long l;
+
+  l = strtol( *p, &end, 10 );
+  if( end == *p  ||  l > INT_MAX  ||  l < INT_MIN )
+    return 0;
+  *v = l;
+  *p = end;
+  return 1;
+}
+
+
+
+/*
+  Reads a floating point number from text, as fscanf()'s " %lf" would.
+  Plain decimals of up to 19 significant digits and 22 decimal places are
+  read directly: their digits make an integer exactly representable as a
+  double, and dividing it by an exact power of ten rounds once, so the
+  result is the same correctly rounded one strtod() gives.  Anything else,
+  such as exponents, hex, infinities, and NaNs, is left to strtod().
+
+  @param p pointer into text; advanced past the number
+  @param v output as the number
+
+  @return Returns 1 if a number was read or 0 otherwise.
+*/
+static int parse_double( char** p, double* v )
+{
+  static const double pow10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7,
+				  1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14,
+				  1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21,
+				  1e22 };
+  unsigned long long m = 0;
+  char* s = *p, * start, * end;
+  int neg, nd = 0, nf = 0;
+
+  while( *s == ' '  ||  ( *s >= '\t'  &&  *s <= '\r' ) )
+    s++;
+  start = s;
+  neg = *s == '-';
+  if( *s == '-'  ||  *s == '+' )
+    s++;
+  for( ; *s >= '0'  &&  *s <= '9'  &&  nd < 19; s++, nd++ )
+    m = m * 10 + ( *s - '0' );
+  if( *s == '.' )
+    for( s++; *s >= '0'  &&  *s <= '9'  &&  nd < 19; s++, nd++, nf++ )
+      m = m * 10 + ( *s - '0' );
+
+  if( nd == 0  ||  nf > 22  ||  m > ( 1ULL << 53 )  ||
+      ( *s != '\0'  &&  ! isspace( (unsigned char)*s ) ) )
+    {
+      *v = strtod( start, &end );
+      if( end == start )
+	return 0;
+      *p = end;
+      return 1;
+    }
+  *v = ( nf )? (double)m / pow10[nf] : (double)m;
+  if( neg )
+    *v = -*v;
+  *p = s;
+  return 1;
+}
+
+
+
+/*
+  Opens a text feature file for writing through a buffer
+
+  @param out the buffered file to initialize
+  @param filename name of the file
+
+  @return Returns 0 on success or -1 on error.
+*/
+static int text_open( struct text_out* out, char* filename )
+{
+  out->len = 0;
+  out->err = 0;
+  out->buf = malloc( FEATURE_TEXT_BUF );
+  if( ! out->buf )
+    return -1;
+  if( ! ( out->file = fopen( filename, "w" ) ) )
+    {
+      free( out->buf );
+      return -1;
+    }
+  return 0;
+}
+
+
+
+/*
+  Makes room in a text buffer, writing its contents to its file if needed
+
+  @param out a buffered file
+  @param need number of characters about to be added
+*/
+static void text_reserve( struct text_out* out, size_t need )
+{
+  if( out->len + need <= FEATURE_TEXT_BUF )
+    return;
+  if( fwrite( out->buf, 1, out->len, out->file ) != out->len )
+    out->err = 1;
+  out->len = 0;
+}
+
+
+
+/*
+  Formats an integer as "%d" into a text buffer
+
+  @param out a buffered file
+  @param v the integer
+*/
+static void text_int( struct text_out* out, int v )
+{
+  char digits[12];
+  unsigned int u = ( v < 0 )? -(unsigned int)v : (unsigned int)v;
+  int n = 0;
+
+  text_reserve( out, sizeof( digits ) );
+  do
+    digits[n++] = '0' + u % 10;
+  while( ( u /= 10 ) > 0 );
+  if( v < 0 )
+    out->buf[out->len++] = '-';
+  while( n > 0 )
+    out->buf[out->len++] = digits[--n];
+}
+
+
+
+/*
+  Formats a floating point number as "%f" into a text buffer.  A number of
+  magnitude below 2 x 10^9 is rounded to six decimal places directly:
+  fma() gives the exact error of scaling it by 10^6, which decides the
+  rounding, with ties to even, exactly as printf() would.  Anything else is
+  left to snprintf().
+
+  @param out a buffered file
+  @param v the number
+*/
+static void text_double( struct text_out* out, double v )
+{
+  unsigned long long r;
+  double a, p, q, d, e;
+  int k;
+
+  a = fabs( v );
+  if( ! ( a < 2e9 ) )
+    {
+      text_reserve( out, FEATURE_TEXT_MAX );
+      out->len += snprintf( out->buf + out->len, FEATURE_TEXT_MAX, "%f", v );
+      return;
+    }
+
+  /* a * 10^6 is exactly p + e; p - q - 0.5 is exact whenever it is near
+     enough to zero for e to change its sign */
+  p = a * 1e6;
+  e = fma( a, 1e6, -p );
+  q = floor( p );
+  d = ( p - q - 0.5 ) + e;
+  r = (unsigned long long)q;
+  if( d > 0  ||  ( d == 0  &&  r % 2 ) )
+    r++;
+
+  /* room for a sign, 10 digits, a point, and 6 more digits */
+  text_reserve( out, 18 );
+  if( signbit( v ) )
+    out->buf[out->len++] = '-';
+  text_int( out, (int)( r / 1000000 ) );
+  out->buf[out->len++] = '.';
+  r %= 1000000;
+  for( k = 5; k >= 0; k--, r /= 10 )
+    out->buf[out->len+k] = '0' + r % 10;
+  out->len += 6;
+}
+
+
+
+/*
+  Adds a character to a text buffer
+
+  @param out a buffered file
+  @param c the character
+*/
+static void text_char( struct text_out* out, char c )
+{
+  text_reserve( out, 1 );
+  out->buf[out->len++] = c;
+}
+
+
+
+/*
+  Writes out what remains in a text buffer and closes its file
+
+  @param out a buffered file
+
+  @return Returns 0 on success or -1 if any write failed.
+*/
+static int text_close( struct text_out* out )
+{
+  if( out->len > 0  &&
+      fwrite( out->buf, 1, out->len, out->file ) != out->len )
+    out->err = 1;
+  if( fclose( out->file ) )
+    out->err = 1;
+  free( out->buf );
+  return ( out->err )? -1 : 0;
+}
@@ -17,32 +17,70 @@
 #include "kdtree.h"
 #include "minpq.h"
 #include "imgfeatures.h"
+#include "descrdist.h"
+#include "parallel.h"
 #include "utils.h"
 
 #include <cxcore.h>
 
+#include <float.h>
+#include <math.h>
 #include <stdio.h>
+#include <string.h>
 
-struct bbf_data
+/* working state of a tree being built; see build_tree() */
+struct build_state
 {
-  double d;
-  void* old_data;
+  double** keys;               /* each feature's partition key coordinates */
+  int* idx;                    /* indices of the features in leaf order */
+  int d;                       /* descriptor length */
+  int rand_dims;               /* number of dimensions to choose among */
+  int* top_ki;                 /* the rand_dims of highest variance */
+  double* top_var;             /* and their variances */
+  unsigned int* rng;           /* random state, or NULL */
+};
+
+/* shared state of a batch search; see search_batch() */
+struct batch_job
+{
+  struct kd_tree** trees;
+  int ntrees;
+  struct kd_search** search;   /* one search context per thread */
+  int* err;                    /* set per thread when a search fails */
+  struct feature* feat;
+  int k;
+  int max_nn_chks;
+  double ratio_thr;
+  struct feature** nbrs;
+  double* dists;
 };
 
 /************************* Local Function Prototypes *************************/
 
-static struct kd_node* kd_node_init( struct feature*, int );
-static void expand_kd_node_subtree( struct kd_node* );
-static void assign_part_key( struct kd_node* );
+static struct kd_tree* build_tree( struct feature*, int, int, int, int,
+				   unsigned int*, int );
+static int expand_kd_node_subtree( struct kd_tree*, struct build_state*,
+				   int, int );
+static void assign_part_key( struct kd_node*, struct build_state*, int* );
 static double median_select( double*, int );
 static double rank_select( double*, int, int );
 static void insertion_sort( double*, int );
 static int partition_array( double*, int, double );
-static void partition_features( struct kd_node* );
-static struct kd_node* explore_to_leaf( struct kd_node*, struct feature*,
-					struct min_pq* );
-static int insert_into_nbr_array( struct feature*, struct feature**, int, int );
+static int partition_features( struct kd_node*, double**, int* );
+static double rand_gauss( unsigned int* );
+static void random_rotation( double*, int, unsigned int* );
+static void rotate_descr( double*, double*, double*, int );
+static int search_trees( struct kd_search*, struct kd_tree**, int,
+			 struct feature*, int, int );
+static int grow_search( struct kd_search*, int, int, int );
+static struct kd_node* explore_to_leaf( struct kd_tree*, struct kd_node*,
+					double*, struct min_pq* );
+static int insert_into_nbr_array( struct feature*, double, struct feature**,
+				  double*, int, int );
 static int within_rect( CvPoint2D64f, CvRect );
+static int knn_batch( struct kd_tree**, int, struct feature*, int, int, int,
+		      double, struct feature**, double*, struct thread_pool* );
+static void search_batch( void*, int, int, int );
 
 
 /******************** Functions prototyped in keyptdb.h **********************/
@@ -54,33 +92,38 @@ static int within_rect( CvPoint2D64f, CvRect );
   @param features an array of features
   @param n the number of features in features
   
-  @return Returns the root of a kd tree built from features or NULL on
-    error.
+  @return Returns a kd tree built from features or NULL on error.
 */
-struct kd_node* kdtree_build( struct feature* features, int n )
+struct kd_tree* kdtree_build( struct feature* features, int n )
 {
-  struct kd_node* kd_root;
+  return _kdtree_build( features, n, KDTREE_LEAF_SIZE );
+}
+
 
-  if( ! features  ||  n <= 0 )
-    {
-      fprintf( stderr, "Warning: kdtree_build(): no features, %s, line %d\n",
-	       __FILE__, __LINE__ );
-      return NULL;
-    }
 
-  kd_root = kd_node_init( features, n );
-  expand_kd_node_subtree( kd_root );
+/*
+  Builds a k-d tree with leaves of up to leaf_size features.
 
-  return kd_root;
+  @param features an array of features
+  @param n the number of features in features
+  @param leaf_size maximum number of features per leaf
+
+  @return Returns a kd tree built from features or NULL on error.
+*/
+struct kd_tree* _kdtree_build( struct feature* features, int n,
+			       int leaf_size )
+{
+  return build_tree( features, n, leaf_size, 1, 0, NULL, 1 );
 }
 
 
 
 /*
   Finds an image feature's approximate k nearest neighbors in a kd tree using
-  Best Bin First search.
+  Best Bin First search.  A search context is made for the search and the
+  neighbors it finds copied out of it.
   
-  @param kd_root root of an image feature kd tree
+  @param kd_tree an image feature kd tree
   @param feat image feature for whose neighbors to search
   @param k number of neighbors to find
    @param nbrs pointer to an array in which to store pointers to neighbors
@@ -90,82 +133,139 @@ struct kd_node* kdtree_build( struct feature* features, int n )
   @return Returns the number of neighbors found and stored in nbrs, or
     -1 on error.
 */
-int kdtree_bbf_knn( struct kd_node* kd_root, struct feature* feat, int k,
+int kdtree_bbf_knn( struct kd_tree* kd_tree, struct feature* feat, int k,
 		    struct feature*** nbrs, int max_nn_chks )
 {
-  struct kd_node* expl;
-  struct min_pq* min_pq;
-  struct feature* tree_feat, ** _nbrs;
-  struct bbf_data* bbf_data;
-  int i, t = 0, n = 0;
+  struct kd_search* search;
+  int n = -1;
 
-  if( ! nbrs  ||  ! feat  ||  ! kd_root )
+  if( ! nbrs )
     {
       fprintf( stderr, "Warning: NULL pointer error, %s, line %d\n",
 	       __FILE__, __LINE__ );
       return -1;
     }
 
-  _nbrs = calloc( k, sizeof( struct feature* ) );
-  min_pq = minpq_init();
-  minpq_insert( min_pq, kd_root, 0 );
-  while( min_pq->n > 0  &&  t < max_nn_chks )
+  *nbrs = NULL;
+  search = kdtree_search_init();
+  if( search )
+    n = kdtree_search_knn( search, kd_tree, feat, k, max_nn_chks );
+  if( n >= 0 )
     {
-      expl = (struct kd_node*)minpq_extract_min( min_pq );
-      if( ! expl )
-	{
-	  fprintf( stderr, "Warning: PQ unexpectedly empty, %s line %d\n",
-		   __FILE__, __LINE__ );
-	  goto fail;
-	}
+      *nbrs = calloc( MAX( k, 1 ), sizeof( struct feature* ) );
+      memcpy( *nbrs, search->nbrs, n * sizeof( struct feature* ) );
+    }
+  kdtree_search_release( &search );
+  return n;
+}
 
-      expl = explore_to_leaf( expl, feat, min_pq );
-      if( ! expl )
-	{
-	  fprintf( stderr, "Warning: PQ unexpectedly empty, %s line %d\n",
-		   __FILE__, __LINE__ );
-	  goto fail;
-	}
 
-      for( i = 0; i < expl->n; i++ )
-	{
-	  tree_feat = &expl->features[i];
-	  bbf_data = malloc( sizeof( struct bbf_data ) );
-	  if( ! bbf_data )
-	    {
-	      fprintf( stderr, "Warning: unable to allocate memory,"
-		       " %s line %d\n", __FILE__, __LINE__ );
-	      goto fail;
-	    }
-	  bbf_data->old_data = tree_feat->feature_data;
-	  bbf_data->d = descr_dist_sq(feat, tree_feat);
-	  tree_feat->feature_data = bbf_data;
-	  n += insert_into_nbr_array( tree_feat, _nbrs, n, k );
-	}
-      t++;
+
+/*
+  Creates a context for searching k-d trees.  Room for neighbors is
+  allocated by the first search and grown as larger k are requested.
+
+  @return Returns a new search context or NULL if no memory is available
+*/
+struct kd_search* kdtree_search_init( void )
+{
+  struct kd_search* search;
+
+  search = calloc( 1, sizeof( struct kd_search ) );
+  if( search )
+    search->min_pq = minpq_init();
+  if( ! search  ||  ! search->min_pq )
+    {
+      fprintf( stderr, "Warning: unable to allocate memory, %s line %d\n",
+	       __FILE__, __LINE__ );
+      free( search );
+      return NULL;
     }
+  return search;
+}
 
-  minpq_release( &min_pq );
-  for( i = 0; i < n; i++ )
+
+
+/*
+  Finds an image feature's approximate k nearest neighbors in a kd tree using
+  Best Bin First search, keeping the neighbors and their distances in a
+  search context.  Nothing in the tree or its features is written.
+
+  @param search a search context
+  @param kd_tree an image feature kd tree
+  @param feat image feature for whose neighbors to search
+  @param k number of neighbors to find
+  @param max_nn_chks search is cut off after examining this many tree entries
+
+  @return Returns the number of neighbors found and stored in search->nbrs,
+    or -1 on error.
+*/
+int kdtree_search_knn( struct kd_search* search, struct kd_tree* kd_tree,
+		       struct feature* feat, int k, int max_nn_chks )
+{
+  if( ! search  ||  ! feat  ||  ! kd_tree )
     {
-      bbf_data = _nbrs[i]->feature_data;
-      _nbrs[i]->feature_data = bbf_data->old_data;
-      free( bbf_data );
+      fprintf( stderr, "Warning: NULL pointer error, %s, line %d\n",
+	       __FILE__, __LINE__ );
+      return -1;
     }
-  *nbrs = _nbrs;
-  return n;
+  return search_trees( search, &kd_tree, 1, feat, k, max_nn_chks );
+}
 
- fail:
-  minpq_release( &min_pq );
-  for( i = 0; i < n; i++ )
+
+
+/*
+  De-allocates a k-d tree search context
+
+  @param search pointer to a search context
+*/
+void kdtree_search_release( struct kd_search** search )
+{
+  if( ! search  ||  ! *search )
+    return;
+  minpq_release( &(*search)->min_pq );
+  free( (*search)->nbrs );
+  free( (*search)->dists );
+  free( (*search)->q );
+  free( (*search)->seen );
+  free( *search );
+  *search = NULL;
+}
+
+
+
+/*
+  Finds the approximate k nearest neighbors of an array of image features,
+  dividing them among the threads of a pool.  Search contexts are made for
+  each thread for the duration of the call.
+
+  @param kd_tree an image feature kd tree
+  @param feat array of image features for whose neighbors to search
+  @param n number of features in feat
+  @param k number of neighbors to find for each feature
+  @param max_nn_chks each search is cut off after examining this many tree
+    entries
+  @param ratio_thr threshold on the squared nearest neighbor distance ratio,
+    or 0 to keep all neighbors
+  @param nbrs n x k matrix of neighbors
+  @param dists n x k matrix of squared distances, or NULL
+  @param pool threads, or NULL
+
+  @return Returns the number of features with neighbors or -1 on error
+*/
+int kdtree_bbf_knn_batch( struct kd_tree* kd_tree, struct feature* feat,
+			  int n, int k, int max_nn_chks, double ratio_thr,
+			  struct feature** nbrs, double* dists,
+			  struct thread_pool* pool )
+{
+  if( ! kd_tree )
     {
-      bbf_data = _nbrs[i]->feature_data;
-      _nbrs[i]->feature_data = bbf_data->old_data;
-      free( bbf_data );
+      fprintf( stderr, "Warning: NULL pointer error, %s, line %d\n",
+	       __FILE__, __LINE__ );
+      return -1;
     }
-  free( _nbrs );
-  *nbrs = NULL;
-  return -1;
+  return knn_batch( &kd_tree, 1, feat, n, k, max_nn_chks, ratio_thr, nbrs,
+		    dists, pool );
 }
 
 
@@ -174,7 +274,7 @@ int kdtree_bbf_knn( struct kd_node* kd_root, struct feature* feat, int k,
   Finds an image feature's approximate k nearest neighbors within a specified
   spatial region in a kd tree using Best Bin First search.
   
-  @param kd_root root of an image feature kd tree
+  @param kd_tree an image feature kd tree
   @param feat image feature for whose neighbors to search
   @param k number of neighbors to find
    @param nbrs pointer to an array in which to store pointers to neighbors
@@ -188,7 +288,7 @@ int kdtree_bbf_knn( struct kd_node* kd_root, struct feature* feat, int k,
      (in case \a k neighbors could not be found before examining
      \a max_nn_checks keypoint entries).
 */
-int kdtree_bbf_spatial_knn( struct kd_node* kd_root, struct feature* feat,
+int kdtree_bbf_spatial_knn( struct kd_tree* kd_tree, struct feature* feat,
 			    int k, struct feature*** nbrs, int max_nn_chks,
 			    CvRect rect, int model )
 {
@@ -196,7 +296,7 @@ int kdtree_bbf_spatial_knn( struct kd_node* kd_root, struct feature* feat,
   CvPoint2D64f pt;
   int i, n, t = 0;
 
-  n = kdtree_bbf_knn( kd_root, feat, max_nn_chks, &all_nbrs, max_nn_chks );
+  n = kdtree_bbf_knn( kd_tree, feat, max_nn_chks, &all_nbrs, max_nn_chks );
   sp_nbrs = calloc( k, sizeof( struct feature* ) );
   for( i = 0; i < n; i++ )
     {
@@ -223,15 +323,163 @@ int kdtree_bbf_spatial_knn( struct kd_node* kd_root, struct feature* feat,
 /*
   De-allocates memory held by a kd tree
   
-  @param kd_root pointer to the root of a kd tree
+  @param kd_tree a kd tree
 */
-void kdtree_release( struct kd_node* kd_root )
+void kdtree_release( struct kd_tree* kd_tree )
 {
-  if( ! kd_root )
+  free( kd_tree );
+}
+
+
+
+/*
+  Sets randomized k-d forest parameters to their defaults.
+
+  @param params parameters to initialize
+*/
+void kdtree_forest_params_init( struct kd_forest_params* params )
+{
+  params->ntrees = KDTREE_FOREST_TREES;
+  params->leaf_size = KDTREE_LEAF_SIZE;
+  params->rand_dims = KDTREE_FOREST_RAND_DIMS;
+  params->rotate = KDTREE_FOREST_ROTATE;
+  params->seed = KDTREE_FOREST_SEED;
+}
+
+
+
+/*
+  Builds a randomized k-d forest.  The trees are built one after another
+  from a single random state seeded by the parameters, so a forest does not
+  depend on anything but its features and parameters.
+
+  @param features an array of features, left in its order
+  @param n the number of features in features
+  @param params forest parameters, or NULL for the defaults
+
+  @return Returns a forest built from features or NULL on error.
+*/
+struct kd_forest* kdtree_forest_build( struct feature* features, int n,
+				       struct kd_forest_params* params )
+{
+  struct kd_forest_params defaults;
+  struct kd_forest* forest;
+  unsigned int rng;
+  int i;
+
+  if( ! params )
+    {
+      kdtree_forest_params_init( &defaults );
+      params = &defaults;
+    }
+  if( params->ntrees < 1 )
+    {
+      fprintf( stderr, "Warning: kdtree_forest_build(): a forest needs at " \
+	       "least one tree, %s, line %d\n", __FILE__, __LINE__ );
+      return NULL;
+    }
+
+  forest = calloc( 1, sizeof( struct kd_forest ) +
+		   params->ntrees * sizeof( struct kd_tree* ) );
+  if( ! forest )
+    {
+      fprintf( stderr, "Warning: unable to allocate memory, %s line %d\n",
+	       __FILE__, __LINE__ );
+      return NULL;
+    }
+  forest->trees = (struct kd_tree**)( forest + 1 );
+  forest->ntrees = params->ntrees;
+
+  /* xorshift state must not be zero */
+  rng = params->seed ^ 0x9E3779B9;
+  if( ! rng )
+    rng = 1;
+  for( i = 0; i < forest->ntrees; i++ )
+    {
+      forest->trees[i] = build_tree( features, n, params->leaf_size,
+				     params->rand_dims, params->rotate, &rng,
+				     0 );
+      if( ! forest->trees[i] )
+	{
+	  kdtree_forest_release( &forest );
+	  return NULL;
+	}
+    }
+  forest->n = n;
+  forest->d = forest->trees[0]->d;
+  forest->features = features;
+  return forest;
+}
+
+
+
+/*
+  Finds an image feature's approximate k nearest neighbors in a randomized
+  k-d forest, keeping the neighbors and their distances in a search context.
+
+  @param search a search context
+  @param forest a randomized k-d forest
+  @param feat image feature for whose neighbors to search
+  @param k number of neighbors to find
+  @param max_nn_chks search is cut off after examining this many features
+
+  @return Returns the number of neighbors found and stored in search->nbrs,
+    or -1 on error.
+*/
+int kdtree_forest_search_knn( struct kd_search* search,
+			      struct kd_forest* forest, struct feature* feat,
+			      int k, int max_nn_chks )
+{
+  if( ! search  ||  ! feat  ||  ! forest )
+    {
+      fprintf( stderr, "Warning: NULL pointer error, %s, line %d\n",
+	       __FILE__, __LINE__ );
+      return -1;
+    }
+  return search_trees( search, forest->trees, forest->ntrees, feat, k,
+		       max_nn_chks );
+}
+
+
+
+/*
+  Finds the approximate k nearest neighbors of an array of image features in
+  a randomized k-d forest, dividing them among the threads of a pool.
+
+  @return Returns the number of features with neighbors or -1 on error
+*/
+int kdtree_forest_knn_batch( struct kd_forest* forest, struct feature* feat,
+			     int n, int k, int max_nn_chks, double ratio_thr,
+			     struct feature** nbrs, double* dists,
+			     struct thread_pool* pool )
+{
+  if( ! forest )
+    {
+      fprintf( stderr, "Warning: NULL pointer error, %s, line %d\n",
+	       __FILE__, __LINE__ );
+      return -1;
+    }
+  return knn_batch( forest->trees, forest->ntrees, feat, n, k, max_nn_chks,
+		    ratio_thr, nbrs, dists, pool );
+}
+
+
+
+/*
+  De-allocates a randomized k-d forest
+
+  @param forest pointer to a forest
+*/
+void kdtree_forest_release( struct kd_forest** forest )
+{
+  int i;
+
+  if( ! forest  ||  ! *forest )
     return;
-  kdtree_release( kd_root->kd_left );
-  kdtree_release( kd_root->kd_right );
-  free( kd_root );
+  for( i = 0; i < (*forest)->ntrees; i++ )
+    kdtree_release( (*forest)->trees[i] );
+  free( *forest );
+  *forest = NULL;
 }
 
 
@@ -239,97 +487,250 @@ void kdtree_release( struct kd_node* kd_root )
 
 
 /*
-  Initializes a kd tree node with a set of features.  The node is not
-  expanded, and no ordering is imposed on the features.
-  
-  @param features an array of image features
-  @param n number of features
+  Builds a k-d tree with leaves of up to leaf_size features.  Nodes are
+  split by partitioning an array of feature indices, so features are moved
+  at most once, into leaf order, after the tree is built.  The tree's
+  header, nodes, and descriptor matrix or leaf order and rotation share one
+  allocation, with room for the most nodes a tree of n features can have.
+  A tree that leaves the features in place has no descriptor matrix, so
+  the trees of a forest share the features' descriptors rather than each
+  holding a copy.  Partition keys are coordinates of rotated descriptors if
+  rotate is nonzero, but distances are always found between the features'
+  own descriptors, so they are exact.
 
-  @return Returns an unexpanded kd-tree node.
+  @param features an array of features
+  @param n the number of features in features
+  @param leaf_size maximum number of features per leaf
+  @param rand_dims number of highest-variance dimensions among which each
+    node's partition key index is chosen at random; 1 always takes the
+    dimension of highest variance
+  @param rotate if nonzero, partition a randomly rotated descriptor space
+  @param rng random state, advanced by this function; may be NULL if
+    rand_dims is 1 and rotate is 0
+  @param reorder if nonzero, rearrange features into leaf order; otherwise
+    record the leaf order in the tree
+
+  @return Returns a kd tree built from features or NULL on error.
 */
-static struct kd_node* kd_node_init( struct feature* features, int n )
+static struct kd_tree* build_tree( struct feature* features, int n,
+				   int leaf_size, int rand_dims, int rotate,
+				   unsigned int* rng, int reorder )
 {
-  struct kd_node* kd_node;
+  struct kd_tree* kd_tree;
+  struct build_state bs;
+  struct feature* tmp = NULL;
+  double* rkeys = NULL, * block;
+  size_t size;
+  int d, i;
 
-  kd_node = malloc( sizeof( struct kd_node ) );
-  memset( kd_node, 0, sizeof( struct kd_node ) );
-  kd_node->ki = -1;
-  kd_node->features = features;
-  kd_node->n = n;
+  if( ! features  ||  n <= 0 )
+    {
+      fprintf( stderr, "Warning: kdtree_build(): no features, %s, line %d\n",
+	       __FILE__, __LINE__ );
+      return NULL;
+    }
+
+  d = features[0].d;
+  for( i = 1; i < n; i++ )
+    if( features[i].d != d )
+      {
+	fprintf( stderr, "Warning: kdtree_build(): features have differing" \
+		 " descriptor lengths, %s, line %d\n", __FILE__, __LINE__ );
+	return NULL;
+      }
 
-  return kd_node;
+  size = sizeof( struct kd_tree ) +
+    ( 2 * (size_t)n - 1 ) * sizeof( struct kd_node );
+  if( reorder )
+    size += (size_t)n * d * sizeof( double );
+  if( rotate )
+    size += (size_t)d * d * sizeof( double );
+  if( ! reorder )
+    size += n * sizeof( int );
+  bs.rand_dims = MAX( rand_dims, 1 );
+  kd_tree = malloc( size );
+  bs.keys = malloc( n * sizeof( double* ) );
+  bs.idx = malloc( n * sizeof( int ) );
+  bs.top_ki = malloc( bs.rand_dims * sizeof( int ) );
+  bs.top_var = malloc( bs.rand_dims * sizeof( double ) );
+  if( reorder )
+    tmp = malloc( n * sizeof( struct feature ) );
+  if( rotate )
+    rkeys = malloc( (size_t)n * d * sizeof( double ) );
+  if( ! kd_tree  ||  ! bs.keys  ||  ! bs.idx  ||  ! bs.top_ki  ||
+      ! bs.top_var  ||  ( reorder  &&  ! tmp )  ||  ( rotate  &&  ! rkeys ) )
+    {
+      fprintf( stderr, "Warning: unable to allocate memory, %s line %d\n",
+	       __FILE__, __LINE__ );
+      free( kd_tree );
+      kd_tree = NULL;
+      goto end;
+    }
+  kd_tree->n = n;
+  kd_tree->d = d;
+  kd_tree->leaf_size = MAX( leaf_size, 1 );
+  kd_tree->nnodes = 0;
+  kd_tree->nodes = (struct kd_node*)( kd_tree + 1 );
+  kd_tree->features = features;
+  block = (double*)( kd_tree->nodes + 2 * n - 1 );
+  kd_tree->descr = ( reorder )? block : NULL;
+  if( reorder )
+    block += (size_t)n * d;
+  kd_tree->rot = ( rotate )? block : NULL;
+  if( rotate )
+    block += (size_t)d * d;
+  kd_tree->order = ( reorder )? NULL : (int*)block;
+
+  if( rotate )
+    random_rotation( kd_tree->rot, d, rng );
+  for( i = 0; i < n; i++ )
+    {
+      bs.idx[i] = i;
+      if( rotate )
+	{
+	  bs.keys[i] = rkeys + (size_t)i * d;
+	  rotate_descr( kd_tree->rot, features[i].descr, bs.keys[i], d );
+	}
+      else
+	bs.keys[i] = features[i].descr;
+    }
+  bs.d = d;
+  bs.rng = rng;
+  expand_kd_node_subtree( kd_tree, &bs, 0, n );
+
+  /* move features and their descriptors into leaf order, or record it */
+  if( reorder )
+    {
+      memcpy( tmp, features, n * sizeof( struct feature ) );
+      for( i = 0; i < n; i++ )
+	{
+	  features[i] = tmp[bs.idx[i]];
+	  memcpy( kd_tree->descr + (size_t)i * d, features[i].descr,
+		  d * sizeof( double ) );
+	}
+    }
+  else
+    memcpy( kd_tree->order, bs.idx, n * sizeof( int ) );
+
+ end:
+  free( bs.keys );
+  free( bs.idx );
+  free( bs.top_ki );
+  free( bs.top_var );
+  free( tmp );
+  free( rkeys );
+  return kd_tree;
 }
 
 
 
 /*
-  Recursively expands a specified kd tree node into a tree whose leaves
-  contain one entry each.
-
-  @param kd_node an unexpanded node in a kd tree
+  Recursively builds the subtree of a kd tree holding a range of features,
+  appending its nodes to the tree's node array with each subtree's root
+  first.  A node holding more than the tree's leaf size of features is
+  split in two unless all of them fall on one side of the partition.
+
+  @param kd_tree a kd tree
+  @param bs state of the build; the entries of bs->idx in the range are
+    reordered by this function
+  @param first start of the range of bs->idx holding the subtree's features
+  @param n number of features in the subtree
+
+  @return Returns the index of the subtree's root node.
 */
-static void expand_kd_node_subtree( struct kd_node* kd_node )
+static int expand_kd_node_subtree( struct kd_tree* kd_tree,
+				   struct build_state* bs, int first, int n )
 {
+  struct kd_node* kd_node;
+  int i, j;
+
+  i = kd_tree->nnodes++;
+  kd_node = kd_tree->nodes + i;
+  kd_node->ki = -1;
+  kd_node->kv = 0;
+  kd_node->leaf = 0;
+  kd_node->first = first;
+  kd_node->n = n;
+  kd_node->kd_left = kd_node->kd_right = -1;
+
   /* base case: leaf node */
-  if( kd_node->n == 1  ||  kd_node->n == 0 )
+  if( n <= kd_tree->leaf_size )
     {
       kd_node->leaf = 1;
-      return;
+      return i;
     }
 
-  assign_part_key( kd_node );
-  partition_features( kd_node );
+  assign_part_key( kd_node, bs, bs->idx + first );
+  j = partition_features( kd_node, bs->keys, bs->idx + first );
+  if( kd_node->leaf )
+    return i;
 
-  if( kd_node->kd_left )
-    expand_kd_node_subtree( kd_node->kd_left );
-  if( kd_node->kd_right )
-    expand_kd_node_subtree( kd_node->kd_right );
+  kd_node->kd_left = expand_kd_node_subtree( kd_tree, bs, first, j + 1 );
+  kd_node->kd_right = expand_kd_node_subtree( kd_tree, bs, first + j + 1,
+					      n - j - 1 );
+  return i;
 }
 
 
 
 /*
   Determines the descriptor index at which and the value with which to
-  partition a kd tree node's features.
+  partition a kd tree node's features.  The index is chosen at random from
+  among the bs->rand_dims dimensions along which the features' keys have
+  most variance, ignoring any with none.
 
   @param kd_node a kd tree node
+  @param bs state of the build
+  @param idx indices of the node's features
 */
-static void assign_part_key( struct kd_node* kd_node )
+static void assign_part_key( struct kd_node* kd_node, struct build_state* bs,
+			     int* idx )
 {
-  struct feature* features;
-  double kv, x, mean, var, var_max = 0;
+  double** keys = bs->keys;
+  double kv, x, mean, var;
   double* tmp;
-  int d, n, i, j, ki = 0;
+  int d, n, i, j, m, ntop = 0, ki = 0;
 
-  features = kd_node->features;
   n = kd_node->n;
-  d = features[0].d;
+  d = bs->d;
 
-  /* partition key index is that along which descriptors have most variance */
+  /* keep the dimensions of most variance, earlier ones first among ties */
   for( j = 0; j < d; j++ )
     {
       mean = var = 0;
       for( i = 0; i < n; i++ )
-	mean += features[i].descr[j];
+	mean += keys[idx[i]][j];
       mean /= n;
       for( i = 0; i < n; i++ )
 	{
-	  x = features[i].descr[j] - mean;
+	  x = keys[idx[i]][j] - mean;
 	  var += x * x;
 	}
       var /= n;
 
-      if( var > var_max )
+      if( var <= 0  ||  ( ntop == bs->rand_dims  &&
+			  var <= bs->top_var[ntop-1] ) )
+	continue;
+      m = MIN( ntop, bs->rand_dims - 1 );
+      while( m > 0  &&  bs->top_var[m-1] < var )
 	{
-	  ki = j;
-	  var_max = var;
+	  bs->top_var[m] = bs->top_var[m-1];
+	  bs->top_ki[m] = bs->top_ki[m-1];
+	  m--;
 	}
+      bs->top_var[m] = var;
+      bs->top_ki[m] = j;
+      ntop = MIN( ntop + 1, bs->rand_dims );
     }
+  if( ntop > 1 )
+    ki = bs->top_ki[ rand_next( bs->rng ) % ntop ];
+  else if( ntop == 1 )
+    ki = bs->top_ki[0];
 
-  /* partition key value is median of descriptor values at ki */
+  /* partition key value is median of key values at ki */
   tmp = calloc( n, sizeof( double ) );
   for( i = 0; i < n; i++ )
-    tmp[i] = features[i].descr[ki];
+    tmp[i] = keys[idx[i]][ki];
   kv = median_select( tmp, n );
   free( tmp );
 
@@ -470,67 +871,331 @@ static int partition_array( double* array, int n, double pivot )
 
 
 /*
-  Partitions the features at a specified kd tree node to create its two
-  children.
+  Partitions the features at a specified kd tree node, by reordering their
+  indices, into those that belong to its left and right children.
+
+  @param kd_node a kd tree node whose partition key is set; it is made a
+    leaf if all of its features fall on the same side of the partition
+  @param keys each feature's partition key coordinates
+  @param idx indices of the node's features
 
-  @param kd_node a kd tree node whose partition key is set
+  @return Returns the index in idx of the last feature of the left child.
 */
-static void partition_features( struct kd_node* kd_node )
+static int partition_features( struct kd_node* kd_node, double** keys,
+			       int* idx )
 {
-  struct feature* features, tmp;
   double kv;
-  int n, ki, p, i, j = -1;
+  int n, ki, p = 0, i, j = -1, tmp;
 
-  features = kd_node->features;
   n = kd_node->n;
   ki = kd_node->ki;
   kv = kd_node->kv;
   for( i = 0; i < n; i++ )
-    if( features[i].descr[ki] <= kv )
+    if( keys[idx[i]][ki] <= kv )
       {
-	tmp = features[++j];
-	features[j] = features[i];
-	features[i] = tmp;
-	if( features[j].descr[ki] == kv )
+	tmp = idx[++j];
+	idx[j] = idx[i];
+	idx[i] = tmp;
+	if( keys[idx[j]][ki] == kv )
 	  p = j;
       }
-  tmp = features[p];
-  features[p] = features[j];
-  features[j] = tmp;
+  tmp = idx[p];
+  idx[p] = idx[j];
+  idx[j] = tmp;
 
   /* if all records fall on same side of partition, make node a leaf */
   if( j == n - 1 )
+    kd_node->leaf = 1;
+  return j;
+}
+
+
+
+/*
+  Draws a number from the standard normal distribution using the
+  Box-Muller transform
+
+  @param state random state
+
+  @return Returns a normally distributed random number.
+*/
+static double rand_gauss( unsigned int* state )
+{
+  double u1, u2;
+
+  u1 = ( rand_next( state ) + 1.0 ) / 4294967297.0;
+  u2 = rand_next( state ) / 4294967296.0;
+  return sqrt( -2.0 * log( u1 ) ) * cos( 2.0 * CV_PI * u2 );
+}
+
+
+
+/*
+  Makes a uniformly random rotation by orthonormalizing the rows of a
+  matrix of normally distributed numbers with Gram-Schmidt
+
+  @param rot d x d matrix in which to store the rotation
+  @param d dimension
+  @param state random state
+*/
+static void random_rotation( double* rot, int d, unsigned int* state )
+{
+  double* row, dot, norm;
+  int i, j, c;
+
+  for( i = 0; i < d; i++ )
     {
-      kd_node->leaf = 1;
-      return;
+      row = rot + (size_t)i * d;
+      do
+	{
+	  for( c = 0; c < d; c++ )
+	    row[c] = rand_gauss( state );
+	  for( j = 0; j < i; j++ )
+	    {
+	      dot = 0;
+	      for( c = 0; c < d; c++ )
+		dot += row[c] * rot[(size_t)j*d+c];
+	      for( c = 0; c < d; c++ )
+		row[c] -= dot * rot[(size_t)j*d+c];
+	    }
+	  norm = 0;
+	  for( c = 0; c < d; c++ )
+	    norm += row[c] * row[c];
+	  norm = sqrt( norm );
+	}
+      while( norm < 1e-6 );
+      for( c = 0; c < d; c++ )
+	row[c] /= norm;
+    }
+}
+
+
+
+/*
+  Rotates a descriptor
+
+  @param rot d x d rotation
+  @param descr descriptor
+  @param out array in which to store the rotated descriptor
+  @param d descriptor length
+*/
+static void rotate_descr( double* rot, double* descr, double* out, int d )
+{
+  double x;
+  int i, c;
+
+  for( i = 0; i < d; i++, rot += d )
+    {
+      x = 0;
+      for( c = 0; c < d; c++ )
+	x += rot[c] * descr[c];
+      out[i] = x;
+    }
+}
+
+
+
+/*
+  Finds an image feature's approximate k nearest neighbors in one or more
+  kd trees of the same features using Best Bin First search.  The roots of
+  all the trees go into one priority queue, so each step explores the most
+  promising bin of any tree.  When there are several trees, a feature
+  already checked in one is skipped, and not counted, in the others.
+
+  @param search a search context
+  @param trees kd trees of the same features
+  @param ntrees number of trees
+  @param feat image feature for whose neighbors to search
+  @param k number of neighbors to find
+  @param max_nn_chks search is cut off after examining this many features
+
+  @return Returns the number of neighbors found and stored in search->nbrs,
+    or -1 on error.
+*/
+static int search_trees( struct kd_search* search, struct kd_tree** trees,
+			 int ntrees, struct feature* feat, int k,
+			 int max_nn_chks )
+{
+  struct kd_node* expl;
+  struct kd_tree* kd_tree;
+  struct min_pq* min_pq;
+  double* descr, * q;
+  unsigned int* seen = NULL;
+  int i, d, f, nq = 0, t = 0, n = 0;
+
+  d = trees[0]->d;
+  if( feat->d != d )
+    {
+      fprintf( stderr, "Warning: comparing imcompatible descriptors, %s" \
+	       " line %d\n", __FILE__, __LINE__ );
+      return -1;
+    }
+  if( k < 1 )
+    return 0;
+
+  for( i = 0; i < ntrees; i++ )
+    if( trees[i]->rot )
+      nq = ntrees * d;
+  if( grow_search( search, k, nq, ( ntrees > 1 )? trees[0]->n : 0 ) )
+    return -1;
+  if( ntrees > 1 )
+    {
+      seen = search->seen;
+      if( ++search->stamp == 0 )
+	{
+	  memset( seen, 0, search->nseen_allocd * sizeof( unsigned int ) );
+	  search->stamp = 1;
+	}
+    }
+
+  min_pq = search->min_pq;
+  minpq_reset( min_pq );
+  for( i = 0; i < ntrees; i++ )
+    {
+      if( trees[i]->rot )
+	rotate_descr( trees[i]->rot, feat->descr, search->q + i * d, d );
+      if( minpq_insert( min_pq, trees[i]->nodes, 0 ) )
+	{
+	  fprintf( stderr, "Warning: unable to insert into PQ, %s, line %d\n",
+		   __FILE__, __LINE__ );
+	  return -1;
+	}
+    }
+  while( min_pq->n > 0  &&  t < max_nn_chks )
+    {
+      expl = (struct kd_node*)minpq_extract_min( min_pq );
+      if( ! expl )
+	{
+	  fprintf( stderr, "Warning: PQ unexpectedly empty, %s line %d\n",
+		   __FILE__, __LINE__ );
+	  return -1;
+	}
+
+      /* find the tree to which the node belongs */
+      for( i = 0; i < ntrees - 1; i++ )
+	if( expl >= trees[i]->nodes  &&
+	    expl < trees[i]->nodes + trees[i]->nnodes )
+	  break;
+      kd_tree = trees[i];
+      q = ( kd_tree->rot )? search->q + i * d : feat->descr;
+
+      expl = explore_to_leaf( kd_tree, expl, q, min_pq );
+      if( ! expl )
+	{
+	  fprintf( stderr, "Warning: PQ unexpectedly empty, %s line %d\n",
+		   __FILE__, __LINE__ );
+	  return -1;
+	}
+
+      /* a leaf's descriptors are adjacent rows of the descriptor matrix,
+	 if the tree has one */
+      for( i = expl->first; i < expl->first + expl->n; i++ )
+	{
+	  if( kd_tree->order )
+	    {
+	      f = kd_tree->order[i];
+	      descr = kd_tree->features[f].descr;
+	    }
+	  else
+	    {
+	      f = i;
+	      descr = kd_tree->descr + (size_t)i * d;
+	    }
+	  if( seen )
+	    {
+	      if( seen[f] == search->stamp )
+		continue;
+	      seen[f] = search->stamp;
+	    }
+	  n += insert_into_nbr_array( kd_tree->features + f,
+				      descr_dist_sq_f64( feat->descr, descr, d ),
+				      search->nbrs, search->dists, n, k );
+	  t++;
+	}
     }
 
-  kd_node->kd_left = kd_node_init( features, j + 1 );
-  kd_node->kd_right = kd_node_init( features + ( j + 1 ), ( n - j - 1 ) );
+  return n;
+}
+
+
+
+/*
+  Grows a search context's buffers if necessary
+
+  @param search a search context
+  @param k number of neighbors for which to make room
+  @param nq number of rotated query coordinates for which to make room
+  @param nseen number of features whose checks must be tracked
+
+  @return Returns 0 on success or -1 if no memory is available.
+*/
+static int grow_search( struct kd_search* search, int k, int nq, int nseen )
+{
+  void* p = search;
+
+  if( k > search->nallocd )
+    {
+      p = realloc( search->nbrs, k * sizeof( struct feature* ) );
+      if( p )
+	search->nbrs = p;
+      p = ( p )? realloc( search->dists, k * sizeof( double ) ) : NULL;
+      if( p )
+	{
+	  search->dists = p;
+	  search->nallocd = k;
+	}
+    }
+  if( p  &&  nq > search->nq_allocd )
+    {
+      p = realloc( search->q, nq * sizeof( double ) );
+      if( p )
+	{
+	  search->q = p;
+	  search->nq_allocd = nq;
+	}
+    }
+  if( p  &&  nseen > search->nseen_allocd )
+    {
+      free( search->seen );
+      search->nseen_allocd = 0;
+      search->stamp = 0;
+      p = search->seen = calloc( nseen, sizeof( unsigned int ) );
+      if( p )
+	search->nseen_allocd = nseen;
+    }
+  if( ! p )
+    {
+      fprintf( stderr, "Warning: unable to allocate memory, %s line %d\n",
+	       __FILE__, __LINE__ );
+      return -1;
+    }
+  return 0;
 }
 
 
 
 /*
   Explores a kd tree from a given node to a leaf.  Branching decisions are
-  made at each node based on the descriptor of a given feature.  Each node
-  examined but not explored is put into a priority queue to be explored
-  later, keyed based on the distance from its partition key value to the
-  given feature's desctiptor.
+  made at each node based on the coordinates of a query in the space the
+  tree partitions.  Each node examined but not explored is put into a
+  priority queue to be explored later, keyed based on the distance from
+  its partition key value to the query's coordinate.
   
+  @param kd_tree the kd tree to which kd_node belongs
   @param kd_node root of the subtree to be explored
-  @param feat feature upon which branching decisions are based
+  @param q the query's descriptor, rotated by the tree's rotation if it has
+    one; must be as long as the tree's descriptors
   @param min_pq a minimizing priority queue into which tree nodes are placed
     as described above
 
   @return Returns a pointer to the leaf node at which exploration ends or
     NULL on error.
 */
-static struct kd_node* explore_to_leaf( struct kd_node* kd_node,
-					struct feature* feat,
-					struct min_pq* min_pq )
+static struct kd_node* explore_to_leaf( struct kd_tree* kd_tree,
+					struct kd_node* kd_node,
+					double* q, struct min_pq* min_pq )
 {
-  struct kd_node* unexpl, * expl = kd_node;
+  struct kd_node* unexpl, * expl = kd_node, * nodes = kd_tree->nodes;
   double kv;
   int ki;
 
@@ -539,24 +1204,18 @@ static struct kd_node* explore_to_leaf( struct kd_node* kd_node,
       ki = expl->ki;
       kv = expl->kv;
       
-      if( ki >= feat->d )
-	{
-	  fprintf( stderr, "Warning: comparing imcompatible descriptors, %s" \
-		   " line %d\n", __FILE__, __LINE__ );
-	  return NULL;
-	}
-      if( feat->descr[ki] <= kv )
+      if( q[ki] <= kv )
 	{
-	  unexpl = expl->kd_right;
-	  expl = expl->kd_left;
+	  unexpl = nodes + expl->kd_right;
+	  expl = nodes + expl->kd_left;
 	}
       else
 	{
-	  unexpl = expl->kd_left;
-	  expl = expl->kd_right;
+	  unexpl = nodes + expl->kd_left;
+	  expl = nodes + expl->kd_right;
 	}
       
-      if( minpq_insert( min_pq, unexpl, ABS( kv - feat->descr[ki] ) ) )
+      if( minpq_insert( min_pq, unexpl, ABS( kv - q[ki] ) ) )
 	{
 	  fprintf( stderr, "Warning: unable to insert into PQ, %s, line %d\n",
 		   __FILE__, __LINE__ );
@@ -573,43 +1232,36 @@ static struct kd_node* explore_to_leaf( struct kd_node* kd_node,
   Inserts a feature into the nearest-neighbor array so that the array remains
   in order of increasing descriptor distance from the search feature.
 
-  @param feat feature to be inderted into the array; it's feature_data field
-    should be a pointer to a bbf_data with d equal to the squared descriptor
-    distance between feat and the search feature
+  @param feat feature to be inderted into the array
+  @param df squared descriptor distance between feat and the search feature
   @param nbrs array of nearest neighbors neighbors
+  @param dists squared descriptor distances of the features in nbrs
   @param n number of elements already in nbrs and
   @param k maximum number of elements in nbrs
 
   @return If feat was successfully inserted into nbrs, returns 1; otherwise
     returns 0.
 */
-static int insert_into_nbr_array( struct feature* feat, struct feature** nbrs,
+static int insert_into_nbr_array( struct feature* feat, double df,
+				  struct feature** nbrs, double* dists,
 				  int n, int k )
 {
-  struct bbf_data* fdata, * ndata;
-  double dn, df;
   int i, ret = 0;
 
   if( n == 0 )
     {
       nbrs[0] = feat;
+      dists[0] = df;
       return 1;
     }
 
   /* check at end of array */
-  fdata = (struct bbf_data*)feat->feature_data;
-  df = fdata->d;
-  ndata = (struct bbf_data*)nbrs[n-1]->feature_data;
-  dn = ndata->d;
-  if( df >= dn )
+  if( df >= dists[n-1] )
     {
       if( n == k )
-	{
-	  feat->feature_data = fdata->old_data;
-	  free( fdata );
-	  return 0;
-	}
+	return 0;
       nbrs[n] = feat;
+      dists[n] = df;
       return 1;
     }
 
@@ -617,31 +1269,157 @@ static int insert_into_nbr_array( struct feature* feat, struct feature** nbrs,
   if( n < k )
     {
       nbrs[n] = nbrs[n-1];
+      dists[n] = dists[n-1];
       ret = 1;
     }
-  else
-    {
-      nbrs[n-1]->feature_data = ndata->old_data;
-      free( ndata );
-    }
   i = n-2;
   while( i >= 0 )
     {
-      ndata = (struct bbf_data*)nbrs[i]->feature_data;
-      dn = ndata->d;
-      if( dn <= df )
+      if( dists[i] <= df )
 	break;
       nbrs[i+1] = nbrs[i];
+      dists[i+1] = dists[i];
       i--;
     }
   i++;
   nbrs[i] = feat;
+  dists[i] = df;
 
   return ret;
 }
 
 
 
+/*
+  Finds the approximate k nearest neighbors of an array of image features in
+  one or more kd trees of the same features, dividing them among the threads
+  of a pool.  Search contexts are made for each thread for the duration of
+  the call.
+
+  @param trees kd trees of the same features
+  @param ntrees number of trees
+  @param feat array of image features for whose neighbors to search
+  @param n number of features in feat
+  @param k number of neighbors to find for each feature
+  @param max_nn_chks each search is cut off after examining this many
+    features
+  @param ratio_thr threshold on the squared nearest neighbor distance ratio,
+    or 0 to keep all neighbors
+  @param nbrs n x k matrix of neighbors
+  @param dists n x k matrix of squared distances, or NULL
+  @param pool threads, or NULL
+
+  @return Returns the number of features with neighbors or -1 on error
+*/
+static int knn_batch( struct kd_tree** trees, int ntrees,
+		      struct feature* feat, int n, int k, int max_nn_chks,
+		      double ratio_thr, struct feature** nbrs, double* dists,
+		      struct thread_pool* pool )
+{
+  struct batch_job job;
+  int nthreads = thread_pool_size( pool ), found = 0, i, ret = 0;
+
+  if( n > 0  &&  ( ! feat  ||  ! nbrs ) )
+    {
+      fprintf( stderr, "Warning: NULL pointer error, %s, line %d\n",
+	       __FILE__, __LINE__ );
+      return -1;
+    }
+  if( k < 1  ||  ( ratio_thr > 0  &&  k < 2 ) )
+    {
+      fprintf( stderr, "Warning: too few neighbors requested, %s, line %d\n",
+	       __FILE__, __LINE__ );
+      return -1;
+    }
+  for( i = 0; i < n; i++ )
+    if( feat[i].d != trees[0]->d )
+      {
+	fprintf( stderr, "Warning: comparing imcompatible descriptors, %s" \
+		 " line %d\n", __FILE__, __LINE__ );
+	return -1;
+      }
+
+  job.search = calloc( nthreads, sizeof( struct kd_search* ) );
+  job.err = calloc( nthreads, sizeof( int ) );
+  if( ! job.search  ||  ! job.err )
+    ret = -1;
+  for( i = 0; i < nthreads  &&  ret == 0; i++ )
+    if( ! ( job.search[i] = kdtree_search_init() ) )
+      ret = -1;
+  if( ret == 0 )
+    {
+      job.trees = trees;
+      job.ntrees = ntrees;
+      job.feat = feat;
+      job.k = k;
+      job.max_nn_chks = max_nn_chks;
+      job.ratio_thr = ratio_thr;
+      job.nbrs = nbrs;
+      job.dists = dists;
+      parallel_for( pool, n, KDTREE_BATCH_GRAIN, search_batch, &job );
+      for( i = 0; i < nthreads; i++ )
+	if( job.err[i] )
+	  ret = -1;
+    }
+
+  for( i = 0; job.search  &&  i < nthreads; i++ )
+    kdtree_search_release( job.search + i );
+  free( job.search );
+  free( job.err );
+  if( ret )
+    return -1;
+
+  for( i = 0; i < n; i++ )
+    if( nbrs[(size_t)i*k] )
+      found++;
+  return found;
+}
+
+
+
+/*
+  Searches kd trees for the neighbors of a range of features in a batch
+  and stores them in their rows of the neighbor and distance matrices,
+  clearing rows that fail the ratio test; run by parallel_for()
+
+  @param data a struct batch_job
+  @param begin index of the first feature
+  @param end one past the index of the last feature
+  @param tid thread index, which selects the search context
+*/
+static void search_batch( void* data, int begin, int end, int tid )
+{
+  struct batch_job* job = data;
+  struct kd_search* search = job->search[tid];
+  struct feature** nbrs;
+  double* dists;
+  int k = job->k, i, j, m;
+
+  for( i = begin; i < end; i++ )
+    {
+      nbrs = job->nbrs + (size_t)i * k;
+      dists = ( job->dists )? job->dists + (size_t)i * k : NULL;
+      m = search_trees( search, job->trees, job->ntrees, job->feat + i, k,
+			job->max_nn_chks );
+      if( m < 0 )
+	{
+	  job->err[tid] = 1;
+	  m = 0;
+	}
+      if( job->ratio_thr > 0  &&  ( m < 2  ||  search->dists[0] >=
+				    search->dists[1] * job->ratio_thr ) )
+	m = 0;
+      for( j = 0; j < k; j++ )
+	{
+	  nbrs[j] = ( j < m )? search->nbrs[j] : NULL;
+	  if( dists )
+	    dists[j] = ( j < m )? search->dists[j] : DBL_MAX;
+	}
+    }
+}
+
+
+
 /*
   Determines whether a given point lies within a specified rectangular region
 
@@ -1,5 +1,7 @@
 /*
-  Detects SIFT features in two images and finds matches between them.
+  Detects SIFT features in two images and finds matches between them.  By
+  default matches are found approximately with a k-d tree; with -e they
+  are found exactly by comparing all pairs of features.
 
   Copyright (C) 2006-2012  Rob Hess <rob@iqengines.com>
 
@@ -9,6 +11,9 @@
 #include "sift.h"
 #include "imgfeatures.h"
 #include "kdtree.h"
+#include "featset.h"
+#include "bfmatch.h"
+#include "parallel.h"
 #include "utils.h"
 #include "xform.h"
 
@@ -17,6 +22,7 @@
 #include <highgui.h>
 
 #include <stdio.h>
+#include <string.h>
 
 
 /* the maximum number of keypoint NN candidates to check during BBF search */
@@ -26,18 +32,28 @@
 #define NN_SQ_DIST_RATIO_THR 0.49
 
 
+static int match_exact( struct feature*, int, struct feature*, int,
+			struct thread_pool* );
+
+
 int main( int argc, char** argv )
 {
   IplImage* img1, * img2, * stacked;
-  struct feature* feat1, * feat2, * feat;
+  struct feature* feat1, * feat2;
   struct feature** nbrs;
-  struct kd_node* kd_root;
+  struct kd_tree* kd_root = NULL;
+  struct thread_pool* pool;
   CvPoint pt1, pt2;
-  double d0, d1;
-  int n1, n2, k, i, m = 0;
+  int n1, n2, i, m = 0, exact = 0;
 
+  if( argc == 4  &&  strcmp( argv[1], "-e" ) == 0 )
+    {
+      exact = 1;
+      argv++;
+      argc--;
+    }
   if( argc != 3 )
-    fatal_error( "usage: %s <img1> <img2>", argv[0] );
+    fatal_error( "usage: %s [-e] <img1> <img2>", argv[0] );
   
   img1 = cvLoadImage( argv[1], 1 );
   if( ! img1 )
@@ -51,28 +67,37 @@ int main( int argc, char** argv )
   n1 = sift_features( img1, &feat1 );
   fprintf( stderr, "Finding features in %s...\n", argv[2] );
   n2 = sift_features( img2, &feat2 );
-  fprintf( stderr, "Building kd tree...\n" );
-  kd_root = kdtree_build( feat2, n2 );
-  for( i = 0; i < n1; i++ )
+  pool = thread_pool_init( 0 );
+  if( exact )
+    {
+      fprintf( stderr, "Comparing all pairs of features...\n" );
+      if( match_exact( feat1, n1, feat2, n2, pool ) == -1 )
+	fatal_error( "unable to match features exactly" );
+    }
+  else
     {
-      feat = feat1 + i;
-      k = kdtree_bbf_knn( kd_root, feat, 2, &nbrs, KDTREE_BBF_MAX_NN_CHKS );
-      if( k == 2 )
-	{
-	  d0 = descr_dist_sq( feat, nbrs[0] );
-	  d1 = descr_dist_sq( feat, nbrs[1] );
-	  if( d0 < d1 * NN_SQ_DIST_RATIO_THR )
-	    {
-	      pt1 = cvPoint( cvRound( feat->x ), cvRound( feat->y ) );
-	      pt2 = cvPoint( cvRound( nbrs[0]->x ), cvRound( nbrs[0]->y ) );
-	      pt2.y += img1->height;
-	      cvLine( stacked, pt1, pt2, CV_RGB(255,0,255), 1, 8, 0 );
-	      m++;
-	      feat1[i].fwd_match = nbrs[0];
-	    }
-	}
+      fprintf( stderr, "Building kd tree...\n" );
+      kd_root = kdtree_build( feat2, n2 );
+      nbrs = calloc( 2 * MAX( n1, 1 ), sizeof( struct feature* ) );
+      if( kd_root  &&
+	  kdtree_bbf_knn_batch( kd_root, feat1, n1, 2, KDTREE_BBF_MAX_NN_CHKS,
+				NN_SQ_DIST_RATIO_THR, nbrs, NULL, pool ) < 0 )
+	fatal_error( "unable to search kd tree" );
+      for( i = 0; i < n1; i++ )
+	feat1[i].fwd_match = nbrs[2*i];
       free( nbrs );
     }
+  thread_pool_release( &pool );
+  for( i = 0; i < n1; i++ )
+    if( feat1[i].fwd_match )
+      {
+	pt1 = cvPoint( cvRound( feat1[i].x ), cvRound( feat1[i].y ) );
+	pt2 = cvPoint( cvRound( feat1[i].fwd_match->x ),
+		       cvRound( feat1[i].fwd_match->y ) );
+	pt2.y += img1->height;
+	cvLine( stacked, pt1, pt2, CV_RGB(255,0,255), 1, 8, 0 );
+	m++;
+      }
 
   fprintf( stderr, "Found %d total matches\n", m );
   display_big_img( stacked, "Matches" );
@@ -81,11 +106,12 @@ int main( int argc, char** argv )
   /* 
      UNCOMMENT BELOW TO SEE HOW RANSAC FUNCTION WORKS
      
-     Note that this line above:
-     
-     feat1[i].fwd_match = nbrs[0];
-     
-     is important for the RANSAC function to work.
+     Note that the forward matches set above, by
+
+     feat1[i].fwd_match = nbrs[2*i];
+
+     after the batch k-d tree search, or by match_exact() from the
+     bfmatch_knn2() results, are important for the RANSAC function to work.
   */
   /*
   {
@@ -111,8 +137,43 @@ int main( int argc, char** argv )
   cvReleaseImage( &stacked );
   cvReleaseImage( &img1 );
   cvReleaseImage( &img2 );
-  kdtree_release( kd_root );
+  if( kd_root )
+    kdtree_release( kd_root );
   free( feat1 );
   free( feat2 );
   return 0;
 }
+
+
+
+/*
+  Sets the forward match of each feature in feat1 whose nearest neighbor in
+  feat2 passes the ratio test, comparing all pairs of features on the
+  threads of a pool.
+
+  @return Returns 0 on success or -1 on failure
+*/
+static int match_exact( struct feature* feat1, int n1,
+			struct feature* feat2, int n2, struct thread_pool* pool )
+{
+  struct feature_set* set1, * set2;
+  struct bf_match* matches;
+  int i, ret = -1;
+
+  set1 = feature_set_from_features( feat1, n1 );
+  set2 = feature_set_from_features( feat2, n2 );
+  matches = calloc( MAX( n1, 1 ), sizeof( struct bf_match ) );
+  if( set1  &&  set2  &&  matches  &&
+      bfmatch_knn2( set1, set2, matches, pool ) == 0 )
+    {
+      for( i = 0; i < n1; i++ )
+	if( matches[i].nn[1] >= 0  &&
+	    matches[i].dsq[0] < matches[i].dsq[1] * NN_SQ_DIST_RATIO_THR )
+	  feat1[i].fwd_match = feat2 + matches[i].nn[0];
+      ret = 0;
+    }
+  free( matches );
+  feature_set_release( &set1 );
+  feature_set_release( &set2 );
+  return ret;
+}
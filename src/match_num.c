@@ -1,5 +1,7 @@
 /*
   Detects SIFT features in two images and finds matches between them.
+  Prints the number of matches, found with a k-d tree or, with -e, by
+  comparing all pairs of features.
 
   Copyright (C) 2006-2012  Rob Hess <rob@iqengines.com>
 
@@ -9,6 +11,9 @@
 #include "sift.h"
 #include "imgfeatures.h"
 #include "kdtree.h"
+#include "featset.h"
+#include "bfmatch.h"
+#include "parallel.h"
 #include "utils.h"
 #include "xform.h"
 
@@ -18,6 +23,7 @@
 
 #include <stdio.h>
 #include <pthread.h>
+#include <string.h>
 
 #define DEBUG 1
 
@@ -57,41 +63,74 @@ void* process_image(void* arg) {
 
 int compare_features(FeatureData* f0, FeatureData* f1)
 {
-  struct kd_node* kd_root;
-  double d0, d1;
+  struct kd_tree* kd_root;
   struct feature** nbrs;
+  struct thread_pool* pool;
   int num_matches;
-  size_t i; /* Serves as an index into an array, hence, size_t */
 
   /* Build KD Tree */
   kd_root = kdtree_build(f1->features, f1->count);
-
-  /* Compare feature distances */
-  for(i = 0; i < f0->count; ++i) {
-    int k;
-    struct feature* feat;
-    feat = f0->features + i;
-    k = kdtree_bbf_knn( kd_root, feat, 2, &nbrs, KDTREE_BBF_MAX_NN_CHKS );
-    if( k == 2 ) {
-      d0 = descr_dist_sq( feat, nbrs[0] );
-      d1 = descr_dist_sq( feat, nbrs[1] );
-      if( d0 < d1 * NN_SQ_DIST_RATIO_THR ) ++num_matches;
-    }
-    free( nbrs );
-  }
+  if (!kd_root) return 0;
+  nbrs = calloc(2 * f0->count + 2, sizeof(struct feature*));
+  if (!nbrs) fatal_error("Unable to allocate match data.");
+
+  /* Search for every feature's neighbors on every CPU; the ratio test
+     leaves only the features that match */
+  pool = thread_pool_init(0);
+  num_matches = kdtree_bbf_knn_batch(kd_root, f0->features, f0->count, 2,
+                                     KDTREE_BBF_MAX_NN_CHKS,
+                                     NN_SQ_DIST_RATIO_THR, nbrs, NULL, pool);
+  if (num_matches < 0) fatal_error("Unable to search KD tree.");
+
+  thread_pool_release(&pool);
+  free(nbrs);
   kdtree_release( kd_root );
   return num_matches;
 }
 
+int compare_features_exact(FeatureData* f0, FeatureData* f1)
+{
+  struct feature_set *s0, *s1;
+  struct bf_match* matches;
+  struct thread_pool* pool;
+  int num_matches = 0;
+  size_t i;
+
+  s0 = feature_set_from_features(f0->features, f0->count);
+  s1 = feature_set_from_features(f1->features, f1->count);
+  matches = calloc(f0->count + 1, sizeof(struct bf_match));
+  if (!s0 || !s1 || !matches) fatal_error("Unable to allocate match data.");
+
+  /* Compare all pairs of feature descriptors on every CPU */
+  pool = thread_pool_init(0);
+  if (bfmatch_knn2(s0, s1, matches, pool))
+    fatal_error("Unable to match features exactly.");
+  for(i = 0; i < f0->count; ++i)
+    if (matches[i].nn[1] >= 0 &&
+        matches[i].dsq[0] < matches[i].dsq[1] * NN_SQ_DIST_RATIO_THR)
+      ++num_matches;
+
+  thread_pool_release(&pool);
+  free(matches);
+  feature_set_release(&s0);
+  feature_set_release(&s1);
+  return num_matches;
+}
+
 int main( int argc, char** argv ) {
-  int i;
+  int i, exact = 0;
   pthread_t threads[2];
   struct thread_data td[2];
   pthread_attr_t attr;
   void* status;
 
   /* Handle filenames */
-  if( argc != 3 ) fatal_error( "usage: %s <img1> <img2>", argv[0] );
+  if (argc == 4 && strcmp(argv[1], "-e") == 0) {
+    exact = 1;
+    ++argv;
+    --argc;
+  }
+  if( argc != 3 ) fatal_error( "usage: %s [-e] <img1> <img2>", argv[0] );
   td[0].filename=argv[1];
   td[1].filename=argv[2];
 
@@ -114,7 +153,11 @@ int main( int argc, char** argv ) {
     if (rc) fatal_error("Return code from thread pthread_join is %d",rc);
   }
 
-  fprintf( stdout, "%d\n", compare_features(&(td[0].fdata), &(td[1].fdata)));
+  if (exact)
+    fprintf( stdout, "%d\n",
+             compare_features_exact(&(td[0].fdata), &(td[1].fdata)));
+  else
+    fprintf( stdout, "%d\n", compare_features(&(td[0].fdata), &(td[1].fdata)));
 
   /* Release structures */
   for (i=0; i<2; ++i) free(td[i].fdata.features);
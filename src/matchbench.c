@@ -0,0 +1,346 @@
+/*
+  Times nearest neighbor matching between two feature files, comparing
+  approximate k-d tree search with exact brute-force matching.  For each
+  method, reports the time to match every feature of the first file
+  against the second, the number of matches passing the ratio test, and
+  the fraction of features whose nearest neighbor was found exactly.  Then
+  compares the search time and exact nearest neighbors of a single k-d
+  tree and a randomized k-d forest over a range of check budgets.
+
+  Copyright (C) 2006-2012  Rob Hess <rob@iqengines.com>
+
+  @version 1.1.2-20100521
+*/
+
+#include "imgfeatures.h"
+#include "kdtree.h"
+#include "featset.h"
+#include "descrdist.h"
+#include "bfmatch.h"
+#include "parallel.h"
+#include "utils.h"
+
+#include <cxcore.h>
+
+#include <limits.h>
+#include <stdio.h>
+
+/* the maximum number of keypoint NN candidates to check during BBF search */
+#define KDTREE_BBF_MAX_NN_CHKS 200
+
+/* threshold on squared ratio of distances between NN and 2nd NN */
+#define NN_SQ_DIST_RATIO_THR 0.49
+
+/* number of times each method is timed */
+#define MATCHBENCH_REPS 5
+
+/* check budgets at which a tree and a forest are compared */
+static int chks_list[] = { 25, 50, 100, 200, 400, 800 };
+
+
+/*************************** Function Prototypes *****************************/
+
+static double time_bbf( struct feature*, int, struct feature*, int, int,
+			int, struct thread_pool*, struct bf_match* );
+static double time_search( struct kd_tree*, struct kd_forest*,
+			   struct feature*, int, int, struct thread_pool*,
+			   struct bf_match* );
+static void store_nbrs( struct feature**, double*, int, struct bf_match* );
+static double time_pairwise( struct feature_set*, struct feature_set*,
+			     struct bf_match* );
+static double time_bfmatch( struct feature_set*, struct feature_set*,
+			    struct thread_pool*, struct bf_match* );
+static void report( char*, double, struct bf_match*, struct bf_match*, int );
+static double exact_nn( struct bf_match*, struct bf_match*, int );
+
+
+/********************************** Main *************************************/
+
+int main( int argc, char** argv )
+{
+  struct feature* feat1, * feat2;
+  struct feature_set* set1, * set2;
+  struct bf_match* exact, * found;
+  struct thread_pool* pool;
+  struct kd_tree* kd_root;
+  struct kd_forest* forest;
+  char name[32];
+  double t, tf;
+  int n1, n2, threads, i;
+
+  if( argc < 3  ||  argc > 4 )
+    fatal_error( "usage: %s <lowe_feature_file1> <lowe_feature_file2> "
+		 "[threads]", argv[0] );
+  threads = ( argc == 4 )? atoi( argv[3] ) : 0;
+
+  n1 = import_features( argv[1], FEATURE_LOWE, &feat1 );
+  if( n1 < 1 )
+    fatal_error( "unable to load features from %s", argv[1] );
+  n2 = import_features( argv[2], FEATURE_LOWE, &feat2 );
+  if( n2 < 2 )
+    fatal_error( "unable to load features from %s", argv[2] );
+  set1 = feature_set_from_features( feat1, n1 );
+  set2 = feature_set_from_features( feat2, n2 );
+  if( ! set1  ||  ! set2  ||  set1->d != set2->d )
+    fatal_error( "features in %s and %s are incompatible", argv[1], argv[2] );
+  exact = calloc( n1, sizeof( struct bf_match ) );
+  found = calloc( n1, sizeof( struct bf_match ) );
+  pool = thread_pool_init( threads );
+
+  fprintf( stdout, "%d x %d features of length %d\n", n1, n2, set1->d );
+  fprintf( stdout, "method          ms  matches  exact NN\n" );
+  t = time_pairwise( set1, set2, exact );
+  report( "pairwise", t, exact, exact, n1 );
+  t = time_bbf( feat1, n1, feat2, n2, 0, KDTREE_BBF_MAX_NN_CHKS, NULL,
+		found );
+  report( "bbf 1", t, found, exact, n1 );
+  t = time_bbf( feat1, n1, feat2, n2, 0, KDTREE_BBF_MAX_NN_CHKS, pool,
+		found );
+  sprintf( name, "bbf %d", thread_pool_size( pool ) );
+  report( name, t, found, exact, n1 );
+  t = time_bbf( feat1, n1, feat2, n2, KDTREE_FOREST_TREES,
+		KDTREE_BBF_MAX_NN_CHKS, pool, found );
+  sprintf( name, "forest %d", thread_pool_size( pool ) );
+  report( name, t, found, exact, n1 );
+  t = time_bfmatch( set1, set2, NULL, found );
+  report( "bfmatch 1", t, found, exact, n1 );
+  t = time_bfmatch( set1, set2, pool, found );
+  sprintf( name, "bfmatch %d", thread_pool_size( pool ) );
+  report( name, t, found, exact, n1 );
+
+  fprintf( stdout, "\nsearch only, 1 tree vs. %d-tree forest\n",
+	   KDTREE_FOREST_TREES );
+  fprintf( stdout, "checks   tree ms   1st NN  forest ms   1st NN\n" );
+  /* building the tree reorders feat2, so it must come first */
+  kd_root = kdtree_build( feat2, n2 );
+  forest = kdtree_forest_build( feat2, n2, NULL );
+  if( ! forest  ||  ! kd_root )
+    fatal_error( "unable to build k-d trees" );
+  for( i = 0; i < sizeof( chks_list ) / sizeof( int ); i++ )
+    {
+      t = time_search( kd_root, NULL, feat1, n1, chks_list[i], pool, found );
+      fprintf( stdout, "%6d  %8.2f  %7.2f%%", chks_list[i], t,
+	       exact_nn( found, exact, n1 ) );
+      tf = time_search( NULL, forest, feat1, n1, chks_list[i], pool, found );
+      fprintf( stdout, "  %9.2f  %7.2f%%\n", tf,
+	       exact_nn( found, exact, n1 ) );
+    }
+  kdtree_release( kd_root );
+  kdtree_forest_release( &forest );
+
+  thread_pool_release( &pool );
+  feature_set_release( &set1 );
+  feature_set_release( &set2 );
+  free( exact );
+  free( found );
+  free( feat1 );
+  free( feat2 );
+  return 0;
+}
+
+
+/************************** Function Definitions *****************************/
+
+/*
+  Returns the average time in ms to build a k-d tree, or a randomized k-d
+  forest, of feat2 and search it for the two nearest neighbors of each
+  feature in feat1, storing their squared distances in nbrs; neighbor
+  indices are not kept because building a tree reorders feat2
+*/
+static double time_bbf( struct feature* feat1, int n1, struct feature* feat2,
+			int n2, int ntrees, int chks, struct thread_pool* pool,
+			struct bf_match* nbrs )
+{
+  struct kd_forest_params params;
+  struct kd_forest* forest;
+  struct kd_tree* kd_root;
+  struct feature** nn;
+  double* dists, start, t;
+  int r, m;
+
+  kdtree_forest_params_init( &params );
+  params.ntrees = ntrees;
+  nn = calloc( 2 * n1, sizeof( struct feature* ) );
+  dists = calloc( 2 * n1, sizeof( double ) );
+  start = get_time_ms();
+  for( r = 0; r < MATCHBENCH_REPS; r++ )
+    {
+      if( ntrees > 0 )
+	{
+	  forest = kdtree_forest_build( feat2, n2, &params );
+	  m = kdtree_forest_knn_batch( forest, feat1, n1, 2, chks, 0, nn, dists,
+				       pool );
+	  kdtree_forest_release( &forest );
+	}
+      else
+	{
+	  kd_root = kdtree_build( feat2, n2 );
+	  m = kdtree_bbf_knn_batch( kd_root, feat1, n1, 2, chks, 0, nn, dists,
+				    pool );
+	  kdtree_release( kd_root );
+	}
+      if( m < 0 )
+	fatal_error( "k-d tree search failed" );
+    }
+  t = ( get_time_ms() - start ) / MATCHBENCH_REPS;
+
+  store_nbrs( nn, dists, n1, nbrs );
+  free( nn );
+  free( dists );
+  return t;
+}
+
+
+
+/*
+  Returns the average time in ms to search an already built k-d tree or
+  randomized k-d forest for the two nearest neighbors of each feature in
+  feat1 with at most chks checks, storing their squared distances in nbrs
+*/
+static double time_search( struct kd_tree* kd_root, struct kd_forest* forest,
+			   struct feature* feat1, int n1, int chks,
+			   struct thread_pool* pool, struct bf_match* nbrs )
+{
+  struct feature** nn;
+  double* dists, start, t;
+  int r, m;
+
+  nn = calloc( 2 * n1, sizeof( struct feature* ) );
+  dists = calloc( 2 * n1, sizeof( double ) );
+  start = get_time_ms();
+  for( r = 0; r < MATCHBENCH_REPS; r++ )
+    {
+      if( forest )
+	m = kdtree_forest_knn_batch( forest, feat1, n1, 2, chks, 0, nn, dists,
+				     pool );
+      else
+	m = kdtree_bbf_knn_batch( kd_root, feat1, n1, 2, chks, 0, nn, dists,
+				  pool );
+      if( m < 0 )
+	fatal_error( "k-d tree search failed" );
+    }
+  t = ( get_time_ms() - start ) / MATCHBENCH_REPS;
+
+  store_nbrs( nn, dists, n1, nbrs );
+  free( nn );
+  free( dists );
+  return t;
+}
+
+
+
+/*
+  Stores the squared distances of k-d tree search results, found for n
+  features as n x 2 matrices of neighbors and distances, in nbrs
+*/
+static void store_nbrs( struct feature** nn, double* dists, int n,
+			struct bf_match* nbrs )
+{
+  int i, j;
+
+  for( i = 0; i < n; i++ )
+    for( j = 0; j < 2; j++ )
+      {
+	nbrs[i].nn[j] = ( nn[2*i+j] )? 0 : -1;
+	nbrs[i].dsq[j] = ( nn[2*i+j] )? (int)dists[2*i+j] : INT_MAX;
+      }
+}
+
+
+
+/*
+  Returns the time in ms to find the two nearest neighbors of each feature
+  in set1 by calling descr_dist_sq_u8() on every pair, storing them in nbrs
+*/
+static double time_pairwise( struct feature_set* set1,
+			     struct feature_set* set2, struct bf_match* nbrs )
+{
+  double start;
+  int i, j, dsq;
+
+  start = get_time_ms();
+  for( i = 0; i < set1->n; i++ )
+    {
+      nbrs[i].nn[0] = nbrs[i].nn[1] = -1;
+      nbrs[i].dsq[0] = nbrs[i].dsq[1] = INT_MAX;
+      for( j = 0; j < set2->n; j++ )
+	{
+	  dsq = descr_dist_sq_u8( feature_set_descr( set1, i ),
+				  feature_set_descr( set2, j ), set1->stride );
+	  if( dsq < nbrs[i].dsq[0] )
+	    {
+	      nbrs[i].nn[1] = nbrs[i].nn[0];
+	      nbrs[i].dsq[1] = nbrs[i].dsq[0];
+	      nbrs[i].nn[0] = j;
+	      nbrs[i].dsq[0] = dsq;
+	    }
+	  else if( dsq < nbrs[i].dsq[1] )
+	    {
+	      nbrs[i].nn[1] = j;
+	      nbrs[i].dsq[1] = dsq;
+	    }
+	}
+    }
+  return get_time_ms() - start;
+}
+
+
+
+/*
+  Returns the average time in ms to match set1 against set2 with
+  bfmatch_knn2(), storing the neighbors in nbrs
+*/
+static double time_bfmatch( struct feature_set* set1,
+			    struct feature_set* set2, struct thread_pool* pool,
+			    struct bf_match* nbrs )
+{
+  double start;
+  int r;
+
+  start = get_time_ms();
+  for( r = 0; r < MATCHBENCH_REPS; r++ )
+    if( bfmatch_knn2( set1, set2, nbrs, pool ) )
+      fatal_error( "bfmatch_knn2() failed" );
+  return ( get_time_ms() - start ) / MATCHBENCH_REPS;
+}
+
+
+
+/*
+  Prints a method's time, its number of matches passing the ratio test,
+  and the fraction of features whose nearest neighbor distance it found
+  exactly
+*/
+static void report( char* name, double t, struct bf_match* nbrs,
+		    struct bf_match* exact, int n )
+{
+  int i, m = 0, e = 0;
+
+  for( i = 0; i < n; i++ )
+    {
+      if( nbrs[i].nn[1] >= 0  &&
+	  nbrs[i].dsq[0] < nbrs[i].dsq[1] * NN_SQ_DIST_RATIO_THR )
+	m++;
+      if( nbrs[i].dsq[0] == exact[i].dsq[0]  &&
+	  nbrs[i].dsq[1] == exact[i].dsq[1] )
+	e++;
+    }
+  fprintf( stdout, "%-10s  %8.2f  %7d  %7.2f%%\n", name, t, m,
+	   100.0 * e / n );
+}
+
+
+
+/*
+  Returns the percentage of features whose nearest neighbor distance was
+  found exactly
+*/
+static double exact_nn( struct bf_match* nbrs, struct bf_match* exact, int n )
+{
+  int i, e = 0;
+
+  for( i = 0; i < n; i++ )
+    if( nbrs[i].dsq[0] == exact[i].dsq[0] )
+      e++;
+  return 100.0 * e / n;
+}
@@ -145,6 +145,19 @@ void* minpq_extract_min( struct min_pq* min_pq )
 }
 
 
+/*
+  Removes all elements from a minimizing priority queue without releasing
+  its array, so the queue can be refilled without allocating.
+
+  @param min_pq a minimizing priority queue
+*/
+void minpq_reset( struct min_pq* min_pq )
+{
+  min_pq->n = 0;
+}
+
+
+
 /*
   De-allocates the memory held by a minimizing priorioty queue
   
@@ -0,0 +1,241 @@
+/*
+  This program builds a vocabulary tree from the features of a collection
+  of images, indexes the images in it, and writes it to a file to be
+  searched with retrieve.  Images are given by a list file naming one
+  Lowe-style feature file per line; each image's id is its position in the
+  list, counting from 0 and skipping blank lines.
+
+  Copyright (C) 2006-2012  Rob Hess <rob@iqengines.com>
+
+  @version 1.1.2-20100521
+*/
+
+#include "vocab.h"
+#include "imgfeatures.h"
+#include "featset.h"
+#include "parallel.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define OPTIONS ":b:l:i:n:s:t:h"
+
+/*************************** Function Prototypes *****************************/
+
+static void usage( char* );
+static void arg_parse( int, char** );
+static int int_arg( int );
+
+/******************************** Globals ************************************/
+
+char* pname;
+char* list_file_name;
+char* vocab_file_name;
+int branch = VOCAB_BRANCH;
+int depth = VOCAB_DEPTH;
+int iters = VOCAB_ITERS;
+int max_train = VOCAB_MAX_TRAIN;
+int seed = VOCAB_SEED;
+int threads = 0;
+
+
+/********************************** Main *************************************/
+
+int main( int argc, char** argv )
+{
+  struct vocab_params params;
+  struct vocab_tree* tree;
+  struct feature_set** sets;
+  struct thread_pool* pool;
+  struct feature* feat;
+  char** names;
+  double start;
+  int nimages, i, n, total = 0;
+
+  arg_parse( argc, argv );
+
+  names = read_list( list_file_name, &nimages );
+  sets = calloc( nimages, sizeof( struct feature_set* ) );
+  fprintf( stderr, "Loading features of %d images...\n", nimages );
+  for( i = 0; i < nimages; i++ )
+    {
+      n = import_features( names[i], FEATURE_LOWE, &feat );
+      if( n < 0 )
+	fatal_error( "unable to load features from %s", names[i] );
+      sets[i] = feature_set_from_features( feat, n );
+      if( ! sets[i] )
+	fatal_error( "unable to store features from %s", names[i] );
+      total += n;
+      free( feat );
+    }
+
+  vocab_params_init( &params );
+  params.branch = branch;
+  params.depth = depth;
+  params.iters = iters;
+  params.max_train = max_train;
+  params.seed = seed;
+  pool = thread_pool_init( threads );
+
+  fprintf( stderr, "Building vocabulary tree from %d features...\n",
+	   ( max_train > 0 )? MIN( max_train, total ) : total );
+  start = get_time_ms();
+  tree = vocab_build( sets, nimages, &params, pool );
+  if( ! tree )
+    fatal_error( "unable to build vocabulary tree" );
+  fprintf( stderr, "Built %d words in %.0f ms\n", tree->nwords,
+	   get_time_ms() - start );
+
+  fprintf( stderr, "Indexing images...\n" );
+  start = get_time_ms();
+  if( vocab_add_images( tree, sets, NULL, nimages, pool ) )
+    fatal_error( "unable to index images" );
+  fprintf( stderr, "Indexed %d images in %.0f ms\n", tree->nimages,
+	   get_time_ms() - start );
+
+  if( vocab_save( tree, vocab_file_name ) )
+    fatal_error( "unable to write vocabulary tree to %s", vocab_file_name );
+
+  vocab_release( &tree );
+  thread_pool_release( &pool );
+  for( i = 0; i < nimages; i++ )
+    {
+      feature_set_release( sets + i );
+      free( names[i] );
+    }
+  free( sets );
+  free( names );
+  return 0;
+}
+
+
+/************************** Function Definitions *****************************/
+
+// print usage for this program
+static void usage( char* name )
+{
+  fprintf(stderr, "%s: build and index a vocabulary tree of images\n\n",
+	  name);
+  fprintf(stderr, "Usage: %s [options] <list_file> <vocab_file>\n", name);
+  fprintf(stderr, "  <list_file> names one image's feature file per" \
+	  " line\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "  -h               Display this message and exit\n");
+  fprintf(stderr, "  -b <branch>      Set number of children of each tree" \
+	  " node (default %d)\n", VOCAB_BRANCH);
+  fprintf(stderr, "  -l <levels>      Set number of tree levels below the" \
+	  " root (default %d)\n", VOCAB_DEPTH);
+  fprintf(stderr, "  -i <iters>       Set maximum k-means iterations per" \
+	  " node (default %d)\n", VOCAB_ITERS);
+  fprintf(stderr, "  -n <features>    Set maximum number of training" \
+	  " features; 0 uses all\n");
+  fprintf(stderr, "                   (default %d)\n", VOCAB_MAX_TRAIN);
+  fprintf(stderr, "  -s <seed>        Set seed of k-means initialization" \
+	  " (default %d)\n", VOCAB_SEED);
+  fprintf(stderr, "  -t <threads>     Set number of threads; 0 uses one per" \
+	  " CPU (default 0)\n");
+}
+
+
+
+/*
+  arg_parse() parses the command line arguments, setting appropriate globals.
+
+  argc and argv should be passed directly from the command line
+*/
+static void arg_parse( int argc, char** argv )
+{
+  //extract program name from command line (remove path, if present)
+  pname = basename( argv[0] );
+
+  //parse commandline options
+  while( 1 )
+    {
+      int arg = getopt( argc, argv, OPTIONS );
+      if( arg == -1 )
+	break;
+
+      switch( arg )
+	{
+	  // catch unsupplied required arguments and exit
+	case ':':
+	  fatal_error( "-%c option requires an argument\n"		\
+		       "Try '%s -h' for help.", optopt, pname );
+	  break;
+
+	case 'b':
+	  branch = int_arg( arg );
+	  break;
+
+	case 'l':
+	  depth = int_arg( arg );
+	  break;
+
+	case 'i':
+	  iters = int_arg( arg );
+	  break;
+
+	case 'n':
+	  max_train = int_arg( arg );
+	  break;
+
+	case 's':
+	  seed = int_arg( arg );
+	  break;
+
+	case 't':
+	  threads = int_arg( arg );
+	  break;
+
+	  // user asked for help
+	case 'h':
+	  usage( pname );
+	  exit(0);
+	  break;
+
+	  // catch invalid arguments
+	default:
+	  fatal_error( "-%c: invalid option.\nTry '%s -h' for help.",
+		       optopt, pname );
+	}
+    }
+
+  // make sure input and output files are specified
+  if( argc - optind < 2 )
+    fatal_error( "list file and vocabulary file must be specified.\n" \
+		 "Try '%s -h' for help.", pname );
+
+  // make sure there aren't too many arguments
+  if( argc - optind > 2 )
+    fatal_error( "too many arguments.\nTry '%s -h' for help.", pname );
+
+  list_file_name = argv[optind];
+  vocab_file_name = argv[optind+1];
+}
+
+
+
+/*
+  Parses the integer argument of the current option
+
+  @param arg the option
+
+  @return Returns the integer.
+*/
+static int int_arg( int arg )
+{
+  char* arg_check;
+  int i;
+
+  if( ! optarg )
+    fatal_error( "error parsing arguments at -%c\n"	\
+		 "Try '%s -h' for help.", arg, pname );
+  i = strtol( optarg, &arg_check, 10 );
+  if( arg_check == optarg  ||  *arg_check != '\0' )
+    fatal_error( "-%c option requires an integer argument\n"	\
+		 "Try '%s -h' for help.", arg, pname );
+  return i;
+}
@@ -0,0 +1,212 @@
+/*
+  Functions for running loops in parallel on a pool of threads.
+
+  Copyright (C) 2006-2012  Rob Hess <rob@iqengines.com>
+
+  @version 1.1.2-20100521
+*/
+
+#include "parallel.h"
+#include "utils.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+/************************* Local Function Prototypes *************************/
+
+static void* worker( void* );
+static void run_chunks( struct thread_pool*, int );
+
+
+/******************** Functions prototyped in parallel.h *********************/
+
+/*
+  Creates a thread pool.
+
+  @param nthreads the total number of threads that should run each loop;
+    values less than 1 select one thread per online CPU
+
+  @return Returns a new thread pool or NULL on failure
+*/
+struct thread_pool* thread_pool_init( int nthreads )
+{
+  struct thread_pool* pool;
+  int i;
+
+  if( nthreads < 1 )
+    nthreads = num_cpus();
+
+  pool = calloc( 1, sizeof( struct thread_pool ) );
+  pool->nthreads = nthreads;
+  pool->threads = calloc( MAX( nthreads - 1, 1 ), sizeof( pthread_t ) );
+  pthread_mutex_init( &pool->lock, NULL );
+  pthread_cond_init( &pool->start, NULL );
+  pthread_cond_init( &pool->done, NULL );
+
+  for( i = 0; i < nthreads - 1; i++ )
+    if( pthread_create( &pool->threads[i], NULL, worker, pool ) )
+      {
+	fprintf( stderr, "Warning: unable to start thread, %s line %d\n",
+		 __FILE__, __LINE__ );
+	pool->nthreads = i + 1;
+	thread_pool_release( &pool );
+	return NULL;
+      }
+
+  return pool;
+}
+
+
+
+/*
+  Returns the number of threads that run each loop of a thread pool.
+
+  @param pool a thread pool or NULL
+
+  @return Returns the number of threads in pool
+*/
+int thread_pool_size( struct thread_pool* pool )
+{
+  return ( pool )? pool->nthreads : 1;
+}
+
+
+
+/*
+  Runs a loop body over the indices [0, n) on the threads of a pool and
+  waits for it to finish.
+
+  @param pool a thread pool or NULL
+  @param n number of indices
+  @param grain minimum number of indices per call to fn
+  @param fn loop body
+  @param ctx argument passed to fn
+*/
+void parallel_for( struct thread_pool* pool, int n, int grain,
+		   parallel_fn fn, void* ctx )
+{
+  if( n <= 0 )
+    return;
+  grain = MAX( grain, 1 );
+  if( ! pool  ||  pool->nthreads < 2  ||  n <= grain )
+    {
+      fn( ctx, 0, n, 0 );
+      return;
+    }
+
+  /* a few chunks per thread balances load without much contention */
+  pthread_mutex_lock( &pool->lock );
+  pool->fn = fn;
+  pool->ctx = ctx;
+  pool->n = n;
+  pool->chunk = MAX( grain, n / ( pool->nthreads * 4 ) );
+  pool->next = 0;
+  pool->next_tid = 1;
+  pool->busy = pool->nthreads - 1;
+  pool->gen++;
+  pthread_cond_broadcast( &pool->start );
+  pthread_mutex_unlock( &pool->lock );
+
+  run_chunks( pool, 0 );
+
+  pthread_mutex_lock( &pool->lock );
+  while( pool->busy > 0 )
+    pthread_cond_wait( &pool->done, &pool->lock );
+  pthread_mutex_unlock( &pool->lock );
+}
+
+
+
+/*
+  Stops the threads of a thread pool and de-allocates its memory
+
+  @param pool pointer to a thread pool
+*/
+void thread_pool_release( struct thread_pool** pool )
+{
+  int i;
+
+  if( ! pool  ||  ! *pool )
+    return;
+
+  pthread_mutex_lock( &(*pool)->lock );
+  (*pool)->quit = 1;
+  pthread_cond_broadcast( &(*pool)->start );
+  pthread_mutex_unlock( &(*pool)->lock );
+  for( i = 0; i < (*pool)->nthreads - 1; i++ )
+    pthread_join( (*pool)->threads[i], NULL );
+
+  pthread_mutex_destroy( &(*pool)->lock );
+  pthread_cond_destroy( &(*pool)->start );
+  pthread_cond_destroy( &(*pool)->done );
+  free( (*pool)->threads );
+  free( *pool );
+  *pool = NULL;
+}
+
+
+
+/*
+  Returns the number of online CPUs
+*/
+int num_cpus( void )
+{
+  long n = sysconf( _SC_NPROCESSORS_ONLN );
+
+  return ( n > 0 )? (int)n : 1;
+}
+
+
+/************************ Functions prototyped here **************************/
+
+/*
+  Main loop of a worker thread.  Waits for a loop to be started, helps run
+  it, and reports back when it runs out of indices.
+
+  @param arg the thread pool to which the worker belongs
+*/
+static void* worker( void* arg )
+{
+  struct thread_pool* pool = arg;
+  unsigned long seen = 0;
+  int tid;
+
+  pthread_mutex_lock( &pool->lock );
+  while( 1 )
+    {
+      while( pool->gen == seen  &&  ! pool->quit )
+	pthread_cond_wait( &pool->start, &pool->lock );
+      if( pool->quit )
+	break;
+      seen = pool->gen;
+      tid = pool->next_tid++;
+      pthread_mutex_unlock( &pool->lock );
+
+      run_chunks( pool, tid );
+
+      pthread_mutex_lock( &pool->lock );
+      if( --pool->busy == 0 )
+	pthread_cond_signal( &pool->done );
+    }
+  pthread_mutex_unlock( &pool->lock );
+
+  return NULL;
+}
+
+
+
+/*
+  Claims chunks of the current loop and runs the loop body on them until
+  no indices remain.
+
+  @param pool a thread pool
+  @param tid index of the calling thread
+*/
+static void run_chunks( struct thread_pool* pool, int tid )
+{
+  int begin;
+
+  while( ( begin = __sync_fetch_and_add( &pool->next, pool->chunk ) ) <
+	 pool->n )
+    pool->fn( pool->ctx, begin, MIN( begin + pool->chunk, pool->n ), tid );
+}
@@ -0,0 +1,240 @@
+/*
+  Measures product quantization of SIFT descriptors.  Trains a product
+  quantizer on the features of one or more base files, encodes them, and
+  searches the codes for the neighbors of each feature of a query file,
+  reporting for a range of inverted lists visited per query the search
+  time and recall@R: the fraction of queries whose exact nearest neighbor,
+  found by brute force, is among the first R returned.
+
+  Copyright (C) 2006-2012  Rob Hess <rob@iqengines.com>
+
+  @version 1.1.2-20100521
+*/
+
+#include "imgfeatures.h"
+#include "featset.h"
+#include "bfmatch.h"
+#include "pqcodec.h"
+#include "parallel.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define OPTIONS ":m:c:t:h"
+
+/* number of neighbors returned by each search */
+#define PQBENCH_K 100
+
+/* number of times each search is timed */
+#define PQBENCH_REPS 3
+
+/* numbers of inverted lists visited per query */
+static int nprobe_list[] = { 1, 2, 4, 8, 16, 32, 64, 128, 256 };
+
+/* ranks at which recall is reported */
+static int recall_list[] = { 1, 10, 100 };
+
+
+/*************************** Function Prototypes *****************************/
+
+static void usage( char* );
+static struct feature_set* load_set( char* );
+static double recall( struct pq_hit*, struct bf_match*, int, int );
+
+
+/********************************** Main *************************************/
+
+int main( int argc, char** argv )
+{
+  struct pq_params params;
+  struct pq_index* index;
+  struct feature_set* query, ** bases, * base;
+  struct bf_match* exact;
+  struct pq_hit* hits;
+  struct thread_pool* pool;
+  char* pname, * arg_check;
+  double start, t;
+  int threads = 0, nbases, n = 0, arg, i, j, r;
+
+  pname = basename( argv[0] );
+  pq_params_init( &params );
+  while( ( arg = getopt( argc, argv, OPTIONS ) ) != -1 )
+    switch( arg )
+      {
+      case 'm':
+      case 'c':
+      case 't':
+	i = strtol( optarg, &arg_check, 10 );
+	if( arg_check == optarg  ||  *arg_check != '\0' )
+	  fatal_error( "-%c option requires an integer argument\n"	\
+		       "Try '%s -h' for help.", arg, pname );
+	if( arg == 'm' )
+	  params.m = i;
+	else if( arg == 'c' )
+	  params.nlist = i;
+	else
+	  threads = i;
+	break;
+
+      case 'h':
+	usage( pname );
+	exit(0);
+	break;
+
+      case ':':
+	fatal_error( "-%c option requires an argument\n"	\
+		     "Try '%s -h' for help.", optopt, pname );
+	break;
+
+      default:
+	fatal_error( "-%c: invalid option.\nTry '%s -h' for help.",
+		     optopt, pname );
+      }
+  if( argc - optind < 2 )
+    fatal_error( "query and base feature files must be specified.\n" \
+		 "Try '%s -h' for help.", pname );
+
+  /* all base features, numbered consecutively across files */
+  query = load_set( argv[optind] );
+  nbases = argc - optind - 1;
+  bases = calloc( nbases, sizeof( struct feature_set* ) );
+  for( i = 0; i < nbases; i++ )
+    {
+      bases[i] = load_set( argv[optind+1+i] );
+      if( bases[i]->d != query->d )
+	fatal_error( "features in %s and %s are incompatible", argv[optind],
+		     argv[optind+1+i] );
+      n += bases[i]->n;
+    }
+  base = feature_set_init( n, query->d );
+  if( ! base )
+    fatal_error( "unable to allocate memory for %d features", n );
+  for( i = 0, n = 0; i < nbases; i++ )
+    for( j = 0; j < bases[i]->n; j++, n++ )
+      memcpy( feature_set_descr( base, n ), feature_set_descr( bases[i], j ),
+	      base->stride );
+
+  pool = thread_pool_init( threads );
+  exact = calloc( query->n, sizeof( struct bf_match ) );
+  hits = calloc( (size_t)query->n * PQBENCH_K, sizeof( struct pq_hit ) );
+  if( ! exact  ||  ! hits )
+    fatal_error( "unable to allocate memory for %d queries", query->n );
+  fprintf( stdout, "%d queries, %d base features of length %d, %d threads\n",
+	   query->n, base->n, base->d, thread_pool_size( pool ) );
+
+  start = get_time_ms();
+  if( bfmatch_knn2( query, base, exact, pool ) )
+    fatal_error( "bfmatch_knn2() failed" );
+  fprintf( stdout, "exact search %.2f ms\n", get_time_ms() - start );
+
+  start = get_time_ms();
+  index = pq_train( bases, nbases, &params, pool );
+  if( ! index )
+    fatal_error( "unable to train product quantizer" );
+  fprintf( stdout, "trained %d x %d centroids and %d lists in %.2f ms\n",
+	   index->m, PQ_CENTROIDS, index->nlist, get_time_ms() - start );
+  start = get_time_ms();
+  for( i = 0; i < nbases; i++ )
+    if( pq_add( index, bases[i], NULL, pool ) )
+      fatal_error( "unable to encode features of %s", argv[optind+1+i] );
+  fprintf( stdout, "encoded in %.2f ms; %d bytes per feature, %d in a" \
+	   " feature set, %d in a struct feature\n", get_time_ms() - start,
+	   index->m + (int)sizeof( int ), base->stride,
+	   (int)sizeof( struct feature ) );
+
+  fprintf( stdout, "\nnprobe        ms" );
+  for( r = 0; r < sizeof( recall_list ) / sizeof( int ); r++ )
+    fprintf( stdout, "  recall@%-3d", recall_list[r] );
+  fprintf( stdout, "\n" );
+  for( i = 0; i < sizeof( nprobe_list ) / sizeof( int ); i++ )
+    {
+      if( nprobe_list[i] > index->nlist )
+	break;
+      start = get_time_ms();
+      for( j = 0; j < PQBENCH_REPS; j++ )
+	if( pq_knn_batch( index, query, PQBENCH_K, nprobe_list[i], hits,
+			  pool ) )
+	  fatal_error( "product quantizer search failed" );
+      t = ( get_time_ms() - start ) / PQBENCH_REPS;
+      fprintf( stdout, "%6d  %8.2f", nprobe_list[i], t );
+      for( r = 0; r < sizeof( recall_list ) / sizeof( int ); r++ )
+	fprintf( stdout, "  %9.2f%%",
+		 recall( hits, exact, query->n, recall_list[r] ) );
+      fprintf( stdout, "\n" );
+    }
+
+  pq_release( &index );
+  thread_pool_release( &pool );
+  for( i = 0; i < nbases; i++ )
+    feature_set_release( bases + i );
+  feature_set_release( &base );
+  feature_set_release( &query );
+  free( bases );
+  free( exact );
+  free( hits );
+  return 0;
+}
+
+
+/************************** Function Definitions *****************************/
+
+// print usage for this program
+static void usage( char* name )
+{
+  fprintf(stderr, "%s: measure product quantization search\n\n", name);
+  fprintf(stderr, "Usage: %s [options] <query_feature_file>" \
+	  " <base_feature_file> ...\n", name);
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "  -h               Display this message and exit\n");
+  fprintf(stderr, "  -m <bytes>       Set number of subquantizers, i.e. code" \
+	  " bytes (default %d)\n", PQ_SUBQUANTIZERS);
+  fprintf(stderr, "  -c <lists>       Set number of coarse centroids" \
+	  " (default %d)\n", PQ_NLIST);
+  fprintf(stderr, "  -t <threads>     Set number of threads; 0 uses one per" \
+	  " CPU (default 0)\n");
+}
+
+
+
+/*
+  Returns the features of a Lowe-style feature file as a feature set
+*/
+static struct feature_set* load_set( char* filename )
+{
+  struct feature_set* set;
+  struct feature* feat;
+  int n;
+
+  n = import_features( filename, FEATURE_LOWE, &feat );
+  if( n < 1 )
+    fatal_error( "unable to load features from %s", filename );
+  set = feature_set_from_features( feat, n );
+  if( ! set )
+    fatal_error( "unable to store features from %s", filename );
+  free( feat );
+  return set;
+}
+
+
+
+/*
+  Returns the percentage of n queries whose exact nearest neighbor is among
+  the first r of the k = PQBENCH_K hits found for it
+*/
+static double recall( struct pq_hit* hits, struct bf_match* exact, int n,
+		      int r )
+{
+  int i, j, found = 0;
+
+  for( i = 0; i < n; i++ )
+    for( j = 0; j < r  &&  j < PQBENCH_K; j++ )
+      if( hits[(size_t)i*PQBENCH_K+j].id == exact[i].nn[0] )
+	{
+	  found++;
+	  break;
+	}
+  return 100.0 * found / n;
+}
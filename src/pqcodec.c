@@ -0,0 +1,1056 @@
+/*
+  Functions and structures for storing large numbers of SIFT descriptors
+  as compact product quantization codes and searching them.
+
+  For more information, refer to:
+
+  Jegou, H., Douze, M., and Schmid, C.  Product quantization for nearest
+  neighbor search.  <EM>IEEE Transactions on Pattern Analysis and Machine
+  Intelligence</EM>, 33, 1 (2011), pp. 117--128.
+
+  Copyright (C) 2006-2012  Rob Hess <rob@iqengines.com>
+
+  @version 1.1.2-20100521
+*/
+
+#include "pqcodec.h"
+#include "featset.h"
+#include "descrdist.h"
+#include "parallel.h"
+#include "utils.h"
+
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* minimum number of training descriptors assigned by one task */
+#define PQ_ASSIGN_GRAIN 1024
+
+/* minimum number of descriptors encoded by one task */
+#define PQ_ENCODE_GRAIN 256
+
+/* minimum number of queries searched by one task */
+#define PQ_SEARCH_GRAIN 16
+
+/* training vectors being assigned to centers in parallel; see
+   assign_range() */
+struct kmeans_job
+{
+  const float* x;              /* n x d matrix of training vectors */
+  int d;
+  const float* centers;        /* k x d matrix of centers */
+  int k;
+  int* assign;                 /* nearest center of each vector */
+  float* dmin;                 /* squared distance to the nearest center */
+  int* changed;                /* set per thread when an assignment changes */
+};
+
+/* descriptors being encoded in parallel; see encode_range() */
+struct encode_job
+{
+  struct pq_index* index;
+  struct feature_set* set;
+  int* lists;                  /* inverted list of each descriptor */
+  unsigned char* codes;        /* code of each descriptor */
+  int* err;                    /* set per thread when encoding fails */
+};
+
+/* queries being searched in parallel; see search_range() */
+struct search_job
+{
+  struct pq_index* index;
+  struct feature_set* set;
+  int k;
+  int nprobe;
+  struct pq_hit* hits;
+  float** scratch;             /* distance tables of each thread */
+};
+
+/************************* Local Function Prototypes *************************/
+
+static float* gather_train( struct feature_set**, int, int, int* );
+static int kmeans( const float*, int, int, int, int, unsigned int*, float*,
+		   int*, struct thread_pool* );
+static int assign_points( struct kmeans_job*, int, struct thread_pool* );
+static void assign_range( void*, int, int, int );
+static int nearest( const float*, const float*, int, int );
+static void encode_one( struct pq_index*, const unsigned char*, float*,
+			int*, unsigned char* );
+static void encode_range( void*, int, int, int );
+static void compute_terms( struct pq_index* );
+static float* alloc_scratch( struct pq_index* );
+static int search_one( struct pq_index*, const unsigned char*, int, int,
+		       struct pq_hit*, float* );
+static void scan_list( struct pq_index*, int, const float*, float, int,
+		       struct pq_hit*, int* );
+static int hit_worse( struct pq_hit*, struct pq_hit* );
+static void sift_down( struct pq_hit*, int, int );
+static void search_range( void*, int, int, int );
+
+
+/********************* Functions prototyped in pqcodec.h *********************/
+
+/*
+  Sets product quantizer parameters to their defaults.
+
+  @param params parameters to initialize
+*/
+void pq_params_init( struct pq_params* params )
+{
+  params->m = PQ_SUBQUANTIZERS;
+  params->nlist = PQ_NLIST;
+  params->iters = PQ_ITERS;
+  params->max_train = PQ_MAX_TRAIN;
+  params->seed = PQ_SEED;
+}
+
+
+
+/*
+  Trains a product quantizer.  The training descriptors are clustered into
+  coarse centroids and replaced by their residuals, whose subvectors are
+  then gathered one subspace at a time and clustered into that subspace's
+  centroids.  Last, the query-independent terms of search distances are
+  precomputed.
+
+  @param sets feature sets whose descriptors are used for training
+  @param nsets number of sets
+  @param params quantizer parameters, or NULL for the defaults
+  @param pool threads, or NULL
+
+  @return Returns a new index or NULL on error.
+*/
+struct pq_index* pq_train( struct feature_set** sets, int nsets,
+			   struct pq_params* params,
+			   struct thread_pool* pool )
+{
+  struct pq_params defaults;
+  struct pq_index* index;
+  float* train = NULL, * sub = NULL;
+  int* assign = NULL;
+  int d, m, dsub, ntrain, i, j;
+  unsigned int rng;
+
+  if( ! params )
+    {
+      pq_params_init( &defaults );
+      params = &defaults;
+    }
+  if( ! sets  ||  nsets < 1 )
+    {
+      fprintf( stderr, "Warning: pq_train(): no features, %s, line %d\n",
+	       __FILE__, __LINE__ );
+      return NULL;
+    }
+  d = sets[0]->d;
+  for( i = 1; i < nsets; i++ )
+    if( sets[i]->d != d )
+      {
+	fprintf( stderr, "Warning: pq_train(): features have differing" \
+		 " descriptor lengths, %s, line %d\n", __FILE__, __LINE__ );
+	return NULL;
+      }
+  m = params->m;
+  if( m < 1  ||  m > d  ||  d % m  ||  params->nlist < 1 )
+    {
+      fprintf( stderr, "Warning: pq_train(): %d subquantizers and %d lists" \
+	       " do not fit descriptors of length %d, %s, line %d\n", m,
+	       params->nlist, d, __FILE__, __LINE__ );
+      return NULL;
+    }
+  dsub = d / m;
+
+  index = calloc( 1, sizeof( struct pq_index ) );
+  if( ! index )
+    goto fail;
+  index->d = d;
+  index->m = m;
+  index->dsub = dsub;
+  index->nlist = params->nlist;
+  index->coarse = malloc( (size_t)index->nlist * d * sizeof( float ) );
+  index->codebooks = malloc( (size_t)m * PQ_CENTROIDS * dsub *
+			     sizeof( float ) );
+  index->terms = malloc( (size_t)index->nlist * m * PQ_CENTROIDS *
+			 sizeof( float ) );
+  index->codes = calloc( index->nlist, sizeof( unsigned char* ) );
+  index->ids = calloc( index->nlist, sizeof( int* ) );
+  index->nlisted = calloc( index->nlist, sizeof( int ) );
+  index->nallocd = calloc( index->nlist, sizeof( int ) );
+  if( ! index->coarse  ||  ! index->codebooks  ||  ! index->terms  ||
+      ! index->codes  ||
+      ! index->ids  ||  ! index->nlisted  ||  ! index->nallocd )
+    goto fail;
+
+  train = gather_train( sets, nsets, params->max_train, &ntrain );
+  if( ! train )
+    {
+      pq_release( &index );
+      return NULL;
+    }
+  assign = malloc( ntrain * sizeof( int ) );
+  sub = malloc( (size_t)ntrain * dsub * sizeof( float ) );
+  if( ! assign  ||  ! sub )
+    goto fail;
+  rng = ( params->seed )? params->seed : 1;
+
+  /* coarse centroids, then residuals */
+  if( kmeans( train, ntrain, d, index->nlist, params->iters, &rng,
+	      index->coarse, assign, pool ) )
+    goto fail;
+  for( i = 0; i < ntrain; i++ )
+    for( j = 0; j < d; j++ )
+      train[(size_t)i*d+j] -= index->coarse[(size_t)assign[i]*d+j];
+
+  /* one subspace at a time */
+  for( j = 0; j < m; j++ )
+    {
+      for( i = 0; i < ntrain; i++ )
+	memcpy( sub + (size_t)i * dsub, train + (size_t)i * d + j * dsub,
+		dsub * sizeof( float ) );
+      if( kmeans( sub, ntrain, dsub, PQ_CENTROIDS, params->iters, &rng,
+		  index->codebooks + (size_t)j * PQ_CENTROIDS * dsub, assign,
+		  pool ) )
+	goto fail;
+    }
+  compute_terms( index );
+
+  free( train );
+  free( sub );
+  free( assign );
+  return index;
+
+ fail:
+  fprintf( stderr, "Warning: unable to allocate memory, %s line %d\n",
+	   __FILE__, __LINE__ );
+  free( train );
+  free( sub );
+  free( assign );
+  pq_release( &index );
+  return NULL;
+}
+
+
+
+/*
+  Encodes a descriptor.
+
+  @param index a trained product quantizer
+  @param descr a descriptor
+  @param code array in which to store the code
+
+  @return Returns the descriptor's inverted list, or -1 if no memory is
+    available.
+*/
+int pq_encode( struct pq_index* index, const unsigned char* descr,
+	       unsigned char* code )
+{
+  float* resid;
+  int list;
+
+  resid = malloc( index->d * sizeof( float ) );
+  if( ! resid )
+    {
+      fprintf( stderr, "Warning: unable to allocate memory, %s line %d\n",
+	       __FILE__, __LINE__ );
+      return -1;
+    }
+  encode_one( index, descr, resid, &list, code );
+  free( resid );
+  return list;
+}
+
+
+
+/*
+  Reconstructs the approximation of a descriptor represented by a code as
+  the sum of its coarse centroid and its subspaces' centroids.
+
+  @param index a trained product quantizer
+  @param list the descriptor's inverted list
+  @param code the descriptor's code
+  @param descr array in which to store the reconstruction
+*/
+void pq_decode( struct pq_index* index, int list, const unsigned char* code,
+		float* descr )
+{
+  const float* c = index->coarse + (size_t)list * index->d, * cb;
+  int dsub = index->dsub, i, j;
+
+  for( j = 0; j < index->m; j++ )
+    {
+      cb = index->codebooks + ( (size_t)j * PQ_CENTROIDS + code[j] ) * dsub;
+      for( i = 0; i < dsub; i++ )
+	descr[j*dsub+i] = c[j*dsub+i] + cb[i];
+    }
+}
+
+
+
+/*
+  Encodes a feature set's descriptors in parallel, then grows each
+  inverted list once and appends the codes to it in order of feature.
+
+  @param index a trained product quantizer
+  @param set features whose descriptors are added
+  @param ids id of each feature, or NULL
+  @param pool threads, or NULL
+
+  @return Returns 0 on success or -1 on error.
+*/
+int pq_add( struct pq_index* index, struct feature_set* set, int* ids,
+	    struct thread_pool* pool )
+{
+  struct encode_job job;
+  int* need = NULL;
+  void* p;
+  int nthreads = thread_pool_size( pool ), m, l, i, s, ret = 0;
+
+  if( ! index  ||  ! set )
+    {
+      fprintf( stderr, "Warning: NULL pointer error, %s, line %d\n",
+	       __FILE__, __LINE__ );
+      return -1;
+    }
+  if( set->d != index->d )
+    {
+      fprintf( stderr, "Warning: pq_add(): features have descriptor length" \
+	       " %d, not %d, %s, line %d\n", set->d, index->d, __FILE__,
+	       __LINE__ );
+      return -1;
+    }
+  if( set->n > INT_MAX - index->n )
+    {
+      fprintf( stderr, "Warning: pq_add(): too many descriptors, %s, line" \
+	       " %d\n", __FILE__, __LINE__ );
+      return -1;
+    }
+  if( set->n < 1 )
+    return 0;
+
+  m = index->m;
+  job.index = index;
+  job.set = set;
+  job.lists = malloc( set->n * sizeof( int ) );
+  job.codes = malloc( (size_t)set->n * m );
+  job.err = calloc( nthreads, sizeof( int ) );
+  need = calloc( index->nlist, sizeof( int ) );
+  if( ! job.lists  ||  ! job.codes  ||  ! job.err  ||  ! need )
+    goto fail;
+  parallel_for( pool, set->n, PQ_ENCODE_GRAIN, encode_range, &job );
+  for( i = 0; i < nthreads; i++ )
+    if( job.err[i] )
+      goto fail;
+
+  /* make room for the batch, then append it */
+  for( i = 0; i < set->n; i++ )
+    need[job.lists[i]]++;
+  for( l = 0; l < index->nlist; l++ )
+    if( index->nlisted[l] + need[l] > index->nallocd[l] )
+      {
+	s = MAX( index->nlisted[l] + need[l], 2 * index->nallocd[l] );
+	p = realloc( index->codes[l], (size_t)s * m );
+	if( ! p )
+	  goto fail;
+	index->codes[l] = p;
+	p = realloc( index->ids[l], s * sizeof( int ) );
+	if( ! p )
+	  goto fail;
+	index->ids[l] = p;
+	index->nallocd[l] = s;
+      }
+  for( i = 0; i < set->n; i++ )
+    {
+      l = job.lists[i];
+      memcpy( index->codes[l] + (size_t)index->nlisted[l] * m,
+	      job.codes + (size_t)i * m, m );
+      index->ids[l][index->nlisted[l]] = ( ids )? ids[i] : index->n + i;
+      index->nlisted[l]++;
+    }
+  index->n += set->n;
+  goto end;
+
+ fail:
+  fprintf( stderr, "Warning: unable to allocate memory, %s line %d\n",
+	   __FILE__, __LINE__ );
+  ret = -1;
+ end:
+  free( job.lists );
+  free( job.codes );
+  free( job.err );
+  free( need );
+  return ret;
+}
+
+
+
+/*
+  Finds the approximate k nearest neighbors of a descriptor.
+
+  @param index a product quantizer
+  @param descr the query descriptor
+  @param k number of neighbors to find
+  @param nprobe number of inverted lists to visit
+  @param hits array in which to store the neighbors
+
+  @return Returns the number of neighbors found or -1 on error.
+*/
+int pq_search_knn( struct pq_index* index, const unsigned char* descr,
+		   int k, int nprobe, struct pq_hit* hits )
+{
+  float* scratch;
+  int found;
+
+  if( ! index  ||  ! descr  ||  ! hits  ||  k < 1 )
+    {
+      fprintf( stderr, "Warning: invalid search arguments, %s, line %d\n",
+	       __FILE__, __LINE__ );
+      return -1;
+    }
+  scratch = alloc_scratch( index );
+  if( ! scratch )
+    return -1;
+  found = search_one( index, descr, k, nprobe, hits, scratch );
+  free( scratch );
+  return found;
+}
+
+
+
+/*
+  Searches for the neighbors of every feature of a set, one range of
+  features per task, with distance tables allocated once per thread.
+
+  @param index a product quantizer
+  @param set query features
+  @param k number of neighbors to find for each feature
+  @param nprobe number of inverted lists to visit for each feature
+  @param hits array in which to store the neighbors
+  @param pool threads, or NULL
+
+  @return Returns 0 on success or -1 on error.
+*/
+int pq_knn_batch( struct pq_index* index, struct feature_set* set, int k,
+		  int nprobe, struct pq_hit* hits, struct thread_pool* pool )
+{
+  struct search_job job;
+  int nthreads = thread_pool_size( pool ), i, ret = 0;
+
+  if( ! index  ||  ! set  ||  ! hits  ||  k < 1 )
+    {
+      fprintf( stderr, "Warning: invalid search arguments, %s, line %d\n",
+	       __FILE__, __LINE__ );
+      return -1;
+    }
+  if( set->d != index->d )
+    {
+      fprintf( stderr, "Warning: pq_knn_batch(): features have descriptor" \
+	       " length %d, not %d, %s, line %d\n", set->d, index->d,
+	       __FILE__, __LINE__ );
+      return -1;
+    }
+
+  job.index = index;
+  job.set = set;
+  job.k = k;
+  job.nprobe = nprobe;
+  job.hits = hits;
+  job.scratch = calloc( nthreads, sizeof( float* ) );
+  if( ! job.scratch )
+    ret = -1;
+  for( i = 0; i < nthreads  &&  ret == 0; i++ )
+    if( ! ( job.scratch[i] = alloc_scratch( index ) ) )
+      ret = -1;
+  if( ret == 0 )
+    parallel_for( pool, set->n, PQ_SEARCH_GRAIN, search_range, &job );
+
+  for( i = 0; job.scratch  &&  i < nthreads; i++ )
+    free( job.scratch[i] );
+  free( job.scratch );
+  return ret;
+}
+
+
+
+/*
+  De-allocates a product quantizer and its codes
+
+  @param index pointer to an index; set to NULL
+*/
+void pq_release( struct pq_index** index )
+{
+  struct pq_index* pq;
+  int l;
+
+  if( ! index  ||  ! *index )
+    return;
+  pq = *index;
+  for( l = 0; l < pq->nlist; l++ )
+    {
+      if( pq->codes )
+	free( pq->codes[l] );
+      if( pq->ids )
+	free( pq->ids[l] );
+    }
+  free( pq->coarse );
+  free( pq->codebooks );
+  free( pq->terms );
+  free( pq->codes );
+  free( pq->ids );
+  free( pq->nlisted );
+  free( pq->nallocd );
+  free( pq );
+  *index = NULL;
+}
+
+
+/************************ Functions prototyped here **************************/
+
+/*
+  Gathers training descriptors from a number of feature sets into a matrix
+  of floats.  If max_train is positive and there are more descriptors than
+  that, they are taken at evenly spaced indices across all the sets.
+
+  @param sets feature sets
+  @param nsets number of sets
+  @param max_train maximum number of descriptors, or 0 for no limit
+  @param ntrain output as the number of rows
+
+  @return Returns the matrix, with one row of sets[0]->d floats per
+    descriptor, or NULL on error.
+*/
+static float* gather_train( struct feature_set** sets, int nsets,
+			    int max_train, int* ntrain )
+{
+  unsigned char* descr;
+  float* train;
+  size_t i, nd;
+
+  descr = feature_sets_sample( sets, nsets, max_train, sets[0]->d, ntrain );
+  if( ! descr )
+    return NULL;
+  nd = (size_t)*ntrain * sets[0]->d;
+  train = malloc( nd * sizeof( float ) );
+  if( ! train )
+    {
+      fprintf( stderr, "Warning: unable to allocate memory, %s line %d\n",
+	       __FILE__, __LINE__ );
+      free( descr );
+      return NULL;
+    }
+  for( i = 0; i < nd; i++ )
+    train[i] = descr[i];
+  free( descr );
+  return train;
+}
+
+
+
+/*
+  Clusters vectors with k-means.  Centers start at k distinct vectors
+  chosen at random; with no more vectors than centers, the vectors are
+  repeated as centers instead.  Lloyd's iterations run until no assignment
+  changes or the iteration limit is reached.  A center left without
+  vectors is moved to the vector farthest from its own center.
+
+  @param x n x d matrix of vectors
+  @param n number of vectors
+  @param d vector length
+  @param k number of centers
+  @param iters maximum number of iterations
+  @param rng random state, which must not be zero
+  @param centers k x d matrix in which to store the centers
+  @param assign array in which to store the nearest center of each vector
+  @param pool threads among which to divide assignment, or NULL
+
+  @return Returns 0 on success or -1 if no memory is available.
+*/
+static int kmeans( const float* x, int n, int d, int k, int iters,
+		   unsigned int* rng, float* centers, int* assign,
+		   struct thread_pool* pool )
+{
+  struct kmeans_job job;
+  double* sums = NULL;
+  int* counts = NULL, * perm = NULL;
+  int it, changed, far, i, j, t, ret = -1;
+
+  job.x = x;
+  job.d = d;
+  job.centers = centers;
+  job.k = k;
+  job.assign = assign;
+  job.dmin = malloc( n * sizeof( float ) );
+  job.changed = calloc( thread_pool_size( pool ), sizeof( int ) );
+  if( ! job.dmin  ||  ! job.changed )
+    goto end;
+
+  if( n <= k )
+    {
+      for( i = 0; i < k; i++ )
+	memcpy( centers + (size_t)i * d, x + (size_t)( i % n ) * d,
+		d * sizeof( float ) );
+      for( i = 0; i < n; i++ )
+	assign[i] = -1;
+      assign_points( &job, n, pool );
+      ret = 0;
+      goto end;
+    }
+
+  /* the first k entries of a partial shuffle */
+  perm = malloc( n * sizeof( int ) );
+  sums = malloc( (size_t)k * d * sizeof( double ) );
+  counts = malloc( k * sizeof( int ) );
+  if( ! perm  ||  ! sums  ||  ! counts )
+    goto end;
+  for( i = 0; i < n; i++ )
+    perm[i] = i;
+  for( i = 0; i < k; i++ )
+    {
+      j = i + rand_next( rng ) % ( n - i );
+      t = perm[i];
+      perm[i] = perm[j];
+      perm[j] = t;
+      memcpy( centers + (size_t)i * d, x + (size_t)perm[i] * d,
+	      d * sizeof( float ) );
+    }
+  for( i = 0; i < n; i++ )
+    assign[i] = -1;
+
+  for( it = 0; ; it++ )
+    {
+      changed = assign_points( &job, n, pool );
+      if( changed == 0  ||  it >= iters )
+	break;
+      memset( sums, 0, (size_t)k * d * sizeof( double ) );
+      memset( counts, 0, k * sizeof( int ) );
+      for( i = 0; i < n; i++ )
+	{
+	  counts[assign[i]]++;
+	  for( j = 0; j < d; j++ )
+	    sums[(size_t)assign[i]*d+j] += x[(size_t)i*d+j];
+	}
+      for( i = 0; i < k; i++ )
+	{
+	  if( counts[i] )
+	    {
+	      for( j = 0; j < d; j++ )
+		centers[(size_t)i*d+j] = sums[(size_t)i*d+j] / counts[i];
+	      continue;
+	    }
+	  for( j = 0, far = 0; j < n; j++ )
+	    if( job.dmin[j] > job.dmin[far] )
+	      far = j;
+	  memcpy( centers + (size_t)i * d, x + (size_t)far * d,
+		  d * sizeof( float ) );
+	  job.dmin[far] = 0;
+	}
+    }
+  ret = 0;
+
+ end:
+  if( ret )
+    fprintf( stderr, "Warning: unable to allocate memory, %s line %d\n",
+	     __FILE__, __LINE__ );
+  free( job.dmin );
+  free( job.changed );
+  free( perm );
+  free( sums );
+  free( counts );
+  return ret;
+}
+
+
+
+/*
+  Assigns each training vector to its nearest center, dividing the vectors
+  among the threads of a pool
+
+  @param job the vectors and centers
+  @param n number of vectors
+  @param pool threads, or NULL
+
+  @return Returns the number of vectors whose assignment changed.
+*/
+static int assign_points( struct kmeans_job* job, int n,
+			  struct thread_pool* pool )
+{
+  int nthreads = thread_pool_size( pool ), i, changed = 0;
+
+  memset( job->changed, 0, nthreads * sizeof( int ) );
+  parallel_for( pool, n, PQ_ASSIGN_GRAIN, assign_range, job );
+  for( i = 0; i < nthreads; i++ )
+    changed += job->changed[i];
+  return changed;
+}
+
+
+
+/*
+  Assigns a range of training vectors to their nearest centers, the first
+  of several equally near; run by parallel_for()
+
+  @param data a struct kmeans_job
+  @param begin index of the first vector
+  @param end one past the index of the last vector
+  @param tid thread index, which selects the change counter
+*/
+static void assign_range( void* data, int begin, int end, int tid )
+{
+  struct kmeans_job* job = data;
+  const float* v;
+  int d = job->d, i, best;
+
+  for( i = begin; i < end; i++ )
+    {
+      v = job->x + (size_t)i * d;
+      best = nearest( v, job->centers, job->k, d );
+      job->dmin[i] = descr_dist_sq_f32( v, job->centers + (size_t)best * d,
+					d );
+      if( job->assign[i] != best )
+	{
+	  job->assign[i] = best;
+	  job->changed[tid]++;
+	}
+    }
+}
+
+
+
+/*
+  Finds the nearest of a number of centers to a vector
+
+  @param v a vector
+  @param centers k x d matrix of centers
+  @param k number of centers
+  @param d vector length
+
+  @return Returns the index of the nearest center, or of the first of
+    several equally near.
+*/
+static int nearest( const float* v, const float* centers, int k, int d )
+{
+  float dsq, best_dsq = FLT_MAX;
+  int best = 0, i;
+
+  for( i = 0; i < k; i++ )
+    {
+      dsq = descr_dist_sq_f32( v, centers + (size_t)i * d, d );
+      if( dsq < best_dsq )
+	{
+	  best = i;
+	  best_dsq = dsq;
+	}
+    }
+  return best;
+}
+
+
+
+/*
+  Encodes a descriptor using caller-provided space for its residual
+
+  @param index a trained product quantizer
+  @param descr a descriptor
+  @param resid array of index->d floats in which to compute the residual
+  @param list output as the descriptor's inverted list
+  @param code array in which to store the code
+*/
+static void encode_one( struct pq_index* index, const unsigned char* descr,
+			float* resid, int* list, unsigned char* code )
+{
+  const float* c;
+  int d = index->d, dsub = index->dsub, i, j;
+
+  for( i = 0; i < d; i++ )
+    resid[i] = descr[i];
+  *list = nearest( resid, index->coarse, index->nlist, d );
+  c = index->coarse + (size_t)*list * d;
+  for( i = 0; i < d; i++ )
+    resid[i] -= c[i];
+  for( j = 0; j < index->m; j++ )
+    code[j] = (unsigned char)
+      nearest( resid + j * dsub,
+	       index->codebooks + (size_t)j * PQ_CENTROIDS * dsub,
+	       PQ_CENTROIDS, dsub );
+}
+
+
+
+/*
+  Encodes a range of a feature set's descriptors; run by parallel_for()
+
+  @param data a struct encode_job
+  @param begin index of the first feature
+  @param end one past the index of the last feature
+  @param tid thread index
+*/
+static void encode_range( void* data, int begin, int end, int tid )
+{
+  struct encode_job* job = data;
+  float* resid;
+  int i;
+
+  resid = malloc( job->index->d * sizeof( float ) );
+  if( ! resid )
+    {
+      job->err[tid] = 1;
+      return;
+    }
+  for( i = begin; i < end; i++ )
+    encode_one( job->index, feature_set_descr( job->set, i ), resid,
+		job->lists + i, job->codes + (size_t)i * job->index->m );
+  free( resid );
+}
+
+
+
+/*
+  Computes the terms of asymmetric distances that do not depend on the
+  query.  With q a query subvector, c the matching subvector of a coarse
+  centroid, and y a subspace centroid, the squared distance between the
+  query's residual and y is
+
+    |q - c - y|^2 = |q - c|^2 + ( |y|^2 + 2 c.y ) - 2 q.y
+
+  Summed over subspaces, the first term is the query's squared distance to
+  the coarse centroid, which search has already found; the second, stored
+  here for each list, subspace, and centroid, is fixed; and the last is
+  the same for every list.
+
+  @param index a product quantizer with trained centroids
+*/
+static void compute_terms( struct pq_index* index )
+{
+  const float* c, * y;
+  float* t;
+  int dsub = index->dsub, l, j, i, e;
+
+  for( l = 0; l < index->nlist; l++ )
+    for( j = 0; j < index->m; j++ )
+      {
+	c = index->coarse + (size_t)l * index->d + j * dsub;
+	t = index->terms + ( (size_t)l * index->m + j ) * PQ_CENTROIDS;
+	for( i = 0; i < PQ_CENTROIDS; i++ )
+	  {
+	    y = index->codebooks + ( (size_t)j * PQ_CENTROIDS + i ) * dsub;
+	    t[i] = 0;
+	    for( e = 0; e < dsub; e++ )
+	      t[i] += y[e] * ( y[e] + 2 * c[e] );
+	  }
+      }
+}
+
+
+
+/*
+  Allocates the space a search needs: the query, its distance to each
+  coarse centroid, its dot products with every subspace centroid, and a
+  distance table, the last two of m x PQ_CENTROIDS entries.
+
+  @param index a product quantizer
+
+  @return Returns the space, to be freed with free(), or NULL if no memory
+    is available.
+*/
+static float* alloc_scratch( struct pq_index* index )
+{
+  float* scratch;
+
+  scratch = malloc( ( (size_t)index->d + index->nlist +
+		      2 * (size_t)index->m * PQ_CENTROIDS ) * sizeof( float ) );
+  if( ! scratch )
+    fprintf( stderr, "Warning: unable to allocate memory, %s line %d\n",
+	     __FILE__, __LINE__ );
+  return scratch;
+}
+
+
+
+/*
+  Finds the approximate k nearest neighbors of a descriptor.  The nprobe
+  nearest coarse centroids are visited in order of distance.  Each list's
+  distance table is its precomputed terms less twice the query's dot
+  products with the subspace centroids, which are found once per query;
+  see compute_terms().
+
+  @param index a product quantizer
+  @param descr the query descriptor
+  @param k number of neighbors to find
+  @param nprobe number of inverted lists to visit
+  @param hits array in which to store the neighbors
+  @param scratch space returned by alloc_scratch()
+
+  @return Returns the number of neighbors found.
+*/
+static int search_one( struct pq_index* index, const unsigned char* descr,
+		       int k, int nprobe, struct pq_hit* hits, float* scratch )
+{
+  float* q = scratch, * cdist = q + index->d, * qdot = cdist + index->nlist,
+    * table = qdot + index->m * PQ_CENTROIDS;
+  const float* y, * t;
+  struct pq_hit tmp;
+  float base, dot;
+  int d = index->d, dsub = index->dsub, nt = index->m * PQ_CENTROIDS,
+    found = 0, p, l, best, i, j, e;
+
+  for( i = 0; i < d; i++ )
+    q[i] = descr[i];
+  for( l = 0; l < index->nlist; l++ )
+    cdist[l] = descr_dist_sq_f32( q, index->coarse + (size_t)l * d, d );
+  nprobe = MIN( MAX( nprobe, 1 ), index->nlist );
+
+  for( j = 0; j < index->m; j++ )
+    for( i = 0; i < PQ_CENTROIDS; i++ )
+      {
+	y = index->codebooks + ( (size_t)j * PQ_CENTROIDS + i ) * dsub;
+	dot = 0;
+	for( e = 0; e < dsub; e++ )
+	  dot += q[j*dsub+e] * y[e];
+	qdot[j*PQ_CENTROIDS+i] = dot;
+      }
+
+  for( p = 0; p < nprobe; p++ )
+    {
+      /* the nearest list not yet visited, which is then marked visited */
+      for( l = 0, best = -1; l < index->nlist; l++ )
+	if( cdist[l] >= 0  &&  ( best < 0  ||  cdist[l] < cdist[best] ) )
+	  best = l;
+      base = cdist[best];
+      cdist[best] = -1;
+      if( index->nlisted[best] == 0 )
+	continue;
+
+      t = index->terms + (size_t)best * nt;
+      for( i = 0; i < nt; i++ )
+	table[i] = t[i] - 2 * qdot[i];
+      scan_list( index, best, table, base, k, hits, &found );
+    }
+
+  /* hits is a max-heap; sort it in place by increasing distance */
+  for( i = found - 1; i > 0; i-- )
+    {
+      tmp = hits[0];
+      hits[0] = hits[i];
+      hits[i] = tmp;
+      sift_down( hits, i, 0 );
+    }
+  for( i = found; i < k; i++ )
+    {
+      hits[i].id = -1;
+      hits[i].dsq = FLT_MAX;
+    }
+  return found;
+}
+
+
+
+/*
+  Computes the asymmetric distance to every code of an inverted list from
+  a distance table and keeps the k nearest in a max-heap
+
+  @param index a product quantizer
+  @param list the inverted list
+  @param table distance table of the query for the list
+  @param base squared distance from the query to the list's centroid,
+    which is added to every distance
+  @param k number of neighbors to keep
+  @param hits max-heap of the neighbors found so far
+  @param found number of entries in hits; updated
+*/
+static void scan_list( struct pq_index* index, int list, const float* table,
+		       float base, int k, struct pq_hit* hits, int* found )
+{
+  const unsigned char* code = index->codes[list];
+  struct pq_hit hit;
+  int m = index->m, n = index->nlisted[list], i, j, c, p;
+
+  for( i = 0; i < n; i++, code += m )
+    {
+      hit.dsq = base;
+      for( j = 0; j < m; j++ )
+	hit.dsq += table[j*PQ_CENTROIDS+code[j]];
+      hit.id = index->ids[list][i];
+      if( *found < k )
+	{
+	  /* sift up */
+	  c = (*found)++;
+	  while( c > 0  &&  hit_worse( &hit, hits + ( p = ( c - 1 ) / 2 ) ) )
+	    {
+	      hits[c] = hits[p];
+	      c = p;
+	    }
+	  hits[c] = hit;
+	}
+      else if( hit_worse( hits, &hit ) )
+	{
+	  hits[0] = hit;
+	  sift_down( hits, k, 0 );
+	}
+    }
+}
+
+
+
+/*
+  Determines whether one hit is worse than another: farther, or as far
+  with a higher id
+
+  @param a a hit
+  @param b another hit
+
+  @return Returns 1 if a is worse than b or 0 otherwise.
+*/
+static int hit_worse( struct pq_hit* a, struct pq_hit* b )
+{
+  return a->dsq > b->dsq  ||  ( a->dsq == b->dsq  &&  a->id > b->id );
+}
+
+
+
+/*
+  Restores the max-heap property below an entry of a heap of hits
+
+  @param hits a heap of hits, worst first
+  @param n number of entries in the heap
+  @param i index of an entry that may be better than its children
+*/
+static void sift_down( struct pq_hit* hits, int n, int i )
+{
+  struct pq_hit tmp = hits[i];
+  int c;
+
+  while( ( c = 2 * i + 1 ) < n )
+    {
+      if( c + 1 < n  &&  hit_worse( hits + c + 1, hits + c ) )
+	c++;
+      if( ! hit_worse( hits + c, &tmp ) )
+	break;
+      hits[i] = hits[c];
+      i = c;
+    }
+  hits[i] = tmp;
+}
+
+
+
+/*
+  Searches for the neighbors of a range of query features; run by
+  parallel_for()
+
+  @param data a struct search_job
+  @param begin index of the first feature
+  @param end one past the index of the last feature
+  @param tid thread index, which selects the distance tables
+*/
+static void search_range( void* data, int begin, int end, int tid )
+{
+  struct search_job* job = data;
+  int i;
+
+  for( i = begin; i < end; i++ )
+    search_one( job->index, feature_set_descr( job->set, i ), job->k,
+		job->nprobe, job->hits + (size_t)i * job->k,
+		job->scratch[tid] );
+}
@@ -0,0 +1,689 @@
+/*
+  Functions and structures for building Gaussian scale space pyramids with
+  precomputed, separable convolution kernels.
+
+  Copyright (C) 2006-2012  Rob Hess <rob@iqengines.com>
+
+  @version 1.1.2-20100521
+*/
+
+#include "pyramid.h"
+#include "utils.h"
+
+#include <cxcore.h>
+
+#include <float.h>
+
+#if defined(__GNUC__)  &&  ( defined(__x86_64__)  ||  defined(__i386__) )
+#define PYR_X86
+#include <immintrin.h>
+#endif
+
+/*
+  coefficients of the odd polynomial that approximates atan() on [0, 1] to
+  within 1e-5; Abramowitz and Stegun, 4.4.47
+*/
+#define ATAN_C1  0.9998660f
+#define ATAN_C3 -0.3302995f
+#define ATAN_C5  0.1801410f
+#define ATAN_C7 -0.0851330f
+#define ATAN_C9  0.0208351f
+
+#define PI_F ( (float)CV_PI )
+#define HALF_PI_F ( (float)( CV_PI / 2 ) )
+
+/************************* Local Function Prototypes *************************/
+
+static void pad_row( float*, float*, int, int );
+static void row_pass( float*, float*, int, struct gauss_kernel*, int );
+static void col_pass( float**, float*, int, struct gauss_kernel*, int );
+static void row_pass_c( float*, float*, int, float*, int );
+static void col_pass_c( float**, float*, int, float*, int, int );
+#ifdef PYR_X86
+static void row_pass_sse2( float*, float*, int, float*, int );
+static void col_pass_sse2( float**, float*, int, float*, int );
+static void row_pass_avx2( float*, float*, int, float*, int );
+static void col_pass_avx2( float**, float*, int, float*, int );
+#endif
+static void grad_row( float*, int, float*, float*, int, int );
+static void grad_row_c( float*, int, float*, float*, int, int );
+#ifdef PYR_X86
+static void grad_row_sse2( float*, int, float*, float*, int );
+static void grad_row_avx2( float*, int, float*, float*, int );
+#endif
+
+
+/************************** Local Inline Functions ***************************/
+
+/*
+  Approximates atan2( y, x ) with a polynomial in the ratio of the smaller
+  to the larger of |x| and |y|, reflected into the right octant.  Returns 0
+  when x and y are both 0.
+*/
+static inline float approx_atan2( float y, float x )
+{
+  float ax = fabsf( x ), ay = fabsf( y ), mn, mx, t, a, p;
+
+  mn = ( ax < ay )? ax : ay;
+  mx = ( ax < ay )? ay : ax;
+  t = mn / ( mx + FLT_MIN );
+  a = t * t;
+  p = t * ( ATAN_C1 + a * ( ATAN_C3 + a * ( ATAN_C5 + a * ( ATAN_C7 +
+							   a * ATAN_C9 ) ) ) );
+  if( ay > ax )
+    p = HALF_PI_F - p;
+  if( x < 0 )
+    p = PI_F - p;
+  if( y < 0 )
+    p = -p;
+  return p;
+}
+
+
+#ifdef PYR_X86
+
+/* SSE2 approx_atan2() of 4 values; computes exactly the same results */
+static inline __m128 approx_atan2_sse2( __m128 y, __m128 x )
+{
+  __m128 sign = _mm_set1_ps( -0.0f ), zero = _mm_setzero_ps();
+  __m128 ax, ay, t, a, p, m;
+
+  ax = _mm_andnot_ps( sign, x );
+  ay = _mm_andnot_ps( sign, y );
+  t = _mm_div_ps( _mm_min_ps( ax, ay ),
+		  _mm_add_ps( _mm_max_ps( ax, ay ), _mm_set1_ps( FLT_MIN ) ) );
+  a = _mm_mul_ps( t, t );
+  p = _mm_mul_ps( a, _mm_set1_ps( ATAN_C9 ) );
+  p = _mm_mul_ps( a, _mm_add_ps( _mm_set1_ps( ATAN_C7 ), p ) );
+  p = _mm_mul_ps( a, _mm_add_ps( _mm_set1_ps( ATAN_C5 ), p ) );
+  p = _mm_mul_ps( a, _mm_add_ps( _mm_set1_ps( ATAN_C3 ), p ) );
+  p = _mm_mul_ps( t, _mm_add_ps( _mm_set1_ps( ATAN_C1 ), p ) );
+
+  m = _mm_cmpgt_ps( ay, ax );
+  p = _mm_or_ps( _mm_andnot_ps( m, p ),
+		 _mm_and_ps( m, _mm_sub_ps( _mm_set1_ps( HALF_PI_F ), p ) ) );
+  m = _mm_cmplt_ps( x, zero );
+  p = _mm_or_ps( _mm_andnot_ps( m, p ),
+		 _mm_and_ps( m, _mm_sub_ps( _mm_set1_ps( PI_F ), p ) ) );
+  return _mm_xor_ps( p, _mm_and_ps( _mm_cmplt_ps( y, zero ), sign ) );
+}
+
+
+
+/* AVX2 approx_atan2() of 8 values; computes exactly the same results */
+__attribute__(( target( "avx2" ) ))
+static inline __m256 approx_atan2_avx2( __m256 y, __m256 x )
+{
+  __m256 sign = _mm256_set1_ps( -0.0f ), zero = _mm256_setzero_ps();
+  __m256 ax, ay, t, a, p;
+
+  ax = _mm256_andnot_ps( sign, x );
+  ay = _mm256_andnot_ps( sign, y );
+  t = _mm256_div_ps( _mm256_min_ps( ax, ay ),
+		     _mm256_add_ps( _mm256_max_ps( ax, ay ),
+				    _mm256_set1_ps( FLT_MIN ) ) );
+  a = _mm256_mul_ps( t, t );
+  p = _mm256_mul_ps( a, _mm256_set1_ps( ATAN_C9 ) );
+  p = _mm256_mul_ps( a, _mm256_add_ps( _mm256_set1_ps( ATAN_C7 ), p ) );
+  p = _mm256_mul_ps( a, _mm256_add_ps( _mm256_set1_ps( ATAN_C5 ), p ) );
+  p = _mm256_mul_ps( a, _mm256_add_ps( _mm256_set1_ps( ATAN_C3 ), p ) );
+  p = _mm256_mul_ps( t, _mm256_add_ps( _mm256_set1_ps( ATAN_C1 ), p ) );
+
+  p = _mm256_blendv_ps( p, _mm256_sub_ps( _mm256_set1_ps( HALF_PI_F ), p ),
+			_mm256_cmp_ps( ay, ax, _CMP_GT_OQ ) );
+  p = _mm256_blendv_ps( p, _mm256_sub_ps( _mm256_set1_ps( PI_F ), p ),
+			_mm256_cmp_ps( x, zero, _CMP_LT_OQ ) );
+  return _mm256_xor_ps( p, _mm256_and_ps( _mm256_cmp_ps( y, zero,
+							 _CMP_LT_OQ ),
+					  sign ) );
+}
+
+#endif
+
+
+/********************** Functions prototyped in pyramid.h ********************/
+
+
+/*
+  Computes a Gaussian kernel with the same size and coefficients cvSmooth()
+  uses for a 32-bit floating point image.
+
+  @param sigma standard deviation of the Gaussian
+
+  @return Returns a new kernel
+*/
+struct gauss_kernel* create_gauss_kernel( double sigma )
+{
+  struct gauss_kernel* kernel;
+  double* k, x, sum = 0;
+  int i, n;
+
+  n = cvRound( sigma * 4 * 2 + 1 ) | 1;
+  kernel = malloc( sizeof( struct gauss_kernel ) );
+  kernel->sigma = sigma;
+  kernel->n = n;
+  kernel->h = ( n - 1 ) / 2;
+  kernel->k = calloc( n, sizeof( float ) );
+
+  k = calloc( n, sizeof( double ) );
+  for( i = 0; i < n; i++ )
+    {
+      x = i - ( n - 1 ) * 0.5;
+      k[i] = exp( -x * x / ( 2.0 * sigma * sigma ) );
+      sum += k[i];
+    }
+  for( i = 0; i < n; i++ )
+    kernel->k[i] = (float)( k[i] / sum );
+  free( k );
+
+  return kernel;
+}
+
+
+
+/*
+  Computes the kernels needed to build one octave of a Gaussian scale space
+  pyramid.
+
+  @param intvls the number of intervals sampled per octave of scale space
+  @param sigma the amount of Gaussian smoothing at the base of each octave
+
+  @return Returns an array of intvls + 3 kernels whose first element is NULL
+*/
+struct gauss_kernel** create_pyr_kernels( int intvls, double sigma )
+{
+  struct gauss_kernel** kernels;
+  double sig, k;
+  int i;
+
+  /*
+    precompute Gaussian sigmas using the following formula:
+
+    \sigma_{total}^2 = \sigma_{i}^2 + \sigma_{i-1}^2
+
+    sig is the incremental sigma value needed to compute
+    the actual sigma of level i. Keeping track of incremental
+    sigmas vs. total sigmas keeps the gaussian kernel small.
+  */
+  kernels = calloc( intvls + 3, sizeof( struct gauss_kernel* ) );
+  k = pow( 2.0, 1.0 / intvls );
+  sig = sigma * sqrt( k*k- 1 );
+  for( i = 1; i < intvls + 3; i++ )
+    {
+      kernels[i] = create_gauss_kernel( sig );
+      sig *= k;
+    }
+
+  return kernels;
+}
+
+
+
+/*
+  Blurs a single-channel, 32-bit floating point image with a Gaussian kernel.
+
+  @param src source image
+  @param dst destination image
+  @param kernel the Gaussian kernel with which to blur
+*/
+void gauss_smooth( IplImage* src, IplImage* dst, struct gauss_kernel* kernel )
+{
+  gauss_smooth_rows( src, dst, kernel, 0, src->height );
+}
+
+
+
+/*
+  Blurs a band of rows of a single-channel, 32-bit floating point image with
+  a Gaussian kernel.  Rows are filtered horizontally into a ring buffer
+  holding just the kernel's height worth of rows, from which each output row
+  is filtered vertically.  Every source row is consumed before the output
+  row with the same index is written, so src and dst may be the same image
+  when the band covers the whole image.
+
+  @param src source image
+  @param dst destination image
+  @param kernel the Gaussian kernel with which to blur
+  @param r0 first row of the band
+  @param r1 one past the last row of the band
+*/
+void gauss_smooth_rows( IplImage* src, IplImage* dst,
+			struct gauss_kernel* kernel, int r0, int r1 )
+{
+  float* buf, * pad, ** rows;
+  int* ring_row;
+  int width, height, n, h, simd, r, i, sr, slot;
+
+  width = src->width;
+  height = src->height;
+  n = kernel->n;
+  h = kernel->h;
+  simd = simd_level();
+
+  buf = malloc( ( n * width + width + 2 * h ) * sizeof( float ) );
+  pad = buf + n * width;
+  rows = malloc( n * sizeof( float* ) );
+  ring_row = malloc( n * sizeof( int ) );
+  for( i = 0; i < n; i++ )
+    ring_row[i] = -1;
+
+  for( r = r0; r < r1; r++ )
+    {
+      /* make sure the horizontally-filtered rows r-h..r+h are available */
+      for( i = 0; i < n; i++ )
+	{
+	  sr = MIN( MAX( r - h + i, 0 ), height - 1 );
+	  slot = sr % n;
+	  if( ring_row[slot] != sr )
+	    {
+	      pad_row( (float*)( src->imageData + src->widthStep * sr ),
+		       pad, width, h );
+	      row_pass( pad, buf + slot * width, width, kernel, simd );
+	      ring_row[slot] = sr;
+	    }
+	  rows[i] = buf + slot * width;
+	}
+      col_pass( rows, (float*)( dst->imageData + dst->widthStep * r ), width,
+		kernel, simd );
+    }
+
+  free( ring_row );
+  free( rows );
+  free( buf );
+}
+
+
+
+/*
+  Computes the gradient magnitude and orientation of a band of rows of an
+  image.
+
+  @param img source image
+  @param mag output magnitude image
+  @param ori output orientation image
+  @param r0 first row of the band
+  @param r1 one past the last row of the band
+*/
+void calc_grad_rows( IplImage* img, IplImage* mag, IplImage* ori,
+		     int r0, int r1 )
+{
+  float* p, * m, * o;
+  int width = img->width, step, simd, r;
+
+  step = img->widthStep / sizeof( float );
+  simd = simd_level();
+  for( r = r0; r < r1; r++ )
+    {
+      m = (float*)( mag->imageData + mag->widthStep * r );
+      o = (float*)( ori->imageData + ori->widthStep * r );
+      if( r == 0  ||  r == img->height - 1  ||  width < 3 )
+	{
+	  memset( m, 0, width * sizeof( float ) );
+	  memset( o, 0, width * sizeof( float ) );
+	  continue;
+	}
+      p = (float*)( img->imageData + img->widthStep * r );
+      m[0] = o[0] = m[width-1] = o[width-1] = 0;
+      grad_row( p + 1, step, m + 1, o + 1, width - 2, simd );
+    }
+}
+
+
+
+/*
+  De-allocates memory held by a Gaussian kernel
+
+  @param kernel pointer to a Gaussian kernel
+*/
+void release_gauss_kernel( struct gauss_kernel** kernel )
+{
+  if( ! kernel  ||  ! *kernel )
+    return;
+  free( (*kernel)->k );
+  free( *kernel );
+  *kernel = NULL;
+}
+
+
+
+/*
+  De-allocates memory held by an array of pyramid kernels
+
+  @param kernels pointer to an array returned by create_pyr_kernels()
+  @param intvls the number of intervals used to create kernels
+*/
+void release_pyr_kernels( struct gauss_kernel*** kernels, int intvls )
+{
+  int i;
+
+  if( ! kernels  ||  ! *kernels )
+    return;
+  for( i = 0; i < intvls + 3; i++ )
+    release_gauss_kernel( &(*kernels)[i] );
+  free( *kernels );
+  *kernels = NULL;
+}
+
+
+/************************ Functions prototyped here **************************/
+
+/*
+  Copies an image row into a buffer, replicating its first and last pixels
+  into h extra elements on either side.
+
+  @param src image row
+  @param pad buffer of width + 2h elements
+  @param width number of pixels in src
+  @param h padding on each side
+*/
+static void pad_row( float* src, float* pad, int width, int h )
+{
+  int i;
+
+  for( i = 0; i < h; i++ )
+    {
+      pad[i] = src[0];
+      pad[h + width + i] = src[width - 1];
+    }
+  memcpy( pad + h, src, width * sizeof( float ) );
+}
+
+
+
+/*
+  Filters one padded row horizontally using the best available code path.
+
+  @param src padded source row
+  @param dst output row of width elements
+  @param width row width
+  @param kernel Gaussian kernel
+  @param simd one of SIMD_NONE, SIMD_SSE2, or SIMD_AVX2
+*/
+static void row_pass( float* src, float* dst, int width,
+		      struct gauss_kernel* kernel, int simd )
+{
+  float* k = kernel->k + kernel->h;
+
+#ifdef PYR_X86
+  if( simd >= SIMD_AVX2 )
+    row_pass_avx2( src, dst, width, k, kernel->h );
+  else if( simd >= SIMD_SSE2 )
+    row_pass_sse2( src, dst, width, k, kernel->h );
+  else
+#endif
+    row_pass_c( src, dst, width, k, kernel->h );
+}
+
+
+
+/*
+  Filters a set of rows vertically into one output row using the best
+  available code path.
+
+  @param rows the kernel->n horizontally-filtered rows centered on the
+    output row
+  @param dst output row
+  @param width row width
+  @param kernel Gaussian kernel
+  @param simd one of SIMD_NONE, SIMD_SSE2, or SIMD_AVX2
+*/
+static void col_pass( float** rows, float* dst, int width,
+		      struct gauss_kernel* kernel, int simd )
+{
+  float* k = kernel->k + kernel->h;
+
+#ifdef PYR_X86
+  if( simd >= SIMD_AVX2 )
+    col_pass_avx2( rows, dst, width, k, kernel->h );
+  else if( simd >= SIMD_SSE2 )
+    col_pass_sse2( rows, dst, width, k, kernel->h );
+  else
+#endif
+    col_pass_c( rows, dst, width, k, kernel->h, 0 );
+}
+
+
+
+/*
+  Plain C horizontal pass.  The kernel is symmetric, so mirrored taps are
+  summed before being multiplied.
+
+  @param src source row padded by h elements on each side
+  @param dst output row
+  @param width row width
+  @param k pointer to the center tap of the kernel
+  @param h kernel half width
+*/
+static void row_pass_c( float* src, float* dst, int width, float* k, int h )
+{
+  float* p, sum;
+  int c, i;
+
+  for( c = 0; c < width; c++ )
+    {
+      p = src + c + h;
+      sum = k[0] * p[0];
+      for( i = 1; i <= h; i++ )
+	sum += k[i] * ( p[-i] + p[i] );
+      dst[c] = sum;
+    }
+}
+
+
+
+/*
+  Plain C vertical pass over columns c0 and above.
+
+  @param rows 2h + 1 rows centered on the output row
+  @param dst output row
+  @param width row width
+  @param k pointer to the center tap of the kernel
+  @param h kernel half width
+  @param c0 first column to filter
+*/
+static void col_pass_c( float** rows, float* dst, int width, float* k, int h,
+			int c0 )
+{
+  float** center = rows + h, sum;
+  int c, i;
+
+  for( c = c0; c < width; c++ )
+    {
+      sum = k[0] * center[0][c];
+      for( i = 1; i <= h; i++ )
+	sum += k[i] * ( center[-i][c] + center[i][c] );
+      dst[c] = sum;
+    }
+}
+
+
+/*
+  Computes the gradients of a run of pixels in one image row using the best
+  available code path.
+
+  @param p first pixel of the run; must not be on the image border
+  @param step image row stride in floats
+  @param mag output magnitudes
+  @param ori output orientations
+  @param n number of pixels in the run
+  @param simd one of SIMD_NONE, SIMD_SSE2, or SIMD_AVX2
+*/
+static void grad_row( float* p, int step, float* mag, float* ori, int n,
+		      int simd )
+{
+#ifdef PYR_X86
+  if( simd >= SIMD_AVX2 )
+    grad_row_avx2( p, step, mag, ori, n );
+  else if( simd >= SIMD_SSE2 )
+    grad_row_sse2( p, step, mag, ori, n );
+  else
+#endif
+    grad_row_c( p, step, mag, ori, n, 0 );
+}
+
+
+
+/*
+  Plain C gradients of pixels c0 and above of a run; see grad_row().
+
+  @param c0 first pixel of the run to process
+*/
+static void grad_row_c( float* p, int step, float* mag, float* ori, int n,
+			int c0 )
+{
+  float dx, dy;
+  int c;
+
+  for( c = c0; c < n; c++ )
+    {
+      dx = p[c+1] - p[c-1];
+      dy = p[c-step] - p[c+step];
+      mag[c] = sqrtf( dx * dx + dy * dy );
+      ori[c] = approx_atan2( dy, dx );
+    }
+}
+
+
+#ifdef PYR_X86
+
+/* SSE2 horizontal pass; see row_pass_c() */
+static void row_pass_sse2( float* src, float* dst, int width, float* k, int h )
+{
+  __m128 sum, t;
+  float* p;
+  int c, i;
+
+  for( c = 0; c + 4 <= width; c += 4 )
+    {
+      p = src + c + h;
+      sum = _mm_mul_ps( _mm_set1_ps( k[0] ), _mm_loadu_ps( p ) );
+      for( i = 1; i <= h; i++ )
+	{
+	  t = _mm_add_ps( _mm_loadu_ps( p - i ), _mm_loadu_ps( p + i ) );
+	  sum = _mm_add_ps( sum, _mm_mul_ps( _mm_set1_ps( k[i] ), t ) );
+	}
+      _mm_storeu_ps( dst + c, sum );
+    }
+  row_pass_c( src + c, dst + c, width - c, k, h );
+}
+
+
+
+/* SSE2 vertical pass; see col_pass_c() */
+static void col_pass_sse2( float** rows, float* dst, int width, float* k,
+			   int h )
+{
+  float** center = rows + h;
+  __m128 sum, t;
+  int c, i;
+
+  for( c = 0; c + 4 <= width; c += 4 )
+    {
+      sum = _mm_mul_ps( _mm_set1_ps( k[0] ), _mm_loadu_ps( center[0] + c ) );
+      for( i = 1; i <= h; i++ )
+	{
+	  t = _mm_add_ps( _mm_loadu_ps( center[-i] + c ),
+			  _mm_loadu_ps( center[i] + c ) );
+	  sum = _mm_add_ps( sum, _mm_mul_ps( _mm_set1_ps( k[i] ), t ) );
+	}
+      _mm_storeu_ps( dst + c, sum );
+    }
+  col_pass_c( rows, dst, width, k, h, c );
+}
+
+
+
+/* AVX2 horizontal pass; see row_pass_c() */
+__attribute__(( target( "avx2" ) ))
+static void row_pass_avx2( float* src, float* dst, int width, float* k, int h )
+{
+  __m256 sum, t;
+  float* p;
+  int c, i;
+
+  for( c = 0; c + 8 <= width; c += 8 )
+    {
+      p = src + c + h;
+      sum = _mm256_mul_ps( _mm256_set1_ps( k[0] ), _mm256_loadu_ps( p ) );
+      for( i = 1; i <= h; i++ )
+	{
+	  t = _mm256_add_ps( _mm256_loadu_ps( p - i ), _mm256_loadu_ps( p + i ) );
+	  sum = _mm256_add_ps( sum, _mm256_mul_ps( _mm256_set1_ps( k[i] ), t ) );
+	}
+      _mm256_storeu_ps( dst + c, sum );
+    }
+  row_pass_sse2( src + c, dst + c, width - c, k, h );
+}
+
+
+
+/* AVX2 vertical pass; see col_pass_c() */
+__attribute__(( target( "avx2" ) ))
+static void col_pass_avx2( float** rows, float* dst, int width, float* k,
+			   int h )
+{
+  float** center = rows + h;
+  __m256 sum, t;
+  int c, i;
+
+  for( c = 0; c + 8 <= width; c += 8 )
+    {
+      sum = _mm256_mul_ps( _mm256_set1_ps( k[0] ),
+			   _mm256_loadu_ps( center[0] + c ) );
+      for( i = 1; i <= h; i++ )
+	{
+	  t = _mm256_add_ps( _mm256_loadu_ps( center[-i] + c ),
+			     _mm256_loadu_ps( center[i] + c ) );
+	  sum = _mm256_add_ps( sum, _mm256_mul_ps( _mm256_set1_ps( k[i] ), t ) );
+	}
+      _mm256_storeu_ps( dst + c, sum );
+    }
+  col_pass_c( rows, dst, width, k, h, c );
+}
+
+
+
+
+/* AVX2 gradients; see grad_row_c() */
+__attribute__(( target( "avx2" ) ))
+static void grad_row_avx2( float* p, int step, float* mag, float* ori, int n )
+{
+  __m256 dx, dy;
+  int c;
+
+  for( c = 0; c + 8 <= n; c += 8 )
+    {
+      dx = _mm256_sub_ps( _mm256_loadu_ps( p + c + 1 ),
+			  _mm256_loadu_ps( p + c - 1 ) );
+      dy = _mm256_sub_ps( _mm256_loadu_ps( p + c - step ),
+			  _mm256_loadu_ps( p + c + step ) );
+      _mm256_storeu_ps( mag + c,
+			_mm256_sqrt_ps( _mm256_add_ps( _mm256_mul_ps( dx, dx ),
+						       _mm256_mul_ps( dy, dy ) )
+					) );
+      _mm256_storeu_ps( ori + c, approx_atan2_avx2( dy, dx ) );
+    }
+  grad_row_sse2( p + c, step, mag + c, ori + c, n - c );
+}
+
+
+
+/* SSE2 gradients; see grad_row_c() */
+static void grad_row_sse2( float* p, int step, float* mag, float* ori, int n )
+{
+  __m128 dx, dy;
+  int c;
+
+  for( c = 0; c + 4 <= n; c += 4 )
+    {
+      dx = _mm_sub_ps( _mm_loadu_ps( p + c + 1 ), _mm_loadu_ps( p + c - 1 ) );
+      dy = _mm_sub_ps( _mm_loadu_ps( p + c - step ),
+		       _mm_loadu_ps( p + c + step ) );
+      _mm_storeu_ps( mag + c, _mm_sqrt_ps( _mm_add_ps( _mm_mul_ps( dx, dx ),
+						       _mm_mul_ps( dy, dy ) ) ) );
+      _mm_storeu_ps( ori + c, approx_atan2_sse2( dy, dx ) );
+    }
+  grad_row_c( p, step, mag, ori, n, c );
+}
+
+#endif
@@ -0,0 +1,179 @@
+/*
+  Times Gaussian scale space pyramid construction, comparing the separable
+  kernels from pyramid.h against the generic cvSmooth() path they replace.
+  Reports milliseconds per octave for each code path and the largest
+  difference between their outputs.
+
+  Copyright (C) 2006-2012  Rob Hess <rob@iqengines.com>
+
+  @version 1.1.2-20100521
+*/
+
+#include "sift.h"
+#include "pyramid.h"
+#include "utils.h"
+
+#include <cxcore.h>
+#include <cv.h>
+#include <highgui.h>
+
+#include <stdio.h>
+
+/* number of times each octave is rebuilt when timing */
+#define PYRBENCH_REPS 5
+
+/*************************** Function Prototypes *****************************/
+
+static IplImage* init_img( IplImage* );
+static double time_cv( IplImage**, int, struct gauss_kernel**, int );
+static double time_engine( IplImage**, int, struct gauss_kernel**, int, int );
+static double max_diff( IplImage*, IplImage* );
+
+
+/********************************** Main *************************************/
+
+int main( int argc, char** argv )
+{
+  IplImage* img, * base, ** ref, ** lvl;
+  struct gauss_kernel** kernels;
+  double t_cv, t_c, t_simd, diff;
+  int octvs, reps = PYRBENCH_REPS, intvls = SIFT_INTVLS, o, i, simd;
+
+  if( argc < 2  ||  argc > 3 )
+    fatal_error( "usage: %s <img> [reps]", argv[0] );
+  if( argc == 3 )
+    reps = MAX( atoi( argv[2] ), 1 );
+
+  img = cvLoadImage( argv[1], 1 );
+  if( ! img )
+    fatal_error( "unable to load image from %s", argv[1] );
+  base = init_img( img );
+  octvs = log( MIN( base->width, base->height ) ) / log(2) - 2;
+  kernels = create_pyr_kernels( intvls, SIFT_SIGMA );
+  ref = calloc( intvls + 3, sizeof( IplImage* ) );
+  lvl = calloc( intvls + 3, sizeof( IplImage* ) );
+  simd = simd_level();
+
+  fprintf( stdout, "%d x %d base image, %d octaves, SIMD level %d\n",
+	   base->width, base->height, octvs, simd );
+  fprintf( stdout, "octave       size    cvSmooth    engine C  engine SIMD" \
+	   "   max diff\n" );
+  for( o = 0; o < octvs; o++ )
+    {
+      for( i = 0; i < intvls + 3; i++ )
+	{
+	  ref[i] = cvCreateImage( cvGetSize( base ), IPL_DEPTH_32F, 1 );
+	  lvl[i] = cvCreateImage( cvGetSize( base ), IPL_DEPTH_32F, 1 );
+	}
+      cvCopy( base, ref[0], NULL );
+      cvCopy( base, lvl[0], NULL );
+
+      t_cv = time_cv( ref, intvls, kernels, reps );
+      t_c = time_engine( lvl, intvls, kernels, reps, SIMD_NONE );
+      t_simd = time_engine( lvl, intvls, kernels, reps, simd );
+
+      diff = 0;
+      for( i = 1; i < intvls + 3; i++ )
+	diff = MAX( diff, max_diff( ref[i], lvl[i] ) );
+      fprintf( stdout, "%6d  %4d x %4d  %7.3f ms  %7.3f ms   %7.3f ms  %9.3g\n",
+	       o, base->width, base->height, t_cv, t_c, t_simd, diff );
+
+      /* base of the next octave is the halved image, as in _sift_features() */
+      cvReleaseImage( &base );
+      base = cvCreateImage( cvSize( lvl[intvls]->width / 2,
+				    lvl[intvls]->height / 2 ),
+			    IPL_DEPTH_32F, 1 );
+      cvResize( lvl[intvls], base, CV_INTER_NN );
+      for( i = 0; i < intvls + 3; i++ )
+	{
+	  cvReleaseImage( &ref[i] );
+	  cvReleaseImage( &lvl[i] );
+	}
+    }
+
+  release_pyr_kernels( &kernels, intvls );
+  cvReleaseImage( &base );
+  cvReleaseImage( &img );
+  free( ref );
+  free( lvl );
+  return 0;
+}
+
+
+/************************** Function Definitions *****************************/
+
+/*
+  Builds a doubled, 32-bit grayscale image like the one at the base of the
+  first octave in _sift_features()
+*/
+static IplImage* init_img( IplImage* img )
+{
+  IplImage* gray8, * gray32, * dbl;
+
+  gray8 = cvCreateImage( cvGetSize( img ), IPL_DEPTH_8U, 1 );
+  gray32 = cvCreateImage( cvGetSize( img ), IPL_DEPTH_32F, 1 );
+  cvCvtColor( img, gray8, CV_BGR2GRAY );
+  cvConvertScale( gray8, gray32, 1.0 / 255.0, 0 );
+  dbl = cvCreateImage( cvSize( img->width * 2, img->height * 2 ),
+		       IPL_DEPTH_32F, 1 );
+  cvResize( gray32, dbl, CV_INTER_CUBIC );
+
+  cvReleaseImage( &gray8 );
+  cvReleaseImage( &gray32 );
+  return dbl;
+}
+
+
+
+/*
+  Returns the average time in ms to blur one octave with cvSmooth()
+*/
+static double time_cv( IplImage** lvl, int intvls,
+		       struct gauss_kernel** kernels, int reps )
+{
+  double start;
+  int r, i;
+
+  start = get_time_ms();
+  for( r = 0; r < reps; r++ )
+    for( i = 1; i < intvls + 3; i++ )
+      cvSmooth( lvl[i-1], lvl[i], CV_GAUSSIAN, 0, 0, kernels[i]->sigma,
+		kernels[i]->sigma );
+  return ( get_time_ms() - start ) / reps;
+}
+
+
+
+/*
+  Returns the average time in ms to blur one octave with gauss_smooth()
+*/
+static double time_engine( IplImage** lvl, int intvls,
+			   struct gauss_kernel** kernels, int reps, int simd )
+{
+  double start;
+  int r, i;
+
+  limit_simd_level( simd );
+  start = get_time_ms();
+  for( r = 0; r < reps; r++ )
+    for( i = 1; i < intvls + 3; i++ )
+      gauss_smooth( lvl[i-1], lvl[i], kernels[i] );
+  return ( get_time_ms() - start ) / reps;
+}
+
+
+
+/*
+  Returns the largest absolute difference between two 32-bit images
+*/
+static double max_diff( IplImage* img1, IplImage* img2 )
+{
+  double diff = 0;
+  int r, c;
+
+  for( r = 0; r < img1->height; r++ )
+    for( c = 0; c < img1->width; c++ )
+      diff = MAX( diff, ABS( pixval32f( img1, r, c ) -
+			     pixval32f( img2, r, c ) ) );
+  return diff;
+}
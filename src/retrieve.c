@@ -0,0 +1,310 @@
+/*
+  This program finds the images in a vocabulary tree built by mkvocab that
+  are most similar to a query image, given its Lowe-style feature file.
+  With -v, the shortlisted images are re-verified by matching their
+  features with the query's and fitting a homography to the matches with
+  RANSAC, and are reranked by number of inliers.
+
+  Copyright (C) 2006-2012  Rob Hess <rob@iqengines.com>
+
+  @version 1.1.2-20100521
+*/
+
+#include "vocab.h"
+#include "imgfeatures.h"
+#include "featset.h"
+#include "kdtree.h"
+#include "parallel.h"
+#include "xform.h"
+#include "utils.h"
+
+#include <cxcore.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define OPTIONS ":k:t:vh"
+
+/* the maximum number of keypoint NN candidates to check during BBF search */
+#define KDTREE_BBF_MAX_NN_CHKS 200
+
+/* threshold on squared ratio of distances between NN and 2nd NN */
+#define NN_SQ_DIST_RATIO_THR 0.49
+
+/* a shortlisted image and its number of RANSAC inliers */
+struct candidate
+{
+  struct vocab_hit hit;
+  int inliers;
+};
+
+/*************************** Function Prototypes *****************************/
+
+static void usage( char* );
+static void arg_parse( int, char** );
+static int verify( struct feature*, int, char*, struct thread_pool* );
+static int cmp_inliers( const void*, const void* );
+
+/******************************** Globals ************************************/
+
+char* pname;
+char* vocab_file_name;
+char* list_file_name;
+char* query_file_name;
+int top_k = VOCAB_TOP_K;
+int threads = 0;
+int verify_hits = 0;
+
+
+/********************************** Main *************************************/
+
+int main( int argc, char** argv )
+{
+  struct vocab_tree* tree;
+  struct vocab_hit* hits;
+  struct candidate* cands;
+  struct feature_set* set;
+  struct thread_pool* pool = NULL;
+  struct feature* feat;
+  char** names;
+  double start;
+  int nnames, n, nhits, i;
+
+  arg_parse( argc, argv );
+
+  tree = vocab_load( vocab_file_name );
+  if( ! tree )
+    fatal_error( "unable to load vocabulary tree from %s", vocab_file_name );
+  names = read_list( list_file_name, &nnames );
+  if( nnames != tree->nimages )
+    fatal_error( "%s names %d images but %s indexes %d", list_file_name,
+		 nnames, vocab_file_name, tree->nimages );
+  n = import_features( query_file_name, FEATURE_LOWE, &feat );
+  if( n < 0 )
+    fatal_error( "unable to load features from %s", query_file_name );
+  set = feature_set_from_features( feat, n );
+  if( ! set )
+    fatal_error( "unable to store features from %s", query_file_name );
+
+  hits = calloc( MAX( top_k, 1 ), sizeof( struct vocab_hit ) );
+  cands = calloc( MAX( top_k, 1 ), sizeof( struct candidate ) );
+  start = get_time_ms();
+  nhits = vocab_query( tree, set, hits, top_k );
+  if( nhits < 0 )
+    fatal_error( "unable to query vocabulary tree" );
+  fprintf( stderr, "Queried %d images in %.2f ms\n", tree->nimages,
+	   get_time_ms() - start );
+
+  for( i = 0; i < nhits; i++ )
+    {
+      cands[i].hit = hits[i];
+      cands[i].inliers = -1;
+    }
+  if( verify_hits )
+    {
+      pool = thread_pool_init( threads );
+      start = get_time_ms();
+      for( i = 0; i < nhits; i++ )
+	cands[i].inliers = verify( feat, n, names[hits[i].id], pool );
+      qsort( cands, nhits, sizeof( struct candidate ), cmp_inliers );
+      fprintf( stderr, "Verified %d images in %.2f ms\n", nhits,
+	       get_time_ms() - start );
+    }
+
+  fprintf( stdout, "rank  image     score  inliers  file\n" );
+  for( i = 0; i < nhits; i++ )
+    fprintf( stdout, "%4d  %5d  %8.4f  %7d  %s\n", i + 1, cands[i].hit.id,
+	     cands[i].hit.score, cands[i].inliers, names[cands[i].hit.id] );
+
+  thread_pool_release( &pool );
+  vocab_release( &tree );
+  feature_set_release( &set );
+  for( i = 0; i < nnames; i++ )
+    free( names[i] );
+  free( names );
+  free( hits );
+  free( cands );
+  free( feat );
+  return 0;
+}
+
+
+/************************** Function Definitions *****************************/
+
+// print usage for this program
+static void usage( char* name )
+{
+  fprintf(stderr, "%s: find the images most similar to a query in a" \
+	  " vocabulary tree\n\n", name);
+  fprintf(stderr, "Usage: %s [options] <vocab_file> <list_file>" \
+	  " <query_feature_file>\n", name);
+  fprintf(stderr, "  <list_file> is the list from which mkvocab built" \
+	  " <vocab_file>\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "  -h               Display this message and exit\n");
+  fprintf(stderr, "  -k <images>      Set number of images to return" \
+	  " (default %d)\n", VOCAB_TOP_K);
+  fprintf(stderr, "  -v               Re-verify returned images with" \
+	  " RANSAC and rerank them\n");
+  fprintf(stderr, "                   by number of inliers\n");
+  fprintf(stderr, "  -t <threads>     Set number of threads used to match" \
+	  " features; 0 uses one\n");
+  fprintf(stderr, "                   per CPU (default 0)\n");
+}
+
+
+
+/*
+  arg_parse() parses the command line arguments, setting appropriate globals.
+
+  argc and argv should be passed directly from the command line
+*/
+static void arg_parse( int argc, char** argv )
+{
+  //extract program name from command line (remove path, if present)
+  pname = basename( argv[0] );
+
+  //parse commandline options
+  while( 1 )
+    {
+      char* arg_check;
+      int arg = getopt( argc, argv, OPTIONS );
+      if( arg == -1 )
+	break;
+
+      switch( arg )
+	{
+	  // catch unsupplied required arguments and exit
+	case ':':
+	  fatal_error( "-%c option requires an argument\n"		\
+		       "Try '%s -h' for help.", optopt, pname );
+	  break;
+
+	  // read number of images or threads
+	case 'k':
+	case 't':
+	  if( ! optarg )
+	    fatal_error( "error parsing arguments at -%c\n"	\
+			 "Try '%s -h' for help.", arg, pname );
+	  if( arg == 'k' )
+	    top_k = strtol( optarg, &arg_check, 10 );
+	  else
+	    threads = strtol( optarg, &arg_check, 10 );
+	  if( arg_check == optarg  ||  *arg_check != '\0' )
+	    fatal_error( "-%c option requires an integer argument\n"	\
+			 "Try '%s -h' for help.", arg, pname );
+	  break;
+
+	case 'v':
+	  verify_hits = 1;
+	  break;
+
+	  // user asked for help
+	case 'h':
+	  usage( pname );
+	  exit(0);
+	  break;
+
+	  // catch invalid arguments
+	default:
+	  fatal_error( "-%c: invalid option.\nTry '%s -h' for help.",
+		       optopt, pname );
+	}
+    }
+
+  // make sure input files are specified
+  if( argc - optind < 3 )
+    fatal_error( "vocabulary, list, and query files must be specified.\n" \
+		 "Try '%s -h' for help.", pname );
+
+  // make sure there aren't too many arguments
+  if( argc - optind > 3 )
+    fatal_error( "too many arguments.\nTry '%s -h' for help.", pname );
+
+  vocab_file_name = argv[optind];
+  list_file_name = argv[optind+1];
+  query_file_name = argv[optind+2];
+}
+
+
+
+/*
+  Matches a query's features with those of a shortlisted image using a k-d
+  tree and the ratio test, then fits a homography to the matches with
+  RANSAC.
+
+  @param feat the query's features; their forward matches are overwritten
+  @param n number of features in feat
+  @param filename name of the shortlisted image's feature file
+  @param pool threads among which to divide the k-d tree search
+
+  @return Returns the number of RANSAC inliers, or 0 if no homography
+    could be fit.
+*/
+static int verify( struct feature* feat, int n, char* filename,
+		   struct thread_pool* pool )
+{
+  struct feature* gallery, ** nbrs;
+  struct kd_tree* kd_root;
+  CvMat* H;
+  int m, i, n_in = 0;
+
+  m = import_features( filename, FEATURE_LOWE, &gallery );
+  if( m < 0 )
+    fatal_error( "unable to load features from %s", filename );
+  for( i = 0; i < n; i++ )
+    feat[i].fwd_match = NULL;
+  if( m < 2  ||  n < 1 )
+    {
+      free( gallery );
+      return 0;
+    }
+
+  kd_root = kdtree_build( gallery, m );
+  nbrs = calloc( 2 * n, sizeof( struct feature* ) );
+  if( ! kd_root  ||  ! nbrs  ||
+      kdtree_bbf_knn_batch( kd_root, feat, n, 2, KDTREE_BBF_MAX_NN_CHKS,
+			    NN_SQ_DIST_RATIO_THR, nbrs, NULL, pool ) < 0 )
+    fatal_error( "unable to match features with %s", filename );
+  for( i = 0; i < n; i++ )
+    feat[i].fwd_match = nbrs[2*i];
+
+  H = ransac_xform( feat, n, FEATURE_FWD_MATCH, lsq_homog, 4, 0.01,
+		    homog_xfer_err, 3.0, NULL, &n_in );
+  if( H )
+    cvReleaseMat( &H );
+  else
+    n_in = 0;
+
+  for( i = 0; i < n; i++ )
+    feat[i].fwd_match = NULL;
+  kdtree_release( kd_root );
+  free( nbrs );
+  free( gallery );
+  return n_in;
+}
+
+
+
+/*
+  Compares two candidates for qsort(), ordering them by decreasing number of
+  inliers and then by decreasing score
+
+  @param a pointer to a candidate
+  @param b pointer to another candidate
+
+  @return Returns a negative value if *a ranks before *b, a positive value
+    if it ranks after, or 0 if they rank equally.
+*/
+static int cmp_inliers( const void* a, const void* b )
+{
+  const struct candidate* ca = a, * cb = b;
+
+  if( ca->inliers != cb->inliers )
+    return cb->inliers - ca->inliers;
+  if( ca->hit.score != cb->hit.score )
+    return ( ca->hit.score < cb->hit.score )? 1 : -1;
+  return ca->hit.image - cb->hit.image;
+}
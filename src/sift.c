@@ -19,50 +19,247 @@
 
 #include "sift.h"
 #include "imgfeatures.h"
+#include "pyramid.h"
+#include "parallel.h"
+#include "arena.h"
+#include "featset.h"
 #include "utils.h"
 
 #include <cxcore.h>
 #include <cv.h>
 
+#include <limits.h>
+
+#if defined(__GNUC__)  &&  ( defined(__x86_64__)  ||  defined(__i386__) )
+#define SIFT_X86
+#include <immintrin.h>
+#endif
+
+/******************************** Structures *********************************/
+
+/* threads and memory used to detect features, reused from image to image */
+struct sift_ctx
+{
+  struct sift_params params;   /* detection parameters */
+  struct thread_pool* pool;    /* NULL when detecting on one thread */
+  struct arena** arenas;       /* one per thread; reset after every image */
+  CvMemStorage* storage;       /* holds features detected in an image */
+  struct gauss_kernel* init_kernel; /* blur that produces the pyramid base */
+  struct gauss_kernel** kernels; /* blur that produces each level from the
+				    one below it */
+  CvSize size;                 /* size of images the buffers below fit, or
+				  0 x 0 if there are none */
+  int octvs;                   /* octaves of gauss_pyr */
+  IplImage* gray8;             /* 8-bit gray conversion of a color image */
+  IplImage* gray;              /* 32-bit gray image */
+  IplImage* dbl;               /* doubled gray image, if shift is -1 */
+  IplImage* small;             /* downsampled gray image, if shift is
+				  positive */
+  int shift;                   /* times the image is halved, or -1 if it is
+				  doubled, before the pyramid is built */
+  double step;                 /* image pixels between pixels of the base
+				  of the pyramid, 2^shift */
+  IplImage*** gauss_pyr;       /* Gaussian pyramid, rebuilt for each image */
+  struct grad_plane** grad;    /* gradient planes, if grad_planes is set */
+  CvRect search;               /* region of the image searched for extrema */
+  CvPoint origin;              /* image coordinates of the pyramid's origin */
+  IplImage* mask;              /* image pixels that may hold features, or
+				  NULL */
+};
+
+/* candidate extrema found in one interval of a DoG octave */
+struct extrema_cands
+{
+  int* loc;                    /* candidate locations, as r * width + c */
+  struct feature** feat;       /* refined feature for each location or NULL */
+  int n;                       /* number of candidates */
+  int nallocd;                 /* number of locations allocated */
+};
+
+/* a level of the Gaussian pyramid to be blurred in bands of rows */
+struct blur_job
+{
+  IplImage* src;
+  IplImage* dst;
+  struct gauss_kernel* kernel;
+};
+
+/* one octave of DoG scale space to be searched for extrema in bands of rows */
+struct extrema_job
+{
+  struct sift_ctx* ctx;
+  IplImage*** gauss_pyr;
+  int octv;
+  int intvls;
+  double contr_thr;
+  int curv_thr;
+  int r0, r1, c0, c1;          /* rows and columns of the octave searched */
+  int nbands;
+  struct extrema_cands** cands; /* intvls + 2 candidate lists per band */
+};
+
+/* a feature ranked against the others for a place in a feature budget */
+struct feature_rank
+{
+  double contr;                /* |D(x)| at the feature */
+  int cell_rank;               /* number of stronger features in its cell */
+  int i;                       /* index of the feature */
+};
+
+/* gradient magnitude and orientation planes of one Gaussian pyramid level */
+struct grad_plane
+{
+  IplImage* mag;               /* NULL until a feature lies on the level */
+  IplImage* ori;
+  int valid;                   /* computed for the current image? */
+};
+
+/* a level of the Gaussian pyramid whose gradients are found in bands of rows */
+struct grad_job
+{
+  IplImage* img;
+  struct grad_plane* plane;
+};
+
+/* features to be assigned orientations, and the orientations found */
+struct ori_job
+{
+  struct sift_ctx* ctx;
+  IplImage*** gauss_pyr;
+  struct grad_plane** grad;    /* gradient planes or NULL */
+  struct feature* feats;
+  double* oris;                /* SIFT_ORI_HIST_BINS orientations per feature */
+  int* noris;                  /* number of orientations per feature */
+};
+
+/* features whose descriptors are to be computed */
+struct descr_job
+{
+  struct sift_ctx* ctx;
+  IplImage*** gauss_pyr;
+  struct grad_plane** grad;    /* gradient planes or NULL */
+  struct feature** feats;
+  int d;
+  int n;
+};
+
+/* a feature's descriptor window, whose samples are gathered a row at a time */
+struct descr_window
+{
+  float cos_t;                 /* cos(ori) / histogram width */
+  float sin_t;                 /* sin(ori) / histogram width */
+  float off;                   /* offset from rotated coords to bin coords */
+  float d;                     /* width of the array of histograms */
+  float* wt;                   /* Gaussian weight of each row or col offset */
+  float* rbin;                 /* sub-bin row coords of a row's samples */
+  float* cbin;                 /* sub-bin column coords of a row's samples */
+  float* mag;                  /* weighted gradient magnitudes */
+  float* dx;                   /* horizontal gradients */
+  float* dy;                   /* vertical gradients */
+  float* ori;                  /* gradient orientations, if read from planes */
+};
+
 /************************* Local Function Prototypes *************************/
 
-static IplImage* create_init_img( IplImage*, int, double );
-static IplImage* convert_to_gray32( IplImage* );
-static IplImage*** build_gauss_pyr( IplImage*, int, int, double );
-static IplImage* downsample( IplImage* );
-static IplImage*** build_dog_pyr( IplImage***, int, int );
+static CvSeq* detect_features( struct sift_ctx*, IplImage* );
+static void reset_ctx( struct sift_ctx* );
+static int set_search( struct sift_ctx*, IplImage*, CvRect, IplImage*,
+		       CvRect* );
+static int mask_bounds( IplImage*, CvRect, CvRect* );
+static struct feature* features_to_array( CvSeq* );
+static int fit_buffers( struct sift_ctx*, CvSize );
+static CvSize base_size( struct sift_ctx*, CvSize );
+static int count_octvs( struct sift_ctx*, CvSize );
+static void release_buffers( struct sift_ctx* );
+static void create_init_img( struct sift_ctx*, IplImage* );
+static void convert_to_gray32( struct sift_ctx*, IplImage* );
+static void build_gauss_pyr( struct sift_ctx* );
+static void smooth( IplImage*, IplImage*, struct gauss_kernel*,
+		    struct thread_pool* );
+static void blur_rows( void*, int, int, int );
+static void downsample( IplImage*, IplImage* );
 static CvSeq* scale_space_extrema( IplImage***, int, int, double, int,
-				   CvMemStorage*);
-static int is_extremum( IplImage***, int, int, int, int );
+				   struct sift_ctx* );
+static void search_bounds( struct sift_ctx*, int, int, int, int*, int*,
+			   int*, int* );
+static void find_band_extrema( void*, int, int, int );
+static int masked( struct sift_ctx*, int, int, int );
+static void find_extrema_cands( IplImage**, int, double, int, int, int, int,
+				struct extrema_cands* );
+static void dog_row( IplImage**, int, int, int, int, float* );
+static int extrema_in_row( float**, int, float, int*, int );
+static int extrema_in_row_c( float**, int, int, float, int* );
+#ifdef SIFT_X86
+static int extrema_in_row_sse2( float**, int, float, int* );
+static int extrema_in_row_avx2( float**, int, float, int* );
+#endif
+static int loc_cmp( const void*, const void* );
 static struct feature* interp_extremum( IplImage***, int, int, int, int, int,
-					double);
+					double, struct arena* );
 static void interp_step( IplImage***, int, int, int, int, double*, double*,
 			 double* );
-static CvMat* deriv_3D( IplImage***, int, int, int, int );
-static CvMat* hessian_3D( IplImage***, int, int, int, int );
+static void deriv_3D( IplImage***, int, int, int, int, CvMat* );
+static void hessian_3D( IplImage***, int, int, int, int, CvMat* );
 static double interp_contr( IplImage***, int, int, int, int, double, double,
 			    double );
-static struct feature* new_feature( void );
-static int is_too_edge_like( IplImage*, int, int, int );
+static struct feature* new_feature( struct arena* );
+static int is_too_edge_like( IplImage***, int, int, int, int, int );
+static void keep_strongest( CvSeq*, struct sift_ctx* );
+static int contr_rank_cmp( const void*, const void* );
+static int cell_rank_cmp( const void*, const void* );
+static int index_rank_cmp( const void*, const void* );
 static void calc_feature_scales( CvSeq*, double, int );
-static void adjust_for_img_dbl( CvSeq* );
-static void calc_feature_oris( CvSeq*, IplImage*** );
-static double* ori_hist( IplImage*, int, int, int, int, double );
+static void adjust_for_img_scale( CvSeq*, double );
+static void build_grad_planes( CvSeq*, struct sift_ctx* );
+static void grad_rows( void*, int, int, int );
+static void calc_feature_oris( CvSeq*, IplImage***, struct grad_plane**,
+			       struct sift_ctx* );
+static void assign_oris( void*, int, int, int );
+static void ori_hist( IplImage*, struct grad_plane*, int, int, int, int,
+		      double, double* );
 static int calc_grad_mag_ori( IplImage*, int, int, double*, double* );
 static void smooth_ori_hist( double*, int );
 static double dominant_ori( double*, int );
-static void add_good_ori_features( CvSeq*, double*, int, double,
-				   struct feature* );
-static struct feature* clone_feature( struct feature* );
-static void compute_descriptors( CvSeq*, IplImage***, int, int );
-static double*** descr_hist( IplImage*, int, int, double, double, int, int );
-static void interp_hist_entry( double***, double, double, double, double, int,
-			       int);
-static void hist_to_descr( double***, int, int, struct feature* );
+static int good_oris( double*, int, double, double* );
+static void add_good_ori_features( CvSeq*, double*, int, struct feature*,
+				   struct arena* );
+static struct feature* clone_feature( struct feature*, struct arena* );
+static void compute_descriptors( CvSeq*, IplImage***, struct grad_plane**,
+				 int, int, struct sift_ctx* );
+static void describe_features( void*, int, int, int );
+static float* descr_hist( IplImage*, struct grad_plane*, int, int, double,
+			  double, int, int, struct arena* );
+static int gather_row( struct descr_window*, float*, float*, float*, int, int,
+		       int, int, int );
+static int gather_row_c( struct descr_window*, float*, float*, float*, int,
+			 int, int, int, int );
+#ifdef SIFT_X86
+static int gather_row_sse2( struct descr_window*, float*, float*, float*, int,
+			    int, int, int );
+static int gather_row_avx2( struct descr_window*, float*, float*, float*, int,
+			    int, int, int );
+#endif
+static void interp_hist_entry( float*, float, float, float, float, int, int );
+static void hist_to_descr( float*, int, int, struct feature* );
 static void normalize_descr( struct feature* );
 static int feature_cmp( void*, void*, void* );
-static void release_descr_hist( double****, int );
 static void release_pyr( IplImage****, int, int );
+static void release_grad_planes( struct grad_plane***, int, int );
+
+
+/************************** Local Inline Functions ***************************/
+
+/*
+  Returns the value of pixel (r,c) in interval intvl of a DoG octave,
+  computed from the Gaussian scale space pyramid exactly as cvSub() would
+  have computed it.
+*/
+static inline float dog_val( IplImage*** gauss_pyr, int octv, int intvl,
+			     int r, int c )
+{
+  return pixval32f( gauss_pyr[octv][intvl+1], r, c ) -
+    pixval32f( gauss_pyr[octv][intvl], r, c );
+}
 
 
 /*********************** Functions prototyped in sift.h **********************/
@@ -116,332 +313,1363 @@ int _sift_features( IplImage* img, struct feature** feat, int intvls,
 		    double sigma, double contr_thr, int curv_thr,
 		    int img_dbl, int descr_width, int descr_hist_bins )
 {
-  IplImage* init_img;
-  IplImage*** gauss_pyr, *** dog_pyr;
-  CvMemStorage* storage;
+  struct sift_params params;
+
+  sift_params_init( &params );
+  params.intvls = intvls;
+  params.sigma = sigma;
+  params.contr_thr = contr_thr;
+  params.curv_thr = curv_thr;
+  params.img_dbl = img_dbl;
+  params.descr_width = descr_width;
+  params.descr_hist_bins = descr_hist_bins;
+  return sift_features_params( img, feat, &params );
+}
+
+
+
+/*
+  Sets SIFT parameters to their default values
+
+  @param params SIFT parameters
+*/
+void sift_params_init( struct sift_params* params )
+{
+  if( ! params )
+    fatal_error( "NULL pointer error, %s, line %d",  __FILE__, __LINE__ );
+
+  params->intvls = SIFT_INTVLS;
+  params->sigma = SIFT_SIGMA;
+  params->contr_thr = SIFT_CONTR_THR;
+  params->curv_thr = SIFT_CURV_THR;
+  params->img_dbl = SIFT_IMG_DBL;
+  params->descr_width = SIFT_DESCR_WIDTH;
+  params->descr_hist_bins = SIFT_DESCR_HIST_BINS;
+  params->threads = SIFT_THREADS;
+  params->grad_planes = SIFT_GRAD_PLANES;
+  params->roi_margin = SIFT_ROI_MARGIN;
+  params->budget = SIFT_BUDGET;
+  params->budget_grid = SIFT_BUDGET_GRID;
+  params->first_octv = SIFT_FIRST_OCTV;
+  params->max_octvs = SIFT_MAX_OCTVS;
+}
+
+
+
+/*
+  Finds SIFT features in an image using the parameters in a sift_params
+  structure.
+
+  @param img the image in which to detect features
+  @param feat a pointer to an array in which to store detected features
+  @param params detection parameters
+
+  @return Returns the number of keypoints stored in feat or -1 on failure
+*/
+int sift_features_params( IplImage* img, struct feature** feat,
+			  const struct sift_params* params )
+{
+  struct sift_ctx* ctx;
+  int n;
+
+  ctx = sift_ctx_init( params );
+  if( ! ctx )
+    return -1;
+  n = sift_ctx_features( ctx, img, feat );
+  sift_ctx_release( &ctx );
+  return n;
+}
+
+
+
+/*
+  Finds SIFT features in an image using the parameters in a sift_params
+  structure and stores them in a compact feature set.
+
+  @param img the image in which to detect features
+  @param set a pointer to a feature set in which to store detected features
+  @param params detection parameters
+
+  @return Returns the number of features stored in set or -1 on failure
+*/
+int sift_features_set( IplImage* img, struct feature_set** set,
+		       const struct sift_params* params )
+{
+  struct sift_ctx* ctx;
+  int n;
+
+  ctx = sift_ctx_init( params );
+  if( ! ctx )
+    return -1;
+  n = sift_ctx_features_set( ctx, img, set );
+  sift_ctx_release( &ctx );
+  return n;
+}
+
+
+
+/*
+  Finds SIFT features in a region of interest of an image, optionally
+  restricted further by a mask.
+
+  @param img the image in which to detect features
+  @param roi region of img in which to detect features
+  @param mask 8-bit image whose nonzero pixels may hold features, or NULL
+  @param feat a pointer to an array in which to store detected features
+  @param params detection parameters
+
+  @return Returns the number of keypoints stored in feat or -1 on failure
+*/
+int sift_features_roi( IplImage* img, CvRect roi, IplImage* mask,
+		       struct feature** feat, const struct sift_params* params )
+{
+  struct sift_ctx* ctx;
+  int n;
+
+  ctx = sift_ctx_init( params );
+  if( ! ctx )
+    return -1;
+  n = sift_ctx_features_roi( ctx, img, roi, mask, feat );
+  sift_ctx_release( &ctx );
+  return n;
+}
+
+
+
+/*
+  Creates a context for detecting SIFT features in a series of images.
+
+  @param params detection parameters; copied into the context
+
+  @return Returns a new context or NULL if the parameters are invalid
+*/
+struct sift_ctx* sift_ctx_init( const struct sift_params* params )
+{
+  struct sift_ctx* ctx;
+  double sig_diff;
+  int i;
+
+  if( ! params )
+    fatal_error( "NULL pointer error, %s, line %d",  __FILE__, __LINE__ );
+  if( params->first_octv < 0 )
+    {
+      fprintf( stderr, "Warning: first octave %d is negative; use img_dbl" \
+	       " to double the image, %s line %d\n", params->first_octv,
+	       __FILE__, __LINE__ );
+      return NULL;
+    }
+
+  ctx = calloc( 1, sizeof( struct sift_ctx ) );
+  ctx->params = *params;
+
+  /* first_octv counts octaves of the pyramid that would otherwise be
+     built, whose first octave is the doubled image when img_dbl is set */
+  ctx->shift = params->first_octv - ( ( params->img_dbl )? 1 : 0 );
+  ctx->step = pow( 2.0, ctx->shift );
+
+  /* if threads can't be started, fall back to running on this one */
+  if( params->threads != 1 )
+    ctx->pool = thread_pool_init( params->threads );
+  ctx->arenas = calloc( thread_pool_size( ctx->pool ),
+			sizeof( struct arena* ) );
+  for( i = 0; i < thread_pool_size( ctx->pool ); i++ )
+    ctx->arenas[i] = arena_init( 0 );
+  ctx->storage = cvCreateMemStorage( 0 );
+
+  /* kernels depend only on the parameters, so they're made once */
+  if( ctx->shift < 0 )
+    sig_diff = sqrt( params->sigma * params->sigma -
+		     SIFT_INIT_SIGMA * SIFT_INIT_SIGMA * 4 );
+  else
+    sig_diff = sqrt( params->sigma * params->sigma -
+		     SIFT_INIT_SIGMA * SIFT_INIT_SIGMA );
+  ctx->init_kernel = create_gauss_kernel( sig_diff );
+  ctx->kernels = create_pyr_kernels( params->intvls, params->sigma );
+
+  return ctx;
+}
+
+
+
+/*
+  Allocates the buffers in which a detection context builds the scale space
+  of images of a given size.
+
+  @param ctx a detection context
+  @param size size of the images in which features will be detected
+*/
+void sift_ctx_reserve( struct sift_ctx* ctx, CvSize size )
+{
+  if( ! ctx )
+    fatal_error( "NULL pointer error, %s, line %d",  __FILE__, __LINE__ );
+  fit_buffers( ctx, size );
+}
+
+
+
+/*
+  Finds SIFT features in an image using a detection context.
+
+  @param ctx a detection context
+  @param img the image in which to detect features
+  @param feat a pointer to an array in which to store detected features
+
+  @return Returns the number of keypoints stored in feat or -1 on failure
+*/
+int sift_ctx_features( struct sift_ctx* ctx, IplImage* img,
+		       struct feature** feat )
+{
   CvSeq* features;
-  int octvs, i, n = 0;
-  
+  int n;
+
   /* check arguments */
+  if( ! ctx )
+    fatal_error( "NULL pointer error, %s, line %d",  __FILE__, __LINE__ );
   if( ! img )
     fatal_error( "NULL pointer error, %s, line %d",  __FILE__, __LINE__ );
   if( ! feat )
     fatal_error( "NULL pointer error, %s, line %d",  __FILE__, __LINE__ );
 
-  /* build scale space pyramid; smallest dimension of top level is ~4 pixels */
-  init_img = create_init_img( img, img_dbl, sigma );
-  octvs = log( MIN( init_img->width, init_img->height ) ) / log(2) - 2;
-  gauss_pyr = build_gauss_pyr( init_img, octvs, intvls, sigma );
-  dog_pyr = build_dog_pyr( gauss_pyr, octvs, intvls );
-  
-  storage = cvCreateMemStorage( 0 );
-  features = scale_space_extrema( dog_pyr, octvs, intvls, contr_thr,
-				  curv_thr, storage );
-  calc_feature_scales( features, sigma, intvls );
-  if( img_dbl )
-    adjust_for_img_dbl( features );
-  calc_feature_oris( features, gauss_pyr );
-  compute_descriptors( features, gauss_pyr, descr_width, descr_hist_bins );
-
-  /* sort features by decreasing scale and move from CvSeq to array */
-  cvSeqSort( features, (CvCmpFunc)feature_cmp, NULL );
+  ctx->search = cvRect( 0, 0, cvGetSize( img ).width, cvGetSize( img ).height );
+  ctx->origin = cvPoint( 0, 0 );
+  ctx->mask = NULL;
+  features = detect_features( ctx, img );
+  if( ! features )
+    return -1;
   n = features->total;
-  *feat = calloc( n, sizeof(struct feature) );
-  *feat = cvCvtSeqToArray( features, *feat, CV_WHOLE_SEQ );
-  for( i = 0; i < n; i++ )
+  *feat = features_to_array( features );
+  reset_ctx( ctx );
+  return n;
+}
+
+
+
+/*
+  Finds SIFT features in an image using a detection context and stores them
+  in a compact feature set.
+
+  @param ctx a detection context
+  @param img the image in which to detect features
+  @param set a pointer to a feature set in which to store detected features
+
+  @return Returns the number of features stored in set or -1 on failure
+*/
+int sift_ctx_features_set( struct sift_ctx* ctx, IplImage* img,
+			   struct feature_set** set )
+{
+  CvSeq* features;
+  struct sift_params* params;
+  int i, n;
+
+  /* check arguments */
+  if( ! ctx )
+    fatal_error( "NULL pointer error, %s, line %d",  __FILE__, __LINE__ );
+  if( ! img )
+    fatal_error( "NULL pointer error, %s, line %d",  __FILE__, __LINE__ );
+  if( ! set )
+    fatal_error( "NULL pointer error, %s, line %d",  __FILE__, __LINE__ );
+  params = &ctx->params;
+
+  /* features are copied straight from the CvSeq; no struct array is made */
+  ctx->search = cvRect( 0, 0, cvGetSize( img ).width, cvGetSize( img ).height );
+  ctx->origin = cvPoint( 0, 0 );
+  ctx->mask = NULL;
+  features = detect_features( ctx, img );
+  if( ! features )
     {
-      free( (*feat)[i].feature_data );
-      (*feat)[i].feature_data = NULL;
+      *set = NULL;
+      return -1;
     }
-  
-  cvReleaseMemStorage( &storage );
-  cvReleaseImage( &init_img );
-  release_pyr( &gauss_pyr, octvs, intvls + 3 );
-  release_pyr( &dog_pyr, octvs, intvls + 2 );
+  n = features->total;
+  *set = feature_set_init( n, params->descr_width * params->descr_width *
+			   params->descr_hist_bins );
+  if( *set )
+    for( i = 0; i < n; i++ )
+      feature_set_store( *set, i,
+			 CV_GET_SEQ_ELEM( struct feature, features, i ) );
+  reset_ctx( ctx );
+  return ( *set )? n : -1;
+}
+
+
+
+/*
+  Finds SIFT features in a region of interest of an image, optionally
+  restricted further by a mask, using a detection context.  The image's ROI
+  is pointed at the region over which the pyramid is built while features
+  are detected, then restored.
+
+  @param ctx a detection context
+  @param img the image in which to detect features
+  @param roi region of img in which to detect features
+  @param mask 8-bit image whose nonzero pixels may hold features, or NULL
+  @param feat a pointer to an array in which to store detected features
+
+  @return Returns the number of keypoints stored in feat or -1 on failure
+*/
+int sift_ctx_features_roi( struct sift_ctx* ctx, IplImage* img, CvRect roi,
+			   IplImage* mask, struct feature** feat )
+{
+  CvSeq* features;
+  CvRect pyr_rect, img_roi;
+  int n, had_roi;
+
+  /* check arguments */
+  if( ! ctx )
+    fatal_error( "NULL pointer error, %s, line %d",  __FILE__, __LINE__ );
+  if( ! img )
+    fatal_error( "NULL pointer error, %s, line %d",  __FILE__, __LINE__ );
+  if( ! feat )
+    fatal_error( "NULL pointer error, %s, line %d",  __FILE__, __LINE__ );
+
+  *feat = NULL;
+  n = set_search( ctx, img, roi, mask, &pyr_rect );
+  if( n <= 0 )
+    return n;
+
+  had_roi = img->roi != NULL;
+  img_roi = cvGetImageROI( img );
+  cvSetImageROI( img, pyr_rect );
+  features = detect_features( ctx, img );
+  if( had_roi )
+    cvSetImageROI( img, img_roi );
+  else
+    cvResetImageROI( img );
+  if( ! features )
+    return -1;
+
+  n = features->total;
+  *feat = features_to_array( features );
+  reset_ctx( ctx );
   return n;
 }
 
 
+
+/*
+  De-allocates a detection context
+
+  @param ctx pointer to a detection context
+*/
+void sift_ctx_release( struct sift_ctx** ctx )
+{
+  int i;
+
+  if( ! ctx  ||  ! *ctx )
+    return;
+  for( i = 0; i < thread_pool_size( (*ctx)->pool ); i++ )
+    arena_release( &(*ctx)->arenas[i] );
+  free( (*ctx)->arenas );
+  thread_pool_release( &(*ctx)->pool );
+  cvReleaseMemStorage( &(*ctx)->storage );
+  release_buffers( *ctx );
+  release_gauss_kernel( &(*ctx)->init_kernel );
+  release_pyr_kernels( &(*ctx)->kernels, (*ctx)->params.intvls );
+  free( *ctx );
+  *ctx = NULL;
+}
+
+
 /************************ Functions prototyped here **************************/
 
 /*
-  Converts an image to 8-bit grayscale and Gaussian-smooths it.  The image is
-  optionally doubled in size prior to smoothing.
+  Detects SIFT features in an image and computes their descriptors.  The
+  features, and the detection data they point to, live in the memory of
+  ctx until reset_ctx() is called.  The scale space is built in buffers
+  kept by ctx, which are reallocated only when the image size changes.
 
-  @param img input image
-  @param img_dbl if true, image is doubled in size prior to smoothing
-  @param sigma total std of Gaussian smoothing
+  @param ctx a detection context
+  @param img the image in which to detect features
+
+  @return Returns the features found, sorted by decreasing scale, or NULL
+    if the image is too small for the context's first octave
 */
-static IplImage* create_init_img( IplImage* img, int img_dbl, double sigma )
+static CvSeq* detect_features( struct sift_ctx* ctx, IplImage* img )
 {
-  IplImage* gray, * dbl;
-  double sig_diff;
+  CvSeq* features;
+  struct feature* feat;
+  struct sift_params* params = &ctx->params;
+  int i;
 
-  gray = convert_to_gray32( img );
-  if( img_dbl )
+  /* build scale space pyramid; smallest dimension of top level is ~4 pixels */
+  if( fit_buffers( ctx, cvGetSize( img ) ) )
+    return NULL;
+  create_init_img( ctx, img );
+  build_gauss_pyr( ctx );
+
+  features = scale_space_extrema( ctx->gauss_pyr, ctx->octvs, params->intvls,
+				  params->contr_thr, params->curv_thr, ctx );
+  if( params->budget > 0 )
+    keep_strongest( features, ctx );
+  calc_feature_scales( features, params->sigma, params->intvls );
+  if( ctx->step != 1.0 )
+    adjust_for_img_scale( features, ctx->step );
+  if( params->grad_planes )
+    build_grad_planes( features, ctx );
+  calc_feature_oris( features, ctx->gauss_pyr, ctx->grad, ctx );
+
+  /* extra orientations can take a budgeted image over its budget again */
+  if( params->budget > 0 )
+    keep_strongest( features, ctx );
+  compute_descriptors( features, ctx->gauss_pyr, ctx->grad,
+		       params->descr_width, params->descr_hist_bins, ctx );
+
+  /* sort features by decreasing scale */
+  cvSeqSort( features, (CvCmpFunc)feature_cmp, NULL );
+
+  /* features are reported in the coordinates of the whole image */
+  if( ctx->origin.x  ||  ctx->origin.y )
+    for( i = 0; i < features->total; i++ )
+      {
+	feat = CV_GET_SEQ_ELEM( struct feature, features, i );
+	feat->img_pt.x = feat->x += ctx->origin.x;
+	feat->img_pt.y = feat->y += ctx->origin.y;
+      }
+
+  return features;
+}
+
+
+
+/*
+  Releases all memory a detection context used for the last image, keeping
+  it for the next.
+
+  @param ctx a detection context
+*/
+static void reset_ctx( struct sift_ctx* ctx )
+{
+  int i;
+
+  for( i = 0; i < thread_pool_size( ctx->pool ); i++ )
+    arena_reset( ctx->arenas[i] );
+  cvClearMemStorage( ctx->storage );
+}
+
+
+
+/*
+  Sets the region of an image that a detection context searches for
+  extrema, and finds the region over which its pyramid must be built: the
+  search region expanded by the context's margin, with its origin moved
+  back to a multiple of the interval at which the pyramid's top octave
+  samples the image, so that every octave samples the same pixels as it
+  would in the whole image.
+
+  @param ctx a detection context
+  @param img an image
+  @param roi region of img to search
+  @param mask 8-bit image whose nonzero pixels may hold features, or NULL
+  @param pyr_rect output as the region of img over which to build the
+    pyramid
+
+  @return Returns 1 if there is a region to search, 0 if the region, or
+    the part of the mask within it, is empty, or -1 if the mask is invalid
+*/
+static int set_search( struct sift_ctx* ctx, IplImage* img, CvRect roi,
+		       IplImage* mask, CvRect* pyr_rect )
+{
+  int margin = ctx->params.roi_margin;
+  int x0, y0, x1, y1, align, octvs, n;
+
+  if( mask  &&  ( mask->width != img->width  ||
+		  mask->height != img->height  ||
+		  mask->depth != IPL_DEPTH_8U  ||  mask->nChannels != 1 ) )
     {
-      sig_diff = sqrt( sigma * sigma - SIFT_INIT_SIGMA * SIFT_INIT_SIGMA * 4 );
-      dbl = cvCreateImage( cvSize( img->width*2, img->height*2 ),
-			   IPL_DEPTH_32F, 1 );
-      cvResize( gray, dbl, CV_INTER_CUBIC );
-      cvSmooth( dbl, dbl, CV_GAUSSIAN, 0, 0, sig_diff, sig_diff );
-      cvReleaseImage( &gray );
-      return dbl;
+      fprintf( stderr, "Warning: mask must be an 8-bit, single-channel image"
+	       " the size of the image, %s line %d\n", __FILE__, __LINE__ );
+      return -1;
     }
-  else
+
+  x0 = MAX( roi.x, 0 );
+  y0 = MAX( roi.y, 0 );
+  x1 = MIN( roi.x + roi.width, img->width );
+  y1 = MIN( roi.y + roi.height, img->height );
+  if( x1 <= x0  ||  y1 <= y0 )
+    return 0;
+  ctx->search = cvRect( x0, y0, x1 - x0, y1 - y0 );
+  if( mask  &&  ! mask_bounds( mask, ctx->search, &ctx->search ) )
+    return 0;
+  ctx->mask = mask;
+
+  x0 = MAX( ctx->search.x - margin, 0 );
+  y0 = MAX( ctx->search.y - margin, 0 );
+  x1 = MIN( ctx->search.x + ctx->search.width + margin, img->width );
+  y1 = MIN( ctx->search.y + ctx->search.height + margin, img->height );
+
+  /* octave o samples every 2^o x step pixels; aligning can add an octave */
+  octvs = count_octvs( ctx, cvSize( x1 - x0, y1 - y0 ) );
+  while( 1 )
     {
-      sig_diff = sqrt( sigma * sigma - SIFT_INIT_SIGMA * SIFT_INIT_SIGMA );
-      cvSmooth( gray, gray, CV_GAUSSIAN, 0, 0, sig_diff, sig_diff );
-      return gray;
+      align = MAX( (int)( ( 1 << MAX( octvs - 1, 0 ) ) * ctx->step ), 1 );
+      n = count_octvs( ctx, cvSize( x1 - x0 / align * align,
+				    y1 - y0 / align * align ) );
+      if( n <= octvs )
+	break;
+      octvs = n;
     }
+  x0 = x0 / align * align;
+  y0 = y0 / align * align;
+  ctx->origin = cvPoint( x0, y0 );
+  *pyr_rect = cvRect( x0, y0, x1 - x0, y1 - y0 );
+  return 1;
 }
 
 
 
 /*
-  Converts an image to 32-bit grayscale
+  Finds the bounding box of the nonzero pixels of a mask within a region
 
-  @param img a 3-channel 8-bit color (BGR) or 8-bit gray image
+  @param mask an 8-bit, single-channel image
+  @param rect region of mask to examine
+  @param bounds output as the bounding box
 
-  @return Returns a 32-bit grayscale image
+  @return Returns 1 if any pixel in rect is nonzero or 0 otherwise
 */
-static IplImage* convert_to_gray32( IplImage* img )
+static int mask_bounds( IplImage* mask, CvRect rect, CvRect* bounds )
 {
-  IplImage* gray8, * gray32;
-  
-  gray32 = cvCreateImage( cvGetSize(img), IPL_DEPTH_32F, 1 );
-  if( img->nChannels == 1 )
-    gray8 = cvClone( img );
-  else
+  unsigned char* m;
+  int x0 = INT_MAX, y0 = INT_MAX, x1 = -1, y1 = -1, x, y;
+
+  for( y = rect.y; y < rect.y + rect.height; y++ )
     {
-      gray8 = cvCreateImage( cvGetSize(img), IPL_DEPTH_8U, 1 );
-      cvCvtColor( img, gray8, CV_BGR2GRAY );
+      m = (unsigned char*)( mask->imageData + mask->widthStep * y );
+      for( x = rect.x; x < rect.x + rect.width; x++ )
+	if( m[x] )
+	  {
+	    x0 = MIN( x0, x );
+	    x1 = MAX( x1, x );
+	    y0 = MIN( y0, y );
+	    y1 = y;
+	  }
     }
-  cvConvertScale( gray8, gray32, 1.0 / 255.0, 0 );
+  if( x1 < 0 )
+    return 0;
+  *bounds = cvRect( x0, y0, x1 - x0 + 1, y1 - y0 + 1 );
+  return 1;
+}
+
+
+
+/*
+  Copies detected features from a CvSeq to a new array.  Their detection
+  data lives in arenas that are emptied all at once, so it is not kept.
+
+  @param features detected features
 
-  cvReleaseImage( &gray8 );
-  return gray32;
+  @return Returns an array of the features, which the caller must free
+*/
+static struct feature* features_to_array( CvSeq* features )
+{
+  struct feature* feat;
+  int i, n = features->total;
+
+  feat = calloc( n, sizeof(struct feature) );
+  feat = cvCvtSeqToArray( features, feat, CV_WHOLE_SEQ );
+  for( i = 0; i < n; i++ )
+    feat[i].feature_data = NULL;
+  return feat;
 }
 
 
 
 /*
-  Builds Gaussian scale space pyramid from an image
+  Makes sure a detection context's scale space buffers fit images of a
+  given size, reallocating them if they were made for another size.  Every
+  level of the Gaussian pyramid is allocated here; gradient planes are
+  allocated by build_grad_planes() for the levels on which features lie.
 
-  @param base base image of the pyramid
-  @param octvs number of octaves of scale space
-  @param intvls number of intervals per octave
-  @param sigma amount of Gaussian smoothing per octave
+  @param ctx a detection context
+  @param size size of the image in which features are to be detected
 
-  @return Returns a Gaussian scale space pyramid as an octvs x (intvls + 3)
-    array
+  @return Returns 0 on success or -1 if the image is too small for the
+    context's first octave
 */
-static IplImage*** build_gauss_pyr( IplImage* base, int octvs,
-			     int intvls, double sigma )
+static int fit_buffers( struct sift_ctx* ctx, CvSize size )
 {
-  IplImage*** gauss_pyr;
-  const int _intvls = intvls;
-  double sig[_intvls+3], sig_total, sig_prev, k;
+  CvSize lvl_size;
+  int intvls = ctx->params.intvls;
   int i, o;
 
-  gauss_pyr = calloc( octvs, sizeof( IplImage** ) );
-  for( i = 0; i < octvs; i++ )
-    gauss_pyr[i] = calloc( intvls + 3, sizeof( IplImage *) );
+  if( size.width == ctx->size.width  &&  size.height == ctx->size.height )
+    return 0;
+  release_buffers( ctx );
+  if( count_octvs( ctx, size ) < 1 )
+    {
+      fprintf( stderr, "Warning: %d x %d image is too small to start at" \
+	       " octave %d, %s line %d\n", size.width, size.height,
+	       ctx->params.first_octv, __FILE__, __LINE__ );
+      return -1;
+    }
+  ctx->size = size;
+
+  ctx->gray = cvCreateImage( size, IPL_DEPTH_32F, 1 );
+  lvl_size = base_size( ctx, size );
+  if( ctx->shift < 0 )
+    ctx->dbl = cvCreateImage( lvl_size, IPL_DEPTH_32F, 1 );
+  else if( ctx->shift > 0 )
+    ctx->small = cvCreateImage( lvl_size, IPL_DEPTH_32F, 1 );
+
+  ctx->octvs = count_octvs( ctx, size );
+  ctx->gauss_pyr = calloc( ctx->octvs, sizeof( IplImage** ) );
+  for( o = 0; o < ctx->octvs; o++ )
+    {
+      ctx->gauss_pyr[o] = calloc( intvls + 3, sizeof( IplImage* ) );
+      for( i = 0; i < intvls + 3; i++ )
+	ctx->gauss_pyr[o][i] = cvCreateImage( lvl_size, IPL_DEPTH_32F, 1 );
 
-  /*
-    precompute Gaussian sigmas using the following formula:
+      /* each octave is downsampled from the one below it */
+      lvl_size = cvSize( lvl_size.width / 2, lvl_size.height / 2 );
+    }
 
-    \sigma_{total}^2 = \sigma_{i}^2 + \sigma_{i-1}^2
+  if( ctx->params.grad_planes )
+    {
+      ctx->grad = calloc( ctx->octvs, sizeof( struct grad_plane* ) );
+      for( o = 0; o < ctx->octvs; o++ )
+	ctx->grad[o] = calloc( intvls + 3, sizeof( struct grad_plane ) );
+    }
 
-    sig[i] is the incremental sigma value needed to compute 
-    the actual sigma of level i. Keeping track of incremental
-    sigmas vs. total sigmas keeps the gaussian kernel small.
-  */
-  k = pow( 2.0, 1.0 / intvls );
-  sig[0] = sigma;
-  sig[1] = sigma * sqrt( k*k- 1 );
-  for (i = 2; i < intvls + 3; i++)
-      sig[i] = sig[i-1] * k;
+  return 0;
+}
 
-  for( o = 0; o < octvs; o++ )
+
+
+/*
+  Finds the size of the base of the pyramid built for an image: the image
+  doubled, or downsampled to its first octave, or as it is
+
+  @param ctx a detection context
+  @param size size of an image
+
+  @return Returns the size of the pyramid's base
+*/
+static CvSize base_size( struct sift_ctx* ctx, CvSize size )
+{
+  int k = ctx->shift;
+
+  if( k < 0 )
+    return cvSize( size.width * 2, size.height * 2 );
+  if( k > 0 )
+    return cvSize( size.width >> k, size.height >> k );
+  return size;
+}
+
+
+
+/*
+  Finds the number of octaves in the pyramid built for an image: enough
+  that the smallest dimension of the top octave is about 4 pixels, but at
+  least one and no more than the context's cap
+
+  @param ctx a detection context
+  @param size size of an image
+
+  @return Returns the number of octaves, or 0 if the base of the pyramid
+    would be empty
+*/
+static int count_octvs( struct sift_ctx* ctx, CvSize size )
+{
+  int octvs, max = ctx->params.max_octvs;
+
+  size = base_size( ctx, size );
+  if( size.width < 1  ||  size.height < 1 )
+    return 0;
+  octvs = log( MIN( size.width, size.height ) ) / log(2) - 2;
+  octvs = MAX( octvs, 1 );
+  if( max > 0  &&  octvs > max )
+    octvs = max;
+  return octvs;
+}
+
+
+
+/*
+  De-allocates a detection context's scale space buffers
+
+  @param ctx a detection context
+*/
+static void release_buffers( struct sift_ctx* ctx )
+{
+  cvReleaseImage( &ctx->gray8 );
+  cvReleaseImage( &ctx->gray );
+  cvReleaseImage( &ctx->dbl );
+  cvReleaseImage( &ctx->small );
+  if( ctx->gauss_pyr )
+    release_pyr( &ctx->gauss_pyr, ctx->octvs, ctx->params.intvls + 3 );
+  release_grad_planes( &ctx->grad, ctx->octvs, ctx->params.intvls + 3 );
+  ctx->size = cvSize( 0, 0 );
+  ctx->octvs = 0;
+}
+
+
+
+/*
+  Converts an image to grayscale, optionally doubles it in size or
+  downsamples it to its first octave, and Gaussian-smooths it into the base
+  of a detection context's pyramid.  A downsampled image is assumed to be
+  blurred by SIFT_INIT_SIGMA, like the input image.
+
+  @param ctx a detection context whose buffers fit img
+  @param img input image
+*/
+static void create_init_img( struct sift_ctx* ctx, IplImage* img )
+{
+  IplImage* gray;
+
+  convert_to_gray32( ctx, img );
+  gray = ctx->gray;
+  if( ctx->dbl )
+    {
+      cvResize( gray, ctx->dbl, CV_INTER_CUBIC );
+      gray = ctx->dbl;
+    }
+  else if( ctx->small )
+    {
+      cvResize( gray, ctx->small, CV_INTER_AREA );
+      gray = ctx->small;
+    }
+
+  if( ctx->octvs > 0 )
+    smooth( gray, ctx->gauss_pyr[0][0], ctx->init_kernel, ctx->pool );
+}
+
+
+
+/*
+  Converts an image to 32-bit grayscale in a detection context's gray
+  buffer
+
+  @param ctx a detection context whose buffers fit img
+  @param img a 3-channel 8-bit color (BGR) or 8-bit gray image
+*/
+static void convert_to_gray32( struct sift_ctx* ctx, IplImage* img )
+{
+  IplImage* gray8 = img;
+
+  if( img->nChannels != 1 )
+    {
+      if( ! ctx->gray8 )
+	ctx->gray8 = cvCreateImage( cvGetSize(img), IPL_DEPTH_8U, 1 );
+      gray8 = ctx->gray8;
+      cvCvtColor( img, gray8, CV_BGR2GRAY );
+    }
+  cvConvertScale( gray8, ctx->gray, 1.0 / 255.0, 0 );
+}
+
+
+
+/*
+  Builds a Gaussian scale space pyramid in a detection context's buffers
+  from the base already stored in its first level
+
+  @param ctx a detection context
+*/
+static void build_gauss_pyr( struct sift_ctx* ctx )
+{
+  IplImage*** gauss_pyr = ctx->gauss_pyr;
+  int intvls = ctx->params.intvls;
+  int i, o;
+
+  for( o = 0; o < ctx->octvs; o++ )
     for( i = 0; i < intvls + 3; i++ )
       {
 	if( o == 0  &&  i == 0 )
-	  gauss_pyr[o][i] = cvCloneImage(base);
+	  continue;
 
 	/* base of new octvave is halved image from end of previous octave */
 	else if( i == 0 )
-	  gauss_pyr[o][i] = downsample( gauss_pyr[o-1][intvls] );
-	  
-	/* blur the current octave's last image to create the next one */
+	  downsample( gauss_pyr[o-1][intvls], gauss_pyr[o][i] );
+
+	/* blur the current octave's last image to create the next one;
+	   kernels[i] holds the incremental blur that produces level i */
 	else
-	  {
-	    gauss_pyr[o][i] = cvCreateImage( cvGetSize(gauss_pyr[o][i-1]),
-					     IPL_DEPTH_32F, 1 );
-	    cvSmooth( gauss_pyr[o][i-1], gauss_pyr[o][i],
-		      CV_GAUSSIAN, 0, 0, sig[i], sig[i] );
-	  }
+	  smooth( gauss_pyr[o][i-1], gauss_pyr[o][i], ctx->kernels[i],
+		  ctx->pool );
       }
-
-  return gauss_pyr;
 }
 
 
 
 /*
-  Downsamples an image to a quarter of its size (half in each dimension)
-  using nearest-neighbor interpolation
-
-  @param img an image
+  Blurs an image with a Gaussian kernel, splitting the image into bands of
+  rows that are blurred concurrently when a thread pool is given.
 
-  @return Returns an image whose dimensions are half those of img
+  @param src source image
+  @param dst destination image; may be src only if pool is NULL
+  @param kernel the Gaussian kernel with which to blur
+  @param pool threads with which to blur, or NULL
 */
-static IplImage* downsample( IplImage* img )
+static void smooth( IplImage* src, IplImage* dst, struct gauss_kernel* kernel,
+		    struct thread_pool* pool )
 {
-  IplImage* smaller = cvCreateImage( cvSize(img->width / 2, img->height / 2),
-				     img->depth, img->nChannels );
-  cvResize( img, smaller, CV_INTER_NN );
+  struct blur_job job;
 
-  return smaller;
+  if( ! pool )
+    {
+      gauss_smooth( src, dst, kernel );
+      return;
+    }
+
+  job.src = src;
+  job.dst = dst;
+  job.kernel = kernel;
+  parallel_for( pool, src->height, SIFT_PAR_MIN_ROWS, blur_rows, &job );
 }
 
 
 
 /*
-  Builds a difference of Gaussians scale space pyramid by subtracting adjacent
-  intervals of a Gaussian pyramid
-
-  @param gauss_pyr Gaussian scale-space pyramid
-  @param octvs number of octaves of scale space
-  @param intvls number of intervals per octave
+  Blurs a band of rows of a pyramid level; run by parallel_for()
 
-  @return Returns a difference of Gaussians scale space pyramid as an
-    octvs x (intvls + 2) array
+  @param ctx a struct blur_job
+  @param begin first row of the band
+  @param end one past the last row of the band
+  @param tid index of the calling thread
 */
-static IplImage*** build_dog_pyr( IplImage*** gauss_pyr, int octvs, int intvls )
+static void blur_rows( void* ctx, int begin, int end, int tid )
 {
-  IplImage*** dog_pyr;
-  int i, o;
+  struct blur_job* job = ctx;
 
-  dog_pyr = calloc( octvs, sizeof( IplImage** ) );
-  for( i = 0; i < octvs; i++ )
-    dog_pyr[i] = calloc( intvls + 2, sizeof(IplImage*) );
+  gauss_smooth_rows( job->src, job->dst, job->kernel, begin, end );
+}
 
-  for( o = 0; o < octvs; o++ )
-    for( i = 0; i < intvls + 2; i++ )
-      {
-	dog_pyr[o][i] = cvCreateImage( cvGetSize(gauss_pyr[o][i]),
-				       IPL_DEPTH_32F, 1 );
-	cvSub( gauss_pyr[o][i+1], gauss_pyr[o][i], dog_pyr[o][i], NULL );
-      }
 
-  return dog_pyr;
+
+/*
+  Downsamples an image to a quarter of its size (half in each dimension)
+  using nearest-neighbor interpolation
+
+  @param img an image
+  @param smaller output as img downsampled; its dimensions must be half
+    those of img
+*/
+static void downsample( IplImage* img, IplImage* smaller )
+{
+  cvResize( img, smaller, CV_INTER_NN );
 }
 
 
 
 /*
   Detects features at extrema in DoG scale space.  Bad features are discarded
-  based on contrast and ratio of principal curvatures.
+  based on contrast and ratio of principal curvatures.  Full DoG images are
+  never built; candidate extrema are found by find_extrema_cands(), and the
+  few DoG values needed to refine each candidate are computed on demand from
+  the Gaussian pyramid.
+
+  Each octave is split into bands of rows that are searched and refined
+  concurrently when a thread pool is given.  Refined features are then
+  collected band by band in the same interval-major raster order in which a
+  single thread would find them, so the result doesn't depend on the number
+  of bands.
 
-  @param dog_pyr DoG scale space pyramid
-  @param octvs octaves of scale space represented by dog_pyr
+  @param gauss_pyr Gaussian scale space pyramid
+  @param octvs octaves of scale space represented by gauss_pyr
   @param intvls intervals per octave
   @param contr_thr low threshold on feature contrast
   @param curv_thr high threshold on feature ratio of principal curvatures
-  @param storage memory storage in which to store detected features
+  @param ctx detection context whose threads search each octave, whose
+    arenas hold detection data, and whose storage holds detected features
 
   @return Returns an array of detected features whose scales, orientations,
     and descriptors are yet to be determined.
 */
-static CvSeq* scale_space_extrema( IplImage*** dog_pyr, int octvs, int intvls,
-				   double contr_thr, int curv_thr,
-				   CvMemStorage* storage )
+static CvSeq* scale_space_extrema( IplImage*** gauss_pyr, int octvs,
+				   int intvls, double contr_thr, int curv_thr,
+				   struct sift_ctx* ctx )
 {
   CvSeq* features;
-  double prelim_contr_thr = 0.5 * contr_thr / intvls;
   struct feature* feat;
   struct detection_data* ddata;
-  int o, i, r, c;
+  struct extrema_cands* cands;
+  struct extrema_job job;
+  int o, i, j, b, w, rows;
   unsigned long* feature_mat;
 
-  features = cvCreateSeq( 0, sizeof(CvSeq), sizeof(struct feature), storage );
+  features = cvCreateSeq( 0, sizeof(CvSeq), sizeof(struct feature),
+			  ctx->storage );
+  job.ctx = ctx;
+  job.gauss_pyr = gauss_pyr;
+  job.intvls = intvls;
+  job.contr_thr = contr_thr;
+  job.curv_thr = curv_thr;
   for( o = 0; o < octvs; o++ )
   {
-    feature_mat = calloc( dog_pyr[o][0]->height * dog_pyr[o][0]->width, sizeof(unsigned long) );
+    w = gauss_pyr[o][0]->width;
+    search_bounds( ctx, o, w, gauss_pyr[o][0]->height, &job.r0, &job.r1,
+		   &job.c0, &job.c1 );
+    rows = job.r1 - job.r0;
+    if( rows <= 0  ||  job.c1 <= job.c0 )
+      continue;
+    job.octv = o;
+    job.nbands = MIN( 4 * thread_pool_size( ctx->pool ),
+		      rows / SIFT_PAR_MIN_ROWS );
+    job.nbands = MAX( job.nbands, 1 );
+    job.cands = calloc( job.nbands, sizeof( struct extrema_cands* ) );
+    for( b = 0; b < job.nbands; b++ )
+      job.cands[b] = calloc( intvls + 2, sizeof( struct extrema_cands ) );
+    parallel_for( ctx->pool, job.nbands, 1, find_band_extrema, &job );
+
+    feature_mat = calloc( gauss_pyr[o][0]->height * w, sizeof(unsigned long) );
     for( i = 1; i <= intvls; i++ )
-      for(r = SIFT_IMG_BORDER; r < dog_pyr[o][0]->height-SIFT_IMG_BORDER; r++)
-	for(c = SIFT_IMG_BORDER; c < dog_pyr[o][0]->width-SIFT_IMG_BORDER; c++)
-	  /* perform preliminary check on contrast */
-	  if( ABS( pixval32f( dog_pyr[o][i], r, c ) ) > prelim_contr_thr )
-	    if( is_extremum( dog_pyr, o, i, r, c ) )
-	      {
-		feat = interp_extremum(dog_pyr, o, i, r, c, intvls, contr_thr);
-		if( feat )
-		  {
-		    ddata = feat_detection_data( feat );
-		    if( ! is_too_edge_like( dog_pyr[ddata->octv][ddata->intvl],
-					    ddata->r, ddata->c, curv_thr ) )
-		      {
-                        if( ddata->intvl > sizeof(unsigned long) )
-                          cvSeqPush( features, feat );
-                        else if( (feature_mat[dog_pyr[o][0]->width * ddata->r + ddata->c] & (1 << ddata->intvl-1)) == 0 )
-                        {
-                          cvSeqPush( features, feat );
-                          feature_mat[dog_pyr[o][0]->width * ddata->r + ddata->c] += 1 << ddata->intvl-1;
-                        }
-		      }
-		    else
-		      free( ddata );
-		    free( feat );
-		  }
-	      }
+      for( b = 0; b < job.nbands; b++ )
+	{
+	  cands = job.cands[b] + i;
+	  for( j = 0; j < cands->n; j++ )
+	    {
+	      feat = cands->feat[j];
+	      if( ! feat )
+		continue;
+	      ddata = feat_detection_data( feat );
+              if( ddata->intvl > sizeof(unsigned long) )
+                cvSeqPush( features, feat );
+              else if( (feature_mat[w * ddata->r + ddata->c] & (1 << ddata->intvl-1)) == 0 )
+              {
+                cvSeqPush( features, feat );
+                feature_mat[w * ddata->r + ddata->c] += 1 << ddata->intvl-1;
+              }
+	    }
+	}
     free( feature_mat );
+
+    for( b = 0; b < job.nbands; b++ )
+      {
+	for( i = 0; i < intvls + 2; i++ )
+	  {
+	    free( job.cands[b][i].loc );
+	    free( job.cands[b][i].feat );
+	  }
+	free( job.cands[b] );
+      }
+    free( job.cands );
   }
+
   return features;
 }
 
 
 
 /*
-  Determines whether a pixel is a scale-space extremum by comparing it to it's
-  3x3x3 pixel neighborhood.
+  Finds the rows and columns of an octave searched for extrema: those
+  outside the image border that sample the context's search region, given
+  that the octave's pixel (r, c) samples the image at the pyramid's origin
+  plus (c, r) times the octave's sampling interval
+
+  @param ctx a detection context
+  @param octv an octave
+  @param w width of the octave's images
+  @param h height of the octave's images
+  @param r0 output as the first row to search
+  @param r1 output as one past the last row to search
+  @param c0 output as the first column to search
+  @param c1 output as one past the last column to search
+*/
+static void search_bounds( struct sift_ctx* ctx, int octv, int w, int h,
+			   int* r0, int* r1, int* c0, int* c1 )
+{
+  CvRect* search = &ctx->search;
+  double s;
+
+  s = pow( 2.0, octv ) * ctx->step;
+  *c0 = ceil( ( search->x - ctx->origin.x ) / s );
+  *c1 = ceil( ( search->x + search->width - ctx->origin.x ) / s );
+  *r0 = ceil( ( search->y - ctx->origin.y ) / s );
+  *r1 = ceil( ( search->y + search->height - ctx->origin.y ) / s );
+  *c0 = MAX( *c0, SIFT_IMG_BORDER );
+  *c1 = MIN( *c1, w - SIFT_IMG_BORDER );
+  *r0 = MAX( *r0, SIFT_IMG_BORDER );
+  *r1 = MIN( *r1, h - SIFT_IMG_BORDER );
+}
+
 
-  @param dog_pyr DoG scale space pyramid
-  @param octv pixel's scale space octave
-  @param intvl pixel's within-octave interval
-  @param r pixel's image row
-  @param c pixel's image col
 
-  @return Returns 1 if the specified pixel is an extremum (max or min) among
-    it's 3x3x3 pixel neighborhood.
+/*
+  Finds candidate extrema in bands of rows of one octave and refines them
+  into features, discarding those with low contrast or that are too edge
+  like; run by parallel_for()
+
+  @param ctx a struct extrema_job
+  @param begin first band
+  @param end one past the last band
+  @param tid index of the calling thread
 */
-static int is_extremum( IplImage*** dog_pyr, int octv, int intvl, int r, int c )
+static void find_band_extrema( void* ctx, int begin, int end, int tid )
 {
-  double val = pixval32f( dog_pyr[octv][intvl], r, c );
-  int i, j, k;
+  struct extrema_job* job = ctx;
+  struct extrema_cands* cands;
+  struct feature* feat;
+  struct detection_data* ddata;
+  struct arena* arena = job->ctx->arenas[tid];
+  IplImage** octv = job->gauss_pyr[job->octv];
+  int rows = job->r1 - job->r0;
+  int b, i, j, r0, r1, r, c;
 
-  /* check for maximum */
-  if( val > 0 )
+  for( b = begin; b < end; b++ )
     {
-      for( i = -1; i <= 1; i++ )
-	for( j = -1; j <= 1; j++ )
-	  for( k = -1; k <= 1; k++ )
-	    if( val < pixval32f( dog_pyr[octv][intvl+i], r + j, c + k ) )
-	      return 0;
+      r0 = job->r0 + (int)( (long)rows * b / job->nbands );
+      r1 = job->r0 + (int)( (long)rows * ( b + 1 ) / job->nbands );
+      find_extrema_cands( octv, job->intvls,
+			  0.5 * job->contr_thr / job->intvls, r0, r1,
+			  job->c0, job->c1, job->cands[b] );
+      for( i = 1; i <= job->intvls; i++ )
+	{
+	  cands = job->cands[b] + i;
+	  cands->feat = malloc( MAX( cands->n, 1 ) * sizeof(struct feature*) );
+	  for( j = 0; j < cands->n; j++ )
+	    {
+	      r = cands->loc[j] / octv[0]->width;
+	      c = cands->loc[j] % octv[0]->width;
+	      if( masked( job->ctx, job->octv, r, c ) )
+		{
+		  cands->feat[j] = NULL;
+		  continue;
+		}
+	      feat = interp_extremum( job->gauss_pyr, job->octv, i, r, c,
+				      job->intvls, job->contr_thr, arena );
+	      if( feat )
+		{
+		  ddata = feat_detection_data( feat );
+		  if( is_too_edge_like( job->gauss_pyr, ddata->octv,
+					ddata->intvl, ddata->r, ddata->c,
+					job->curv_thr ) )
+		    feat = NULL;
+		}
+	      cands->feat[j] = feat;
+	    }
+	}
     }
+}
 
-  /* check for minimum */
-  else
+
+
+/*
+  Determines whether a pixel of an octave samples the image where a
+  detection context's mask is zero
+
+  @param ctx a detection context
+  @param octv an octave
+  @param r row of the octave
+  @param c column of the octave
+
+  @return Returns 1 if the pixel is masked out or 0 if it is searched
+*/
+static int masked( struct sift_ctx* ctx, int octv, int r, int c )
+{
+  IplImage* mask = ctx->mask;
+  double s;
+  int x, y;
+
+  if( ! mask )
+    return 0;
+  s = pow( 2.0, octv ) * ctx->step;
+  x = ctx->origin.x + (int)( c * s );
+  y = ctx->origin.y + (int)( r * s );
+  return ! ( (unsigned char*)( mask->imageData + mask->widthStep * y ) )[x];
+}
+
+
+
+/*
+  Finds candidate extrema in one octave of DoG scale space.  The octave is
+  scanned in vertical strips narrow enough that three rows of every DoG
+  interval fit in SIFT_DOG_WINDOW_BYTES.  As the scan moves down a strip,
+  each new DoG row is computed from two adjacent Gaussian rows and replaces
+  the oldest row of its interval in the window, so every DoG value is
+  computed once and is still in cache when its 26 neighbors are compared.
+
+  @param gauss_octv the intvls + 3 Gaussian images of one octave
+  @param intvls intervals per octave
+  @param prelim_contr_thr preliminary low threshold on |D(x)|
+  @param r0 first row to search; must be at least SIFT_IMG_BORDER
+  @param r1 one past the last row to search; must be at most the image
+    height less SIFT_IMG_BORDER
+  @param x0 first column to search; must be at least SIFT_IMG_BORDER
+  @param x1 one past the last column to search; must be at most the image
+    width less SIFT_IMG_BORDER
+  @param cands array of intvls + 2 candidate lists; on return, list i holds,
+    in raster order, every pixel of interval i in rows r0 through r1 - 1 and
+    columns x0 through x1 - 1 that passes the preliminary contrast check and
+    is a maximum or minimum among its 3x3x3 neighborhood
+*/
+static void find_extrema_cands( IplImage** gauss_octv, int intvls,
+				double prelim_contr_thr, int r0, int r1,
+				int x0, int x1, struct extrema_cands* cands )
+{
+  float* win, * rows[9];
+  float thr;
+  int* cols;
+  int w, n, tw, step, strips = 0, c0, c1, r, i, j, k, m, simd;
+
+  w = gauss_octv[0]->width;
+  n = intvls + 2;
+  simd = simd_level();
+  for( i = 0; i < n; i++ )
+    cands[i].n = 0;
+
+  /* |D| > thr for a float D exactly when |D| > prelim_contr_thr */
+  thr = prelim_contr_thr;
+  if( thr > prelim_contr_thr )
+    thr = nextafterf( thr, 0 );
+
+  /* each window row holds a strip plus one column of neighbors on each side */
+  tw = SIFT_DOG_WINDOW_BYTES / ( 3 * n * sizeof(float) ) - 2;
+  tw = MAX( MIN( tw, w ), 1 );
+  step = tw + 2;
+  win = malloc( 3 * n * step * sizeof(float) );
+  cols = malloc( tw * sizeof(int) );
+
+  for( c0 = x0; c0 < x1; c0 += tw )
     {
-      for( i = -1; i <= 1; i++ )
-	for( j = -1; j <= 1; j++ )
-	  for( k = -1; k <= 1; k++ )
-	    if( val > pixval32f( dog_pyr[octv][intvl+i], r + j, c + k ) )
-	      return 0;
+      c1 = MIN( c0 + tw, x1 );
+      strips++;
+      for( r = r0 - 1; r <= r1; r++ )
+	{
+	  for( i = 0; i < n; i++ )
+	    dog_row( gauss_octv, i, r, c0 - 1, c1 - c0 + 2,
+		     win + ( i * 3 + r % 3 ) * step );
+	  if( r <= r0 )
+	    continue;
+
+	  /* row r - 1 now has DoG rows above and below it in the window */
+	  for( i = 1; i <= intvls; i++ )
+	    {
+	      for( j = 0; j < 3; j++ )
+		for( k = 0; k < 3; k++ )
+		  rows[j*3+k] = win + ( ( i + j - 1 ) * 3 + ( r + k - 2 ) % 3 )
+		    * step + 1;
+	      m = extrema_in_row( rows, c1 - c0, thr, cols, simd );
+	      for( k = 0; k < m; k++ )
+		{
+		  if( cands[i].n == cands[i].nallocd )
+		    {
+		      cands[i].nallocd = array_double( (void**)&cands[i].loc,
+						       MAX( cands[i].nallocd,
+							    64 ),
+						       sizeof(int) );
+		      if( ! cands[i].nallocd )
+			fatal_error( "unable to allocate memory, %s, line %d",
+				     __FILE__, __LINE__ );
+		    }
+		  cands[i].loc[cands[i].n++] = ( r - 1 ) * w + c0 + cols[k];
+		}
+	    }
+	}
     }
 
-  return 1;
+  /* candidates from different strips interleave in raster order */
+  if( strips > 1 )
+    for( i = 1; i <= intvls; i++ )
+      qsort( cands[i].loc, cands[i].n, sizeof(int), loc_cmp );
+
+  free( win );
+  free( cols );
+}
+
+
+
+/*
+  Computes part of one row of a DoG image by subtracting adjacent levels of
+  a Gaussian octave.  The difference is taken in single precision, exactly as
+  cvSub() computed it for the stored DoG pyramid.
+
+  @param gauss_octv the Gaussian images of one octave
+  @param intvl the DoG interval to compute
+  @param r image row
+  @param c first image column
+  @param n number of columns to compute
+  @param dst output row
+*/
+static void dog_row( IplImage** gauss_octv, int intvl, int r, int c, int n,
+		     float* dst )
+{
+  float* g0, * g1;
+  int i;
+
+  g0 = (float*)( gauss_octv[intvl]->imageData +
+		 gauss_octv[intvl]->widthStep * r ) + c;
+  g1 = (float*)( gauss_octv[intvl+1]->imageData +
+		 gauss_octv[intvl+1]->widthStep * r ) + c;
+  for( i = 0; i < n; i++ )
+    dst[i] = g1[i] - g0[i];
+}
+
+
+
+/*
+  Finds the extrema in one row of a DoG strip using the best available code
+  path.
+
+  @param rows the three rows above, at, and below the tested row in each of
+    the three intervals around it, ordered by interval and then by row, so
+    that rows[4] is the tested row; each row is readable one element before
+    its start and one element past its end
+  @param n number of pixels to test
+  @param thr preliminary low threshold on |D(x)|
+  @param cols output as the offsets of extrema within the row, in
+    increasing order
+  @param simd one of SIMD_NONE, SIMD_SSE2, or SIMD_AVX2
+
+  @return Returns the number of extrema stored in cols.
+*/
+static int extrema_in_row( float** rows, int n, float thr, int* cols,
+			   int simd )
+{
+#ifdef SIFT_X86
+  if( simd >= SIMD_AVX2 )
+    return extrema_in_row_avx2( rows, n, thr, cols );
+  if( simd >= SIMD_SSE2 )
+    return extrema_in_row_sse2( rows, n, thr, cols );
+#endif
+  return extrema_in_row_c( rows, 0, n, thr, cols );
+}
+
+
+
+/*
+  Plain C extremum test.  A pixel is kept if its DoG value passes the
+  preliminary contrast check and is not exceeded by any of its 3x3x3
+  neighbors in the direction of its sign.
+
+  @param rows see extrema_in_row()
+  @param x offset of the first pixel to test
+  @param n offset one past the last pixel to test
+  @param thr see extrema_in_row()
+  @param cols output as the offsets of extrema
+
+  @return Returns the number of extrema stored in cols.
+*/
+static int extrema_in_row_c( float** rows, int x, int n, float thr,
+			     int* cols )
+{
+  float val;
+  int i, k, m = 0;
+
+  for( ; x < n; x++ )
+    {
+      val = rows[4][x];
+      if( ! ( ABS( val ) > thr ) )
+	continue;
+
+      /* check for maximum */
+      if( val > 0 )
+	{
+	  for( i = 0; i < 9; i++ )
+	    for( k = -1; k <= 1; k++ )
+	      if( val < rows[i][x+k] )
+		goto next;
+	}
+
+      /* check for minimum */
+      else
+	{
+	  for( i = 0; i < 9; i++ )
+	    for( k = -1; k <= 1; k++ )
+	      if( val > rows[i][x+k] )
+		goto next;
+	}
+
+      cols[m++] = x;
+    next: ;
+    }
+
+  return m;
+}
+
+
+#ifdef SIFT_X86
+
+/*
+  SSE2 extremum test; see extrema_in_row_c().  Vectors in which no pixel
+  passes the contrast check skip the neighbor comparisons entirely.
+*/
+static int extrema_in_row_sse2( float** rows, int n, float thr, int* cols )
+{
+  __m128 v, mx, mn, t, is_max, is_min;
+  __m128 thr4 = _mm_set1_ps( thr ), zero = _mm_setzero_ps(),
+    sign = _mm_set1_ps( -0.0f );
+  int x, i, k, bits, m = 0;
+
+  for( x = 0; x + 4 <= n; x += 4 )
+    {
+      v = _mm_loadu_ps( rows[4] + x );
+      bits = _mm_movemask_ps( _mm_cmpgt_ps( _mm_andnot_ps( sign, v ), thr4 ) );
+      if( ! bits )
+	continue;
+
+      mx = mn = v;
+      for( i = 0; i < 9; i++ )
+	for( k = -1; k <= 1; k++ )
+	  {
+	    t = _mm_loadu_ps( rows[i] + x + k );
+	    mx = _mm_max_ps( mx, t );
+	    mn = _mm_min_ps( mn, t );
+	  }
+      is_max = _mm_and_ps( _mm_cmpgt_ps( v, zero ), _mm_cmpge_ps( v, mx ) );
+      is_min = _mm_and_ps( _mm_cmple_ps( v, zero ), _mm_cmple_ps( v, mn ) );
+      bits &= _mm_movemask_ps( _mm_or_ps( is_max, is_min ) );
+      while( bits )
+	{
+	  cols[m++] = x + __builtin_ctz( bits );
+	  bits &= bits - 1;
+	}
+    }
+  return m + extrema_in_row_c( rows, x, n, thr, cols + m );
+}
+
+
+
+/* AVX2 extremum test; see extrema_in_row_sse2() */
+__attribute__(( target( "avx2" ) ))
+static int extrema_in_row_avx2( float** rows, int n, float thr, int* cols )
+{
+  __m256 v, mx, mn, t, is_max, is_min;
+  __m256 thr8 = _mm256_set1_ps( thr ), zero = _mm256_setzero_ps(),
+    sign = _mm256_set1_ps( -0.0f );
+  int x, i, k, bits, m = 0;
+
+  for( x = 0; x + 8 <= n; x += 8 )
+    {
+      v = _mm256_loadu_ps( rows[4] + x );
+      bits = _mm256_movemask_ps( _mm256_cmp_ps( _mm256_andnot_ps( sign, v ),
+						thr8, _CMP_GT_OQ ) );
+      if( ! bits )
+	continue;
+
+      mx = mn = v;
+      for( i = 0; i < 9; i++ )
+	for( k = -1; k <= 1; k++ )
+	  {
+	    t = _mm256_loadu_ps( rows[i] + x + k );
+	    mx = _mm256_max_ps( mx, t );
+	    mn = _mm256_min_ps( mn, t );
+	  }
+      is_max = _mm256_and_ps( _mm256_cmp_ps( v, zero, _CMP_GT_OQ ),
+			      _mm256_cmp_ps( v, mx, _CMP_GE_OQ ) );
+      is_min = _mm256_and_ps( _mm256_cmp_ps( v, zero, _CMP_LE_OQ ),
+			      _mm256_cmp_ps( v, mn, _CMP_LE_OQ ) );
+      bits &= _mm256_movemask_ps( _mm256_or_ps( is_max, is_min ) );
+      while( bits )
+	{
+	  cols[m++] = x + __builtin_ctz( bits );
+	  bits &= bits - 1;
+	}
+    }
+
+  /* avoid the AVX-SSE transition penalty in the non-VEX C code */
+  _mm256_zeroupper();
+  return m + extrema_in_row_c( rows, x, n, thr, cols + m );
+}
+
+#endif
+
+
+
+/*
+  Compares two candidate locations for qsort()
+*/
+static int loc_cmp( const void* a, const void* b )
+{
+  return *(const int*)a - *(const int*)b;
 }
 
 
@@ -451,22 +1679,24 @@ static int is_extremum( IplImage*** dog_pyr, int octv, int intvl, int r, int c )
   accuracy to form an image feature.  Rejects features with low contrast.
   Based on Section 4 of Lowe's paper.  
 
-  @param dog_pyr DoG scale space pyramid
+  @param gauss_pyr Gaussian scale space pyramid from which DoG values are
+    computed
   @param octv feature's octave of scale space
   @param intvl feature's within-octave interval
   @param r feature's image row
   @param c feature's image column
   @param intvls total intervals per octave
   @param contr_thr threshold on feature contrast
+  @param arena arena from which to allocate the feature
 
   @return Returns the feature resulting from interpolation of the given
     parameters or NULL if the given location could not be interpolated or
     if contrast at the interpolated loation was too low.  If a feature is
     returned, its scale, orientation, and descriptor are yet to be determined.
 */
-static struct feature* interp_extremum( IplImage*** dog_pyr, int octv,
+static struct feature* interp_extremum( IplImage*** gauss_pyr, int octv,
 					int intvl, int r, int c, int intvls,
-					double contr_thr )
+					double contr_thr, struct arena* arena )
 {
   struct feature* feat;
   struct detection_data* ddata;
@@ -475,7 +1705,7 @@ static struct feature* interp_extremum( IplImage*** dog_pyr, int octv,
   
   while( i < SIFT_MAX_INTERP_STEPS )
     {
-      interp_step( dog_pyr, octv, intvl, r, c, &xi, &xr, &xc );
+      interp_step( gauss_pyr, octv, intvl, r, c, &xi, &xr, &xc );
       if( ABS( xi ) < 0.5  &&  ABS( xr ) < 0.5  &&  ABS( xc ) < 0.5 )
 	break;
       
@@ -487,8 +1717,8 @@ static struct feature* interp_extremum( IplImage*** dog_pyr, int octv,
 	  intvl > intvls  ||
 	  c < SIFT_IMG_BORDER  ||
 	  r < SIFT_IMG_BORDER  ||
-	  c >= dog_pyr[octv][0]->width - SIFT_IMG_BORDER  ||
-	  r >= dog_pyr[octv][0]->height - SIFT_IMG_BORDER )
+	  c >= gauss_pyr[octv][0]->width - SIFT_IMG_BORDER  ||
+	  r >= gauss_pyr[octv][0]->height - SIFT_IMG_BORDER )
 	{
 	  return NULL;
 	}
@@ -500,11 +1730,11 @@ static struct feature* interp_extremum( IplImage*** dog_pyr, int octv,
   if( i >= SIFT_MAX_INTERP_STEPS )
     return NULL;
   
-  contr = interp_contr( dog_pyr, octv, intvl, r, c, xi, xr, xc );
+  contr = interp_contr( gauss_pyr, octv, intvl, r, c, xi, xr, xc );
   if( ABS( contr ) < contr_thr / intvls )
     return NULL;
 
-  feat = new_feature();
+  feat = new_feature( arena );
   ddata = feat_detection_data( feat );
   feat->img_pt.x = feat->x = ( c + xc ) * pow( 2.0, octv );
   feat->img_pt.y = feat->y = ( r + xr ) * pow( 2.0, octv );
@@ -513,6 +1743,7 @@ static struct feature* interp_extremum( IplImage*** dog_pyr, int octv,
   ddata->octv = octv;
   ddata->intvl = intvl;
   ddata->subintvl = xi;
+  ddata->contr = ABS( contr );
 
   return feat;
 }
@@ -523,7 +1754,8 @@ static struct feature* interp_extremum( IplImage*** dog_pyr, int octv,
   Performs one step of extremum interpolation.  Based on Eqn. (3) in Lowe's
   paper.
 
-  @param dog_pyr difference of Gaussians scale space pyramid
+  @param gauss_pyr Gaussian scale space pyramid from which DoG values are
+    computed
   @param octv octave of scale space
   @param intvl interval being interpolated
   @param r row being interpolated
@@ -533,22 +1765,20 @@ static struct feature* interp_extremum( IplImage*** dog_pyr, int octv,
   @param xc output as interpolated subpixel increment to col
 */
 
-static void interp_step( IplImage*** dog_pyr, int octv, int intvl, int r, int c,
-			 double* xi, double* xr, double* xc )
+static void interp_step( IplImage*** gauss_pyr, int octv, int intvl, int r,
+			 int c, double* xi, double* xr, double* xc )
 {
-  CvMat* dD, * H, * H_inv, X;
-  double x[3] = { 0 };
+  CvMat dD, H, H_inv, X;
+  double d[3], h[9], h_inv[9], x[3] = { 0 };
   
-  dD = deriv_3D( dog_pyr, octv, intvl, r, c );
-  H = hessian_3D( dog_pyr, octv, intvl, r, c );
-  H_inv = cvCreateMat( 3, 3, CV_64FC1 );
-  cvInvert( H, H_inv, CV_SVD );
+  cvInitMatHeader( &dD, 3, 1, CV_64FC1, d, CV_AUTOSTEP );
+  cvInitMatHeader( &H, 3, 3, CV_64FC1, h, CV_AUTOSTEP );
+  cvInitMatHeader( &H_inv, 3, 3, CV_64FC1, h_inv, CV_AUTOSTEP );
+  deriv_3D( gauss_pyr, octv, intvl, r, c, &dD );
+  hessian_3D( gauss_pyr, octv, intvl, r, c, &H );
+  cvInvert( &H, &H_inv, CV_SVD );
   cvInitMatHeader( &X, 3, 1, CV_64FC1, x, CV_AUTOSTEP );
-  cvGEMM( H_inv, dD, -1, NULL, 0, &X, 0 );
-  
-  cvReleaseMat( &dD );
-  cvReleaseMat( &H );
-  cvReleaseMat( &H_inv );
+  cvGEMM( &H_inv, &dD, -1, NULL, 0, &X, 0 );
 
   *xi = x[2];
   *xr = x[1];
@@ -561,33 +1791,30 @@ static void interp_step( IplImage*** dog_pyr, int octv, int intvl, int r, int c,
   Computes the partial derivatives in x, y, and scale of a pixel in the DoG
   scale space pyramid.
 
-  @param dog_pyr DoG scale space pyramid
-  @param octv pixel's octave in dog_pyr
+  @param gauss_pyr Gaussian scale space pyramid from which DoG values are
+    computed
+  @param octv pixel's octave in gauss_pyr
   @param intvl pixel's interval in octv
   @param r pixel's image row
   @param c pixel's image col
-
-  @return Returns the vector of partial derivatives for pixel I
-    { dI/dx, dI/dy, dI/ds }^T as a CvMat*
+  @param dI output as the 3 x 1 vector of partial derivatives for pixel I
+    { dI/dx, dI/dy, dI/ds }^T
 */
-static CvMat* deriv_3D( IplImage*** dog_pyr, int octv, int intvl, int r, int c )
+static void deriv_3D( IplImage*** gauss_pyr, int octv, int intvl, int r,
+		      int c, CvMat* dI )
 {
-  CvMat* dI;
   double dx, dy, ds;
 
-  dx = ( pixval32f( dog_pyr[octv][intvl], r, c+1 ) -
-	 pixval32f( dog_pyr[octv][intvl], r, c-1 ) ) / 2.0;
-  dy = ( pixval32f( dog_pyr[octv][intvl], r+1, c ) -
-	 pixval32f( dog_pyr[octv][intvl], r-1, c ) ) / 2.0;
-  ds = ( pixval32f( dog_pyr[octv][intvl+1], r, c ) -
-	 pixval32f( dog_pyr[octv][intvl-1], r, c ) ) / 2.0;
+  dx = ( dog_val( gauss_pyr, octv, intvl, r, c+1 ) -
+	 dog_val( gauss_pyr, octv, intvl, r, c-1 ) ) / 2.0;
+  dy = ( dog_val( gauss_pyr, octv, intvl, r+1, c ) -
+	 dog_val( gauss_pyr, octv, intvl, r-1, c ) ) / 2.0;
+  ds = ( dog_val( gauss_pyr, octv, intvl+1, r, c ) -
+	 dog_val( gauss_pyr, octv, intvl-1, r, c ) ) / 2.0;
   
-  dI = cvCreateMat( 3, 1, CV_64FC1 );
   cvmSet( dI, 0, 0, dx );
   cvmSet( dI, 1, 0, dy );
   cvmSet( dI, 2, 0, ds );
-
-  return dI;
 }
 
 
@@ -595,45 +1822,43 @@ static CvMat* deriv_3D( IplImage*** dog_pyr, int octv, int intvl, int r, int c )
 /*
   Computes the 3D Hessian matrix for a pixel in the DoG scale space pyramid.
 
-  @param dog_pyr DoG scale space pyramid
-  @param octv pixel's octave in dog_pyr
+  @param gauss_pyr Gaussian scale space pyramid from which DoG values are
+    computed
+  @param octv pixel's octave in gauss_pyr
   @param intvl pixel's interval in octv
   @param r pixel's image row
   @param c pixel's image col
-
-  @return Returns the Hessian matrix (below) for pixel I as a CvMat*
+  @param H output as the 3 x 3 Hessian matrix (below) for pixel I
 
   / Ixx  Ixy  Ixs \ <BR>
   | Ixy  Iyy  Iys | <BR>
   \ Ixs  Iys  Iss /
 */
-static CvMat* hessian_3D( IplImage*** dog_pyr, int octv, int intvl, int r,
-			  int c )
+static void hessian_3D( IplImage*** gauss_pyr, int octv, int intvl, int r,
+			int c, CvMat* H )
 {
-  CvMat* H;
   double v, dxx, dyy, dss, dxy, dxs, dys;
   
-  v = pixval32f( dog_pyr[octv][intvl], r, c );
-  dxx = ( pixval32f( dog_pyr[octv][intvl], r, c+1 ) + 
-	  pixval32f( dog_pyr[octv][intvl], r, c-1 ) - 2 * v );
-  dyy = ( pixval32f( dog_pyr[octv][intvl], r+1, c ) +
-	  pixval32f( dog_pyr[octv][intvl], r-1, c ) - 2 * v );
-  dss = ( pixval32f( dog_pyr[octv][intvl+1], r, c ) +
-	  pixval32f( dog_pyr[octv][intvl-1], r, c ) - 2 * v );
-  dxy = ( pixval32f( dog_pyr[octv][intvl], r+1, c+1 ) -
-	  pixval32f( dog_pyr[octv][intvl], r+1, c-1 ) -
-	  pixval32f( dog_pyr[octv][intvl], r-1, c+1 ) +
-	  pixval32f( dog_pyr[octv][intvl], r-1, c-1 ) ) / 4.0;
-  dxs = ( pixval32f( dog_pyr[octv][intvl+1], r, c+1 ) -
-	  pixval32f( dog_pyr[octv][intvl+1], r, c-1 ) -
-	  pixval32f( dog_pyr[octv][intvl-1], r, c+1 ) +
-	  pixval32f( dog_pyr[octv][intvl-1], r, c-1 ) ) / 4.0;
-  dys = ( pixval32f( dog_pyr[octv][intvl+1], r+1, c ) -
-	  pixval32f( dog_pyr[octv][intvl+1], r-1, c ) -
-	  pixval32f( dog_pyr[octv][intvl-1], r+1, c ) +
-	  pixval32f( dog_pyr[octv][intvl-1], r-1, c ) ) / 4.0;
+  v = dog_val( gauss_pyr, octv, intvl, r, c );
+  dxx = ( dog_val( gauss_pyr, octv, intvl, r, c+1 ) + 
+	  dog_val( gauss_pyr, octv, intvl, r, c-1 ) - 2 * v );
+  dyy = ( dog_val( gauss_pyr, octv, intvl, r+1, c ) +
+	  dog_val( gauss_pyr, octv, intvl, r-1, c ) - 2 * v );
+  dss = ( dog_val( gauss_pyr, octv, intvl+1, r, c ) +
+	  dog_val( gauss_pyr, octv, intvl-1, r, c ) - 2 * v );
+  dxy = ( dog_val( gauss_pyr, octv, intvl, r+1, c+1 ) -
+	  dog_val( gauss_pyr, octv, intvl, r+1, c-1 ) -
+	  dog_val( gauss_pyr, octv, intvl, r-1, c+1 ) +
+	  dog_val( gauss_pyr, octv, intvl, r-1, c-1 ) ) / 4.0;
+  dxs = ( dog_val( gauss_pyr, octv, intvl+1, r, c+1 ) -
+	  dog_val( gauss_pyr, octv, intvl+1, r, c-1 ) -
+	  dog_val( gauss_pyr, octv, intvl-1, r, c+1 ) +
+	  dog_val( gauss_pyr, octv, intvl-1, r, c-1 ) ) / 4.0;
+  dys = ( dog_val( gauss_pyr, octv, intvl+1, r+1, c ) -
+	  dog_val( gauss_pyr, octv, intvl+1, r-1, c ) -
+	  dog_val( gauss_pyr, octv, intvl-1, r+1, c ) +
+	  dog_val( gauss_pyr, octv, intvl-1, r-1, c ) ) / 4.0;
   
-  H = cvCreateMat( 3, 3, CV_64FC1 );
   cvmSet( H, 0, 0, dxx );
   cvmSet( H, 0, 1, dxy );
   cvmSet( H, 0, 2, dxs );
@@ -643,8 +1868,6 @@ static CvMat* hessian_3D( IplImage*** dog_pyr, int octv, int intvl, int r,
   cvmSet( H, 2, 0, dxs );
   cvmSet( H, 2, 1, dys );
   cvmSet( H, 2, 2, dss );
-
-  return H;
 }
 
 
@@ -653,7 +1876,8 @@ static CvMat* hessian_3D( IplImage*** dog_pyr, int octv, int intvl, int r,
   Calculates interpolated pixel contrast.  Based on Eqn. (3) in Lowe's
   paper.
 
-  @param dog_pyr difference of Gaussians scale space pyramid
+  @param gauss_pyr Gaussian scale space pyramid from which DoG values are
+    computed
   @param octv octave of scale space
   @param intvl within-octave interval
   @param r pixel row
@@ -664,19 +1888,19 @@ static CvMat* hessian_3D( IplImage*** dog_pyr, int octv, int intvl, int r,
 
   @param Returns interpolated contrast.
 */
-static double interp_contr( IplImage*** dog_pyr, int octv, int intvl, int r,
+static double interp_contr( IplImage*** gauss_pyr, int octv, int intvl, int r,
 			    int c, double xi, double xr, double xc )
 {
-  CvMat* dD, X, T;
-  double t[1], x[3] = { xc, xr, xi };
+  CvMat dD, X, T;
+  double d[3], t[1], x[3] = { xc, xr, xi };
 
+  cvInitMatHeader( &dD, 3, 1, CV_64FC1, d, CV_AUTOSTEP );
   cvInitMatHeader( &X, 3, 1, CV_64FC1, x, CV_AUTOSTEP );
   cvInitMatHeader( &T, 1, 1, CV_64FC1, t, CV_AUTOSTEP );
-  dD = deriv_3D( dog_pyr, octv, intvl, r, c );
-  cvGEMM( dD, &X, 1, NULL, 0, &T,  CV_GEMM_A_T );
-  cvReleaseMat( &dD );
+  deriv_3D( gauss_pyr, octv, intvl, r, c, &dD );
+  cvGEMM( &dD, &X, 1, NULL, 0, &T,  CV_GEMM_A_T );
 
-  return pixval32f( dog_pyr[octv][intvl], r, c ) + t[0] * 0.5;
+  return dog_val( gauss_pyr, octv, intvl, r, c ) + t[0] * 0.5;
 }
 
 
@@ -684,17 +1908,21 @@ static double interp_contr( IplImage*** dog_pyr, int octv, int intvl, int r,
 /*
   Allocates and initializes a new feature
 
+  @param arena arena from which to allocate the feature and its detection
+    data
+
   @return Returns a pointer to the new feature
 */
-static struct feature* new_feature( void )
+static struct feature* new_feature( struct arena* arena )
 {
   struct feature* feat;
   struct detection_data* ddata;
 
-  feat = malloc( sizeof( struct feature ) );
-  memset( feat, 0, sizeof( struct feature ) );
-  ddata = malloc( sizeof( struct detection_data ) );
-  memset( ddata, 0, sizeof( struct detection_data ) );
+  feat = arena_calloc( arena, 1, sizeof( struct feature ) );
+  ddata = arena_calloc( arena, 1, sizeof( struct detection_data ) );
+  if( ! feat  ||  ! ddata )
+    fatal_error( "unable to allocate memory, %s, line %d",
+		 __FILE__, __LINE__ );
   feat->feature_data = ddata;
   feat->type = FEATURE_LOWE;
 
@@ -708,24 +1936,32 @@ static struct feature* new_feature( void )
   ratio of principal curvatures at that feature.  Based on Section 4.1 of
   Lowe's paper.
 
-  @param dog_img image from the DoG pyramid in which feature was detected
+  @param gauss_pyr Gaussian scale space pyramid from which DoG values are
+    computed
+  @param octv octave of scale space in which feature was detected
+  @param intvl interval of octv in which feature was detected
   @param r feature row
   @param c feature col
   @param curv_thr high threshold on ratio of principal curvatures
 
-  @return Returns 0 if the feature at (r,c) in dog_img is sufficiently
+  @return Returns 0 if the feature at (r,c) in the DoG image is sufficiently
     corner-like or 1 otherwise.
 */
-static int is_too_edge_like( IplImage* dog_img, int r, int c, int curv_thr )
+static int is_too_edge_like( IplImage*** gauss_pyr, int octv, int intvl,
+			     int r, int c, int curv_thr )
 {
   double d, dxx, dyy, dxy, tr, det;
 
   /* principal curvatures are computed using the trace and det of Hessian */
-  d = pixval32f(dog_img, r, c);
-  dxx = pixval32f( dog_img, r, c+1 ) + pixval32f( dog_img, r, c-1 ) - 2 * d;
-  dyy = pixval32f( dog_img, r+1, c ) + pixval32f( dog_img, r-1, c ) - 2 * d;
-  dxy = ( pixval32f(dog_img, r+1, c+1) - pixval32f(dog_img, r+1, c-1) -
-	  pixval32f(dog_img, r-1, c+1) + pixval32f(dog_img, r-1, c-1) ) / 4.0;
+  d = dog_val( gauss_pyr, octv, intvl, r, c );
+  dxx = dog_val( gauss_pyr, octv, intvl, r, c+1 ) +
+    dog_val( gauss_pyr, octv, intvl, r, c-1 ) - 2 * d;
+  dyy = dog_val( gauss_pyr, octv, intvl, r+1, c ) +
+    dog_val( gauss_pyr, octv, intvl, r-1, c ) - 2 * d;
+  dxy = ( dog_val( gauss_pyr, octv, intvl, r+1, c+1 ) -
+	  dog_val( gauss_pyr, octv, intvl, r+1, c-1 ) -
+	  dog_val( gauss_pyr, octv, intvl, r-1, c+1 ) +
+	  dog_val( gauss_pyr, octv, intvl, r-1, c-1 ) ) / 4.0;
   tr = dxx + dyy;
   det = dxx * dyy - dxy * dxy;
 
@@ -740,6 +1976,135 @@ static int is_too_edge_like( IplImage* dog_img, int r, int c, int curv_thr )
 
 
 
+/*
+  Keeps only the strongest features, by contrast |D(x)|, up to a detection
+  context's feature budget.  With a budget grid, features are ranked first
+  by how many stronger features share their cell of the grid, laid over
+  the base of the pyramid.  Ties go to the feature found first, and kept
+  features stay in the order in which they were found, so the features
+  kept are those any number of threads would keep.
+
+  @param features array of features
+  @param ctx detection context whose budget to apply and whose arena holds
+    scratch space
+*/
+static void keep_strongest( CvSeq* features, struct sift_ctx* ctx )
+{
+  struct arena* arena = ctx->arenas[0];
+  struct arena_pos pos;
+  struct feature* feats;
+  struct feature_rank* ranks;
+  struct detection_data* ddata;
+  int* counts;
+  int n = features->total, budget = ctx->params.budget;
+  int g = ctx->params.budget_grid, w, h, cx, cy, i;
+
+  if( n <= budget )
+    return;
+
+  pos = arena_save( arena );
+  feats = arena_alloc( arena, n * sizeof( struct feature ) );
+  ranks = arena_alloc( arena, n * sizeof( struct feature_rank ) );
+  if( ! feats  ||  ! ranks )
+    fatal_error( "unable to allocate memory, %s, line %d",
+		 __FILE__, __LINE__ );
+  cvCvtSeqToArray( features, feats, CV_WHOLE_SEQ );
+  for( i = 0; i < n; i++ )
+    {
+      ranks[i].contr = feat_detection_data( ( feats + i ) )->contr;
+      ranks[i].cell_rank = 0;
+      ranks[i].i = i;
+    }
+  qsort( ranks, n, sizeof( struct feature_rank ), contr_rank_cmp );
+
+  /* features are placed in cells by where they lie in the pyramid's base */
+  if( g > 1 )
+    {
+      counts = arena_calloc( arena, g * g, sizeof( int ) );
+      if( ! counts )
+	fatal_error( "unable to allocate memory, %s, line %d",
+		     __FILE__, __LINE__ );
+      w = ctx->gauss_pyr[0][0]->width;
+      h = ctx->gauss_pyr[0][0]->height;
+      for( i = 0; i < n; i++ )
+	{
+	  ddata = feat_detection_data( ( feats + ranks[i].i ) );
+	  cx = MIN( (int)( (double)( ddata->c << ddata->octv ) * g / w ), g-1 );
+	  cy = MIN( (int)( (double)( ddata->r << ddata->octv ) * g / h ), g-1 );
+	  ranks[i].cell_rank = counts[ cy * g + cx ]++;
+	}
+      qsort( ranks, n, sizeof( struct feature_rank ), cell_rank_cmp );
+    }
+
+  qsort( ranks, budget, sizeof( struct feature_rank ), index_rank_cmp );
+  cvClearSeq( features );
+  for( i = 0; i < budget; i++ )
+    cvSeqPush( features, feats + ranks[i].i );
+  arena_restore( arena, pos );
+}
+
+
+
+/*
+  Compares ranked features for an order of decreasing contrast, breaking
+  ties by index.  Intended for use with qsort().
+
+  @param a first struct feature_rank
+  @param b second struct feature_rank
+
+  @return Returns -1 if a ranks ahead of b or 1 otherwise
+*/
+static int contr_rank_cmp( const void* a, const void* b )
+{
+  const struct feature_rank* r1 = a, * r2 = b;
+
+  if( r1->contr != r2->contr )
+    return ( r1->contr > r2->contr )? -1 : 1;
+  return ( r1->i < r2->i )? -1 : 1;
+}
+
+
+
+/*
+  Compares ranked features for an order of increasing rank within their
+  cells, then decreasing contrast, breaking ties by index.  Intended for
+  use with qsort().
+
+  @param a first struct feature_rank
+  @param b second struct feature_rank
+
+  @return Returns -1 if a ranks ahead of b or 1 otherwise
+*/
+static int cell_rank_cmp( const void* a, const void* b )
+{
+  const struct feature_rank* r1 = a, * r2 = b;
+
+  if( r1->cell_rank != r2->cell_rank )
+    return ( r1->cell_rank < r2->cell_rank )? -1 : 1;
+  return contr_rank_cmp( a, b );
+}
+
+
+
+/*
+  Compares ranked features for an order of increasing index.  Intended for
+  use with qsort().
+
+  @param a first struct feature_rank
+  @param b second struct feature_rank
+
+  @return Returns -1, 0, or 1 as a's index is less than, equal to, or
+    greater than b's
+*/
+static int index_rank_cmp( const void* a, const void* b )
+{
+  const struct feature_rank* r1 = a, * r2 = b;
+
+  return ( r1->i > r2->i ) - ( r1->i < r2->i );
+}
+
+
+
 /*
   Calculates characteristic scale for each feature in an array.
 
@@ -768,12 +2133,15 @@ static void calc_feature_scales( CvSeq* features, double sigma, int intvls )
 
 
 /*
-  Halves feature coordinates and scale in case the input image was doubled
+  Scales feature coordinates and scale from those of the base of the
+  pyramid to those of the input image, which was doubled or downsampled
   prior to scale space construction.
 
   @param features array of features
+  @param step image pixels between pixels of the pyramid's base; 0.5 for
+    a doubled image
 */
-static void adjust_for_img_dbl( CvSeq* features )
+static void adjust_for_img_scale( CvSeq* features, double step )
 {
   struct feature* feat;
   int i, n;
@@ -782,50 +2150,163 @@ static void adjust_for_img_dbl( CvSeq* features )
   for( i = 0; i < n; i++ )
     {
       feat = CV_GET_SEQ_ELEM( struct feature, features, i );
-      feat->x /= 2.0;
-      feat->y /= 2.0;
-      feat->scl /= 2.0;
-      feat->img_pt.x /= 2.0;
-      feat->img_pt.y /= 2.0;
+      feat->x *= step;
+      feat->y *= step;
+      feat->scl *= step;
+      feat->img_pt.x *= step;
+      feat->img_pt.y *= step;
+    }
+}
+
+
+
+/*
+  Computes gradient magnitude and orientation planes for the levels of a
+  detection context's Gaussian pyramid on which features lie.  Planes are
+  allocated the first time a feature lies on their level and are kept for
+  later images of the same size; levels without features are left as they
+  were and are not read.
+
+  @param features array of features
+  @param ctx detection context whose pyramid holds the features, whose
+    gradient planes are computed, and whose threads compute them
+*/
+static void build_grad_planes( CvSeq* features, struct sift_ctx* ctx )
+{
+  struct detection_data* ddata;
+  struct grad_job job;
+  IplImage* img;
+  int i, o;
+
+  for( o = 0; o < ctx->octvs; o++ )
+    for( i = 0; i < ctx->params.intvls + 3; i++ )
+      ctx->grad[o][i].valid = 0;
+
+  for( i = 0; i < features->total; i++ )
+    {
+      ddata = feat_detection_data( CV_GET_SEQ_ELEM( struct feature,
+						    features, i ) );
+      job.plane = &ctx->grad[ddata->octv][ddata->intvl];
+      if( job.plane->valid )
+	continue;
+
+      job.img = img = ctx->gauss_pyr[ddata->octv][ddata->intvl];
+      if( ! job.plane->mag )
+	{
+	  job.plane->mag = cvCreateImage( cvGetSize( img ), IPL_DEPTH_32F, 1 );
+	  job.plane->ori = cvCreateImage( cvGetSize( img ), IPL_DEPTH_32F, 1 );
+	}
+      parallel_for( ctx->pool, img->height, SIFT_PAR_MIN_ROWS, grad_rows,
+		    &job );
+      job.plane->valid = 1;
     }
 }
 
 
 
+/*
+  Computes the gradient planes of a band of rows of a pyramid level; run by
+  parallel_for()
+
+  @param ctx a struct grad_job
+  @param begin first row of the band
+  @param end one past the last row of the band
+  @param tid index of the calling thread
+*/
+static void grad_rows( void* ctx, int begin, int end, int tid )
+{
+  struct grad_job* job = ctx;
+
+  calc_grad_rows( job->img, job->plane->mag, job->plane->ori, begin, end );
+}
+
+
+
 /*
   Computes a canonical orientation for each image feature in an array.  Based
   on Section 5 of Lowe's paper.  This function adds features to the array when
   there is more than one dominant orientation at a given feature location.
 
+  Orientations are found concurrently when a thread pool is given.  The
+  features that carry them are then added in the order of the features they
+  were cloned from, just as a single thread would add them.
+
   @param features an array of image features
   @param gauss_pyr Gaussian scale space pyramid
+  @param grad gradient planes of gauss_pyr, or NULL to compute gradients
+    from gauss_pyr directly
+  @param ctx detection context whose threads find orientations and whose
+    arenas hold new features
 */
-static void calc_feature_oris( CvSeq* features, IplImage*** gauss_pyr )
+static void calc_feature_oris( CvSeq* features, IplImage*** gauss_pyr,
+			       struct grad_plane** grad, struct sift_ctx* ctx )
 {
-  struct feature* feat;
+  struct arena* arena = ctx->arenas[0];
+  struct ori_job job;
+  int i, n = features->total;
+
+  job.ctx = ctx;
+  job.gauss_pyr = gauss_pyr;
+  job.grad = grad;
+  job.feats = arena_alloc( arena, n * sizeof( struct feature ) );
+  job.oris = arena_alloc( arena, n * SIFT_ORI_HIST_BINS * sizeof( double ) );
+  job.noris = arena_alloc( arena, n * sizeof( int ) );
+  if( ! job.feats  ||  ! job.oris  ||  ! job.noris )
+    fatal_error( "unable to allocate memory, %s, line %d",
+		 __FILE__, __LINE__ );
+  cvCvtSeqToArray( features, job.feats, CV_WHOLE_SEQ );
+  cvClearSeq( features );
+
+  parallel_for( ctx->pool, n, 16, assign_oris, &job );
+
+  for( i = 0; i < n; i++ )
+    add_good_ori_features( features, job.oris + i * SIFT_ORI_HIST_BINS,
+			   job.noris[i], job.feats + i, arena );
+}
+
+
+
+/*
+  Finds the dominant orientations of a range of features; run by
+  parallel_for()
+
+  @param ctx a struct ori_job
+  @param begin first feature
+  @param end one past the last feature
+  @param tid index of the calling thread
+*/
+static void assign_oris( void* ctx, int begin, int end, int tid )
+{
+  struct ori_job* job = ctx;
+  struct arena* arena = job->ctx->arenas[tid];
+  struct arena_pos pos;
   struct detection_data* ddata;
   double* hist;
   double omax;
-  int i, j, n = features->total;
+  int i, j;
 
-  for( i = 0; i < n; i++ )
+  /* one histogram is reused for every feature in the range */
+  pos = arena_save( arena );
+  hist = arena_alloc( arena, SIFT_ORI_HIST_BINS * sizeof( double ) );
+  if( ! hist )
+    fatal_error( "unable to allocate memory, %s, line %d",
+		 __FILE__, __LINE__ );
+  for( i = begin; i < end; i++ )
     {
-      feat = malloc( sizeof( struct feature ) );
-      cvSeqPopFront( features, feat );
-      ddata = feat_detection_data( feat );
-      hist = ori_hist( gauss_pyr[ddata->octv][ddata->intvl],
-		       ddata->r, ddata->c, SIFT_ORI_HIST_BINS,
-		       cvRound( SIFT_ORI_RADIUS * ddata->scl_octv ),
-		       SIFT_ORI_SIG_FCTR * ddata->scl_octv );
+      ddata = feat_detection_data( ( job->feats + i ) );
+      ori_hist( job->gauss_pyr[ddata->octv][ddata->intvl],
+		( job->grad )? &job->grad[ddata->octv][ddata->intvl] : NULL,
+		ddata->r, ddata->c, SIFT_ORI_HIST_BINS,
+		cvRound( SIFT_ORI_RADIUS * ddata->scl_octv ),
+		SIFT_ORI_SIG_FCTR * ddata->scl_octv, hist );
       for( j = 0; j < SIFT_ORI_SMOOTH_PASSES; j++ )
 	smooth_ori_hist( hist, SIFT_ORI_HIST_BINS );
       omax = dominant_ori( hist, SIFT_ORI_HIST_BINS );
-      add_good_ori_features( features, hist, SIFT_ORI_HIST_BINS,
-			     omax * SIFT_ORI_PEAK_RATIO, feat );
-      free( ddata );
-      free( feat );
-      free( hist );
+      job->noris[i] = good_oris( hist, SIFT_ORI_HIST_BINS,
+				 omax * SIFT_ORI_PEAK_RATIO,
+				 job->oris + i * SIFT_ORI_HIST_BINS );
     }
+  arena_restore( arena, pos );
 }
 
 
@@ -834,24 +2315,44 @@ static void calc_feature_oris( CvSeq* features, IplImage*** gauss_pyr )
   Computes a gradient orientation histogram at a specified pixel.
 
   @param img image
+  @param plane gradient planes of img, or NULL to compute gradients from img
   @param r pixel row
   @param c pixel col
   @param n number of histogram bins
   @param rad radius of region over which histogram is computed
   @param sigma std for Gaussian weighting of histogram entries
-
-  @return Returns an n-element array containing an orientation histogram
-    representing orientations between 0 and 2 PI.
+  @param hist output as an n-element array containing an orientation
+    histogram representing orientations between 0 and 2 PI.
 */
-static double* ori_hist( IplImage* img, int r, int c, int n, int rad,
-			 double sigma )
+static void ori_hist( IplImage* img, struct grad_plane* plane, int r, int c,
+		      int n, int rad, double sigma, double* hist )
 {
-  double* hist;
   double mag, ori, w, exp_denom, PI2 = CV_PI * 2.0;
+  float* m, * o;
   int bin, i, j;
 
-  hist = calloc( n, sizeof( double ) );
+  memset( hist, 0, n * sizeof( double ) );
   exp_denom = 2.0 * sigma * sigma;
+  if( plane )
+    {
+      /* gradients are only defined away from the image border */
+      for( i = MAX( -rad, 1 - r ); i <= MIN( rad, img->height - 2 - r ); i++ )
+	{
+	  m = (float*)( plane->mag->imageData +
+			plane->mag->widthStep * ( r + i ) ) + c;
+	  o = (float*)( plane->ori->imageData +
+			plane->ori->widthStep * ( r + i ) ) + c;
+	  for( j = MAX( -rad, 1 - c ); j <= MIN( rad, img->width - 2 - c ); j++ )
+	    {
+	      w = exp( -( i*i + j*j ) / exp_denom );
+	      bin = cvRound( n * ( o[j] + CV_PI ) / PI2 );
+	      bin = ( bin < n )? bin : 0;
+	      hist[bin] += w * m[j];
+	    }
+	}
+      return;
+    }
+
   for( i = -rad; i <= rad; i++ )
     for( j = -rad; j <= rad; j++ )
       if( calc_grad_mag_ori( img, r + i, c + j, &mag, &ori ) )
@@ -861,8 +2362,6 @@ static double* ori_hist( IplImage* img, int r, int c, int n, int rad,
 	  bin = ( bin < n )? bin : 0;
 	  hist[bin] += w * mag;
 	}
-
-  return hist;
 }
 
 
@@ -956,21 +2455,20 @@ static double dominant_ori( double* hist, int n )
 
 
 /*
-  Adds features to an array for every orientation in a histogram greater than
-  a specified threshold.
+  Finds every orientation in a histogram greater than a specified threshold.
 
-  @param features new features are added to the end of this array
   @param hist orientation histogram
   @param n number of bins in hist
-  @param mag_thr new features are added for entries in hist greater than this
-  @param feat new features are clones of this with different orientations
+  @param mag_thr orientations are found for entries in hist greater than this
+  @param oris output as the orientations found; must have room for n / 2
+    orientations
+
+  @return Returns the number of orientations stored in oris
 */
-static void add_good_ori_features( CvSeq* features, double* hist, int n,
-				   double mag_thr, struct feature* feat )
+static int good_oris( double* hist, int n, double mag_thr, double* oris )
 {
-  struct feature* new_feat;
   double bin, PI2 = CV_PI * 2.0;
-  int l, r, i;
+  int l, r, i, k = 0;
 
   for( i = 0; i < n; i++ )
     {
@@ -981,12 +2479,36 @@ static void add_good_ori_features( CvSeq* features, double* hist, int n,
 	{
 	  bin = i + interp_hist_peak( hist[l], hist[i], hist[r] );
 	  bin = ( bin < 0 )? n + bin : ( bin >= n )? bin - n : bin;
-	  new_feat = clone_feature( feat );
-	  new_feat->ori = ( ( PI2 * bin ) / n ) - CV_PI;
-	  cvSeqPush( features, new_feat );
-	  free( new_feat );
+	  oris[k++] = ( ( PI2 * bin ) / n ) - CV_PI;
 	}
     }
+
+  return k;
+}
+
+
+
+/*
+  Adds a feature to an array for each of a set of orientations.
+
+  @param features new features are added to the end of this array
+  @param oris orientations of new features
+  @param n number of orientations in oris
+  @param feat new features are clones of this with different orientations
+  @param arena arena from which to allocate new features
+*/
+static void add_good_ori_features( CvSeq* features, double* oris, int n,
+				   struct feature* feat, struct arena* arena )
+{
+  struct feature* new_feat;
+  int i;
+
+  for( i = 0; i < n; i++ )
+    {
+      new_feat = clone_feature( feat, arena );
+      new_feat->ori = oris[i];
+      cvSeqPush( features, new_feat );
+    }
 }
 
 
@@ -995,15 +2517,17 @@ static void add_good_ori_features( CvSeq* features, double* hist, int n,
   Makes a deep copy of a feature
 
   @param feat feature to be cloned
+  @param arena arena from which to allocate the copy
 
   @return Returns a deep copy of feat
 */
-static struct feature* clone_feature( struct feature* feat )
+static struct feature* clone_feature( struct feature* feat,
+				      struct arena* arena )
 {
   struct feature* new_feat;
   struct detection_data* ddata;
 
-  new_feat = new_feature();
+  new_feat = new_feature( arena );
   ddata = feat_detection_data( new_feat );
   memcpy( new_feat, feat, sizeof( struct feature ) );
   memcpy( ddata, feat_detection_data(feat), sizeof( struct detection_data ) );
@@ -1020,25 +2544,67 @@ static struct feature* clone_feature( struct feature* feat )
 
   @param features array of features
   @param gauss_pyr Gaussian scale space pyramid
+  @param grad gradient planes of gauss_pyr, or NULL to compute gradients
+    from gauss_pyr directly
   @param d width of 2D array of orientation histograms
   @param n number of bins per orientation histogram
+  @param ctx detection context whose threads compute descriptors
 */
-static void compute_descriptors( CvSeq* features, IplImage*** gauss_pyr, int d,
-				 int n )
+static void compute_descriptors( CvSeq* features, IplImage*** gauss_pyr,
+				 struct grad_plane** grad, int d, int n,
+				 struct sift_ctx* ctx )
 {
-  struct feature* feat;
-  struct detection_data* ddata;
-  double*** hist;
+  struct descr_job job;
   int i, k = features->total;
 
+  job.ctx = ctx;
+  job.gauss_pyr = gauss_pyr;
+  job.grad = grad;
+  job.d = d;
+  job.n = n;
+  job.feats = arena_alloc( ctx->arenas[0], k * sizeof( struct feature* ) );
+  if( ! job.feats )
+    fatal_error( "unable to allocate memory, %s, line %d",
+		 __FILE__, __LINE__ );
   for( i = 0; i < k; i++ )
+    job.feats[i] = CV_GET_SEQ_ELEM( struct feature, features, i );
+
+  parallel_for( ctx->pool, k, 16, describe_features, &job );
+}
+
+
+
+/*
+  Computes the descriptors of a range of features; run by parallel_for()
+
+  @param ctx a struct descr_job
+  @param begin first feature
+  @param end one past the last feature
+  @param tid index of the calling thread
+*/
+static void describe_features( void* ctx, int begin, int end, int tid )
+{
+  struct descr_job* job = ctx;
+  struct arena* arena = job->ctx->arenas[tid];
+  struct arena_pos pos;
+  struct feature* feat;
+  struct detection_data* ddata;
+  float* hist;
+  int i;
+
+  /* each histogram is discarded as soon as its descriptor is computed */
+  pos = arena_save( arena );
+  for( i = begin; i < end; i++ )
     {
-      feat = CV_GET_SEQ_ELEM( struct feature, features, i );
+      feat = job->feats[i];
       ddata = feat_detection_data( feat );
-      hist = descr_hist( gauss_pyr[ddata->octv][ddata->intvl], ddata->r,
-			 ddata->c, feat->ori, ddata->scl_octv, d, n );
-      hist_to_descr( hist, d, n, feat );
-      release_descr_hist( &hist, d );
+      hist = descr_hist( job->gauss_pyr[ddata->octv][ddata->intvl],
+			 ( job->grad )?
+			 &job->grad[ddata->octv][ddata->intvl] : NULL,
+			 ddata->r, ddata->c, feat->ori, ddata->scl_octv,
+			 job->d, job->n, arena );
+      hist_to_descr( hist, job->d, job->n, feat );
+      arena_restore( arena, pos );
     }
 }
 
@@ -1048,147 +2614,404 @@ static void compute_descriptors( CvSeq* features, IplImage*** gauss_pyr, int d,
   Computes the 2D array of orientation histograms that form the feature
   descriptor.  Based on Section 6.1 of Lowe's paper.
 
+  The histograms are accumulated in a single flat array padded by one
+  histogram on every side and by two orientation bins at the end of each
+  histogram, so every sample can be spread into its 8 neighboring bins
+  without bounds checks; see hist_to_descr().  The samples' rotated
+  coordinates and weighted gradient magnitudes are gathered an image row at
+  a time by gather_row().  Their Gaussian weights come from a table built
+  once per feature: rotation preserves distance from the feature, so the
+  weight of the sample at offset (i,j) is wt[i] * wt[j].
+
   @param img image used in descriptor computation
+  @param plane gradient planes of img, or NULL to compute gradients from img
   @param r row coord of center of orientation histogram array
   @param c column coord of center of orientation histogram array
   @param ori canonical orientation of feature whose descr is being computed
   @param scl scale relative to img of feature whose descr is being computed
   @param d width of 2d array of orientation histograms
   @param n bins per orientation histogram
+  @param arena arena from which to allocate the histograms and scratch space
 
-  @return Returns a d x d array of n-bin orientation histograms.
+  @return Returns the padded (d + 2) x (d + 2) x (n + 2) array of orientation
+    histograms.
 */
-static double*** descr_hist( IplImage* img, int r, int c, double ori,
-			     double scl, int d, int n )
+static float* descr_hist( IplImage* img, struct grad_plane* plane, int r,
+			  int c, double ori, double scl, int d, int n,
+			  struct arena* arena )
 {
-  double*** hist;
-  double cos_t, sin_t, hist_width, exp_denom, r_rot, c_rot, grad_mag,
-    grad_ori, w, rbin, cbin, obin, bins_per_rad, PI2 = 2.0 * CV_PI;
-  int radius, i, j;
+  struct descr_window win;
+  float* hist, * p, * pm = NULL, * po = NULL;
+  double hist_width, exp_denom, grad_ori, bins_per_rad, PI2 = 2.0 * CV_PI;
+  int radius, step, simd, i, j0, j1, k, m;
 
-  hist = calloc( d, sizeof( double** ) );
-  for( i = 0; i < d; i++ )
-    {
-      hist[i] = calloc( d, sizeof( double* ) );
-      for( j = 0; j < d; j++ )
-	hist[i][j] = calloc( n, sizeof( double ) );
-    }
-  
-  cos_t = cos( ori );
-  sin_t = sin( ori );
-  bins_per_rad = n / PI2;
-  exp_denom = d * d * 0.5;
   hist_width = SIFT_DESCR_SCL_FCTR * scl;
   radius = hist_width * sqrt(2) * ( d + 1.0 ) * 0.5 + 0.5;
+  bins_per_rad = n / PI2;
+  exp_denom = d * d * 0.5 * hist_width * hist_width;
+  simd = simd_level();
+
+  /*
+    Subtract 0.5 so samples that fall e.g. in the center of row 1 (i.e.
+    r_rot = 1.5) have full weight placed in row 1 after interpolation.
+  */
+  win.cos_t = cos( ori ) / hist_width;
+  win.sin_t = sin( ori ) / hist_width;
+  win.off = d / 2 - 0.5;
+  win.d = d;
+
+  hist = arena_calloc( arena, ( d + 2 ) * ( d + 2 ) * ( n + 2 ),
+		       sizeof( float ) );
+  win.wt = arena_alloc( arena, ( 2 * radius + 1 ) * sizeof( float ) );
+  win.rbin = arena_alloc( arena, 6 * ( 2 * radius + 1 ) * sizeof( float ) );
+  if( ! hist  ||  ! win.wt  ||  ! win.rbin )
+    fatal_error( "unable to allocate memory, %s, line %d",
+		 __FILE__, __LINE__ );
+  win.cbin = win.rbin + 2 * radius + 1;
+  win.mag = win.cbin + 2 * radius + 1;
+  win.dx = win.mag + 2 * radius + 1;
+  win.dy = win.dx + 2 * radius + 1;
+  win.ori = win.dy + 2 * radius + 1;
+  win.wt += radius;
   for( i = -radius; i <= radius; i++ )
-    for( j = -radius; j <= radius; j++ )
-      {
-	/*
-	  Calculate sample's histogram array coords rotated relative to ori.
-	  Subtract 0.5 so samples that fall e.g. in the center of row 1 (i.e.
-	  r_rot = 1.5) have full weight placed in row 1 after interpolation.
-	*/
-	c_rot = ( j * cos_t - i * sin_t ) / hist_width;
-	r_rot = ( j * sin_t + i * cos_t ) / hist_width;
-	rbin = r_rot + d / 2 - 0.5;
-	cbin = c_rot + d / 2 - 0.5;
-	
-	if( rbin > -1.0  &&  rbin < d  &&  cbin > -1.0  &&  cbin < d )
-	  if( calc_grad_mag_ori( img, r + i, c + j, &grad_mag, &grad_ori ))
+    win.wt[i] = exp( -( i * i ) / exp_denom );
+
+  /* gradients are only defined away from the image border */
+  step = img->widthStep / sizeof( float );
+  j0 = MAX( -radius, 1 - c );
+  j1 = MIN( radius, img->width - 2 - c );
+  for( i = MAX( -radius, 1 - r ); i <= MIN( radius, img->height - 2 - r ); i++ )
+    {
+      p = (float*)( img->imageData + img->widthStep * ( r + i ) ) + c;
+      if( plane )
+	{
+	  pm = (float*)( plane->mag->imageData +
+			 plane->mag->widthStep * ( r + i ) ) + c;
+	  po = (float*)( plane->ori->imageData +
+			 plane->ori->widthStep * ( r + i ) ) + c;
+	}
+      m = gather_row( &win, p, pm, po, step, i, j0, j1, simd );
+      for( k = 0; k < m; k++ )
+	{
+	  if( plane )
+	    grad_ori = win.ori[k] - ori;
+	  else
+	    grad_ori = atan2( win.dy[k], win.dx[k] ) - ori;
+	  while( grad_ori < 0.0 )
+	    grad_ori += PI2;
+	  while( grad_ori >= PI2 )
+	    grad_ori -= PI2;
+	  interp_hist_entry( hist, win.rbin[k], win.cbin[k],
+			     grad_ori * bins_per_rad, win.mag[k], d, n );
+	}
+    }
+
+  return hist;
+}
+
+
+
+/*
+  Gathers the samples in one image row of a descriptor window that fall
+  inside the array of orientation histograms, using the best available
+  code path.
+
+  @param win descriptor window; the gathered samples are stored in its
+    rbin, cbin, and mag arrays and either its dx and dy arrays or, when
+    gradients are read from planes, its ori array
+  @param p pointer to the image pixel in the window's center column and in
+    the row being gathered
+  @param pm pointer to the same pixel in a gradient magnitude plane, or NULL
+    to compute gradients from the image
+  @param po pointer to the same pixel in a gradient orientation plane
+  @param step image row stride in floats
+  @param i row offset from the window center
+  @param j0 first column offset from the window center
+  @param j1 last column offset from the window center
+  @param simd one of SIMD_NONE, SIMD_SSE2, or SIMD_AVX2
+
+  @return Returns the number of samples gathered.
+*/
+static int gather_row( struct descr_window* win, float* p, float* pm,
+		       float* po, int step, int i, int j0, int j1, int simd )
+{
+#ifdef SIFT_X86
+  if( simd >= SIMD_AVX2 )
+    return gather_row_avx2( win, p, pm, po, step, i, j0, j1 );
+  if( simd >= SIMD_SSE2 )
+    return gather_row_sse2( win, p, pm, po, step, i, j0, j1 );
+#endif
+  return gather_row_c( win, p, pm, po, step, i, j0, j1, 0 );
+}
+
+
+
+/*
+  Plain C sample gathering; see gather_row().
+
+  @param m number of samples already gathered from this row
+
+  @return Returns the total number of samples gathered from this row.
+*/
+static int gather_row_c( struct descr_window* win, float* p, float* pm,
+			 float* po, int step, int i, int j, int j1, int m )
+{
+  float ri = i * win->cos_t, ci = i * win->sin_t, wi = win->wt[i];
+  float rbin, cbin, dx, dy;
+
+  for( ; j <= j1; j++ )
+    {
+      /* sample's histogram array coords rotated relative to ori */
+      rbin = ( j * win->sin_t + ri ) + win->off;
+      cbin = ( j * win->cos_t - ci ) + win->off;
+      if( rbin > -1.0f  &&  rbin < win->d  &&  cbin > -1.0f  &&  cbin < win->d )
+	{
+	  win->rbin[m] = rbin;
+	  win->cbin[m] = cbin;
+	  if( pm )
 	    {
-	      grad_ori -= ori;
-	      while( grad_ori < 0.0 )
-		grad_ori += PI2;
-	      while( grad_ori >= PI2 )
-		grad_ori -= PI2;
-	      
-	      obin = grad_ori * bins_per_rad;
-	      w = exp( -(c_rot * c_rot + r_rot * r_rot) / exp_denom );
-	      interp_hist_entry( hist, rbin, cbin, obin, grad_mag * w, d, n );
+	      win->ori[m] = po[j];
+	      win->mag[m] = pm[j] * ( wi * win->wt[j] );
 	    }
-      }
+	  else
+	    {
+	      dx = p[j+1] - p[j-1];
+	      dy = p[j-step] - p[j+step];
+	      win->dx[m] = dx;
+	      win->dy[m] = dy;
+	      win->mag[m] = sqrtf( dx * dx + dy * dy ) * ( wi * win->wt[j] );
+	    }
+	  m++;
+	}
+    }
 
-  return hist;
+  return m;
+}
+
+
+#ifdef SIFT_X86
+
+/* SSE2 sample gathering; see gather_row_c() */
+static int gather_row_sse2( struct descr_window* win, float* p, float* pm,
+			    float* po, int step, int i, int j0, int j1 )
+{
+  __m128 jv, rbin, cbin, dx, dy, mag, in;
+  __m128 four = _mm_set1_ps( 4.0f ), neg1 = _mm_set1_ps( -1.0f ),
+    d = _mm_set1_ps( win->d ), off = _mm_set1_ps( win->off ),
+    cos_t = _mm_set1_ps( win->cos_t ), sin_t = _mm_set1_ps( win->sin_t ),
+    ri = _mm_set1_ps( i * win->cos_t ), ci = _mm_set1_ps( i * win->sin_t ),
+    wi = _mm_set1_ps( win->wt[i] );
+  float t[5][4];
+  int j, l, bits, m = 0;
+
+  jv = _mm_setr_ps( j0, j0 + 1, j0 + 2, j0 + 3 );
+  for( j = j0; j + 3 <= j1; j += 4, jv = _mm_add_ps( jv, four ) )
+    {
+      rbin = _mm_add_ps( _mm_add_ps( _mm_mul_ps( jv, sin_t ), ri ), off );
+      cbin = _mm_add_ps( _mm_sub_ps( _mm_mul_ps( jv, cos_t ), ci ), off );
+      in = _mm_and_ps( _mm_and_ps( _mm_cmpgt_ps( rbin, neg1 ),
+				   _mm_cmplt_ps( rbin, d ) ),
+		       _mm_and_ps( _mm_cmpgt_ps( cbin, neg1 ),
+				   _mm_cmplt_ps( cbin, d ) ) );
+      bits = _mm_movemask_ps( in );
+      if( ! bits )
+	continue;
+
+      /* t[2] holds orientations when gradients come from planes */
+      if( pm )
+	{
+	  mag = _mm_loadu_ps( pm + j );
+	  _mm_storeu_ps( t[2], _mm_loadu_ps( po + j ) );
+	}
+      else
+	{
+	  dx = _mm_sub_ps( _mm_loadu_ps( p + j + 1 ),
+			   _mm_loadu_ps( p + j - 1 ) );
+	  dy = _mm_sub_ps( _mm_loadu_ps( p + j - step ),
+			   _mm_loadu_ps( p + j + step ) );
+	  mag = _mm_sqrt_ps( _mm_add_ps( _mm_mul_ps( dx, dx ),
+					 _mm_mul_ps( dy, dy ) ) );
+	  _mm_storeu_ps( t[2], dx );
+	  _mm_storeu_ps( t[3], dy );
+	}
+      mag = _mm_mul_ps( mag, _mm_mul_ps( wi,
+					 _mm_loadu_ps( win->wt + j ) ) );
+      _mm_storeu_ps( t[0], rbin );
+      _mm_storeu_ps( t[1], cbin );
+      _mm_storeu_ps( t[4], mag );
+      while( bits )
+	{
+	  l = __builtin_ctz( bits );
+	  win->rbin[m] = t[0][l];
+	  win->cbin[m] = t[1][l];
+	  if( pm )
+	    win->ori[m] = t[2][l];
+	  else
+	    {
+	      win->dx[m] = t[2][l];
+	      win->dy[m] = t[3][l];
+	    }
+	  win->mag[m] = t[4][l];
+	  m++;
+	  bits &= bits - 1;
+	}
+    }
+  return gather_row_c( win, p, pm, po, step, i, j, j1, m );
+}
+
+
+
+/* AVX2 sample gathering; see gather_row_c() */
+__attribute__(( target( "avx2" ) ))
+static int gather_row_avx2( struct descr_window* win, float* p, float* pm,
+			    float* po, int step, int i, int j0, int j1 )
+{
+  __m256 jv, rbin, cbin, dx, dy, mag, in;
+  __m256 eight = _mm256_set1_ps( 8.0f ), neg1 = _mm256_set1_ps( -1.0f ),
+    d = _mm256_set1_ps( win->d ), off = _mm256_set1_ps( win->off ),
+    cos_t = _mm256_set1_ps( win->cos_t ), sin_t = _mm256_set1_ps( win->sin_t ),
+    ri = _mm256_set1_ps( i * win->cos_t ),
+    ci = _mm256_set1_ps( i * win->sin_t ), wi = _mm256_set1_ps( win->wt[i] );
+  float t[5][8];
+  int j, l, bits, m = 0;
+
+  jv = _mm256_setr_ps( j0, j0 + 1, j0 + 2, j0 + 3,
+		       j0 + 4, j0 + 5, j0 + 6, j0 + 7 );
+  for( j = j0; j + 7 <= j1; j += 8, jv = _mm256_add_ps( jv, eight ) )
+    {
+      rbin = _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( jv, sin_t ), ri ),
+			    off );
+      cbin = _mm256_add_ps( _mm256_sub_ps( _mm256_mul_ps( jv, cos_t ), ci ),
+			    off );
+      in = _mm256_and_ps(
+	     _mm256_and_ps( _mm256_cmp_ps( rbin, neg1, _CMP_GT_OQ ),
+			    _mm256_cmp_ps( rbin, d, _CMP_LT_OQ ) ),
+	     _mm256_and_ps( _mm256_cmp_ps( cbin, neg1, _CMP_GT_OQ ),
+			    _mm256_cmp_ps( cbin, d, _CMP_LT_OQ ) ) );
+      bits = _mm256_movemask_ps( in );
+      if( ! bits )
+	continue;
+
+      /* t[2] holds orientations when gradients come from planes */
+      if( pm )
+	{
+	  mag = _mm256_loadu_ps( pm + j );
+	  _mm256_storeu_ps( t[2], _mm256_loadu_ps( po + j ) );
+	}
+      else
+	{
+	  dx = _mm256_sub_ps( _mm256_loadu_ps( p + j + 1 ),
+			      _mm256_loadu_ps( p + j - 1 ) );
+	  dy = _mm256_sub_ps( _mm256_loadu_ps( p + j - step ),
+			      _mm256_loadu_ps( p + j + step ) );
+	  mag = _mm256_sqrt_ps( _mm256_add_ps( _mm256_mul_ps( dx, dx ),
+					       _mm256_mul_ps( dy, dy ) ) );
+	  _mm256_storeu_ps( t[2], dx );
+	  _mm256_storeu_ps( t[3], dy );
+	}
+      mag = _mm256_mul_ps( mag, _mm256_mul_ps( wi,
+					       _mm256_loadu_ps( win->wt + j ) ) );
+      _mm256_storeu_ps( t[0], rbin );
+      _mm256_storeu_ps( t[1], cbin );
+      _mm256_storeu_ps( t[4], mag );
+      while( bits )
+	{
+	  l = __builtin_ctz( bits );
+	  win->rbin[m] = t[0][l];
+	  win->cbin[m] = t[1][l];
+	  if( pm )
+	    win->ori[m] = t[2][l];
+	  else
+	    {
+	      win->dx[m] = t[2][l];
+	      win->dy[m] = t[3][l];
+	    }
+	  win->mag[m] = t[4][l];
+	  m++;
+	  bits &= bits - 1;
+	}
+    }
+  return gather_row_c( win, p, pm, po, step, i, j, j1, m );
 }
 
+#endif
+
 
 
 /*
   Interpolates an entry into the array of orientation histograms that form
-  the feature descriptor.
-
-  @param hist 2D array of orientation histograms
-  @param rbin sub-bin row coordinate of entry
-  @param cbin sub-bin column coordinate of entry
-  @param obin sub-bin orientation coordinate of entry
+  the feature descriptor.  The entry is distributed into 8 bins, each
+  receiving a weight of 1 - d for each dimension, where d is the distance
+  from the center value of the bin measured in bin units.  The padding of
+  hist absorbs entries that fall just outside the array, so no bin needs a
+  bounds check.
+
+  @param hist padded array of orientation histograms; see descr_hist()
+  @param rbin sub-bin row coordinate of entry, in (-1, d)
+  @param cbin sub-bin column coordinate of entry, in (-1, d)
+  @param obin sub-bin orientation coordinate of entry, in [0, n]
   @param mag size of entry
   @param d width of 2D array of orientation histograms
   @param n number of bins per orientation histogram
 */
-static void interp_hist_entry( double*** hist, double rbin, double cbin,
-			       double obin, double mag, int d, int n )
+static void interp_hist_entry( float* hist, float rbin, float cbin,
+			       float obin, float mag, int d, int n )
 {
-  double d_r, d_c, d_o, v_r, v_c, v_o;
-  double** row, * h;
-  int r0, c0, o0, rb, cb, ob, r, c, o;
+  float d_r, d_c, d_o, v_r0, v_r1, v_00, v_01, v_10, v_11;
+  float* h;
+  int r0, c0, o0, cs = n + 2, rs = ( d + 2 ) * ( n + 2 );
 
   r0 = cvFloor( rbin );
   c0 = cvFloor( cbin );
-  o0 = cvFloor( obin );
+  o0 = (int)obin;
   d_r = rbin - r0;
   d_c = cbin - c0;
   d_o = obin - o0;
 
-  /*
-    The entry is distributed into up to 8 bins.  Each entry into a bin
-    is multiplied by a weight of 1 - d for each dimension, where d is the
-    distance from the center value of the bin measured in bin units.
-  */
-  for( r = 0; r <= 1; r++ )
-    {
-      rb = r0 + r;
-      if( rb >= 0  &&  rb < d )
-	{
-	  v_r = mag * ( ( r == 0 )? 1.0 - d_r : d_r );
-	  row = hist[rb];
-	  for( c = 0; c <= 1; c++ )
-	    {
-	      cb = c0 + c;
-	      if( cb >= 0  &&  cb < d )
-		{
-		  v_c = v_r * ( ( c == 0 )? 1.0 - d_c : d_c );
-		  h = row[cb];
-		  for( o = 0; o <= 1; o++ )
-		    {
-		      ob = ( o0 + o ) % n;
-		      v_o = v_c * ( ( o == 0 )? 1.0 - d_o : d_o );
-		      h[ob] += v_o;
-		    }
-		}
-	    }
-	}
-    }
+  v_r1 = mag * d_r;
+  v_r0 = mag - v_r1;
+  v_01 = v_r0 * d_c;
+  v_00 = v_r0 - v_01;
+  v_11 = v_r1 * d_c;
+  v_10 = v_r1 - v_11;
+
+  h = hist + ( r0 + 1 ) * rs + ( c0 + 1 ) * cs + o0;
+  h[0] += v_00 - v_00 * d_o;
+  h[1] += v_00 * d_o;
+  h[cs] += v_01 - v_01 * d_o;
+  h[cs+1] += v_01 * d_o;
+  h[rs] += v_10 - v_10 * d_o;
+  h[rs+1] += v_10 * d_o;
+  h[rs+cs] += v_11 - v_11 * d_o;
+  h[rs+cs+1] += v_11 * d_o;
 }
 
 
 
 /*
   Converts the 2D array of orientation histograms into a feature's descriptor
-  vector.
+  vector.  Orientation bins past the end of each histogram wrap around to
+  its start, and the padding histograms are dropped.
   
-  @param hist 2D array of orientation histograms
-  @param d width of hist
-  @param n bins per histogram
+  @param hist padded array of orientation histograms; see descr_hist()
+  @param d width of hist, not counting padding
+  @param n bins per histogram, not counting padding
   @param feat feature into which to store descriptor
 */
-static void hist_to_descr( double*** hist, int d, int n, struct feature* feat )
+static void hist_to_descr( float* hist, int d, int n, struct feature* feat )
 {
+  float* h;
   int int_val, i, r, c, o, k = 0;
 
   for( r = 0; r < d; r++ )
     for( c = 0; c < d; c++ )
-      for( o = 0; o < n; o++ )
-	feat->descr[k++] = hist[r][c][o];
+      {
+	h = hist + ( ( r + 1 ) * ( d + 2 ) + c + 1 ) * ( n + 2 );
+	for( o = n; o < n + 2; o++ )
+	  h[o % n] += h[o];
+	for( o = 0; o < n; o++ )
+	  feat->descr[k++] = h[o];
+      }
 
   feat->d = k;
   normalize_descr( feat );
@@ -1255,42 +3078,49 @@ static int feature_cmp( void* feat1, void* feat2, void* param )
 
 
 /*
-  De-allocates memory held by a descriptor histogram
+  De-allocates memory held by a scale space pyramid
 
-  @param hist pointer to a 2D array of orientation histograms
-  @param d width of hist
+  @param pyr scale space pyramid
+  @param octvs number of octaves of scale space
+  @param n number of images per octave
 */
-static void release_descr_hist( double**** hist, int d )
+static void release_pyr( IplImage**** pyr, int octvs, int n )
 {
   int i, j;
-
-  for( i = 0; i < d; i++)
+  for( i = 0; i < octvs; i++ )
     {
-      for( j = 0; j < d; j++ )
-	free( (*hist)[i][j] );
-      free( (*hist)[i] );
+      for( j = 0; j < n; j++ )
+	cvReleaseImage( &(*pyr)[i][j] );
+      free( (*pyr)[i] );
     }
-  free( *hist );
-  *hist = NULL;
+  free( *pyr );
+  *pyr = NULL;
 }
 
 
+
 /*
-  De-allocates memory held by a scale space pyramid
+  De-allocates memory held by the gradient planes of a pyramid
 
-  @param pyr scale space pyramid
+  @param grad pointer to gradient planes or to NULL
   @param octvs number of octaves of scale space
   @param n number of images per octave
 */
-static void release_pyr( IplImage**** pyr, int octvs, int n )
+static void release_grad_planes( struct grad_plane*** grad, int octvs, int n )
 {
   int i, j;
+
+  if( ! *grad )
+    return;
   for( i = 0; i < octvs; i++ )
     {
       for( j = 0; j < n; j++ )
-	cvReleaseImage( &(*pyr)[i][j] );
-      free( (*pyr)[i] );
+	{
+	  cvReleaseImage( &(*grad)[i][j].mag );
+	  cvReleaseImage( &(*grad)[i][j].ori );
+	}
+      free( (*grad)[i] );
     }
-  free( *pyr );
-  *pyr = NULL;
+  free( *grad );
+  *grad = NULL;
 }
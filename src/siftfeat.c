@@ -12,23 +12,124 @@
   British Columbia.  For more information, refer to the file LICENSE.ubc
   that accompanied this distribution.
 
+  In batch mode, given a list of images with -l, images flow through a
+  pipeline of three stages joined by bounded queues: decoder threads load
+  them, worker threads, each with its own detection context, detect their
+  features, and the main thread writes the features, in list order, to one
+  file per image, to a single binary feature set shard, or both.  Loading
+  and writing thus overlap detection, a full queue holds back the stage
+  feeding it, and threads and scratch memory are set up once for the whole
+  run.  The time spent on each image is reported as it is written, and the
+  throughput of each stage at the end.  An image that cannot be processed
+  is reported and skipped, as is one whose feature file would overwrite
+  that of an earlier image with the same name in another directory.
+
   Version: 1.1.2-20100521
 */
 
 #include "sift.h"
 #include "imgfeatures.h"
+#include "featset.h"
+#include "parallel.h"
+#include "bqueue.h"
 #include "utils.h"
 
 #include <highgui.h>
 
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
-#define OPTIONS ":o:m:i:s:c:r:n:b:dxh"
+#define OPTIONS ":o:m:i:s:c:r:n:b:t:a:e:f:u:l:w:j:k:gdxh"
+
+/* room in the queue feeding a stage for each of the stage's threads */
+#define BATCH_QUEUE_PER_THREAD 2
+
+/* longest image path read from a list file */
+#define BATCH_MAX_PATH 4096
+
+/* initial number of slots in the table of feature files written */
+#define BATCH_NAMES_INIT 1024
+
+/* an image passing through the batch pipeline */
+struct batch_item
+{
+  int seq;                     /* position in the list */
+  char* path;                  /* image file */
+  IplImage* img;               /* the image, from loading to detection */
+  struct feature* feat;        /* its features, from detection to output */
+  int n;                       /* number of features, or -1 on failure */
+  char* err;                   /* reason for failure */
+  double load_ms;              /* time to load the image */
+  double detect_ms;            /* time to detect features */
+  double write_ms;             /* time to write the image's features */
+};
+
+/* throughput counters of a stage of the batch pipeline */
+struct batch_stage
+{
+  char* name;                  /* name in the report */
+  int nthreads;                /* number of threads running the stage */
+  int active;                  /* threads still running; the last to stop
+				  closes the stage's output queue */
+  unsigned long items;         /* number of images processed */
+  unsigned long busy_us;       /* microseconds spent processing images,
+				  summed over threads */
+  unsigned long wait_us;       /* microseconds spent waiting on queues,
+				  summed over threads */
+};
+
+/* feature files written in batch mode, in an open addressing hash table */
+struct name_table
+{
+  char** slots;                /* file names, NULL for empty slots */
+  int cap;                     /* number of slots, a power of 2 */
+  int n;                       /* number of file names */
+};
+
+/* the batch pipeline */
+struct batch
+{
+  FILE* list;                  /* list of images */
+  struct bqueue* paths;        /* images to load */
+  struct bqueue* images;       /* loaded images in which to detect features */
+  struct bqueue* results;      /* images whose features are to be written */
+  sem_t window;                /* limits the images in flight, so that those
+				  finished out of order can be held until
+				  they can be written in order */
+  int nwindow;                 /* number of images in flight allowed */
+  struct sift_params* params;  /* detection parameters */
+  int d;                       /* descriptor length */
+  struct name_table names;     /* feature files written */
+  struct batch_stage load;
+  struct batch_stage detect;
+  struct batch_stage output;
+};
 
 /*************************** Function Prototypes *****************************/
 
 static void usage( char* );
 static void arg_parse( int, char** );
+static int run_batch( struct sift_params* );
+static void start_threads( struct batch_stage*, void* (*)( void* ),
+			   struct batch*, pthread_t* );
+static void* feed_thread( void* );
+static void* load_thread( void* );
+static void* detect_thread( void* );
+static void output_item( struct batch_item*, struct name_table*, FILE*,
+			 int, int );
+static void stage_time( unsigned long*, double );
+static void report_stage( struct batch_stage*, double );
+static void report_queue( char*, struct bqueue* );
+static char* feature_file_name( char* );
+static int claim_file_name( struct name_table*, char* );
+static unsigned int hash_name( char* );
+static void spill_set( FILE*, struct feature_set*, int );
+static void write_shard( FILE*, int, int );
 
 /******************************** Globals ************************************/
 
@@ -43,7 +144,17 @@ int curv_thr = SIFT_CURV_THR;
 int img_dbl = SIFT_IMG_DBL;
 int descr_width = SIFT_DESCR_WIDTH;
 int descr_hist_bins = SIFT_DESCR_HIST_BINS;
+int threads = SIFT_THREADS;
+int grad_planes = SIFT_GRAD_PLANES;
+int budget = SIFT_BUDGET;
+int budget_grid = SIFT_BUDGET_GRID;
+int first_octv = SIFT_FIRST_OCTV;
+int max_octvs = SIFT_MAX_OCTVS;
 int display = 1;
+char* list_file_name = NULL;
+char* shard_file_name = NULL;
+int workers = 0;
+int loaders = 1;
 
 
 /********************************** Main *************************************/
@@ -52,16 +163,35 @@ int main( int argc, char** argv )
 {
   IplImage* img;
   struct feature* features;
+  struct sift_params params;
   int n = 0;
 
   arg_parse( argc, argv );
 
+  sift_params_init( &params );
+  params.intvls = intvls;
+  params.sigma = sigma;
+  params.contr_thr = contr_thr;
+  params.curv_thr = curv_thr;
+  params.img_dbl = img_dbl;
+  params.descr_width = descr_width;
+  params.descr_hist_bins = descr_hist_bins;
+  params.threads = threads;
+  params.grad_planes = grad_planes;
+  params.budget = budget;
+  params.budget_grid = budget_grid;
+  params.first_octv = first_octv;
+  params.max_octvs = max_octvs;
+  if( list_file_name )
+    return run_batch( &params );
+
   fprintf( stderr, "Finding SIFT features...\n" );
   img = cvLoadImage( img_file_name, 1 );
   if( ! img )
     fatal_error( "unable to load image from %s", img_file_name );
-  n = _sift_features( img, &features, intvls, sigma, contr_thr, curv_thr,
-		      img_dbl, descr_width, descr_hist_bins );
+  n = sift_features_params( img, &features, &params );
+  if( n < 0 )
+    fatal_error( "unable to detect features in %s", img_file_name );
   fprintf( stderr, "Found %d features.\n", n );
   
   if( display )
@@ -87,9 +217,13 @@ static void usage( char* name )
 {
   fprintf(stderr, "%s: detect SIFT keypoints in an image\n\n", name);
   fprintf(stderr, "Usage: %s [options] <img_file>\n", name);
+  fprintf(stderr, "       %s [options] -l <list_file>\n", name);
   fprintf(stderr, "Options:\n");
   fprintf(stderr, "  -h               Display this message and exit\n");
-  fprintf(stderr, "  -o <out_file>    Output keypoints to text file\n");
+  fprintf(stderr, "  -o <out_file>    Output keypoints to text file; in" \
+	  " batch mode, a directory\n");
+  fprintf(stderr, "                   in which to output each image's" \
+	  " keypoints to <name>.sift\n");
   fprintf(stderr, "  -m <out_img>     Output keypoint image file (format" \
 	  " determined by extension)\n");
   fprintf(stderr, "  -i <intervals>   Set number of sampled intervals per" \
@@ -111,9 +245,43 @@ static void usage( char* name )
   fprintf(stderr, "  -b <bins>        Set number of bins per histogram" \
 	  " in descriptor array\n");
   fprintf(stderr, "                   (default %d)\n", SIFT_DESCR_HIST_BINS);
+  fprintf(stderr, "  -t <threads>     Set number of threads used to detect" \
+	  " keypoints; 0 uses one\n");
+  fprintf(stderr, "                   per CPU (default %d)\n", SIFT_THREADS);
+  fprintf(stderr, "  -a <count>       Keep only the <count> keypoints of" \
+	  " highest contrast; 0 keeps\n");
+  fprintf(stderr, "                   all (default %d)\n", SIFT_BUDGET);
+  fprintf(stderr, "  -e <width>       Spread the -a budget evenly over a" \
+	  " <width> x <width> grid\n");
+  fprintf(stderr, "                   of cells; 0 turns this off" \
+	  " (default %d)\n", SIFT_BUDGET_GRID);
+  fprintf(stderr, "  -f <octave>      Start scale space pyramid at this" \
+	  " octave, counting the\n");
+  fprintf(stderr, "                   doubled image as octave 0 when -d is" \
+	  " not given (default %d)\n", SIFT_FIRST_OCTV);
+  fprintf(stderr, "  -u <octaves>     Set most octaves in scale space" \
+	  " pyramid; 0 for no limit\n");
+  fprintf(stderr, "                   (default %d)\n", SIFT_MAX_OCTVS);
+  fprintf(stderr, "  -g               Toggle precomputed gradient planes" \
+	  " (default %s)\n", SIFT_GRAD_PLANES == 0 ? "off" : "on");
   fprintf(stderr, "  -d               Toggle image doubling (default %s)\n",
 	  SIFT_IMG_DBL == 0 ? "off" : "on");
   fprintf(stderr, "  -x               Turn off keypoint display\n");
+  fprintf(stderr, "  -l <list_file>   Batch mode: detect keypoints in each" \
+	  " image listed one per\n");
+  fprintf(stderr, "                   line in <list_file>, or in standard" \
+	  " input if it is -, and\n");
+  fprintf(stderr, "                   report per-image timing; nothing is" \
+	  " displayed\n");
+  fprintf(stderr, "  -w <workers>     Set number of threads detecting" \
+	  " keypoints in batch mode;\n");
+  fprintf(stderr, "                   0 uses one per CPU (default 0)\n");
+  fprintf(stderr, "  -j <loaders>     Set number of threads loading images" \
+	  " in batch mode\n");
+  fprintf(stderr, "                   (default 1)\n");
+  fprintf(stderr, "  -k <shard_file>  Output all keypoints found in batch" \
+	  " mode to one binary\n");
+  fprintf(stderr, "                   feature set file, in list order\n");
 }
 
 
@@ -244,6 +412,73 @@ static void arg_parse( int argc, char** argv )
 			 "Try '%s -h' for help.", arg, pname );
 	  break;
 	  
+	  // read threads
+	case 't' :
+	  // ensure argument provided
+	  if( ! optarg )
+	    fatal_error( "error parsing arguments at -%c\n"	\
+			 "Try '%s -h' for help.", arg, pname );
+	  
+	  // parse argument and ensure it is an integer
+	  threads = strtol( optarg, &arg_check, 10 );
+	  if( arg_check == optarg  ||  *arg_check != '\0' )
+	    fatal_error( "-%c option requires an integer argument\n"	\
+			 "Try '%s -h' for help.", arg, pname );
+	  break;
+	  
+	  // read keypoint budget, budget grid, first octave, and octave cap
+	case 'a' :
+	case 'e' :
+	case 'f' :
+	case 'u' :
+	  if( ! optarg )
+	    fatal_error( "error parsing arguments at -%c\n"	\
+			 "Try '%s -h' for help.", arg, pname );
+	  if( arg == 'a' )
+	    budget = strtol( optarg, &arg_check, 10 );
+	  else if( arg == 'e' )
+	    budget_grid = strtol( optarg, &arg_check, 10 );
+	  else if( arg == 'f' )
+	    first_octv = strtol( optarg, &arg_check, 10 );
+	  else
+	    max_octvs = strtol( optarg, &arg_check, 10 );
+	  if( arg_check == optarg  ||  *arg_check != '\0' )
+	    fatal_error( "-%c option requires an integer argument\n"	\
+			 "Try '%s -h' for help.", arg, pname );
+	  if( first_octv < 0 )
+	    fatal_error( "-f option requires a non-negative argument\n" \
+			 "Try '%s -h' for help.", pname );
+	  break;
+
+	  // read list, shard, workers, and loaders
+	case 'l' :
+	case 'k' :
+	case 'w' :
+	case 'j' :
+	  if( ! optarg )
+	    fatal_error( "error parsing arguments at -%c\n"	\
+			 "Try '%s -h' for help.", arg, pname );
+	  if( arg == 'l' )
+	    list_file_name = optarg;
+	  else if( arg == 'k' )
+	    shard_file_name = optarg;
+	  else
+	    {
+	      if( arg == 'w' )
+		workers = strtol( optarg, &arg_check, 10 );
+	      else
+		loaders = strtol( optarg, &arg_check, 10 );
+	      if( arg_check == optarg  ||  *arg_check != '\0' )
+		fatal_error( "-%c option requires an integer argument\n" \
+			     "Try '%s -h' for help.", arg, pname );
+	    }
+	  break;
+
+	  // read gradient planes
+	case 'g' :
+	  grad_planes = ( grad_planes == 1 )? 0 : 1;
+	  break;
+
 	  // read double_image
 	case 'd' :
 	  img_dbl = ( img_dbl == 1 )? 0 : 1;
@@ -267,6 +502,20 @@ static void arg_parse( int argc, char** argv )
 	}
     }
 
+  // in batch mode, images come from the list
+  if( list_file_name )
+    {
+      if( argc - optind > 0 )
+	fatal_error( "an image file may not be given with -l.\n"	\
+		     "Try '%s -h' for help.", pname );
+      if( ! out_file_name  &&  ! shard_file_name )
+	fatal_error( "batch mode requires -o or -k.\n"	\
+		     "Try '%s -h' for help.", pname );
+      return;
+    }
+  if( shard_file_name )
+    fatal_error( "-k requires -l.\nTry '%s -h' for help.", pname );
+
   // make sure an input file is specified
   if( argc - optind < 1 )
     fatal_error( "no input file specified.\nTry '%s -h' for help.", pname );
@@ -278,3 +527,559 @@ static void arg_parse( int argc, char** argv )
   // copy image file name from command line argument
   img_file_name = argv[optind];
 }
+
+
+
+/*
+  Detects features in every image of a list with the batch pipeline.  One
+  thread reads the list, loader threads load images, worker threads detect
+  features, and this thread writes them out, reporting the time spent on
+  each image on stdout as it goes.
+
+  @param params detection parameters
+
+  @return Returns 0 if every image was processed or 1 if any failed, as
+    the program's exit status
+*/
+static int run_batch( struct sift_params* params )
+{
+  struct batch batch;
+  struct batch_item* item, ** pending;
+  pthread_t feeder, * threads;
+  FILE* spill = NULL;
+  double start, t;
+  int next = 0, nfailed = 0, total = 0, i;
+  void* p;
+
+  memset( &batch, 0, sizeof( struct batch ) );
+  if( strcmp( list_file_name, "-" ) == 0 )
+    batch.list = stdin;
+  else if( ! ( batch.list = fopen( list_file_name, "r" ) ) )
+    fatal_error( "unable to open list file %s", list_file_name );
+  if( shard_file_name  &&  ! ( spill = tmpfile() ) )
+    fatal_error( "unable to create a temporary file for %s",
+		 shard_file_name );
+
+  batch.params = params;
+  batch.d = params->descr_width * params->descr_width *
+    params->descr_hist_bins;
+  batch.load.name = "load";
+  batch.load.nthreads = MAX( loaders, 1 );
+  batch.detect.name = "detect";
+  batch.detect.nthreads = ( workers < 1 )? num_cpus() : workers;
+  batch.output.name = "output";
+  batch.output.nthreads = 1;
+  batch.paths = bqueue_init( BATCH_QUEUE_PER_THREAD * batch.load.nthreads );
+  batch.images = bqueue_init( BATCH_QUEUE_PER_THREAD *
+			      batch.detect.nthreads );
+  batch.results = bqueue_init( BATCH_QUEUE_PER_THREAD *
+			       batch.detect.nthreads );
+  if( ! batch.paths  ||  ! batch.images  ||  ! batch.results )
+    fatal_error( "unable to create batch queues" );
+
+  /* every image in flight is in a queue, a thread, or pending */
+  batch.nwindow = batch.paths->cap + batch.images->cap +
+    batch.results->cap + batch.load.nthreads + batch.detect.nthreads;
+  if( sem_init( &batch.window, 0, batch.nwindow ) )
+    fatal_error( "unable to create batch semaphore" );
+  pending = calloc( batch.nwindow, sizeof( struct batch_item* ) );
+  threads = calloc( batch.load.nthreads + batch.detect.nthreads,
+		    sizeof( pthread_t ) );
+  batch.names.cap = BATCH_NAMES_INIT;
+  batch.names.slots = calloc( batch.names.cap, sizeof( char* ) );
+  if( ! pending  ||  ! threads  ||  ! batch.names.slots )
+    fatal_error( "unable to allocate memory for batch pipeline" );
+
+  fprintf( stdout, " image  features       first   load_ms  detect_ms" \
+	   "  write_ms  file\n" );
+  start = get_time_ms();
+  if( pthread_create( &feeder, NULL, feed_thread, &batch ) )
+    fatal_error( "unable to start batch threads" );
+  start_threads( &batch.load, load_thread, &batch, threads );
+  start_threads( &batch.detect, detect_thread, &batch,
+		 threads + batch.load.nthreads );
+
+  /* write images in list order as they come out of the pipeline */
+  while( 1 )
+    {
+      t = get_time_ms();
+      i = bqueue_pop( batch.results, &p );
+      stage_time( &batch.output.wait_us, t );
+      if( ! i )
+	break;
+      item = p;
+      pending[item->seq % batch.nwindow] = item;
+      while( ( item = pending[next % batch.nwindow] ) )
+	{
+	  pending[next % batch.nwindow] = NULL;
+	  t = get_time_ms();
+	  output_item( item, &batch.names, spill, batch.d, total );
+	  stage_time( &batch.output.busy_us, t );
+	  batch.output.items++;
+	  if( item->n < 0 )
+	    nfailed++;
+	  else
+	    total += item->n;
+	  free( item->path );
+	  free( item );
+	  sem_post( &batch.window );
+	  next++;
+	}
+    }
+
+  pthread_join( feeder, NULL );
+  for( i = 0; i < batch.load.nthreads + batch.detect.nthreads; i++ )
+    pthread_join( threads[i], NULL );
+  if( spill )
+    write_shard( spill, total, batch.d );
+  t = get_time_ms() - start;
+  fprintf( stderr, "Found %d features in %d images, %d failed, in %.2f ms\n",
+	   total, next, nfailed, t );
+  fprintf( stderr, "stage   threads  images   busy_ms   wait_ms  images/s" \
+	   "  busy\n" );
+  report_stage( &batch.load, t );
+  report_stage( &batch.detect, t );
+  report_stage( &batch.output, t );
+  report_queue( "load", batch.paths );
+  report_queue( "detect", batch.images );
+  report_queue( "output", batch.results );
+
+  bqueue_release( &batch.paths );
+  bqueue_release( &batch.images );
+  bqueue_release( &batch.results );
+  sem_destroy( &batch.window );
+  if( batch.list != stdin )
+    fclose( batch.list );
+  for( i = 0; i < batch.names.cap; i++ )
+    free( batch.names.slots[i] );
+  free( batch.names.slots );
+  free( pending );
+  free( threads );
+  return ( nfailed > 0 )? 1 : 0;
+}
+
+
+
+/*
+  Starts the threads of a stage of the batch pipeline
+
+  @param stage the stage
+  @param fn the threads' function, passed batch
+  @param batch the batch pipeline
+  @param threads array in which to store the threads' ids
+*/
+static void start_threads( struct batch_stage* stage, void* (*fn)( void* ),
+			   struct batch* batch, pthread_t* threads )
+{
+  int i;
+
+  stage->active = stage->nthreads;
+  for( i = 0; i < stage->nthreads; i++ )
+    if( pthread_create( threads + i, NULL, fn, batch ) )
+      fatal_error( "unable to start batch threads" );
+}
+
+
+
+/*
+  Reads the list of images, skipping empty lines, and queues each image to
+  be loaded once the number in flight allows it.  A path too long to read
+  is queued already failed, so that it is reported in its place in the
+  list.  Closes the queue at the end of the list.
+
+  @param arg the batch pipeline
+
+  @return Returns NULL
+*/
+static void* feed_thread( void* arg )
+{
+  struct batch* batch = arg;
+  struct batch_item* item;
+  char line[BATCH_MAX_PATH];
+  int len, seq = 0;
+
+  while( ( len = read_line( batch->list, line, sizeof( line ) ) ) != -1 )
+    {
+      if( len == 0 )
+	continue;
+      while( sem_wait( &batch->window )  &&  errno == EINTR );
+      item = calloc( 1, sizeof( struct batch_item ) );
+      if( ! item  ||  ! ( item->path = strdup( line ) ) )
+	fatal_error( "unable to allocate memory reading %s", list_file_name );
+      item->seq = seq++;
+      item->n = -1;
+      if( len == -2 )
+	item->err = "image path too long";
+      bqueue_push( batch->paths, item );
+    }
+  bqueue_close( batch->paths );
+  return NULL;
+}
+
+
+
+/*
+  Runs a thread of the load stage of the batch pipeline.  An image that
+  cannot be loaded is passed on with its failure recorded.
+
+  @param arg the batch pipeline
+
+  @return Returns NULL
+*/
+static void* load_thread( void* arg )
+{
+  struct batch* batch = arg;
+  struct batch_stage* stage = &batch->load;
+  struct batch_item* item;
+  double t;
+  void* p;
+  int r;
+
+  while( 1 )
+    {
+      t = get_time_ms();
+      r = bqueue_pop( batch->paths, &p );
+      stage_time( &stage->wait_us, t );
+      if( ! r )
+	break;
+      item = p;
+
+      t = get_time_ms();
+      if( ! item->err  &&  ! ( item->img = cvLoadImage( item->path, 1 ) ) )
+	item->err = "unable to load image";
+      item->load_ms = get_time_ms() - t;
+      stage_time( &stage->busy_us, t );
+      __sync_fetch_and_add( &stage->items, 1 );
+
+      t = get_time_ms();
+      bqueue_push( batch->images, item );
+      stage_time( &stage->wait_us, t );
+    }
+
+  if( __sync_sub_and_fetch( &stage->active, 1 ) == 0 )
+    bqueue_close( batch->images );
+  return NULL;
+}
+
+
+
+/*
+  Runs a thread of the detection stage of the batch pipeline with its own
+  detection context.  Images are released once their features are found.
+
+  @param arg the batch pipeline
+
+  @return Returns NULL
+*/
+static void* detect_thread( void* arg )
+{
+  struct batch* batch = arg;
+  struct batch_stage* stage = &batch->detect;
+  struct batch_item* item;
+  struct sift_ctx* ctx;
+  double t;
+  void* p;
+  int r;
+
+  ctx = sift_ctx_init( batch->params );
+  if( ! ctx )
+    fatal_error( "unable to create a detection context" );
+  while( 1 )
+    {
+      t = get_time_ms();
+      r = bqueue_pop( batch->images, &p );
+      stage_time( &stage->wait_us, t );
+      if( ! r )
+	break;
+      item = p;
+
+      if( item->img )
+	{
+	  t = get_time_ms();
+	  item->n = sift_ctx_features( ctx, item->img, &item->feat );
+	  if( item->n < 0 )
+	    item->err = "unable to detect features";
+	  item->detect_ms = get_time_ms() - t;
+	  stage_time( &stage->busy_us, t );
+	  __sync_fetch_and_add( &stage->items, 1 );
+	  cvReleaseImage( &item->img );
+	}
+
+      t = get_time_ms();
+      bqueue_push( batch->results, item );
+      stage_time( &stage->wait_us, t );
+    }
+  sift_ctx_release( &ctx );
+
+  if( __sync_sub_and_fetch( &stage->active, 1 ) == 0 )
+    bqueue_close( batch->results );
+  return NULL;
+}
+
+
+
+/*
+  Writes an image's features to its feature file and the shard's temporary
+  file, as wanted, and reports it.  A failure is reported and the image
+  skipped.
+
+  @param item the image
+  @param names feature files already written
+  @param spill temporary file of the shard, or NULL
+  @param d descriptor length
+  @param first index in the shard of the image's first feature
+*/
+static void output_item( struct batch_item* item, struct name_table* names,
+			 FILE* spill, int d, int first )
+{
+  struct feature_writer* writer;
+  struct feature_set* set;
+  char* name;
+  double start;
+  int err;
+
+  start = get_time_ms();
+  if( item->n >= 0  &&  out_file_name )
+    {
+      name = feature_file_name( item->path );
+      if( ! claim_file_name( names, name ) )
+	{
+	  free( name );
+	  item->err = "feature file already written for an earlier image";
+	  item->n = -1;
+	}
+      else
+	{
+	  writer = feature_writer_open( name, FEATURE_LOWE, item->n, d );
+	  err = ! writer  ||
+	    feature_writer_write( writer, item->feat, item->n );
+	  if( feature_writer_close( &writer ) )
+	    err = 1;
+	  if( err )
+	    {
+	      item->err = "unable to write features";
+	      item->n = -1;
+	    }
+	}
+    }
+  if( item->n >= 0  &&  spill )
+    {
+      set = feature_set_from_features( item->feat, item->n );
+      if( ! set )
+	{
+	  item->err = "unable to store features";
+	  item->n = -1;
+	}
+      else
+	spill_set( spill, set, d );
+      feature_set_release( &set );
+    }
+  item->write_ms = get_time_ms() - start;
+  free( item->feat );
+  item->feat = NULL;
+
+  if( item->n < 0 )
+    fprintf( stdout, "%6d    failed: %s  %s\n", item->seq, item->err,
+	     item->path );
+  else
+    fprintf( stdout, "%6d  %8d  %10d  %8.2f  %9.2f  %8.2f  %s\n",
+	     item->seq, item->n, first, item->load_ms, item->detect_ms,
+	     item->write_ms, item->path );
+  fflush( stdout );
+}
+
+
+
+/*
+  Adds the time elapsed since start to a stage counter
+
+  @param us counter of microseconds
+  @param start start time, from get_time_ms()
+*/
+static void stage_time( unsigned long* us, double start )
+{
+  __sync_fetch_and_add( us, (unsigned long)( 1000 *
+					     ( get_time_ms() - start ) ) );
+}
+
+
+
+/*
+  Reports the throughput of a stage of the batch pipeline on stderr: the
+  images it processed per second of the run and the fraction of its
+  threads' time they spent busy rather than waiting on queues
+
+  @param stage the stage
+  @param ms duration of the run in milliseconds
+*/
+static void report_stage( struct batch_stage* stage, double ms )
+{
+  fprintf( stderr, "%-6s  %7d  %6lu  %8.1f  %8.1f  %8.2f  %3.0f%%\n",
+	   stage->name, stage->nthreads, stage->items, stage->busy_us / 1000.0,
+	   stage->wait_us / 1000.0, stage->items / MAX( ms / 1000, 1e-9 ),
+	   100.0 * stage->busy_us / MAX( 1000 * ms * stage->nthreads, 1 ) );
+}
+
+
+
+/*
+  Reports on stderr how often a queue feeding a stage of the batch
+  pipeline held back the stage before it by being full, or left the stage
+  idle by being empty
+
+  @param name name of the stage the queue feeds
+  @param q the queue
+*/
+static void report_queue( char* name, struct bqueue* q )
+{
+  fprintf( stderr, "queue to %-6s  capacity %3d  %6lu pushed  %6lu full" \
+	   "  %6lu empty\n", name, q->cap, q->npush, q->nfull, q->nempty );
+}
+
+
+
+/*
+  Returns the name of the feature file of an image in the output
+  directory: the image's file name with its extension replaced by .sift.
+  The name must be released with free().
+*/
+static char* feature_file_name( char* path )
+{
+  char* base, * dot, * name;
+  int len;
+
+  base = strrchr( path, '/' );
+  base = ( base )? base + 1 : path;
+  dot = strrchr( base, '.' );
+  len = ( dot  &&  dot != base )? dot - base : strlen( base );
+  name = malloc( strlen( out_file_name ) + len + 7 );
+  if( ! name )
+    fatal_error( "unable to allocate memory for a file name" );
+  sprintf( name, "%s/%.*s.sift", out_file_name, len, base );
+  return name;
+}
+
+
+
+/*
+  Adds a feature file to the table of those written, unless it is already
+  there because an earlier image has the same name.  The table grows to
+  stay at most half full.
+
+  @param table feature files written
+  @param name a feature file name, from feature_file_name(); on success
+    the table owns it
+
+  @return Returns 1 if name was added or 0 if it was already in the table
+*/
+static int claim_file_name( struct name_table* table, char* name )
+{
+  char** old;
+  int cap, i, j;
+
+  if( 2 * ( table->n + 1 ) > table->cap )
+    {
+      old = table->slots;
+      cap = table->cap;
+      table->cap *= 2;
+      table->slots = calloc( table->cap, sizeof( char* ) );
+      if( ! table->slots )
+	fatal_error( "unable to allocate memory for feature file names" );
+      for( i = 0; i < cap; i++ )
+	if( old[i] )
+	  {
+	    j = hash_name( old[i] ) & ( table->cap - 1 );
+	    while( table->slots[j] )
+	      j = ( j + 1 ) & ( table->cap - 1 );
+	    table->slots[j] = old[i];
+	  }
+      free( old );
+    }
+
+  i = hash_name( name ) & ( table->cap - 1 );
+  while( table->slots[i] )
+    {
+      if( strcmp( table->slots[i], name ) == 0 )
+	return 0;
+      i = ( i + 1 ) & ( table->cap - 1 );
+    }
+  table->slots[i] = name;
+  table->n++;
+  return 1;
+}
+
+
+
+/*
+  Hashes a file name with 32-bit FNV-1a
+*/
+static unsigned int hash_name( char* name )
+{
+  unsigned int h = 2166136261u;
+
+  while( *name )
+    h = ( h ^ (unsigned char)*name++ ) * 16777619u;
+  return h;
+}
+
+
+
+/*
+  Appends an image's features to the temporary file from which the shard
+  is written: their count, geometry arrays, and d-byte descriptors.
+
+  @param spill temporary file
+  @param set the image's features
+  @param d descriptor length
+*/
+static void spill_set( FILE* spill, struct feature_set* set, int d )
+{
+  int i, ok;
+
+  ok = fwrite( &set->n, sizeof( int ), 1, spill ) == 1  &&
+    fwrite( set->x, sizeof( float ), set->n, spill ) == set->n  &&
+    fwrite( set->y, sizeof( float ), set->n, spill ) == set->n  &&
+    fwrite( set->scl, sizeof( float ), set->n, spill ) == set->n  &&
+    fwrite( set->ori, sizeof( float ), set->n, spill ) == set->n;
+  for( i = 0; ok  &&  i < set->n; i++ )
+    ok = fwrite( feature_set_descr( set, i ), 1, d, spill ) == d;
+  if( ! ok )
+    fatal_error( "unable to write temporary file for %s", shard_file_name );
+}
+
+
+
+/*
+  Writes the shard from the temporary file filled by spill_set().  The
+  shard's size depends on its number of features, so it can only be
+  created once every image has been processed.
+
+  @param spill temporary file
+  @param total total number of features
+  @param d descriptor length
+*/
+static void write_shard( FILE* spill, int total, int d )
+{
+  struct feature_set* shard;
+  int first, n, i, ok = 1;
+
+  shard = feature_set_create( shard_file_name, total, d );
+  if( ! shard )
+    fatal_error( "unable to create %s", shard_file_name );
+  rewind( spill );
+  for( first = 0; ok  &&  first < total; first += n )
+    {
+      ok = fread( &n, sizeof( int ), 1, spill ) == 1  &&
+	n >= 0  &&  n <= total - first  &&
+	fread( shard->x + first, sizeof( float ), n, spill ) == n  &&
+	fread( shard->y + first, sizeof( float ), n, spill ) == n  &&
+	fread( shard->scl + first, sizeof( float ), n, spill ) == n  &&
+	fread( shard->ori + first, sizeof( float ), n, spill ) == n;
+      for( i = 0; ok  &&  i < n; i++ )
+	ok = fread( feature_set_descr( shard, first + i ), 1, d, spill ) == d;
+    }
+  if( ! ok )
+    fatal_error( "unable to read temporary file for %s", shard_file_name );
+  feature_set_release( &shard );
+  fclose( spill );
+}
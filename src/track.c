@@ -0,0 +1,837 @@
+/*
+  Functions for tracking SIFT features through the frames of a video.
+
+  Copyright (C) 2006-2012  Rob Hess <rob@iqengines.com>
+
+  @version 1.1.2-20100521
+*/
+
+#include "track.h"
+#include "sift.h"
+#include "imgfeatures.h"
+#include "kdtree.h"
+#include "xform.h"
+#include "utils.h"
+
+#include <cxcore.h>
+#include <cv.h>
+
+#include <float.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/************************* Local Function Prototypes *************************/
+
+static int alloc_frame( struct tracker*, CvSize );
+static int mark_regions( struct tracker* );
+static double cell_diff( struct tracker*, int, int );
+static int support_changed( struct tracker*, struct feature* );
+static int label_regions( struct tracker* );
+static void carry_features( struct tracker* );
+static int detect_regions( struct tracker*, int );
+static int add_feature( struct tracker*, struct feature* );
+static void update_ref( struct tracker* );
+static void match_features( struct tracker* );
+static void keep_nearest( struct feature*, struct feature*, int,
+			  int*, double* );
+static void fit_xform( struct tracker* );
+static int update_model( struct tracker* );
+static int index_model( struct tracker* );
+
+
+/************************** Local Inline Functions ***************************/
+
+/*
+  Returns the index of the cell containing a point, clamped to the frame
+*/
+static inline int cell_of( struct tracker* tracker, double x, double y )
+{
+  int c = (int)( x / tracker->params.cell );
+  int r = (int)( y / tracker->params.cell );
+
+  c = MIN( MAX( c, 0 ), tracker->ncols - 1 );
+  r = MIN( MAX( r, 0 ), tracker->nrows - 1 );
+  return r * tracker->ncols + c;
+}
+
+
+/********************** Functions prototyped in track.h **********************/
+
+/*
+  Sets tracking parameters to their defaults
+
+  @param params parameters to initialize
+*/
+void track_params_init( struct track_params* params )
+{
+  params->cell = TRACK_CELL;
+  params->diff_thr = TRACK_DIFF_THR;
+  params->search_radius = TRACK_SEARCH_RADIUS;
+  params->max_age = TRACK_MAX_AGE;
+  params->full_frac = TRACK_FULL_FRAC;
+  params->rebuild_frac = TRACK_REBUILD_FRAC;
+}
+
+
+
+/*
+  Creates a tracker.  Frame buffers are allocated with the first frame.
+
+  @param sift_params parameters with which features are detected
+  @param params tracking parameters, or NULL for the defaults
+
+  @return Returns a new tracker or NULL if sift_params are invalid
+*/
+struct tracker* tracker_init( const struct sift_params* sift_params,
+			      const struct track_params* params )
+{
+  struct tracker* tracker;
+
+  if( ! sift_params )
+    fatal_error( "NULL pointer error, %s, line %d",  __FILE__, __LINE__ );
+
+  tracker = calloc( 1, sizeof( struct tracker ) );
+  if( ! tracker )
+    fatal_error( "unable to allocate memory, %s, line %d",
+		 __FILE__, __LINE__ );
+  if( params )
+    tracker->params = *params;
+  else
+    track_params_init( &tracker->params );
+  tracker->ctx = sift_ctx_init( sift_params );
+  if( ! tracker->ctx )
+    {
+      free( tracker );
+      return NULL;
+    }
+  return tracker;
+}
+
+
+
+/*
+  Finds the features of the next frame of a video and the homography from
+  the frame to the model.
+
+  @param tracker a tracker
+  @param img the next frame
+  @param feat pointer in which to return the frame's features
+  @param H pointer in which to return the homography from the frame to the
+    model, or NULL
+
+  @return Returns the number of features in *feat, or -1 on error
+*/
+int tracker_update( struct tracker* tracker, IplImage* img,
+		    struct feature** feat, CvMat** H )
+{
+  int i, nregions;
+
+  if( ! tracker  ||  ! img  ||  ! feat )
+    fatal_error( "NULL pointer error, %s, line %d",  __FILE__, __LINE__ );
+
+  if( tracker->frame == 0 )
+    {
+      if( alloc_frame( tracker, cvGetSize( img ) ) )
+	return -1;
+    }
+  else if( img->width != tracker->size.width  ||
+	   img->height != tracker->size.height )
+    {
+      fprintf( stderr, "Warning: frame size changed while tracking, %s" \
+	       " line %d\n", __FILE__, __LINE__ );
+      return -1;
+    }
+  if( img->nChannels == 1 )
+    cvCopy( img, tracker->gray, NULL );
+  else
+    cvCvtColor( img, tracker->gray, CV_BGR2GRAY );
+
+  /* keep features in unchanged cells; detect and match the rest */
+  nregions = mark_regions( tracker );
+  carry_features( tracker );
+  if( detect_regions( tracker, nregions ) )
+    return -1;
+  update_ref( tracker );
+
+  /* the first frame is the model; later ones are matched to it */
+  if( tracker->frame == 0 )
+    {
+      tracker->H = cvCreateMat( 3, 3, CV_64FC1 );
+      cvZero( tracker->H );
+      for( i = 0; i < 3; i++ )
+	cvmSet( tracker->H, i, i, 1.0 );
+    }
+  else if( tracker->ndetected > 0 )
+    {
+      match_features( tracker );
+      fit_xform( tracker );
+    }
+  if( update_model( tracker ) )
+    return -1;
+
+  for( i = 0; i < tracker->n; i++ )
+    tracker->feat[i].mdl_match = ( tracker->match[i] >= 0 )?
+      tracker->model + tracker->match[i] : NULL;
+  tracker->frame++;
+
+  *feat = tracker->feat;
+  if( H )
+    *H = tracker->H;
+  return tracker->n;
+}
+
+
+
+/*
+  De-allocates a tracker
+
+  @param tracker pointer to a tracker
+*/
+void tracker_release( struct tracker** tracker )
+{
+  if( ! tracker  ||  ! *tracker )
+    return;
+  sift_ctx_release( &(*tracker)->ctx );
+  cvReleaseImage( &(*tracker)->gray );
+  cvReleaseImage( &(*tracker)->ref );
+  free( (*tracker)->label );
+  free( (*tracker)->stack );
+  free( (*tracker)->rects );
+  free( (*tracker)->feat );
+  free( (*tracker)->match );
+  free( (*tracker)->model );
+  free( (*tracker)->seen );
+  free( (*tracker)->kd_feat );
+  if( (*tracker)->kd )
+    kdtree_release( (*tracker)->kd );
+  if( (*tracker)->H )
+    cvReleaseMat( &(*tracker)->H );
+  free( *tracker );
+  *tracker = NULL;
+}
+
+
+/************************ Functions prototyped here **************************/
+
+/*
+  Allocates a tracker's frame buffers and cell arrays for frames of a given
+  size
+
+  @param tracker a tracker
+  @param size frame size
+
+  @return Returns 0 on success or -1 on error
+*/
+static int alloc_frame( struct tracker* tracker, CvSize size )
+{
+  int cell = tracker->params.cell, ncells;
+
+  if( cell < 1 )
+    {
+      fprintf( stderr, "Warning: invalid tracking cell width %d, %s line %d\n",
+	       cell, __FILE__, __LINE__ );
+      return -1;
+    }
+  tracker->size = size;
+  tracker->ncols = ( size.width + cell - 1 ) / cell;
+  tracker->nrows = ( size.height + cell - 1 ) / cell;
+  ncells = tracker->ncols * tracker->nrows;
+  tracker->gray = cvCreateImage( size, IPL_DEPTH_8U, 1 );
+  tracker->ref = cvCreateImage( size, IPL_DEPTH_8U, 1 );
+  tracker->label = calloc( ncells, sizeof( int ) );
+  tracker->stack = calloc( ncells, sizeof( int ) );
+  tracker->rects = calloc( ncells + 1, sizeof( CvRect ) );
+  if( ! tracker->label  ||  ! tracker->stack  ||  ! tracker->rects )
+    {
+      fprintf( stderr, "Warning: unable to allocate memory, %s line %d\n",
+	       __FILE__, __LINE__ );
+      return -1;
+    }
+  return 0;
+}
+
+
+
+/*
+  Labels the cells of the current frame in which features are to be
+  detected: those whose contents changed since they were last detected,
+  and those holding a feature whose support reaches a changed cell.  The
+  first frame, a frame following one for which no homography was found,
+  and a frame in which too many cells changed are detected whole.
+
+  @param tracker a tracker
+
+  @return Returns the number of regions of connected cells to be
+    detected, whose bounding boxes are stored in tracker->rects[1] on
+*/
+static int mark_regions( struct tracker* tracker )
+{
+  struct track_params* params = &tracker->params;
+  int* label = tracker->label;
+  int ncells = tracker->ncols * tracker->nrows;
+  int i, r, c, n = 0, full = ( tracker->frame == 0  ||  ! tracker->H );
+
+  if( ! full )
+    {
+      for( r = 0; r < tracker->nrows; r++ )
+	for( c = 0; c < tracker->ncols; c++ )
+	  label[r*tracker->ncols+c] =
+	    cell_diff( tracker, r, c ) > params->diff_thr;
+
+      /* a feature whose support changed is detected with its cell */
+      for( i = 0; i < tracker->n; i++ )
+	{
+	  c = cell_of( tracker, tracker->feat[i].x, tracker->feat[i].y );
+	  if( ! label[c]  &&  support_changed( tracker, tracker->feat + i ) )
+	    label[c] = -1;
+	}
+
+      for( i = 0; i < ncells; i++ )
+	if( label[i] )
+	  {
+	    label[i] = 1;
+	    n++;
+	  }
+      full = n > params->full_frac * ncells;
+    }
+
+  if( full )
+    {
+      for( i = 0; i < ncells; i++ )
+	label[i] = 1;
+      tracker->rects[1] = cvRect( 0, 0, tracker->size.width,
+				  tracker->size.height );
+      tracker->ncells = ncells;
+      return 1;
+    }
+  tracker->ncells = n;
+  return label_regions( tracker );
+}
+
+
+
+/*
+  Computes the mean absolute difference between a cell of the current frame
+  and its contents when it was last detected
+
+  @param tracker a tracker
+  @param r row of the cell
+  @param c column of the cell
+
+  @return Returns the mean absolute difference in gray levels
+*/
+static double cell_diff( struct tracker* tracker, int r, int c )
+{
+  IplImage* gray = tracker->gray, * ref = tracker->ref;
+  unsigned char* g, * f;
+  int cell = tracker->params.cell;
+  int x0 = c * cell, y0 = r * cell;
+  int x1 = MIN( x0 + cell, gray->width ), y1 = MIN( y0 + cell, gray->height );
+  int x, y, d;
+  long sum = 0;
+
+  for( y = y0; y < y1; y++ )
+    {
+      g = (unsigned char*)( gray->imageData + gray->widthStep * y );
+      f = (unsigned char*)( ref->imageData + ref->widthStep * y );
+      for( x = x0; x < x1; x++ )
+	{
+	  d = g[x] - f[x];
+	  sum += ( d < 0 )? -d : d;
+	}
+    }
+  return (double)sum / ( ( x1 - x0 ) * ( y1 - y0 ) );
+}
+
+
+
+/*
+  Determines whether any cell within a feature's descriptor support has
+  changed
+
+  @param tracker a tracker whose changed cells have label 1
+  @param feat a feature of the previous frame
+
+  @return Returns 1 if the feature's support changed or 0 otherwise
+*/
+static int support_changed( struct tracker* tracker, struct feature* feat )
+{
+  double s = TRACK_SUPPORT_FCTR * feat->scl;
+  int cell = tracker->params.cell;
+  int c0, c1, r0, r1, r, c;
+
+  c0 = MAX( (int)floor( ( feat->x - s ) / cell ), 0 );
+  c1 = MIN( (int)floor( ( feat->x + s ) / cell ), tracker->ncols - 1 );
+  r0 = MAX( (int)floor( ( feat->y - s ) / cell ), 0 );
+  r1 = MIN( (int)floor( ( feat->y + s ) / cell ), tracker->nrows - 1 );
+  for( r = r0; r <= r1; r++ )
+    for( c = c0; c <= c1; c++ )
+      if( tracker->label[r*tracker->ncols+c] == 1 )
+	return 1;
+  return 0;
+}
+
+
+
+/*
+  Numbers the 4-connected regions of cells marked for detection and finds
+  their bounding boxes
+
+  @param tracker a tracker whose cells to be detected have label 1
+
+  @return Returns the number of regions; region i is labeled i + 1
+*/
+static int label_regions( struct tracker* tracker )
+{
+  int* label = tracker->label, * stack = tracker->stack;
+  int ncols = tracker->ncols, nrows = tracker->nrows;
+  int cell = tracker->params.cell;
+  int i, k, r, c, top, r0, r1, c0, c1, x0, y0, x1, y1, n = 0;
+
+  /* label -1 marks cells not yet assigned to a region */
+  for( i = 0; i < ncols * nrows; i++ )
+    label[i] = -label[i];
+
+  for( i = 0; i < ncols * nrows; i++ )
+    {
+      if( label[i] != -1 )
+	continue;
+      label[i] = ++n;
+      stack[0] = i;
+      top = 1;
+      r0 = r1 = i / ncols;
+      c0 = c1 = i % ncols;
+      while( top > 0 )
+	{
+	  k = stack[--top];
+	  r = k / ncols;
+	  c = k % ncols;
+	  r0 = MIN( r0, r );
+	  r1 = MAX( r1, r );
+	  c0 = MIN( c0, c );
+	  c1 = MAX( c1, c );
+	  if( c > 0  &&  label[k-1] == -1 )
+	    label[ stack[top++] = k - 1 ] = n;
+	  if( c < ncols - 1  &&  label[k+1] == -1 )
+	    label[ stack[top++] = k + 1 ] = n;
+	  if( r > 0  &&  label[k-ncols] == -1 )
+	    label[ stack[top++] = k - ncols ] = n;
+	  if( r < nrows - 1  &&  label[k+ncols] == -1 )
+	    label[ stack[top++] = k + ncols ] = n;
+	}
+
+      x0 = c0 * cell;
+      y0 = r0 * cell;
+      x1 = MIN( ( c1 + 1 ) * cell, tracker->size.width );
+      y1 = MIN( ( r1 + 1 ) * cell, tracker->size.height );
+      tracker->rects[n] = cvRect( x0, y0, x1 - x0, y1 - y0 );
+    }
+
+  return n;
+}
+
+
+
+/*
+  Keeps those features of the previous frame that lie in cells that are not
+  to be detected
+
+  @param tracker a tracker
+*/
+static void carry_features( struct tracker* tracker )
+{
+  int i, n = 0;
+
+  for( i = 0; i < tracker->n; i++ )
+    if( ! tracker->label[ cell_of( tracker, tracker->feat[i].x,
+				   tracker->feat[i].y ) ] )
+      {
+	if( n != i )
+	  {
+	    tracker->feat[n] = tracker->feat[i];
+	    tracker->match[n] = tracker->match[i];
+	  }
+	n++;
+      }
+  tracker->n = tracker->ncarried = n;
+}
+
+
+
+/*
+  Detects features in each region of cells marked for detection.  Each
+  region's bounding box is detected with the margin set in the detection
+  parameters, but only features lying in the region's own cells are kept,
+  so regions whose bounding boxes overlap do not contribute the same
+  feature twice.
+
+  @param tracker a tracker
+  @param nregions number of regions
+
+  @return Returns 0 on success or -1 on error
+*/
+static int detect_regions( struct tracker* tracker, int nregions )
+{
+  struct feature* feat;
+  int i, k, n;
+
+  tracker->ndetected = 0;
+  for( k = 1; k <= nregions; k++ )
+    {
+      n = sift_ctx_features_roi( tracker->ctx, tracker->gray,
+				 tracker->rects[k], NULL, &feat );
+      if( n < 0 )
+	return -1;
+
+      for( i = 0; i < n; i++ )
+	{
+	  if( tracker->label[ cell_of( tracker, feat[i].x, feat[i].y ) ] != k )
+	    continue;
+	  if( add_feature( tracker, feat + i ) )
+	    {
+	      free( feat );
+	      return -1;
+	    }
+	  tracker->ndetected++;
+	}
+      free( feat );
+    }
+  return 0;
+}
+
+
+
+/*
+  Appends an unmatched feature to the current frame's features
+
+  @param tracker a tracker
+  @param feat a feature
+
+  @return Returns 0 on success or -1 on error
+*/
+static int add_feature( struct tracker* tracker, struct feature* feat )
+{
+  struct feature* f;
+  int* m;
+  int nallocd;
+
+  if( tracker->n == tracker->nallocd )
+    {
+      nallocd = MAX( 2 * tracker->nallocd, 256 );
+      f = realloc( tracker->feat, nallocd * sizeof( struct feature ) );
+      if( f )
+	tracker->feat = f;
+      m = realloc( tracker->match, nallocd * sizeof( int ) );
+      if( m )
+	tracker->match = m;
+      if( ! f  ||  ! m )
+	{
+	  fprintf( stderr, "Warning: unable to allocate memory, %s line %d\n",
+		   __FILE__, __LINE__ );
+	  return -1;
+	}
+      tracker->nallocd = nallocd;
+    }
+  tracker->feat[tracker->n] = *feat;
+  tracker->match[tracker->n++] = -1;
+  return 0;
+}
+
+
+
+/*
+  Copies the cells just detected into the reference against which later
+  frames are compared
+
+  @param tracker a tracker
+*/
+static void update_ref( struct tracker* tracker )
+{
+  IplImage* gray = tracker->gray, * ref = tracker->ref;
+  int cell = tracker->params.cell;
+  int r, c, y, x0, x1, y1;
+
+  for( r = 0; r < tracker->nrows; r++ )
+    for( c = 0; c < tracker->ncols; c++ )
+      {
+	if( ! tracker->label[r*tracker->ncols+c] )
+	  continue;
+	x0 = c * cell;
+	x1 = MIN( x0 + cell, gray->width );
+	y1 = MIN( ( r + 1 ) * cell, gray->height );
+	for( y = r * cell; y < y1; y++ )
+	  memcpy( ref->imageData + ref->widthStep * y + x0,
+		  gray->imageData + gray->widthStep * y + x0, x1 - x0 );
+      }
+}
+
+
+
+/*
+  Matches each newly detected feature to the model.  When the last frame's
+  homography is known, only model features near the location it predicts
+  for the feature are considered; otherwise the whole model is searched.
+  Model features added since the model's k-d tree was built are compared
+  directly.  A match must pass the nearest-neighbor distance ratio test if
+  a second neighbor is found.
+
+  @param tracker a tracker
+*/
+static void match_features( struct tracker* tracker )
+{
+  struct feature* feat, ** nbrs;
+  CvPoint2D64f pt;
+  CvRect rect = cvRect( 0, 0, 0, 0 );
+  double dist[2];
+  int idx[2];
+  int i, j, k, rad = tracker->params.search_radius;
+
+  for( i = tracker->ncarried; i < tracker->n; i++ )
+    {
+      feat = tracker->feat + i;
+      idx[0] = idx[1] = -1;
+      dist[0] = dist[1] = DBL_MAX;
+      if( tracker->H )
+	{
+	  pt = persp_xform_pt( feat->img_pt, tracker->H );
+	  rect = cvRect( cvRound( pt.x ) - rad, cvRound( pt.y ) - rad,
+			 2 * rad, 2 * rad );
+	}
+
+      if( tracker->kd )
+	{
+	  if( tracker->H )
+	    k = kdtree_bbf_spatial_knn( tracker->kd, feat, 2, &nbrs,
+					TRACK_BBF_MAX_NN_CHKS, rect, 1 );
+	  else
+	    k = kdtree_bbf_knn( tracker->kd, feat, 2, &nbrs,
+				TRACK_BBF_MAX_NN_CHKS );
+	  for( j = 0; j < k; j++ )
+	    keep_nearest( feat, nbrs[j], nbrs[j]->category, idx, dist );
+	  free( nbrs );
+	}
+
+      for( j = tracker->nindexed; j < tracker->nmodel; j++ )
+	{
+	  pt = tracker->model[j].mdl_pt;
+	  if( tracker->H  &&  ( pt.x < rect.x  ||  pt.y < rect.y  ||
+				pt.x > rect.x + rect.width  ||
+				pt.y > rect.y + rect.height ) )
+	    continue;
+	  keep_nearest( feat, tracker->model + j, j, idx, dist );
+	}
+
+      if( idx[0] >= 0  &&
+	  ( idx[1] < 0  ||  dist[0] < dist[1] * TRACK_NN_SQ_DIST_RATIO_THR ) )
+	tracker->match[i] = idx[0];
+    }
+}
+
+
+
+/*
+  Keeps a model feature if it is one of the two nearest to a feature found
+  so far
+
+  @param feat a feature
+  @param mfeat a model feature
+  @param m index of mfeat in the model
+  @param idx model indices of the nearest and second-nearest features
+  @param dist squared descriptor distances of the nearest and
+    second-nearest features
+*/
+static void keep_nearest( struct feature* feat, struct feature* mfeat, int m,
+			  int* idx, double* dist )
+{
+  double d;
+
+  if( m == idx[0]  ||  m == idx[1] )
+    return;
+  d = descr_dist_sq( feat, mfeat );
+  if( d < dist[0] )
+    {
+      idx[1] = idx[0];
+      dist[1] = dist[0];
+      idx[0] = m;
+      dist[0] = d;
+    }
+  else if( d < dist[1] )
+    {
+      idx[1] = m;
+      dist[1] = d;
+    }
+}
+
+
+
+/*
+  Fits a homography from the current frame to the model by RANSAC over all
+  features matched to the model, carried and new, and drops matches that
+  are not inliers.  If no homography is found, every match is dropped.
+
+  @param tracker a tracker
+*/
+static void fit_xform( struct tracker* tracker )
+{
+  struct feature** inliers = NULL;
+  int* match = tracker->match;
+  int i, j, n_in = 0, nmatched = 0;
+
+  for( i = 0; i < tracker->n; i++ )
+    {
+      tracker->feat[i].mdl_match = ( match[i] >= 0 )?
+	tracker->model + match[i] : NULL;
+      nmatched += match[i] >= 0;
+    }
+
+  if( tracker->H )
+    cvReleaseMat( &tracker->H );
+  if( nmatched >= 4 )
+    tracker->H = ransac_xform( tracker->feat, tracker->n, FEATURE_MDL_MATCH,
+			       lsq_homog, 4, 0.01, homog_xfer_err,
+			       RANSAC_ERR_TOL, &inliers, &n_in );
+
+  /* match[j] < -1 marks inliers until the others are dropped */
+  if( tracker->H )
+    for( i = 0; i < n_in; i++ )
+      {
+	j = inliers[i] - tracker->feat;
+	match[j] = -match[j] - 2;
+      }
+  for( i = 0; i < tracker->n; i++ )
+    match[i] = ( match[i] < -1 )? -match[i] - 2 : -1;
+  free( inliers );
+}
+
+
+
+/*
+  Adds the current frame's unmatched features to the model at the locations
+  given by the frame's homography, records the frame in which each matched
+  model feature was seen, and rebuilds the model's k-d tree, dropping model
+  features unseen for too long, once enough of the model has changed.
+
+  @param tracker a tracker
+
+  @return Returns 0 on success or -1 on error
+*/
+static int update_model( struct tracker* tracker )
+{
+  struct feature* f;
+  int* s;
+  int i, m, nallocd;
+
+  tracker->nmatched = tracker->ninliers = 0;
+  for( i = 0; i < tracker->n; i++ )
+    {
+      m = tracker->match[i];
+      if( m >= 0 )
+	{
+	  tracker->seen[m] = tracker->frame;
+	  tracker->nmatched++;
+	  continue;
+	}
+      if( ! tracker->H )
+	continue;
+
+      if( tracker->nmodel == tracker->nmodel_allocd )
+	{
+	  nallocd = MAX( 2 * tracker->nmodel_allocd, 256 );
+	  f = realloc( tracker->model, nallocd * sizeof( struct feature ) );
+	  if( f )
+	    tracker->model = f;
+	  s = realloc( tracker->seen, nallocd * sizeof( int ) );
+	  if( s )
+	    tracker->seen = s;
+	  if( ! f  ||  ! s )
+	    {
+	      fprintf( stderr, "Warning: unable to allocate memory, %s line"
+		       " %d\n", __FILE__, __LINE__ );
+	      return -1;
+	    }
+	  tracker->nmodel_allocd = nallocd;
+	}
+      m = tracker->nmodel++;
+      f = tracker->model + m;
+      *f = tracker->feat[i];
+      f->mdl_pt = persp_xform_pt( f->img_pt, tracker->H );
+      f->img_pt = f->mdl_pt;
+      f->x = f->mdl_pt.x;
+      f->y = f->mdl_pt.y;
+      f->fwd_match = f->bck_match = f->mdl_match = NULL;
+      f->feature_data = NULL;
+      tracker->seen[m] = tracker->frame;
+      tracker->match[i] = m;
+      tracker->nstale++;
+    }
+  tracker->ninliers = ( tracker->H )? tracker->nmatched : 0;
+
+  if( tracker->nstale > 0  &&
+      ( ! tracker->kd  ||
+	tracker->nstale > tracker->params.rebuild_frac * tracker->nindexed ) )
+    return index_model( tracker );
+  return 0;
+}
+
+
+
+/*
+  Drops model features not seen within the maximum age, renumbering the
+  current frame's matches, and rebuilds the k-d tree of the model
+
+  @param tracker a tracker
+
+  @return Returns 0 on success or -1 on error
+*/
+static int index_model( struct tracker* tracker )
+{
+  struct feature* kd_feat;
+  int* remap;
+  int i, n = 0;
+
+  remap = malloc( tracker->nmodel * sizeof( int ) );
+  if( ! remap )
+    {
+      fprintf( stderr, "Warning: unable to allocate memory, %s line %d\n",
+	       __FILE__, __LINE__ );
+      return -1;
+    }
+  for( i = 0; i < tracker->nmodel; i++ )
+    if( tracker->frame - tracker->seen[i] <= tracker->params.max_age )
+      {
+	tracker->model[n] = tracker->model[i];
+	tracker->seen[n] = tracker->seen[i];
+	remap[i] = n++;
+      }
+    else
+      remap[i] = -1;
+  for( i = 0; i < tracker->n; i++ )
+    if( tracker->match[i] >= 0 )
+      tracker->match[i] = remap[ tracker->match[i] ];
+  tracker->nmodel = n;
+  free( remap );
+
+  if( tracker->kd )
+    kdtree_release( tracker->kd );
+  tracker->kd = NULL;
+  tracker->nindexed = tracker->nstale = 0;
+  if( n == 0 )
+    return 0;
+  kd_feat = realloc( tracker->kd_feat, n * sizeof( struct feature ) );
+  if( ! kd_feat )
+    {
+      fprintf( stderr, "Warning: unable to allocate memory, %s line %d\n",
+	       __FILE__, __LINE__ );
+      return -1;
+    }
+  tracker->kd_feat = kd_feat;
+  memcpy( kd_feat, tracker->model, n * sizeof( struct feature ) );
+  for( i = 0; i < n; i++ )
+    kd_feat[i].category = i;
+  tracker->kd = kdtree_build( kd_feat, n );
+  if( ! tracker->kd )
+    return -1;
+  tracker->nindexed = n;
+  return 0;
+}
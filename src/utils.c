@@ -18,6 +18,11 @@
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
+
+
+/* upper limit on the SIMD level reported by simd_level() */
+static int simd_limit = SIMD_AVX2;
 
 
 /*************************** Function Definitions ****************************/
@@ -126,6 +131,86 @@ char* basename( const char* pathname )
 
 
 
+/*
+  Reads a line of a text file into a buffer, without its line ending.  A
+  line too long for the buffer is skipped through its end.
+
+  @param file a text file
+  @param line buffer in which to store the line
+  @param size size of line in bytes
+
+  @return Returns the length of the line, -1 at the end of the file, or
+    -2 if the line was too long
+*/
+int read_line( FILE* file, char* line, int size )
+{
+  int len, full, c;
+
+  if( ! fgets( line, size, file ) )
+    return -1;
+  len = strlen( line );
+  full = len == size - 1  &&  line[len-1] != '\n';
+  while( len > 0  &&  ( line[len-1] == '\n'  ||  line[len-1] == '\r' ) )
+    line[--len] = '\0';
+  if( ! full )
+    return len;
+
+  /* the buffer is full; the line fit only if its ending comes next */
+  c = getc( file );
+  if( c == '\r' )
+    c = getc( file );
+  if( c == '\n'  ||  c == EOF )
+    return len;
+  while( c != '\n'  &&  c != EOF )
+    c = getc( file );
+  return -2;
+}
+
+
+
+/*
+  Reads the non-empty lines of a list file
+
+  @param filename name of the list file
+  @param n output as the number of lines read
+
+  @return Returns an array of the lines, without line endings.
+*/
+char** read_list( char* filename, int* n )
+{
+  FILE* file;
+  char** lines = NULL;
+  char line[4096];
+  int len, nallocd = 0, lineno = 0;
+
+  file = fopen( filename, "r" );
+  if( ! file )
+    fatal_error( "unable to open list file %s", filename );
+  *n = 0;
+  while( ( len = read_line( file, line, sizeof( line ) ) ) != -1 )
+    {
+      lineno++;
+      if( len == -2 )
+	fatal_error( "line %d of %s is too long", lineno, filename );
+      if( len == 0 )
+	continue;
+      if( *n == nallocd )
+	{
+	  nallocd = MAX( 2 * nallocd, 64 );
+	  lines = realloc( lines, nallocd * sizeof( char* ) );
+	  if( ! lines )
+	    fatal_error( "unable to allocate memory reading %s", filename );
+	}
+      lines[(*n)++] = strdup( line );
+    }
+  fclose( file );
+  if( *n == 0 )
+    fatal_error( "list file %s names no files", filename );
+  return lines;
+}
+
+
+
 /*
   Displays progress in the console with a spinning pinwheel.  Every time this
   function is called, the state of the pinwheel is incremented.  The pinwheel
@@ -222,6 +307,89 @@ double dist_sq_2D( CvPoint2D64f p1, CvPoint2D64f p2 )
 
 
 
+/*
+  Reads a monotonic clock, e.g. for timing code.
+
+  @return Returns the current time in milliseconds, measured from an
+    arbitrary starting point
+*/
+double get_time_ms( void )
+{
+  struct timespec ts;
+
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+
+
+/*
+  Advances a xorshift random state, which must not be zero
+
+  @param state random state
+
+  @return Returns the next 32-bit random number.
+*/
+unsigned int rand_next( unsigned int* state )
+{
+  unsigned int x = *state;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *state = x;
+  return x;
+}
+
+
+
+/*
+  Determines the most capable SIMD instruction set available for vectorized
+  code paths.  The CPU is queried once, at the first call.
+
+  @return Returns one of SIMD_NONE, SIMD_SSE2, or SIMD_AVX2, capped by any
+    limit set with limit_simd_level()
+*/
+int simd_level( void )
+{
+  static int level = -1;
+  int l;
+
+  /* concurrent first calls all store the same value */
+  l = __atomic_load_n( &level, __ATOMIC_RELAXED );
+  if( l < 0 )
+    {
+#if defined(__GNUC__)  &&  ( defined(__x86_64__)  ||  defined(__i386__) )
+      __builtin_cpu_init();
+      if( __builtin_cpu_supports( "avx2" )  &&
+	  __builtin_cpu_supports( "fma" ) )
+	l = SIMD_AVX2;
+      else if( __builtin_cpu_supports( "sse2" ) )
+	l = SIMD_SSE2;
+      else
+	l = SIMD_NONE;
+#else
+      l = SIMD_NONE;
+#endif
+      __atomic_store_n( &level, l, __ATOMIC_RELAXED );
+    }
+  return MIN( l, simd_limit );
+}
+
+
+
+/*
+  Caps the SIMD instruction set used by vectorized code paths.
+
+  @param level one of SIMD_NONE, SIMD_SSE2, or SIMD_AVX2
+*/
+void limit_simd_level( int level )
+{
+  simd_limit = level;
+}
+
+
+
 /*
   Draws an x on an image.
   
@@ -0,0 +1,296 @@
+/*
+  This program tracks SIFT features through the frames of a video, given as
+  a list of image files, one per line, and reports for each frame how much
+  of it had to be detected again, how many features were carried over from
+  the previous frame, and how many matched the model of the scene built
+  from earlier frames.  See track.h.
+
+  Copyright (C) 2006-2012  Rob Hess <rob@iqengines.com>
+
+  @version 1.1.2-20100521
+*/
+
+#include "track.h"
+#include "sift.h"
+#include "imgfeatures.h"
+#include "utils.h"
+
+#include <cxcore.h>
+#include <highgui.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define OPTIONS ":o:c:f:a:t:gvh"
+
+/* longest frame path read from a list file */
+#define VIDTRACK_MAX_PATH 4096
+
+/*************************** Function Prototypes *****************************/
+
+static void usage( char* );
+static void arg_parse( int, char** );
+static char* feature_file_name( char* );
+
+/******************************** Globals ************************************/
+
+char* pname;
+char* list_file_name;
+char* out_dir_name = NULL;
+int cell = TRACK_CELL;
+double diff_thr = TRACK_DIFF_THR;
+int max_age = TRACK_MAX_AGE;
+int threads = SIFT_THREADS;
+int grad_planes = SIFT_GRAD_PLANES;
+int view = 0;
+
+
+/********************************** Main *************************************/
+
+int main( int argc, char** argv )
+{
+  struct sift_params sift_params;
+  struct track_params params;
+  struct tracker* tracker;
+  struct feature* feat;
+  IplImage* img, ** frames = NULL;
+  CvMat* H;
+  FILE* list;
+  char line[VIDTRACK_MAX_PATH], * name;
+  double start, ms, total = 0;
+  int n, len, nframes = 0, cells = 0;
+
+  arg_parse( argc, argv );
+
+  sift_params_init( &sift_params );
+  sift_params.threads = threads;
+  sift_params.grad_planes = grad_planes;
+  track_params_init( &params );
+  params.cell = cell;
+  params.diff_thr = diff_thr;
+  params.max_age = max_age;
+  tracker = tracker_init( &sift_params, &params );
+  if( ! tracker )
+    fatal_error( "unable to create a tracker" );
+
+  list = ( strcmp( list_file_name, "-" ) == 0 )? stdin :
+    fopen( list_file_name, "r" );
+  if( ! list )
+    fatal_error( "unable to open frame list %s", list_file_name );
+
+  printf( "%6s %9s %6s %7s %8s %6s %7s %7s\n", "frame", "ms", "feats",
+	  "carried", "detected", "cells", "matched", "inliers" );
+  while( fgets( line, sizeof( line ), list ) )
+    {
+      len = strlen( line );
+      while( len > 0  &&  ( line[len-1] == '\n'  ||  line[len-1] == '\r' ) )
+	line[--len] = '\0';
+      if( len == 0 )
+	continue;
+      img = cvLoadImage( line, 1 );
+      if( ! img )
+	fatal_error( "unable to load image from %s", line );
+
+      start = get_time_ms();
+      n = tracker_update( tracker, img, &feat, &H );
+      ms = get_time_ms() - start;
+      if( n < 0 )
+	fatal_error( "unable to track features in %s", line );
+      total += ms;
+      cells = tracker->ncols * tracker->nrows;
+      printf( "%6d %9.2f %6d %7d %8d %5.1f%% %7d %7d%s\n", nframes, ms, n,
+	      tracker->ncarried, tracker->ndetected,
+	      100.0 * tracker->ncells / cells, tracker->nmatched,
+	      tracker->ninliers, ( H )? "" : "  (lost)" );
+
+      if( out_dir_name )
+	{
+	  name = feature_file_name( line );
+	  if( export_features( name, feat, n ) )
+	    fatal_error( "unable to write features to %s", name );
+	  free( name );
+	}
+      if( view )
+	{
+	  draw_features( img, feat, n );
+	  frames = realloc( frames, ( nframes + 1 ) * sizeof( IplImage* ) );
+	  if( ! frames )
+	    fatal_error( "unable to allocate memory for %d frames",
+			 nframes + 1 );
+	  frames[nframes] = img;
+	}
+      else
+	cvReleaseImage( &img );
+      nframes++;
+    }
+  if( list != stdin )
+    fclose( list );
+
+  fprintf( stderr, "Tracked %d frames in %.2f ms, %.2f ms per frame; " \
+	   "model holds %d features\n", nframes, total,
+	   ( nframes )? total / nframes : 0.0, tracker->nmodel );
+  tracker_release( &tracker );
+
+  if( view  &&  nframes > 0 )
+    {
+      cvNamedWindow( list_file_name, 1 );
+      vid_view( frames, nframes, list_file_name );
+      while( nframes > 0 )
+	cvReleaseImage( &frames[--nframes] );
+      free( frames );
+    }
+  return 0;
+}
+
+
+/************************** Function Definitions *****************************/
+
+// print usage for this program
+static void usage( char* name )
+{
+  fprintf(stderr, "%s: track SIFT keypoints through video frames\n\n", name);
+  fprintf(stderr, "Usage: %s [options] <list_file>\n", name);
+  fprintf(stderr, "       <list_file> names one frame image per line, or is" \
+	  " - for standard input\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "  -h               Display this message and exit\n");
+  fprintf(stderr, "  -o <out_dir>     Output each frame's keypoints to" \
+	  " <out_dir>/<name>.sift\n");
+  fprintf(stderr, "  -c <width>       Set width of cells compared between" \
+	  " frames (default %d)\n", TRACK_CELL);
+  fprintf(stderr, "  -f <thresh>      Set threshold on a cell's mean absolute" \
+	  " gray level change\n");
+  fprintf(stderr, "                   above which it is detected again" \
+	  " (default %.1f)\n", TRACK_DIFF_THR);
+  fprintf(stderr, "  -a <frames>      Set number of frames an unmatched model" \
+	  " keypoint is kept\n");
+  fprintf(stderr, "                   (default %d)\n", TRACK_MAX_AGE);
+  fprintf(stderr, "  -t <threads>     Set number of threads used to detect" \
+	  " keypoints; 0 uses one\n");
+  fprintf(stderr, "                   per CPU (default %d)\n", SIFT_THREADS);
+  fprintf(stderr, "  -g               Toggle precomputed gradient planes" \
+	  " (default %s)\n", ( SIFT_GRAD_PLANES )? "on" : "off" );
+  fprintf(stderr, "  -v               Play the frames with their keypoints" \
+	  " when done\n");
+}
+
+
+
+/*
+  arg_parse() parses the command line arguments, setting appropriate globals.
+
+  argc and argv should be passed directly from the command line
+*/
+static void arg_parse( int argc, char** argv )
+{
+  //extract program name from command line (remove path, if present)
+  pname = basename( argv[0] );
+
+  //parse commandline options
+  while( 1 )
+    {
+      char* arg_check;
+      int arg = getopt( argc, argv, OPTIONS );
+      if( arg == -1 )
+	break;
+
+      switch( arg )
+	{
+	  // catch unsupplied required arguments and exit
+	case ':':
+	  fatal_error( "-%c option requires an argument\n"		\
+		       "Try '%s -h' for help.", optopt, pname );
+	  break;
+
+	case 'o':
+	  out_dir_name = optarg;
+	  break;
+
+	case 'c':
+	  cell = strtol( optarg, &arg_check, 10 );
+	  if( arg_check == optarg  ||  *arg_check != '\0'  ||  cell < 1 )
+	    fatal_error( "-c option requires a positive integer argument\n" \
+			 "Try '%s -h' for help.", pname );
+	  break;
+
+	case 'f':
+	  diff_thr = strtod( optarg, &arg_check );
+	  if( arg_check == optarg  ||  *arg_check != '\0' )
+	    fatal_error( "-f option requires a floating point argument\n" \
+			 "Try '%s -h' for help.", pname );
+	  break;
+
+	case 'a':
+	  max_age = strtol( optarg, &arg_check, 10 );
+	  if( arg_check == optarg  ||  *arg_check != '\0' )
+	    fatal_error( "-a option requires an integer argument\n" \
+			 "Try '%s -h' for help.", pname );
+	  break;
+
+	case 't':
+	  threads = strtol( optarg, &arg_check, 10 );
+	  if( arg_check == optarg  ||  *arg_check != '\0' )
+	    fatal_error( "-t option requires an integer argument\n" \
+			 "Try '%s -h' for help.", pname );
+	  break;
+
+	case 'g':
+	  grad_planes = ! grad_planes;
+	  break;
+
+	case 'v':
+	  view = 1;
+	  break;
+
+	  // user asked for help
+	case 'h':
+	  usage( pname );
+	  exit(0);
+	  break;
+
+	  // catch invalid arguments
+	default:
+	  fatal_error( "-%c: invalid option.\nTry '%s -h' for help.",
+		       optopt, pname );
+	}
+    }
+
+  // make sure a frame list is specified
+  if( argc - optind < 1 )
+    fatal_error( "no frame list specified.\nTry '%s -h' for help.", pname );
+
+  // make sure there aren't too many arguments
+  if( argc - optind > 1 )
+    fatal_error( "too many arguments.\nTry '%s -h' for help.", pname );
+
+  list_file_name = argv[optind];
+}
+
+
+
+/*
+  Makes the name of the file to which a frame's features are written: the
+  frame file's base name, without extension, with ".sift" appended, in the
+  output directory
+
+  @param path frame file
+
+  @return Returns the name, which the caller must free
+*/
+static char* feature_file_name( char* path )
+{
+  char* base, * dot, * name;
+  int len;
+
+  base = strrchr( path, '/' );
+  base = ( base )? base + 1 : path;
+  dot = strrchr( base, '.' );
+  len = ( dot  &&  dot != base )? dot - base : strlen( base );
+  name = malloc( strlen( out_dir_name ) + len + 7 );
+  if( ! name )
+    fatal_error( "unable to allocate memory for a file name" );
+  sprintf( name, "%s/%.*s.sift", out_dir_name, len, base );
+  return name;
+}
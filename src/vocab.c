@@ -0,0 +1,1086 @@
+/*
+  Functions and structures for indexing large collections of images by
+  quantizing their features with a vocabulary tree.
+
+  For more information, refer to:
+
+  Nister, D. and Stewenius, H.  Scalable recognition with a vocabulary
+  tree.  In <EM>Conference on Computer Vision and Pattern Recognition
+  (CVPR)</EM> (2006), pp. 2161--2168.
+
+  Arthur, D. and Vassilvitskii, S.  k-means++: the advantages of careful
+  seeding.  In <EM>Symposium on Discrete Algorithms (SODA)</EM> (2007),
+  pp. 1027--1035.
+
+  Copyright (C) 2006-2012  Rob Hess <rob@iqengines.com>
+
+  @version 1.1.2-20100521
+*/
+
+#include "vocab.h"
+#include "featset.h"
+#include "descrdist.h"
+#include "parallel.h"
+#include "utils.h"
+
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* identifies a file written by vocab_save() */
+#define VOCAB_MAGIC "OSVOCAB1"
+
+/* written after the magic to detect files of another byte order */
+#define VOCAB_BYTE_ORDER 0x01020304
+
+/* minimum number of training descriptors assigned by one task */
+#define VOCAB_ASSIGN_GRAIN 1024
+
+/* a level's nodes are clustered in parallel, one node per task, once it
+   has at least this many nodes per thread; before that, each node's
+   descriptors are divided among the threads instead */
+#define VOCAB_NODES_PER_THREAD 4
+
+/* shared state of a tree build; see cluster_node() */
+struct build_job
+{
+  struct vocab_tree* tree;
+  unsigned char* train;        /* training descriptors, tree->stride apart */
+  int* idx;                    /* training descriptor indices, grouped by
+				  node */
+  int* first;                  /* start in idx of each node's descriptors */
+  int* assign;                 /* child to which each entry of idx belongs */
+  int iters;
+  unsigned int seed;
+  int level_first;             /* first node of the level being clustered */
+  int* err;                    /* set per thread when clustering fails */
+};
+
+/* descriptors of one node being assigned to its children in parallel; see
+   assign_range() */
+struct assign_job
+{
+  struct vocab_tree* tree;
+  unsigned char* train;
+  int* idx;
+  int* assign;
+  unsigned char* centers;      /* the node's first child's center */
+  int k;                       /* number of centers */
+  int* changed;                /* set per thread when an assignment changes */
+};
+
+/* a visual word and the number of an image's features quantized to it */
+struct word_count
+{
+  int word;
+  int count;
+};
+
+/* an image's words being computed in parallel; see quantize_images() */
+struct quantize_job
+{
+  struct vocab_tree* tree;
+  struct feature_set** sets;
+  struct word_count** hists;   /* each image's word histogram */
+  int* nhists;                 /* number of words in each histogram */
+};
+
+/************************* Local Function Prototypes *************************/
+
+static struct vocab_tree* alloc_tree( int, int, int );
+static void cluster_nodes( void*, int, int, int );
+static int cluster_node( struct build_job*, int, struct thread_pool* );
+static int seed_centers( struct build_job*, int, unsigned int );
+static int assign_points( struct build_job*, int, int, struct thread_pool* );
+static void assign_range( void*, int, int, int );
+static int word_hist( struct vocab_tree*, struct feature_set*,
+		      struct word_count** );
+static int cmp_int( const void*, const void* );
+static void quantize_images( void*, int, int, int );
+static void update_weights( struct vocab_tree* );
+
+
+/********************** Functions prototyped in vocab.h **********************/
+
+/*
+  Sets vocabulary tree parameters to their defaults.
+
+  @param params parameters to initialize
+*/
+void vocab_params_init( struct vocab_params* params )
+{
+  params->branch = VOCAB_BRANCH;
+  params->depth = VOCAB_DEPTH;
+  params->iters = VOCAB_ITERS;
+  params->max_train = VOCAB_MAX_TRAIN;
+  params->seed = VOCAB_SEED;
+}
+
+
+
+/*
+  Builds a vocabulary tree by hierarchical k-means.  The tree is clustered
+  a level at a time.  Each node's training descriptors occupy a contiguous
+  range of an index array, which clustering the node divides into one
+  range per child, so a level's nodes can be clustered independently.
+
+  @param sets feature sets whose descriptors are clustered
+  @param nsets number of sets
+  @param params tree parameters, or NULL for the defaults
+  @param pool threads, or NULL
+
+  @return Returns a new vocabulary tree or NULL on error.
+*/
+struct vocab_tree* vocab_build( struct feature_set** sets, int nsets,
+				struct vocab_params* params,
+				struct thread_pool* pool )
+{
+  struct vocab_params defaults;
+  struct vocab_tree* tree;
+  struct build_job job;
+  int nthreads = thread_pool_size( pool ), d, ntrain, nlevel, l, i, ret = 0;
+
+  if( ! params )
+    {
+      vocab_params_init( &defaults );
+      params = &defaults;
+    }
+  if( ! sets  ||  nsets < 1 )
+    {
+      fprintf( stderr, "Warning: vocab_build(): no features, %s, line %d\n",
+	       __FILE__, __LINE__ );
+      return NULL;
+    }
+  d = sets[0]->d;
+  for( i = 1; i < nsets; i++ )
+    if( sets[i]->d != d )
+      {
+	fprintf( stderr, "Warning: vocab_build(): features have differing" \
+		 " descriptor lengths, %s, line %d\n", __FILE__, __LINE__ );
+	return NULL;
+      }
+
+  tree = alloc_tree( d, params->branch, params->depth );
+  if( ! tree )
+    return NULL;
+  memset( &job, 0, sizeof( struct build_job ) );
+  job.train = feature_sets_sample( sets, nsets, params->max_train,
+				   tree->stride, &ntrain );
+  if( ! job.train )
+    {
+      vocab_release( &tree );
+      return NULL;
+    }
+
+  job.tree = tree;
+  job.idx = malloc( ntrain * sizeof( int ) );
+  job.assign = malloc( ntrain * sizeof( int ) );
+  job.first = calloc( tree->nnodes, sizeof( int ) );
+  job.err = calloc( nthreads, sizeof( int ) );
+  job.iters = MAX( params->iters, 1 );
+  job.seed = params->seed;
+  if( ! job.idx  ||  ! job.assign  ||  ! job.first  ||  ! job.err )
+    {
+      fprintf( stderr, "Warning: unable to allocate memory, %s line %d\n",
+	       __FILE__, __LINE__ );
+      ret = -1;
+      goto end;
+    }
+  for( i = 0; i < ntrain; i++ )
+    job.idx[i] = i;
+  tree->ntrain[0] = ntrain;
+
+  /* cluster each level's nodes to make the next level */
+  job.level_first = 0;
+  nlevel = 1;
+  for( l = 0; l < tree->depth  &&  ret == 0; l++ )
+    {
+      if( nlevel >= VOCAB_NODES_PER_THREAD * nthreads )
+	parallel_for( pool, nlevel, 1, cluster_nodes, &job );
+      else
+	for( i = 0; i < nlevel; i++ )
+	  if( cluster_node( &job, job.level_first + i, pool ) )
+	    job.err[0] = 1;
+      for( i = 0; i < nthreads; i++ )
+	if( job.err[i] )
+	  ret = -1;
+      job.level_first += nlevel;
+      nlevel *= tree->branch;
+    }
+  if( ret )
+    fprintf( stderr, "Warning: unable to allocate memory, %s line %d\n",
+	     __FILE__, __LINE__ );
+
+ end:
+  free( job.train );
+  free( job.idx );
+  free( job.assign );
+  free( job.first );
+  free( job.err );
+  if( ret )
+    vocab_release( &tree );
+  return tree;
+}
+
+
+
+/*
+  Quantizes a descriptor to a visual word, descending at each level to the
+  nearest non-empty child, or the first of several equally near.
+
+  @param tree a vocabulary tree
+  @param descr a descriptor
+
+  @return Returns the index of the descriptor's word.
+*/
+int vocab_quantize( struct vocab_tree* tree, const unsigned char* descr )
+{
+  unsigned char* center;
+  int node = 0, l, c, j, dsq, best, best_dsq;
+
+  for( l = 0; l < tree->depth; l++ )
+    {
+      c = node * tree->branch + 1;
+      center = tree->centers + (size_t)c * tree->stride;
+      best = c;
+      best_dsq = INT_MAX;
+      for( j = 0; j < tree->branch; j++, c++, center += tree->stride )
+	if( tree->ntrain[c] )
+	  {
+	    dsq = descr_dist_sq_u8( descr, center, tree->stride );
+	    if( dsq < best_dsq )
+	      {
+		best = c;
+		best_dsq = dsq;
+	      }
+	  }
+      node = best;
+    }
+
+  return node - ( tree->nnodes - tree->nwords );
+}
+
+
+
+/*
+  Adds images to a vocabulary tree's inverted files.  Each image's word
+  histogram is computed in parallel, every inverted file is grown once to
+  fit the batch, and the images are appended in order.
+
+  @param tree a vocabulary tree
+  @param sets the images' feature sets
+  @param ids caller's id of each image, or NULL
+  @param n number of images
+  @param pool threads, or NULL
+
+  @return Returns 0 on success or -1 on error.
+*/
+int vocab_add_images( struct vocab_tree* tree, struct feature_set** sets,
+		      int* ids, int n, struct thread_pool* pool )
+{
+  struct quantize_job job;
+  struct word_count* hist;
+  int* need = NULL;
+  void* p;
+  int i, j, w, m, ret = 0;
+
+  if( ! tree  ||  ( n > 0  &&  ! sets ) )
+    {
+      fprintf( stderr, "Warning: NULL pointer error, %s, line %d\n",
+	       __FILE__, __LINE__ );
+      return -1;
+    }
+  for( i = 0; i < n; i++ )
+    if( ! sets[i]  ||  sets[i]->d != tree->d )
+      {
+	fprintf( stderr, "Warning: vocab_add_images(): image %d has no" \
+		 " features of the tree's descriptor length, %s, line %d\n",
+		 i, __FILE__, __LINE__ );
+	return -1;
+      }
+  if( n < 1 )
+    return 0;
+
+  job.tree = tree;
+  job.sets = sets;
+  job.hists = calloc( n, sizeof( struct word_count* ) );
+  job.nhists = calloc( n, sizeof( int ) );
+  need = calloc( tree->nwords, sizeof( int ) );
+  if( ! job.hists  ||  ! job.nhists  ||  ! need )
+    goto fail;
+  parallel_for( pool, n, 1, quantize_images, &job );
+  for( i = 0; i < n; i++ )
+    if( job.nhists[i] < 0 )
+      goto fail;
+
+  /* make room for the batch, then append it */
+  if( tree->nimages + n > tree->nimages_allocd )
+    {
+      m = MAX( tree->nimages + n, 2 * tree->nimages_allocd );
+      p = realloc( tree->image_ids, m * sizeof( int ) );
+      if( ! p )
+	goto fail;
+      tree->image_ids = p;
+      p = realloc( tree->norms, m * sizeof( double ) );
+      if( ! p )
+	goto fail;
+      tree->norms = p;
+      tree->nimages_allocd = m;
+    }
+  for( i = 0; i < n; i++ )
+    for( j = 0; j < job.nhists[i]; j++ )
+      need[job.hists[i][j].word]++;
+  for( w = 0; w < tree->nwords; w++ )
+    if( tree->npostings[w] + need[w] > tree->nallocd[w] )
+      {
+	m = MAX( tree->npostings[w] + need[w], 2 * tree->nallocd[w] );
+	p = realloc( tree->postings[w], m * sizeof( struct vocab_posting ) );
+	if( ! p )
+	  goto fail;
+	tree->postings[w] = p;
+	tree->nallocd[w] = m;
+      }
+  for( i = 0; i < n; i++ )
+    {
+      hist = job.hists[i];
+      for( j = 0; j < job.nhists[i]; j++ )
+	{
+	  w = hist[j].word;
+	  tree->postings[w][tree->npostings[w]].image = tree->nimages;
+	  tree->postings[w][tree->npostings[w]].count = hist[j].count;
+	  tree->npostings[w]++;
+	}
+      tree->image_ids[tree->nimages] = ( ids )? ids[i] : tree->nimages;
+      tree->nimages++;
+    }
+  update_weights( tree );
+  goto end;
+
+ fail:
+  fprintf( stderr, "Warning: unable to allocate memory, %s line %d\n",
+	   __FILE__, __LINE__ );
+  ret = -1;
+ end:
+  for( i = 0; job.hists  &&  i < n; i++ )
+    free( job.hists[i] );
+  free( job.hists );
+  free( job.nhists );
+  free( need );
+  return ret;
+}
+
+
+
+/*
+  Finds the images in a vocabulary tree most similar to a query image.
+  Scores are accumulated from the inverted files of the query's words,
+  then divided by the norms of the images' and query's weighted word
+  histograms.
+
+  @param tree a vocabulary tree
+  @param set the query's features
+  @param hits array in which to store the most similar images
+  @param top_k maximum number of images to return
+
+  @return Returns the number of images stored in hits or -1 on error.
+*/
+int vocab_query( struct vocab_tree* tree, struct feature_set* set,
+		 struct vocab_hit* hits, int top_k )
+{
+  struct word_count* hist;
+  struct vocab_posting* post;
+  double* scores;
+  double qw, qnorm = 0, s;
+  int nhist, i, j, w, n = 0;
+
+  if( ! tree  ||  ! set  ||  ! hits )
+    {
+      fprintf( stderr, "Warning: NULL pointer error, %s, line %d\n",
+	       __FILE__, __LINE__ );
+      return -1;
+    }
+  if( set->d != tree->d )
+    {
+      fprintf( stderr, "Warning: comparing imcompatible descriptors, %s" \
+	       " line %d\n", __FILE__, __LINE__ );
+      return -1;
+    }
+  if( top_k < 1  ||  tree->nimages < 1 )
+    return 0;
+
+  nhist = word_hist( tree, set, &hist );
+  scores = calloc( tree->nimages, sizeof( double ) );
+  if( nhist < 0  ||  ! scores )
+    {
+      fprintf( stderr, "Warning: unable to allocate memory, %s line %d\n",
+	       __FILE__, __LINE__ );
+      free( hist );
+      free( scores );
+      return -1;
+    }
+
+  for( i = 0; i < nhist; i++ )
+    {
+      w = hist[i].word;
+      qw = hist[i].count * tree->idf[w];
+      if( qw == 0 )
+	continue;
+      qnorm += qw * qw;
+      post = tree->postings[w];
+      for( j = 0; j < tree->npostings[w]; j++ )
+	scores[post[j].image] += qw * post[j].count * tree->idf[w];
+    }
+  qnorm = sqrt( qnorm );
+
+  /* keep the top_k highest scores, earlier images first among ties */
+  for( i = 0; i < tree->nimages  &&  qnorm > 0; i++ )
+    {
+      if( scores[i] <= 0 )
+	continue;
+      s = scores[i] / ( qnorm * tree->norms[i] );
+      if( n == top_k  &&  s <= hits[n-1].score )
+	continue;
+      j = ( n < top_k )? n++ : n - 1;
+      while( j > 0  &&  hits[j-1].score < s )
+	{
+	  hits[j] = hits[j-1];
+	  j--;
+	}
+      hits[j].image = i;
+      hits[j].id = tree->image_ids[i];
+      hits[j].score = s;
+    }
+
+  free( hist );
+  free( scores );
+  return n;
+}
+
+
+
+/*
+  Writes a vocabulary tree to a binary file: a magic string, a byte order
+  mark, the tree's shape, the training descriptor count and center of each
+  node, the images' ids, and each word's inverted file.  Weights are not
+  written; they are recomputed when the tree is read.
+
+  @param tree a vocabulary tree
+  @param filename name of the file to write
+
+  @return Returns 0 on success or -1 on error.
+*/
+int vocab_save( struct vocab_tree* tree, char* filename )
+{
+  FILE* file;
+  int header[5];
+  int i, ok;
+
+  if( ! tree  ||  ! filename )
+    {
+      fprintf( stderr, "Warning: NULL pointer error, %s, line %d\n",
+	       __FILE__, __LINE__ );
+      return -1;
+    }
+  if( ! ( file = fopen( filename, "wb" ) ) )
+    {
+      fprintf( stderr, "Warning: error opening %s, %s, line %d\n",
+	       filename, __FILE__, __LINE__ );
+      return -1;
+    }
+
+  header[0] = VOCAB_BYTE_ORDER;
+  header[1] = tree->d;
+  header[2] = tree->branch;
+  header[3] = tree->depth;
+  header[4] = tree->nimages;
+  ok = fwrite( VOCAB_MAGIC, 1, 8, file ) == 8  &&
+    fwrite( header, sizeof( int ), 5, file ) == 5  &&
+    fwrite( tree->ntrain, sizeof( int ), tree->nnodes, file ) ==
+    tree->nnodes;
+  for( i = 0; i < tree->nnodes  &&  ok; i++ )
+    ok = fwrite( tree->centers + (size_t)i * tree->stride, 1, tree->d,
+		 file ) == tree->d;
+  if( tree->nimages > 0 )
+    ok = ok  &&  fwrite( tree->image_ids, sizeof( int ), tree->nimages,
+			 file ) == tree->nimages;
+  for( i = 0; i < tree->nwords  &&  ok; i++ )
+    {
+      ok = fwrite( tree->npostings + i, sizeof( int ), 1, file ) == 1;
+      if( ok  &&  tree->npostings[i] > 0 )
+	ok = fwrite( tree->postings[i], sizeof( struct vocab_posting ),
+		     tree->npostings[i], file ) == tree->npostings[i];
+    }
+
+  if( fclose( file )  ||  ! ok )
+    {
+      fprintf( stderr, "Warning: error writing %s, %s, line %d\n",
+	       filename, __FILE__, __LINE__ );
+      return -1;
+    }
+  return 0;
+}
+
+
+
+/*
+  Reads a vocabulary tree written by vocab_save().
+
+  @param filename name of the file to read
+
+  @return Returns the tree or NULL on error.
+*/
+struct vocab_tree* vocab_load( char* filename )
+{
+  struct vocab_tree* tree = NULL;
+  FILE* file;
+  char magic[8];
+  int header[5];
+  int i, n, ok;
+
+  if( ! filename )
+    {
+      fprintf( stderr, "Warning: NULL pointer error, %s, line %d\n",
+	       __FILE__, __LINE__ );
+      return NULL;
+    }
+  if( ! ( file = fopen( filename, "rb" ) ) )
+    {
+      fprintf( stderr, "Warning: error opening %s, %s, line %d\n",
+	       filename, __FILE__, __LINE__ );
+      return NULL;
+    }
+
+  ok = fread( magic, 1, 8, file ) == 8  &&
+    memcmp( magic, VOCAB_MAGIC, 8 ) == 0  &&
+    fread( header, sizeof( int ), 5, file ) == 5  &&
+    header[0] == VOCAB_BYTE_ORDER  &&  header[4] >= 0;
+  if( ok )
+    tree = alloc_tree( header[1], header[2], header[3] );
+  ok = tree  &&  fread( tree->ntrain, sizeof( int ), tree->nnodes, file ) ==
+    tree->nnodes;
+  for( i = 0; ok  &&  i < tree->nnodes; i++ )
+    ok = fread( tree->centers + (size_t)i * tree->stride, 1, tree->d,
+		file ) == tree->d;
+
+  if( ok  &&  ( n = header[4] ) > 0 )
+    {
+      tree->image_ids = malloc( n * sizeof( int ) );
+      tree->norms = malloc( n * sizeof( double ) );
+      ok = tree->image_ids  &&  tree->norms  &&
+	fread( tree->image_ids, sizeof( int ), n, file ) == n;
+      tree->nimages = tree->nimages_allocd = ( ok )? n : 0;
+    }
+  for( i = 0; ok  &&  i < tree->nwords; i++ )
+    {
+      ok = fread( &n, sizeof( int ), 1, file ) == 1  &&  n >= 0;
+      if( ok  &&  n > 0 )
+	{
+	  tree->postings[i] = malloc( n * sizeof( struct vocab_posting ) );
+	  ok = tree->postings[i]  &&
+	    fread( tree->postings[i], sizeof( struct vocab_posting ), n,
+		   file ) == n;
+	  tree->npostings[i] = tree->nallocd[i] = ( ok )? n : 0;
+	}
+    }
+  fclose( file );
+
+  if( ! ok )
+    {
+      fprintf( stderr, "Warning: %s is not a readable vocabulary tree, %s," \
+	       " line %d\n", filename, __FILE__, __LINE__ );
+      vocab_release( &tree );
+      return NULL;
+    }
+  for( i = 0; i < tree->nwords; i++ )
+    for( n = 0; n < tree->npostings[i]; n++ )
+      if( tree->postings[i][n].image < 0  ||
+	  tree->postings[i][n].image >= tree->nimages )
+	{
+	  fprintf( stderr, "Warning: %s has an invalid inverted file, %s," \
+		   " line %d\n", filename, __FILE__, __LINE__ );
+	  vocab_release( &tree );
+	  return NULL;
+	}
+  update_weights( tree );
+  return tree;
+}
+
+
+
+/*
+  De-allocates a vocabulary tree
+
+  @param tree pointer to a vocabulary tree
+*/
+void vocab_release( struct vocab_tree** tree )
+{
+  int i;
+
+  if( ! tree  ||  ! *tree )
+    return;
+  for( i = 0; (*tree)->postings  &&  i < (*tree)->nwords; i++ )
+    free( (*tree)->postings[i] );
+  free( (*tree)->postings );
+  free( (*tree)->npostings );
+  free( (*tree)->nallocd );
+  free( (*tree)->centers );
+  free( (*tree)->ntrain );
+  free( (*tree)->image_ids );
+  free( (*tree)->norms );
+  free( (*tree)->idf );
+  free( *tree );
+  *tree = NULL;
+}
+
+
+/************************ Functions prototyped here **************************/
+
+/*
+  Allocates an empty vocabulary tree of a given shape, with all nodes empty
+  and all centers zero.
+
+  @param d descriptor length
+  @param branch number of children of each node
+  @param depth number of levels below the root
+
+  @return Returns the tree or NULL if the shape is invalid or no memory is
+    available.
+*/
+static struct vocab_tree* alloc_tree( int d, int branch, int depth )
+{
+  struct vocab_tree* tree;
+  double nnodes;
+
+  if( d < 1  ||  branch < 2  ||  depth < 1 )
+    {
+      fprintf( stderr, "Warning: invalid vocabulary tree shape, %s, line" \
+	       " %d\n", __FILE__, __LINE__ );
+      return NULL;
+    }
+  nnodes = ( pow( branch, depth + 1 ) - 1 ) / ( branch - 1 );
+  if( nnodes > INT_MAX / 2 )
+    {
+      fprintf( stderr, "Warning: vocabulary tree of %d levels of %d children" \
+	       " is too large, %s, line %d\n", depth, branch, __FILE__,
+	       __LINE__ );
+      return NULL;
+    }
+
+  tree = calloc( 1, sizeof( struct vocab_tree ) );
+  if( ! tree )
+    goto fail;
+  tree->d = d;
+  tree->stride = ( d + FEATSET_ALIGN - 1 ) / FEATSET_ALIGN * FEATSET_ALIGN;
+  tree->branch = branch;
+  tree->depth = depth;
+  tree->nnodes = (int)( nnodes + 0.5 );
+  tree->nwords = (int)( pow( branch, depth ) + 0.5 );
+  tree->centers = calloc( tree->nnodes, tree->stride );
+  tree->ntrain = calloc( tree->nnodes, sizeof( int ) );
+  tree->idf = calloc( tree->nwords, sizeof( double ) );
+  tree->postings = calloc( tree->nwords, sizeof( struct vocab_posting* ) );
+  tree->npostings = calloc( tree->nwords, sizeof( int ) );
+  tree->nallocd = calloc( tree->nwords, sizeof( int ) );
+  if( tree->centers  &&  tree->ntrain  &&  tree->idf  &&  tree->postings  &&
+      tree->npostings  &&  tree->nallocd )
+    return tree;
+
+ fail:
+  fprintf( stderr, "Warning: unable to allocate memory, %s line %d\n",
+	   __FILE__, __LINE__ );
+  vocab_release( &tree );
+  return NULL;
+}
+
+
+
+/*
+  Clusters a range of a level's nodes, one after another on one thread; run
+  by parallel_for()
+
+  @param data a struct build_job
+  @param begin index within the level of the first node
+  @param end one past the index within the level of the last node
+  @param tid thread index
+*/
+static void cluster_nodes( void* data, int begin, int end, int tid )
+{
+  struct build_job* job = data;
+  int i;
+
+  for( i = begin; i < end; i++ )
+    if( cluster_node( job, job->level_first + i, NULL ) )
+      job->err[tid] = 1;
+}
+
+
+
+/*
+  Clusters a node's training descriptors with k-means to make its
+  children, then groups the node's range of the index array by child.
+  Children left without descriptors are marked empty.
+
+  @param job state of the build
+  @param node index of the node
+  @param pool threads among which to divide assignment of the node's
+    descriptors to children, or NULL
+
+  @return Returns 0 on success or -1 if no memory is available.
+*/
+static int cluster_node( struct build_job* job, int node,
+			 struct thread_pool* pool )
+{
+  struct vocab_tree* tree = job->tree;
+  unsigned char* centers, * descr;
+  double* sums;
+  int* idx, * assign, * counts, * grouped;
+  int n, k, c, it, changed, i, j, d = tree->d, stride = tree->stride;
+  unsigned int rng;
+
+  n = tree->ntrain[node];
+  c = node * tree->branch + 1;
+  if( n == 0 )
+    return 0;
+
+  /* a random state per node keeps the tree independent of scheduling */
+  rng = job->seed ^ ( (unsigned int)node * 0x9E3779B9 );
+  rng ^= rng >> 16;
+  rng *= 0x85EBCA6B;
+  rng ^= rng >> 13;
+  if( ! rng )
+    rng = 1;
+  k = seed_centers( job, node, rng );
+  if( k < 0 )
+    return -1;
+
+  idx = job->idx + job->first[node];
+  assign = job->assign + job->first[node];
+  centers = tree->centers + (size_t)c * stride;
+  sums = malloc( (size_t)k * d * sizeof( double ) );
+  counts = malloc( tree->branch * sizeof( int ) );
+  grouped = malloc( n * sizeof( int ) );
+  if( ! sums  ||  ! counts  ||  ! grouped )
+    {
+      free( sums );
+      free( counts );
+      free( grouped );
+      return -1;
+    }
+
+  /* Lloyd's iterations, ending with an assignment to the final centers */
+  for( i = 0; i < n; i++ )
+    assign[i] = -1;
+  for( it = 0; ; it++ )
+    {
+      changed = assign_points( job, node, k, pool );
+      if( changed < 0 )
+	{
+	  free( sums );
+	  free( counts );
+	  free( grouped );
+	  return -1;
+	}
+      if( changed == 0  ||  it == job->iters )
+	break;
+      memset( sums, 0, (size_t)k * d * sizeof( double ) );
+      memset( counts, 0, tree->branch * sizeof( int ) );
+      for( i = 0; i < n; i++ )
+	{
+	  descr = job->train + (size_t)idx[i] * stride;
+	  counts[assign[i]]++;
+	  for( j = 0; j < d; j++ )
+	    sums[assign[i]*d+j] += descr[j];
+	}
+      for( i = 0; i < k; i++ )
+	if( counts[i] )
+	  for( j = 0; j < d; j++ )
+	    centers[(size_t)i*stride+j] = (unsigned char)
+	      ( sums[i*d+j] / counts[i] + 0.5 );
+    }
+
+  /* group the node's descriptors by child, keeping their order */
+  memset( counts, 0, tree->branch * sizeof( int ) );
+  for( i = 0; i < n; i++ )
+    counts[assign[i]]++;
+  for( i = 0, j = 0; i < tree->branch; i++ )
+    {
+      tree->ntrain[c+i] = counts[i];
+      job->first[c+i] = job->first[node] + j;
+      j += counts[i];
+      counts[i] = j - counts[i];
+    }
+  for( i = 0; i < n; i++ )
+    grouped[counts[assign[i]]++] = idx[i];
+  memcpy( idx, grouped, n * sizeof( int ) );
+
+  free( sums );
+  free( counts );
+  free( grouped );
+  return 0;
+}
+
+
+
+/*
+  Chooses the initial centers of a node's children with k-means++
+  seeding: the first at random and each of the rest at random with
+  probability proportional to its squared distance from the nearest center
+  already chosen.  A node with no more descriptors than children gets one
+  center per descriptor, and seeding stops early if every descriptor
+  coincides with a center.
+
+  @param job state of the build
+  @param node index of the node
+  @param rng random state, which must not be zero
+
+  @return Returns the number of centers chosen or -1 if no memory is
+    available.
+*/
+static int seed_centers( struct build_job* job, int node, unsigned int rng )
+{
+  struct vocab_tree* tree = job->tree;
+  unsigned char* centers, * descr;
+  double total, r;
+  int* idx, * dmin;
+  int n, k, i, dsq, stride = tree->stride;
+
+  n = tree->ntrain[node];
+  idx = job->idx + job->first[node];
+  centers = tree->centers + ( (size_t)node * tree->branch + 1 ) * stride;
+  if( n <= tree->branch )
+    {
+      for( i = 0; i < n; i++ )
+	memcpy( centers + (size_t)i * stride,
+		job->train + (size_t)idx[i] * stride, stride );
+      return n;
+    }
+
+  dmin = malloc( n * sizeof( int ) );
+  if( ! dmin )
+    return -1;
+  i = rand_next( &rng ) % n;
+  for( k = 0; k < tree->branch; k++ )
+    {
+      memcpy( centers + (size_t)k * stride,
+	      job->train + (size_t)idx[i] * stride, stride );
+      total = 0;
+      for( i = 0; i < n; i++ )
+	{
+	  descr = job->train + (size_t)idx[i] * stride;
+	  dsq = descr_dist_sq_u8( descr, centers + (size_t)k * stride, stride );
+	  if( k == 0  ||  dsq < dmin[i] )
+	    dmin[i] = dsq;
+	  total += dmin[i];
+	}
+      if( total == 0 )
+	{
+	  k++;
+	  break;
+	}
+
+      /* the next center is the descriptor in whose share r falls */
+      r = rand_next( &rng ) / 4294967296.0 * total;
+      for( i = 0; i < n - 1; i++ )
+	if( ( r -= dmin[i] ) < 0 )
+	  break;
+    }
+
+  free( dmin );
+  return k;
+}
+
+
+
+/*
+  Assigns each of a node's training descriptors to the nearest of its
+  children's centers, dividing the descriptors among the threads of a pool
+
+  @param job state of the build
+  @param node index of the node
+  @param k number of centers
+  @param pool threads, or NULL
+
+  @return Returns the number of descriptors whose assignment changed or -1
+    if no memory is available.
+*/
+static int assign_points( struct build_job* job, int node, int k,
+			  struct thread_pool* pool )
+{
+  struct assign_job aj;
+  int nthreads = thread_pool_size( pool ), i, changed = 0;
+
+  aj.tree = job->tree;
+  aj.train = job->train;
+  aj.idx = job->idx + job->first[node];
+  aj.assign = job->assign + job->first[node];
+  aj.centers = job->tree->centers +
+    ( (size_t)node * job->tree->branch + 1 ) * job->tree->stride;
+  aj.k = k;
+  aj.changed = calloc( nthreads, sizeof( int ) );
+  if( ! aj.changed )
+    return -1;
+  parallel_for( pool, job->tree->ntrain[node], VOCAB_ASSIGN_GRAIN,
+		assign_range, &aj );
+  for( i = 0; i < nthreads; i++ )
+    changed += aj.changed[i];
+  free( aj.changed );
+  return changed;
+}
+
+
+
+/*
+  Assigns a range of a node's training descriptors to the nearest of its
+  children's centers, the first of several equally near; run by
+  parallel_for()
+
+  @param data a struct assign_job
+  @param begin index of the first descriptor in the node's range
+  @param end one past the index of the last descriptor
+  @param tid thread index, which selects the change counter
+*/
+static void assign_range( void* data, int begin, int end, int tid )
+{
+  struct assign_job* aj = data;
+  unsigned char* descr;
+  int stride = aj->tree->stride, i, j, dsq, best, best_dsq;
+
+  for( i = begin; i < end; i++ )
+    {
+      descr = aj->train + (size_t)aj->idx[i] * stride;
+      best = 0;
+      best_dsq = INT_MAX;
+      for( j = 0; j < aj->k; j++ )
+	{
+	  dsq = descr_dist_sq_u8( descr, aj->centers + (size_t)j * stride,
+				  stride );
+	  if( dsq < best_dsq )
+	    {
+	      best = j;
+	      best_dsq = dsq;
+	    }
+	}
+      if( aj->assign[i] != best )
+	{
+	  aj->assign[i] = best;
+	  aj->changed[tid]++;
+	}
+    }
+}
+
+
+
+/*
+  Computes the histogram of the visual words of a set of features
+
+  @param tree a vocabulary tree
+  @param set a feature set
+  @param hist pointer to an array in which to store the histogram's
+    nonzero bins in order of word; memory for this array is allocated by
+    this function and must be freed by the caller using free(*hist)
+
+  @return Returns the number of bins stored in hist or -1 if no memory is
+    available, in which case *hist is NULL.
+*/
+static int word_hist( struct vocab_tree* tree, struct feature_set* set,
+		      struct word_count** hist )
+{
+  int* words;
+  int i, n = 0;
+
+  words = malloc( MAX( set->n, 1 ) * sizeof( int ) );
+  *hist = malloc( MAX( set->n, 1 ) * sizeof( struct word_count ) );
+  if( ! words  ||  ! *hist )
+    {
+      free( words );
+      free( *hist );
+      *hist = NULL;
+      return -1;
+    }
+
+  for( i = 0; i < set->n; i++ )
+    words[i] = vocab_quantize( tree, feature_set_descr( set, i ) );
+  qsort( words, set->n, sizeof( int ), cmp_int );
+  for( i = 0; i < set->n; i++ )
+    if( n > 0  &&  (*hist)[n-1].word == words[i] )
+      (*hist)[n-1].count++;
+    else
+      {
+	(*hist)[n].word = words[i];
+	(*hist)[n++].count = 1;
+      }
+
+  free( words );
+  return n;
+}
+
+
+
+/*
+  Compares two ints for qsort()
+
+  @param a pointer to an int
+  @param b pointer to another int
+
+  @return Returns a negative, zero, or positive value as *a is less than,
+    equal to, or greater than *b.
+*/
+static int cmp_int( const void* a, const void* b )
+{
+  int x = *(const int*)a, y = *(const int*)b;
+
+  return ( x > y ) - ( x < y );
+}
+
+
+
+/*
+  Computes the word histograms of a range of images; run by parallel_for()
+
+  @param data a struct quantize_job
+  @param begin index of the first image
+  @param end one past the index of the last image
+  @param tid thread index
+*/
+static void quantize_images( void* data, int begin, int end, int tid )
+{
+  struct quantize_job* job = data;
+  int i;
+
+  for( i = begin; i < end; i++ )
+    job->nhists[i] = word_hist( job->tree, job->sets[i], job->hists + i );
+}
+
+
+
+/*
+  Recomputes the inverse document frequency of every word and the norm of
+  every image's word histogram weighted by them.  A word occurring in every
+  image, or in none, has zero weight.
+
+  @param tree a vocabulary tree
+*/
+static void update_weights( struct vocab_tree* tree )
+{
+  struct vocab_posting* post;
+  double x;
+  int w, i;
+
+  for( i = 0; i < tree->nimages; i++ )
+    tree->norms[i] = 0;
+  for( w = 0; w < tree->nwords; w++ )
+    {
+      tree->idf[w] = ( tree->npostings[w] )?
+	log( (double)tree->nimages / tree->npostings[w] ) : 0;
+      post = tree->postings[w];
+      for( i = 0; i < tree->npostings[w]; i++ )
+	{
+	  x = post[i].count * tree->idf[w];
+	  tree->norms[post[i].image] += x * x;
+	}
+    }
+  for( i = 0; i < tree->nimages; i++ )
+    tree->norms[i] = sqrt( tree->norms[i] );
+}
@@ -21,7 +21,7 @@
 static inline struct feature* get_match( struct feature*, int );
 static int get_matched_features( struct feature*, int, int, struct feature*** );
 static int calc_min_inliers( int, int, double, double );
-static inline double log_factorial( int );
+static double* log_factorials( int );
 static struct feature** draw_ransac_sample( struct feature**, int, int );
 static void extract_corresp_pts( struct feature**, int, int, CvPoint2D64f**,
 			  CvPoint2D64f** );
@@ -411,17 +411,17 @@ static int get_matched_features( struct feature* features, int n, int mtype,
 */
 static int calc_min_inliers( int n, int m, double p_badsupp, double p_badxform )
 {
-  double pi, sum;
+  double pi, sum, * lf;
   int i, j;
 
+  lf = log_factorials( n );
   for( j = m+1; j <= n; j++ )
     {
       sum = 0;
       for( i = j; i <= n; i++ )
 	{
 	  pi = (i-m) * log( p_badsupp ) + (n-i+m) * log( 1.0 - p_badsupp ) +
-	    log_factorial( n - m ) - log_factorial( i - m ) -
-	    log_factorial( n - i );
+	    lf[n - m] - lf[i - m] - lf[n - i];
 	  /*
 	   * Last three terms above are equivalent to log( n-m choose i-m )
 	   */
@@ -430,27 +430,34 @@ static int calc_min_inliers( int n, int m, double p_badsupp, double p_badxform )
       if( sum < p_badxform )
 	break;
     }
+  free( lf );
   return j;
 }
 
 
 
 /*
-  Calculates the natural log of the factorial of a number
+  Calculates the natural logs of the factorials of the numbers up to n.
+  Each is summed as it would be alone, so that the minimum number of
+  inliers doesn't take time cubic in the number of correspondences.
 
-  @param n number
+  @param n largest number
 
-  @return Returns log( n! )
+  @return Returns an array of n + 1 elements whose element i is log( i! )
 */
-static inline double log_factorial( int n )
+static double* log_factorials( int n )
 {
-  double f = 0;
+  double* lf;
   int i;
 
+  lf = malloc( ( n + 1 ) * sizeof( double ) );
+  if( ! lf )
+    fatal_error( "unable to allocate memory, %s line %d", __FILE__, __LINE__ );
+  lf[0] = 0;
   for( i = 1; i <= n; i++ )
-    f += log( i );
+    lf[i] = lf[i-1] + log( i );
 
-  return f;
+  return lf;
 }
 
 